@@ -15,6 +15,11 @@ int8_t raspiraw_init(Raspiraw **raspiraw, raw_frame_callback callback);
 
 int8_t raspiraw_start(Raspiraw *raspiraw, void *user_data);
 
+/**
+ * Формат фреймов, которые отдаёт камера в текущем режиме
+ */
+void raspiraw_format(Raspiraw *raspiraw, FrameFormat *format);
+
 int8_t raspiraw_stop(Raspiraw *raspiraw);
 
 int8_t raspiraw_close(Raspiraw *raspiraw);
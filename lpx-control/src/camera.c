@@ -13,6 +13,7 @@
 #include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <inttypes.h>
 #include "../include/raspiraw.h"
 
 typedef struct CaptureSession {
@@ -22,7 +23,6 @@ typedef struct CaptureSession {
     struct timeval frame_req_time; // системное (астрономическое) время запроса фрейма
     void *user_data; // пользовательские данные, передаваемые в каллбэк
     error_callback ecb;
-    List *frames;
     bool stopping;
     pthread_mutex_t mutex;
 } CaptureSession;
@@ -57,8 +57,17 @@ static void camera_handle_frame(uint8_t *buffer, size_t buffer_len, void *cs) {
         return;
     }
 
+    struct timeval cur_time = current_time();
+
+    // метаданные дописываются в индекс стрима после записи фрейма
+    FrameMeta frame = {
+            .start_time = tv2mks(capture_session->frame_req_time),
+            .end_time = tv2mks(cur_time)
+    };
+    capture_session->frame_req_time = cur_time;
+
     r = storage_store_frame(capture_session->storage, capture_session->train_id, capture_session->frame_index++,
-                                buffer, buffer_len);
+                                buffer, buffer_len, &frame);
 
     if (LPX_SUCCESS != r) {
         if (errno != 0) {
@@ -68,16 +77,6 @@ static void camera_handle_frame(uint8_t *buffer, size_t buffer_len, void *cs) {
         fprintf(stderr, "Stream storage failed, errcode: %d\n", r);
         return;
     }
-
-    struct timeval cur_time = current_time();
-
-    FrameMeta *frame = xmalloc(sizeof(FrameMeta));
-    memset(frame, 0, sizeof(FrameMeta));
-    frame->start_time = tv2mks(capture_session->frame_req_time);
-    frame->end_time = tv2mks(cur_time);
-    lst_append(capture_session->frames, frame);
-
-    capture_session->frame_req_time = cur_time;
 }
 
 int8_t camera_init(Storage *storage, Camera **camera, void *user_data, error_callback ecb) {
@@ -107,7 +106,6 @@ int8_t camera_init(Storage *storage, Camera **camera, void *user_data, error_cal
 
 int8_t camera_start_stream(Camera *camera, char *train_id) {
 
-    List *frames = lst_create();
     CaptureSession *cs = xmalloc(sizeof(CaptureSession));
     memset(cs, 0, sizeof(CaptureSession));
     cs->frame_req_time = current_time();
@@ -116,7 +114,6 @@ int8_t camera_start_stream(Camera *camera, char *train_id) {
     strncpy(cs->train_id, train_id, train_id_size);
     cs->train_id = train_id;
     cs->storage = camera->storage;
-    cs->frames = frames;
     cs->ecb = camera->ecb;
     cs->frame_index = 0;
     cs->user_data = camera->user_data;
@@ -128,6 +125,15 @@ int8_t camera_start_stream(Camera *camera, char *train_id) {
         goto error;
     }
 
+    // манифест пишется до первого фрейма: по нему хранилище сжимает фреймы, а сервер выбирает конвертер
+    FrameFormat format;
+    raspiraw_format(camera->raspiraw, &format);
+    if (LPX_SUCCESS != storage_store_format(camera->storage, train_id, &format)) {
+        res = CAM_STRG;
+        fprintf(stderr, "Could not write stream manifest\n");
+        goto error;
+    }
+
     int r = pthread_mutex_init(&cs->mutex, NULL);
     if (0 != r) {
         res = CAM_THREAD;
@@ -143,31 +149,24 @@ int8_t camera_start_stream(Camera *camera, char *train_id) {
 
     error:
     free(cs->train_id);
-    lst_free(cs->frames);
     free(cs);
     return res;
 }
 
-static int8_t camera_write_frame_index(CaptureSession *capture_session) {
+static int8_t camera_seal_frame_index(CaptureSession *capture_session) {
     int8_t res = LPX_SUCCESS;
 
-    size_t frames_cnt = lst_size(capture_session->frames);
-    FrameMeta **frame_array = frames_cnt == 0 ? NULL : xcalloc(frames_cnt, sizeof(FrameMeta *));
-    if (frames_cnt > 0) {
-        lst_to_array(capture_session->frames, (const void **) frame_array);
-        int8_t r = storage_store_stream_idx(capture_session->storage, capture_session->train_id, frame_array, frames_cnt);
-        if (LPX_SUCCESS != r) {
-            if (errno != 0) {
-                res = CAM_STRG;
-                perror("Stream index writing");
-            }
-            capture_session->ecb(capture_session->user_data, r);
-            fprintf(stderr, "Stream storage failed, errcode: %d\n", r);
+    // индекс дописывался по мере записи фреймов, остаётся только закрыть его
+    int8_t r = storage_seal_stream(capture_session->storage, capture_session->train_id);
+    if (LPX_SUCCESS != r) {
+        if (errno != 0) {
+            res = CAM_STRG;
+            perror("Stream index sealing");
         }
+        capture_session->ecb(capture_session->user_data, r);
+        fprintf(stderr, "Stream storage failed, errcode: %d\n", r);
     }
 
-    free_array((void **) frame_array, frames_cnt);
-    lst_free(capture_session->frames);
     free(capture_session);
     
     return res;
@@ -188,7 +187,33 @@ int8_t camera_stop_stream(Camera *camera) {
 
     raspiraw_stop(camera->raspiraw);
 
-    int8_t write_res = camera_write_frame_index(cs);
+    // индекс закрывается только после того, как все фреймы стрима попали на диск
+    int8_t flush_res = storage_flush(cs->storage);
+    if (LPX_SUCCESS != flush_res) {
+        fprintf(stderr, "Stream frames writing failed, errcode: %d\n", flush_res);
+        camera->ecb(camera->user_data, flush_res);
+    }
+
+    FrameWriterStats stats;
+    storage_writer_stats(cs->storage, &stats);
+    printf("frames written: %" PRIu64 ", write errors: %" PRIu64 ", avg write latency: %" PRIu64 " us, "
+           "max write latency: %" PRIu64 " us, queue wait: %" PRIu64 " us\n", stats.frames_written, stats.write_errors, stats.write_latency_avg_us,
+           stats.write_latency_max_us, stats.submit_wait_us);
+    StorageVolume volumes[8];
+    size_t volumes_cnt = storage_volumes(cs->storage, volumes, ALEN(volumes));
+    for (size_t i = 0; i < volumes_cnt && i < ALEN(volumes); i++) {
+        StorageVolume *v = &volumes[i];
+        printf("volume %s: frames written: %" PRIu64 ", %" PRIu64 " MB/s, free: %" PRIu64 " of %" PRIu64 " MB\n",
+               v->path, v->written_frames, v->write_time_us > 0 ? v->written_bytes / v->write_time_us : 0,
+               v->free_bytes / 1000000, v->total_bytes / 1000000);
+    }
+    StorageSync sync;
+    storage_sync_stats(cs->storage, &sync);
+    printf("syncs: %" PRIu64 ", avg sync: %" PRIu64 " us, max sync: %" PRIu64 " us, max unsynced frames: %" PRIu64
+           ", sync errors: %" PRIu64 "\n", sync.syncs, sync.syncs > 0 ? sync.sync_time_us / sync.syncs : 0,
+           sync.sync_time_max_us, sync.unsynced_frames_max, sync.sync_errors);
+
+    int8_t write_res = camera_seal_frame_index(cs);
     if (LPX_SUCCESS != write_res) {
         camera->ecb(camera->user_data, write_res);
     }
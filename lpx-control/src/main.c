@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <time.h>
 #include <sys/time.h>
@@ -37,9 +39,11 @@ static void train_sensor_cb(void *user_data, int8_t status, int8_t code) {
 int main(int argc, char **argv) {
     char *storage_dir = NULL;
     char *dev = "/dev/video0";
+    StorageConfig config;
+    storage_default_config(&config);
     int c;
 
-    while ((c = getopt(argc, argv, "s:d:")) != -1) {
+    while ((c = getopt(argc, argv, "s:d:Dc:bzr:v:S:")) != -1) {
         switch (c) {
             case 's':
                 storage_dir = optarg;
@@ -47,6 +51,60 @@ int main(int argc, char **argv) {
             case 'd':
                 dev = optarg;
                 break;
+            case 'D':
+                // фреймы пишутся в обход page cache, чтобы он оставался под чтение архивов сервером
+                config.direct_io = true;
+                break;
+            case 'c': {
+                // ёмкость кольцевого хранилища: байты или проценты файловой системы с суффиксом %
+                char *end;
+                unsigned long long capacity = strtoull(optarg, &end, 10);
+                if (*end == '%') {
+                    config.capacity_percent = (unsigned) capacity;
+                } else {
+                    config.capacity_bytes = capacity;
+                }
+                break;
+            }
+            case 'b':
+                // стримы раскладываются по директориям суток, существующие стримы переносятся при открытии хранилища
+                config.day_buckets = true;
+                break;
+            case 'z':
+                // фреймы сжимаются без потерь перед записью, сервер распаковывает их при выдаче
+                config.compress = true;
+                break;
+            case 'r': {
+                // записываемый стрим попадает в RAM (tmpfs) и переносится в хранилище после остановки записи:
+                // <директория>[:<ёмкость в байтах>]
+                char *limit = strchr(optarg, ':');
+                if (limit != NULL) {
+                    *limit = 0;
+                    config.ram_bytes = strtoull(limit + 1, NULL, 10);
+                }
+                config.ram_dir = optarg;
+                break;
+            }
+            case 'v':
+                // дополнительный том: фреймы стрима распределяются между хранилищем и томами
+                config.volumes = xrealloc(config.volumes, (config.volumes_cnt + 1) * sizeof(char *));
+                config.volumes[config.volumes_cnt++] = optarg;
+                break;
+            case 'S':
+                // надёжность записи: none, frame или фиксация раз в <фреймов>[:<мс>]
+                if (strcmp(optarg, "none") == 0) {
+                    config.durability = STRG_DURABLE_NONE;
+                } else if (strcmp(optarg, "frame") == 0) {
+                    config.durability = STRG_DURABLE_FRAME;
+                } else {
+                    char *end;
+                    config.durability = STRG_DURABLE_GROUP;
+                    config.index_commit_frames = strtoul(optarg, &end, 10);
+                    if (*end == ':') {
+                        config.index_commit_ms = (unsigned) strtoul(end + 1, NULL, 10);
+                    }
+                }
+                break;
             case '?':
                 continue;
             default:
@@ -54,7 +112,7 @@ int main(int argc, char **argv) {
         }
     }
     if (storage_dir == NULL) {
-        fprintf(stderr, "Usage: lpx-control -s <storage dir> [-d <device>]");
+        fprintf(stderr, "Usage: lpx-control -s <storage dir> [-d <device>] [-D] [-c <capacity bytes>|<capacity percent>%] [-b] [-z] [-r <ram dir>[:<bytes>]] [-v <volume dir>]... [-S none|frame|<frames>[:<ms>]]");
         return 1;
     }
 
@@ -65,7 +123,7 @@ int main(int argc, char **argv) {
     }
 
     Storage *s;
-    storage_open(storage_dir, &s);
+    storage_open_config(storage_dir, &config, &s);
 
     Camera *cam;
     if (LPX_SUCCESS != camera_init(s, &cam, NULL, ec)) {
@@ -137,5 +195,6 @@ int main(int argc, char **argv) {
 
     close_storage:
     storage_close(s);
+    free(config.volumes);
 }
 
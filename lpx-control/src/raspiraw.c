@@ -900,6 +900,23 @@ int8_t raspiraw_start(Raspiraw *raspiraw, void *user_data) {
     return res;
 }
 
+void raspiraw_format(Raspiraw *raspiraw, FrameFormat *format) {
+    static const char *bayer_orders[] = {"BGGR", "GBRG", "GRBG", "RGGB"};
+    struct mode_def *mode = raspiraw->sensor_mode;
+    MMAL_PORT_T *output = raspiraw->output;
+
+    memset(format, 0, sizeof(FrameFormat));
+    format->width = (uint32_t) mode->width;
+    format->height = (uint32_t) mode->height;
+    format->bit_depth = (uint32_t) (mode->encoding ? mode->native_bit_depth : raspiraw->cfg->bit_depth);
+    // ширина порта выровнена до 16 пикселей, MMAL выравнивает строки буфера по ней
+    format->stride = mmal_encoding_width_to_stride(output->format->encoding, output->format->es->video.width);
+    format->frame_size = output->buffer_size;
+    // порядок цветов уже учитывает отражения, заданные при инициализации
+    strncpy(format->bayer_order, bayer_orders[mode->order], MNF_BAYER_ORDER_SIZE - 1);
+    strncpy(format->sensor, raspiraw->sensor->name, MNF_SENSOR_SIZE - 1);
+}
+
 int8_t raspiraw_stop(Raspiraw *raspiraw) {
     raspiraw->cfg->user_data = NULL;
 
@@ -12,15 +12,21 @@
 #include <list.h>
 #include <assert.h>
 #include <limits.h>
+#include <inttypes.h>
 
 #define PORT 8888
 
+// скорость фоновой проверки контрольных сумм по умолчанию: ~3 фрейма 1280x800 в секунду, малая доля записи 30 fps
+#define SCRUB_BYTES_PER_SEC (4 * 1024 * 1024)
+
 #define BAD_REQUEST 1
 #define INTERNAL_ERROR 2
+#define CORRUPTED 3
 
 #define OK_MSG "Ok"
 #define INTERNAL_ERROR_MSG "Internal error"
 #define NOT_FOUND_MSG "Not found"
+#define CORRUPTED_MSG "Frame data corrupted"
 
 typedef struct LpxServer {
     Storage *storage;
@@ -40,21 +46,19 @@ static int list_parameters(void *cls, enum MHD_ValueKind kind, const char *key,
 }
 
 static ssize_t stream_reader_callback(void *cls, uint64_t pos, char *buf, size_t max) {
-    static uint64_t spos = 0;
-    assert(pos == 0 || pos == spos);
-    if (pos == 0) {
-        spos = pos;
-    }
+    // потоки соединений читаются параллельно, MHD запрашивает байты каждого потока по порядку
     VideoStreamBytesStream *stream = cls;
-    ssize_t res = stream_read(stream, (uint8_t *) buf, max);
-    if (res > 0) {
-        spos += res;
-    }
-    return res;
+    return stream_read(stream, (uint8_t *) buf, max);
 }
 
 static void stream_close_callback(void *cls) {
     VideoStreamBytesStream *stream = cls;
+    StreamStats stats;
+    stream_stats(stream, &stats);
+    if (stats.frames > 0) {
+        printf("Followed stream: %" PRIu64 " frames, latency avg: %.1f ms, max: %.1f ms\n", stats.frames,
+               (double) stats.latency_avg_us / 1000, (double) stats.latency_max_us / 1000);
+    }
     stream_close(stream);
 }
 
@@ -87,9 +91,8 @@ open_stream_frames(LpxServer *lpx, char *stream_id, List *frame_times_str, Video
         frame_times[i] = (uint64_t) sframe_time;
     }
     qsort(frame_times, frames_cnt, sizeof(uint64_t), uint64_t_cmp);
-    FrameMeta **index = NULL;
-    size_t index_size = 0;
-    int8_t r = storage_read_stream_idx(lpx->storage, stream_id, &index, &index_size);
+    StreamIndex *index = NULL;
+    int8_t r = storage_open_stream_idx(lpx->storage, stream_id, &index);
     if (r != LPX_SUCCESS) {
         res = INTERNAL_ERROR;
         goto free_iter;
@@ -97,7 +100,7 @@ open_stream_frames(LpxServer *lpx, char *stream_id, List *frame_times_str, Video
 
     List *frame_indexes = lst_create();
     for (int i = 0; i < frames_cnt; i++) {
-        ssize_t sidx = stream_find_frame(index, index_size, frame_times[i]);
+        ssize_t sidx = stream_find_frame(sidx_frames(index), sidx_size(index), frame_times[i]);
         if (sidx < 0) {
             // запросили оффсет больше, чем конец последнего фрейма
             break;
@@ -107,12 +110,14 @@ open_stream_frames(LpxServer *lpx, char *stream_id, List *frame_times_str, Video
         lst_append(frame_indexes, (const void *) idx);
     }
     res = storage_open_stream_frames(lpx->storage, stream_id, frame_indexes, stream);
-    if (res != LPX_SUCCESS) {
+    if (res == LPX_CORRUPT) {
+        res = CORRUPTED;
+    } else if (res != LPX_SUCCESS) {
         res = INTERNAL_ERROR;
     }
 
     lst_deep_free(frame_indexes);
-    free_array((void **) index, index_size);
+    sidx_close(index);
 
     free_iter:
     lst_iter_free(iter);
@@ -138,10 +143,19 @@ open_stream_offset(LpxServer *lpx, struct MHD_Connection *connection, char *stre
         offset = (size_t) soffset;
     }
 
-    int8_t res = storage_open_stream(lpx->storage, stream_id, offset, stream);
-    if (res != LPX_SUCCESS) {
+    // follow - стрим отдаётся по мере записи, пока поезд не уйдёт
+    int8_t res;
+    if (MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "follow") != NULL) {
+        res = storage_follow_stream(lpx->storage, stream_id, offset, stream);
+    } else {
+        res = storage_open_stream(lpx->storage, stream_id, offset, stream);
+    }
+    if (res == LPX_CORRUPT) {
+        return CORRUPTED;
+    } else if (res != LPX_SUCCESS) {
         return INTERNAL_ERROR;
     }
+    return 0;
 }
 
 static int8_t
@@ -170,6 +184,10 @@ static int handle_stream_get(LpxServer *lpx, struct MHD_Connection *connection,
         return send_response(connection, MHD_HTTP_BAD_REQUEST, err_msg);
     } else if (res == INTERNAL_ERROR) {
         return send_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, INTERNAL_ERROR_MSG);
+    } else if (res == CORRUPTED) {
+        // повреждение фрейма, обнаруженное при открытии стрима, до начала ответа. Повреждение, обнаруженное во время
+        // выдачи архива, stream_read возвращает как STRM_IO, и ответ обрывается.
+        return send_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, CORRUPTED_MSG);
     } else if (res != LPX_SUCCESS) {
         assert(false);
     }
@@ -239,7 +257,49 @@ static int handle_stream(LpxServer *lpx, struct MHD_Connection *connection, cons
     return ret;
 }
 
+/**
+ * Список стримов по статистике хранилища, без чтения индексов и файлов стримов: строка CSV на стрим и итоговая строка
+ * total по всему хранилищу, в которой вместо open - количество стримов. duration_us итоговой строки - суммарная
+ * длительность стримов.
+ */
+static int handle_streams_get(LpxServer *lpx, struct MHD_Connection *connection) {
+    StorageStats *stats;
+    size_t stats_cnt;
+    StorageStats total;
+    if (storage_list_stats(lpx->storage, &stats, &stats_cnt) != LPX_SUCCESS) {
+        return send_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, INTERNAL_ERROR_MSG);
+    }
+    if (storage_stats(lpx->storage, NULL, &total) != LPX_SUCCESS) {
+        free(stats);
+        return send_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, INTERNAL_ERROR_MSG);
+    }
+
+    char *body;
+    size_t body_size;
+    FILE *f = open_memstream(&body, &body_size);
+    fprintf(f, "stream,start_time,end_time,duration_us,frames,dropped_frames,bytes,open\n");
+    for (size_t i = 0; i < stats_cnt; i++) {
+        StorageStats *s = &stats[i];
+        fprintf(f, "%s,%" PRId64 ",%" PRId64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%d\n", s->train_id,
+                s->start_time, s->end_time, s->duration_us, s->frames, s->dropped_frames, s->bytes, s->open);
+    }
+    fprintf(f, "total,%" PRId64 ",%" PRId64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+            total.start_time, total.end_time, total.duration_us, total.frames, total.dropped_frames, total.bytes,
+            total.streams);
+    fclose(f);
+    free(stats);
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(body_size, body, MHD_RESPMEM_MUST_FREE);
+    MHD_add_response_header(response, "Content-Type", "text/csv");
+    int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
 static int handle_streams(LpxServer *lpx, struct MHD_Connection *connection, const char *method) {
+    if (strcmp(method, "GET") == 0) {
+        return handle_streams_get(lpx, connection);
+    }
     if(strcmp(method, "DELETE") != 0) {
         return send_response(connection, MHD_HTTP_NOT_FOUND, NOT_FOUND_MSG);
     }
@@ -276,14 +336,27 @@ static int answer_to_connection(void *cls, struct MHD_Connection *connection,
 
 int main(int argc, char **argv) {
     char *storage_dir = NULL;
+    bool convert = false;
+    bool recover = false;
+    uint64_t scrub_bytes_per_sec = SCRUB_BYTES_PER_SEC;
     int c;
 
     opterr = 0;
-    while ((c = getopt(argc, argv, "s:")) != -1) {
+    while ((c = getopt(argc, argv, "s:crb:")) != -1) {
         switch (c) {
             case 's':
                 storage_dir = optarg;
                 break;
+            case 'c':
+                convert = true;
+                break;
+            case 'r':
+                recover = true;
+                break;
+            case 'b':
+                // 0 выключает фоновую проверку
+                scrub_bytes_per_sec = strtoull(optarg, NULL, 10);
+                break;
             case '?':
                 continue;
             default:
@@ -291,16 +364,38 @@ int main(int argc, char **argv) {
         }
     }
     if (storage_dir == NULL) {
-        fprintf(stderr, "Usage: lpx-server -s <storage dir>");
+        fprintf(stderr, "Usage: lpx-server -s <storage dir> [-c] [-r] [-b <scrub bytes per second>]");
         return 1;
     }
 
+    StorageConfig config;
+    storage_default_config(&config);
+    // в режиме восстановления индексы восстанавливаются явно, чтобы сообщить результат
+    config.recover_on_open = !recover;
+    // восстановление и конвертация - разовые запуски, проверка нужна только работающему серверу
+    config.scrub_bytes_per_sec = recover || convert ? 0 : scrub_bytes_per_sec;
     Storage *storage = NULL;
-    storage_open(storage_dir, &storage);
+    storage_open_config(storage_dir, &config, &storage);
+
+    if (recover) {
+        size_t recovered = 0;
+        int8_t res = storage_recover(storage, &recovered);
+        printf("recovered streams: %zu\n", recovered);
+        storage_close(storage);
+        return res;
+    }
+
+    if (convert) {
+        // одноразовая конвертация индексов хранилища в бинарный формат
+        int8_t res = storage_convert_indexes(storage);
+        storage_close(storage);
+        return res;
+    }
     LpxServer lpx = {.storage = storage};
     struct MHD_Daemon *daemon;
 
-    daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, PORT, NULL, NULL,
+    // поток записываемого стрима ждёт новых фреймов внутри stream_read, поэтому у каждого соединения свой поток
+    daemon = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION, PORT, NULL, NULL,
                               &answer_to_connection, &lpx, MHD_OPTION_END);
     if (NULL == daemon) {
         return 1;
@@ -3,7 +3,13 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include "manifest.h"
 
-uint8_t raw12_to_bmp(const uint8_t *raw_12, size_t width, size_t height, uint8_t **bmp, size_t *bmp_size);
+/**
+ * Конвертирует фрейм raw размером raw_size байт в формате format в 8-битный BMP в оттенках серого. Ядро конвертации
+ * строки выбирается по разрядности пикселей, выравнивание строк и буфера фрейма пропускается. Возвращает не 0, если
+ * формат не поддерживается или фрейм меньше, чем требует формат.
+ */
+uint8_t frame_to_bmp(const FrameFormat *format, const uint8_t *raw, size_t raw_size, uint8_t **bmp, size_t *bmp_size);
 
 #endif
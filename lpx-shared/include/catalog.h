@@ -0,0 +1,103 @@
+#ifndef LPX_CATALOG_H
+#define LPX_CATALOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "lpxstd.h"
+
+/**
+ * Запись каталога - временной интервал, покрываемый стримом
+ */
+typedef struct CatalogEntry {
+    char train_id[MAX_INT_LEN + 1];
+    int64_t start_time; // start_time первого фрейма стрима в микросекундах
+    int64_t end_time; // end_time последнего фрейма стрима в микросекундах
+    bool indexed; // false, пока индекс стрима не записан и интервал стрима неизвестен
+    bool open; // индекс стрима ещё дописывается и интервал может вырасти
+    bool approximate; // индекс восстановлен после сбоя, время части фреймов приблизительное
+    uint64_t frames_cnt; // количество фреймов в индексе
+    uint64_t dropped_frames; // из них пропущенных - записей индекса без фрейма
+    uint64_t bytes; // суммарный размер файлов стрима
+    int64_t dir_mtime; // mtime директории стрима в наносекундах на момент чтения стрима
+    int64_t scrub_time; // время последней проверки фреймов стрима в микросекундах, 0 - не проверялся
+    uint64_t scrub_errors; // повреждённых и нечитаемых фреймов по последней проверке
+} CatalogEntry;
+
+/**
+ * Сводка по всем стримам каталога
+ */
+typedef struct CatalogTotals {
+    uint64_t streams;
+    uint64_t frames; // фреймов в индексах стримов
+    uint64_t dropped_frames;
+    uint64_t bytes;
+    uint64_t duration_us; // суммарная длительность проиндексированных стримов
+    int64_t start_time; // start_time первого фрейма самого раннего стрима, 0 - проиндексированных стримов нет
+    int64_t end_time; // end_time последнего фрейма самого позднего стрима
+} CatalogTotals;
+
+/**
+ * Каталог стримов хранилища - массив записей, отсортированный по start_time, для поиска стрима по времени двоичным
+ * поиском. Для стримов без индекса в качестве start_time используется время создания стрима из его идентификатора.
+ */
+typedef struct Catalog Catalog;
+
+Catalog *ctlg_create();
+
+/**
+ * Добавляет запись в каталог или заменяет запись с тем же train_id
+ */
+void ctlg_put(Catalog *catalog, const CatalogEntry *entry);
+
+/**
+ * Добавляет в каталог стрим без индекса
+ */
+void ctlg_put_pending(Catalog *catalog, const char *train_id);
+
+bool ctlg_remove(Catalog *catalog, const char *train_id);
+
+const CatalogEntry *ctlg_get(Catalog *catalog, const char *train_id);
+
+/**
+ * Возвращает проиндексированный стрим, интервал которого содержит time, или NULL
+ */
+const CatalogEntry *ctlg_find(Catalog *catalog, int64_t time);
+
+size_t ctlg_size(Catalog *catalog);
+
+const CatalogEntry *ctlg_at(Catalog *catalog, size_t idx);
+
+/**
+ * Суммарный размер файлов всех стримов каталога. Поддерживается при изменении каталога, без обхода записей.
+ */
+uint64_t ctlg_bytes(Catalog *catalog);
+
+/**
+ * Сводка по стримам каталога. Счётчики фреймов и байт поддерживаются при изменении каталога, границы и длительность
+ * считаются по записям в памяти.
+ */
+void ctlg_totals(Catalog *catalog, CatalogTotals *totals);
+
+void ctlg_clear(Catalog *catalog);
+
+void ctlg_free(Catalog *catalog);
+
+/**
+ * Сохраняет каталог в файл контрольной точки name директории dir_fd. base_mtime - mtime базовой директории
+ * хранилища в наносекундах, с которым согласовано содержимое каталога.
+ */
+int8_t ctlg_save(Catalog *catalog, int dir_fd, const char *name, int64_t base_mtime);
+
+/**
+ * Загружает каталог из файла контрольной точки name директории dir_fd, заменяя текущее содержимое. Возвращает
+ * LPX_IO, если файла нет или он записан в другом формате - в этом случае каталог строится сканированием хранилища.
+ */
+int8_t ctlg_load(Catalog *catalog, int dir_fd, const char *name, int64_t *base_mtime);
+
+/**
+ * Проверяет, что имя файла - идентификатор стрима (миллисекунды в десятичной записи)
+ */
+bool ctlg_is_train_id(const char *name);
+
+#endif //LPX_CATALOG_H
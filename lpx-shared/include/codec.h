@@ -0,0 +1,65 @@
+#ifndef LPX_CODEC_H
+#define LPX_CODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "lpxstd.h"
+
+/**
+ * Сжатие без потерь фреймов в формате RAW12: два 12-битных пикселя упакованы в три байта - старшие 8 бит первого,
+ * старшие 8 бит второго и младшие 4 бита обоих. Фрейм разбивается на строки по width пикселей, каждый пиксель
+ * предсказывается соседним пикселем того же цвета байеровской мозаики (через один слева), а остатки предсказания
+ * упаковываются блоками по CDC_BLOCK пикселей с шириной в битах, достаточной для наибольшего остатка блока.
+ * Распаковка блоков и восстановление пикселей по остаткам векторизованы.
+ * Формат сжатого фрейма:
+ * фрейм ::= <заголовок><строка>*<хвост><8 нулевых байт>
+ * заголовок ::= CodecHeader (16 байт, little endian)
+ * строка ::= <ширины блоков><блок>*
+ * ширины блоков ::= по 4 бита на блок, первый блок - в младших битах байта
+ * блок ::= CDC_BLOCK остатков по <ширина блока> бит, младшими битами вперёд
+ * хвост ::= байты исходного фрейма после последней целой строки
+ * Нулевые байты в конце позволяют распаковщику читать по 8 байт без проверки выхода за конец фрейма.
+ */
+#define CDC_MAGIC   "LPXC"
+#define CDC_VERSION 1
+#define CDC_BLOCK   16
+
+typedef struct CodecHeader {
+    char magic[4]; // CDC_MAGIC
+    uint16_t version; // CDC_VERSION
+    uint16_t width; // пикселей в строке
+    uint32_t raw_size; // размер исходного фрейма
+    uint32_t rows_size; // размер сжатых строк
+} CodecHeader;
+
+/**
+ * Размер буфера, достаточный для сжатого фрейма размером raw_size байт
+ */
+size_t cdc_bound(size_t raw_size, size_t width);
+
+/**
+ * Сжимает фрейм raw размером raw_size байт со строками по width пикселей (кратно CDC_BLOCK) в буфер out размером не
+ * меньше cdc_bound. Возвращает размер сжатого фрейма или 0, если сжатый фрейм не меньше исходного и его лучше
+ * хранить как есть.
+ */
+size_t cdc_encode(const uint8_t *raw, size_t raw_size, size_t width, uint8_t *out);
+
+/**
+ * Размер исходного фрейма по заголовку сжатого фрейма buf размером size байт. Возвращает LPX_IO, если buf не сжатый
+ * фрейм.
+ */
+int8_t cdc_raw_size(const uint8_t *buf, size_t size, size_t *raw_size);
+
+/**
+ * Восстанавливает исходный фрейм из сжатого buf в буфер raw размером cdc_raw_size. Возвращает LPX_IO, если сжатый
+ * фрейм повреждён.
+ */
+int8_t cdc_decode(const uint8_t *buf, size_t size, uint8_t *raw);
+
+/**
+ * true, если распаковка собрана с векторными инструкциями
+ */
+bool cdc_vectorized();
+
+#endif //LPX_CODEC_H
@@ -0,0 +1,23 @@
+#ifndef LPX_CRC32C_H
+#define LPX_CRC32C_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Контрольная сумма CRC32C (полином Кастаньоли) фреймов. На x86-64 с SSE4.2 и ARMv8 с расширением CRC считается
+ * инструкциями процессора, иначе - по таблицам, по 8 байт за шаг.
+ */
+
+/**
+ * Продолжает контрольную сумму crc данными buf размером size байт. Контрольная сумма начинается с 0.
+ */
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t size);
+
+/**
+ * true, если контрольная сумма считается инструкциями процессора
+ */
+bool crc32c_hardware();
+
+#endif //LPX_CRC32C_H
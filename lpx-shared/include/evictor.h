@@ -0,0 +1,48 @@
+#ifndef LPX_EVICTOR_H
+#define LPX_EVICTOR_H
+
+#include <stdbool.h>
+#include "lpxstd.h"
+
+/**
+ * Фоновое освобождение места: поток с пониженным приоритетом, который вызывает функцию вытеснения, пока она
+ * сообщает, что освободила место и может понадобиться ещё. Между вызовами делается пауза, чтобы удаление старых
+ * стримов не конкурировало за диск с записью нового. Поток просыпается периодически и по evct_wake. Хранилище
+ * использует такие потоки для вытеснения старых стримов и для удаления файлов из корзины.
+ */
+typedef struct Evictor Evictor;
+
+/**
+ * Функция вытеснения. Освобождает порцию места (например, удаляет один стрим) и возвращает true, если нужно
+ * продолжить, или false, если место освобождать больше не нужно или нечем.
+ */
+typedef bool (*evict_fn)(void *ctx);
+
+/**
+ * Флаг потока, который только читает с диска: его запросы обслуживаются классом ввода-вывода idle, когда диск больше
+ * никому не нужен
+ */
+#define EVCT_IDLE_IO 1
+
+/**
+ * Флаг потока, работа которого не должна откладываться из-за записи фреймов: поток не понижает свой приоритет
+ */
+#define EVCT_KEEP_PRIORITY 2
+
+/**
+ * Запускает поток вытеснения с флагами EVCT_*. period_ms - период проверки без evct_wake, pause_ms - пауза между
+ * вызовами evict, освобождающими место. Возвращает NULL, если поток не удалось запустить.
+ */
+Evictor *evct_create(evict_fn evict, void *ctx, unsigned period_ms, unsigned pause_ms, int flags);
+
+/**
+ * Будит поток вытеснения, не дожидаясь периода проверки
+ */
+void evct_wake(Evictor *evictor);
+
+/**
+ * Останавливает поток вытеснения, дожидаясь окончания текущего вызова evict
+ */
+void evct_free(Evictor *evictor);
+
+#endif //LPX_EVICTOR_H
@@ -0,0 +1,84 @@
+#ifndef LPX_FRAME_WRITER_H
+#define LPX_FRAME_WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "lpxstd.h"
+#include "stream.h"
+
+/**
+ * Отложенная запись фреймов: фреймы копируются в ограниченную очередь, а на диск их пишут отдельные потоки
+ * ввода-вывода. Так задержки диска не задерживают поток, получающий фреймы от камеры.
+ */
+typedef struct FrameWriter FrameWriter;
+
+/**
+ * Фрейм, передаваемый на запись
+ */
+typedef struct FrameWrite {
+    const char *train_id;
+    uint32_t frame_idx;
+    const uint8_t *buf;
+    size_t size;
+    size_t buf_size; // размер буфера, не меньше size: при выравнивании буфер дополнен нулями
+    const FrameMeta *meta; // метаданные фрейма для индекса стрима или NULL
+    int8_t res; // результат записи фрейма, устанавливается функцией записи
+} FrameWrite;
+
+/**
+ * Функция синхронной записи пачки фреймов, которую вызывают потоки ввода-вывода. Пачка собирается из фреймов,
+ * накопившихся в очереди, так что функция может отправить их на диск одним запросом.
+ */
+typedef void (*frame_write_fn)(void *ctx, FrameWrite *frames, size_t frames_cnt);
+
+/**
+ * Статистика отложенной записи
+ */
+typedef struct FrameWriterStats {
+    size_t queue_depth; // фреймов в очереди и в записи в данный момент
+    size_t queue_capacity;
+    uint64_t bytes_in_flight; // байт в очереди и в записи в данный момент
+    uint64_t frames_written;
+    uint64_t bytes_written;
+    uint64_t write_errors;
+    uint64_t write_latency_avg_us; // среднее время записи фрейма
+    uint64_t write_latency_max_us;
+    uint64_t submit_wait_us; // суммарное время ожидания места в очереди
+} FrameWriterStats;
+
+/**
+ * Создаёт очередь на queue_depth фреймов и threads потоков ввода-вывода, пишущих фреймы функцией write пачками до
+ * batch фреймов. Если align больше нуля, копии фреймов размещаются в буферах, выровненных по align и дополненных
+ * нулями до кратного align размера, чтобы их можно было записать с O_DIRECT.
+ */
+FrameWriter *fwr_create(size_t queue_depth, size_t threads, size_t batch, size_t align, frame_write_fn write,
+                        void *ctx);
+
+/**
+ * Копирует фрейм и его метаданные (meta может быть NULL) в очередь на запись. Если очередь заполнена, ждёт
+ * освобождения места. Возвращает код первой ошибки записи, случившейся после последнего fwr_flush, если такая была.
+ */
+int8_t fwr_submit(FrameWriter *writer, const char *train_id, uint32_t frame_idx, const uint8_t *buf, size_t size,
+                  const FrameMeta *meta);
+
+/**
+ * То же, что fwr_submit, но фрейм из rows строк по row_size байт, идущих в buf с шагом stride, копируется в очередь
+ * без выравнивания строк: копия фрейма сразу занимает row_size * rows байт.
+ */
+int8_t fwr_submit_rows(FrameWriter *writer, const char *train_id, uint32_t frame_idx, const uint8_t *buf,
+                       size_t row_size, size_t stride, size_t rows, const FrameMeta *meta);
+
+/**
+ * Барьер: дожидается записи всех фреймов, поставленных в очередь до вызова. Возвращает и сбрасывает код первой ошибки
+ * записи, случившейся после предыдущего вызова fwr_flush.
+ */
+int8_t fwr_flush(FrameWriter *writer);
+
+void fwr_stats(FrameWriter *writer, FrameWriterStats *stats);
+
+/**
+ * Дописывает очередь и останавливает потоки ввода-вывода
+ */
+void fwr_free(FrameWriter *writer);
+
+#endif //LPX_FRAME_WRITER_H
@@ -0,0 +1,67 @@
+#ifndef LPX_IO_ENGINE_H
+#define LPX_IO_ENGINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Движок позиционного ввода-вывода с пакетной отправкой запросов. Если библиотека собрана с поддержкой io_uring
+ * (LPX_HAVE_IO_URING) и ядро его поддерживает, запросы накапливаются в очереди и отправляются в ядро одним системным
+ * вызовом, а их выполнение идёт параллельно. Иначе движок выполняет каждый запрос синхронно (pread/pwrite) в момент
+ * постановки, а вызывающий код работает так же, как с асинхронным движком.
+ */
+typedef struct IoEngine IoEngine;
+
+/**
+ * Результат выполнения запроса
+ */
+typedef struct IoCompletion {
+    uint64_t user_data; // значение, переданное при постановке запроса
+    ssize_t result; // количество прочитанных или записанных байт или -errno
+} IoCompletion;
+
+/**
+ * Создаёт движок, допускающий до depth одновременно выполняющихся запросов. Никогда не возвращает NULL: при
+ * недоступности io_uring возвращается синхронный движок.
+ */
+IoEngine *ioe_create(unsigned depth);
+
+/**
+ * true, если запросы выполняются асинхронно через io_uring
+ */
+bool ioe_async(IoEngine *engine);
+
+/**
+ * Ставит в очередь чтение len байт по смещению offset. Одновременно может ожидать не больше depth запросов, при
+ * превышении возвращает LPX_IO с errno = EBUSY. Буфер должен оставаться доступным до получения результата.
+ */
+int8_t ioe_read(IoEngine *engine, int fd, void *buf, size_t len, uint64_t offset, uint64_t user_data);
+
+int8_t ioe_write(IoEngine *engine, int fd, const void *buf, size_t len, uint64_t offset, uint64_t user_data);
+
+/**
+ * Отправляет накопленные запросы в ядро
+ */
+int8_t ioe_submit(IoEngine *engine);
+
+/**
+ * Количество поставленных запросов, результат которых ещё не получен через ioe_wait
+ */
+size_t ioe_pending(IoEngine *engine);
+
+/**
+ * Ждёт завершения одного из поставленных запросов. Возвращает EOF, если ожидающих запросов нет.
+ */
+int8_t ioe_wait(IoEngine *engine, IoCompletion *completion);
+
+/**
+ * Отбрасывает результаты всех поставленных запросов: запросы, не отправленные в ядро, убирает из очереди, а
+ * отправленных дожидается. После успешного завершения буферы запросов можно освобождать, а следующий ioe_wait не
+ * вернёт их результатов. Возвращает LPX_IO, если дождаться запросов не удалось.
+ */
+int8_t ioe_drain(IoEngine *engine);
+
+void ioe_free(IoEngine *engine);
+
+#endif //LPX_IO_ENGINE_H
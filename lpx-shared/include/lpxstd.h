@@ -4,12 +4,15 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <time.h>
 
 #define ALEN(arr) ((sizeof (arr)) / sizeof ((arr)[0]))
 
 // Коды статусов вызова функций
 #define LPX_SUCCESS 0
 #define LPX_IO      1
+// данные фрейма не совпадают с контрольной суммой, записанной при сохранении
+#define LPX_CORRUPT 6
 
 #define MAX_INT_LEN 20
 
@@ -17,12 +20,26 @@ uint64_t tv2mks(struct timeval tv);
 
 uint64_t tv2ms(struct timeval tv);
 
+int64_t ts2ns(struct timespec ts);
+
+/*
+ * Время CLOCK_MONOTONIC в микросекундах
+ */
+uint64_t monotonic_us();
+
+/*
+ * Время CLOCK_REALTIME в микросекундах, в нём записаны времена фреймов
+ */
+int64_t realtime_us();
+
 void print_array(char *prefix, const unsigned char *arr, int size);
 
 void* xmalloc(size_t n);
 
 void* xcalloc(size_t n, size_t size);
 
+void* xrealloc(void *p, size_t n);
+
 /*
  * Добавление child к пути base через "/"
  */
@@ -32,6 +49,11 @@ int8_t file_size(FILE *file, off_t *size);
 
 int8_t fd_size(int fd, off_t *size);
 
+/*
+ * Копирует подряд в dst rows строк по row_size байт, которые идут в src с шагом stride
+ */
+void copy_rows(uint8_t *dst, const uint8_t *src, size_t row_size, size_t stride, size_t rows);
+
 /*
  * Перевод числа в строку
  */
@@ -39,6 +61,16 @@ char *itoa(uint64_t i);
 
 int8_t list_directory(char *dir, char ***children, size_t *children_size);
 
+/*
+ * Список файлов директории name, открытой относительно директории dir_fd
+ */
+int8_t list_directory_at(int dir_fd, const char *name, char ***children, size_t *children_size);
+
+/*
+ * Суммарный размер файлов в дереве name директории parent_fd
+ */
+uint64_t tree_bytes(int parent_fd, const char *name);
+
 void free_array(void **arr, size_t size);
 
 bool starts_with(const char *str, const char *prefix);
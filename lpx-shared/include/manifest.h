@@ -0,0 +1,66 @@
+#ifndef LPX_MANIFEST_H
+#define LPX_MANIFEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Манифест стрима: формат фреймов, с которым их записала камера. Пишется в директорию стрима при начале записи, по
+ * нему выбираются конвертеры фреймов при выдаче архива. Стримы без манифеста записаны камерой ar0144 в режиме
+ * 1280x800 RAW12 (mnf_legacy).
+ * Формат файла manifest:
+ * манифест ::= <заголовок><формат>
+ * заголовок ::= ManifestHeader (16 байт, little endian)
+ * формат ::= FrameFormat (record_size байт)
+ */
+#define MNF_FILE "manifest"
+
+#define MNF_MAGIC   "LPXM"
+#define MNF_VERSION 1
+
+// Размеры строковых полей FrameFormat с завершающим нулём
+#define MNF_BAYER_ORDER_SIZE 8
+#define MNF_SENSOR_SIZE      16
+
+typedef struct ManifestHeader {
+    char magic[4]; // MNF_MAGIC
+    uint32_t version; // MNF_VERSION
+    uint32_t record_size; // sizeof(FrameFormat) на момент записи
+    uint32_t reserved;
+} ManifestHeader;
+
+/**
+ * Геометрия и формат пикселей фреймов стрима
+ */
+typedef struct FrameFormat {
+    uint32_t width; // пикселей в строке
+    uint32_t height; // строк изображения
+    uint32_t stride; // байт от начала строки до начала следующей, включая выравнивание
+    uint32_t bit_depth; // бит на пиксель: 8, 10 и 12 - упакованные RAW8/RAW10/RAW12, 16 - little endian
+    uint64_t frame_size; // размер буфера фрейма в байтах, включая выравнивание строк и буфера
+    char bayer_order[MNF_BAYER_ORDER_SIZE]; // BGGR, GBRG, GRBG или RGGB
+    char sensor[MNF_SENSOR_SIZE]; // модель сенсора
+} FrameFormat;
+
+/**
+ * Заполняет формат фреймов стримов, записанных без манифеста
+ */
+void mnf_legacy(FrameFormat *format);
+
+/**
+ * Размер пикселей строки в байтах, без выравнивания. Упакованные форматы занимают целое число групп пикселей.
+ */
+size_t mnf_row_size(const FrameFormat *format);
+
+/**
+ * Записывает манифест в директорию стрима, открытую как dir_fd. Манифест заменяется атомарно.
+ */
+int8_t mnf_write(int dir_fd, const FrameFormat *format);
+
+/**
+ * Читает манифест из директории стрима, открытой как dir_fd. Возвращает STRG_NOT_FOUND, если у стрима нет манифеста,
+ * и STRG_BAD_INDEX, если манифест повреждён.
+ */
+int8_t mnf_read(int dir_fd, FrameFormat *format);
+
+#endif //LPX_MANIFEST_H
@@ -0,0 +1,74 @@
+#ifndef LPX_RAM_TIER_H
+#define LPX_RAM_TIER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "segment.h"
+
+/**
+ * RAM-уровень хранилища (segment.h, SegmentTier): директория, обычно на tmpfs, в которой сегменты записываемого
+ * стрима создаются в поддиректории с идентификатором стрима, а в директории стрима на диске лежат символьные ссылки
+ * на них. Поток переноса копирует сегменты стримов, писатель которых закрыт, в директории стримов и заменяет ими
+ * ссылки.
+ */
+typedef struct RamTier RamTier;
+
+/**
+ * Функции хранилища, которые вызывает поток переноса
+ */
+typedef struct RamTierSource {
+    /**
+     * Открывает директорию стрима на диске. STRG_NOT_FOUND - стрим удалён, его сегменты удаляются из уровня.
+     */
+    int8_t (*acquire_dir)(void *ctx, const char *train_id, int *dir_fd);
+
+    void (*release_dir)(void *ctx, int dir_fd);
+
+    /**
+     * Копирует в train_id идентификатор записываемого стрима, пустая строка - писатель закрыт. Сегменты
+     * записываемого стрима не переносятся.
+     */
+    void (*writer_train)(void *ctx, char *train_id);
+
+    /**
+     * Все сегменты стрима перенесены на диск
+     */
+    void (*migrated)(void *ctx, const char *train_id);
+
+    void *ctx;
+} RamTierSource;
+
+typedef struct RamTierStats {
+    uint64_t bytes; // место, занятое и зарезервированное в уровне
+    uint64_t migrated_segments;
+    uint64_t migrated_bytes;
+} RamTierStats;
+
+/**
+ * Открывает RAM-уровень ёмкостью capacity байт в директории dir, создавая её при необходимости, и запускает поток
+ * переноса, который сначала переносит сегменты, оставшиеся в уровне от предыдущего запуска. Возвращает NULL, если
+ * уровень недоступен, тогда сегменты пишутся сразу на диск.
+ */
+RamTier *rtr_open(const char *dir, uint64_t capacity, const RamTierSource *source);
+
+/**
+ * Создаёт в уровне директорию стрима train_id и заполняет tier для его писателя сегментов. Путь к директории
+ * записывается в path (PATH_MAX байт), он должен жить, пока открыт писатель. Возвращает false, если директорию не
+ * удалось создать.
+ */
+bool rtr_placement(RamTier *ram, const char *train_id, SegmentTier *tier, char *path);
+
+/**
+ * Будит поток переноса, например после закрытия писателя сегментов
+ */
+void rtr_wake(RamTier *ram);
+
+void rtr_stats(RamTier *ram, RamTierStats *stats);
+
+/**
+ * Останавливает поток переноса и переносит на диск всё, что осталось в уровне: RAM-уровень не переживает
+ * перезагрузку. Вызывается после закрытия писателя сегментов.
+ */
+void rtr_free(RamTier *ram);
+
+#endif //LPX_RAM_TIER_H
@@ -0,0 +1,36 @@
+#ifndef LPX_RECOVERY_H
+#define LPX_RECOVERY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Восстановление индекса стрима, запись которого прервалась (аварийное завершение, отключение питания) и у которого
+ * есть фреймы, но индекса нет, он повреждён или не закрыт. Точные записи незакрытого индекса сохраняются, а время
+ * остальных фреймов оценивается по порядку фреймов и времени изменения их файлов: для стримов, записанных по файлу
+ * на фрейм, - по mtime файла каждого фрейма, для сегментов - по mtime сегмента, которое соответствует последнему
+ * фрейму в нём, с линейной интерполяцией между ними. Восстановленный индекс закрывается с флагом
+ * SIDX_FLAG_APPROXIMATE.
+ */
+
+/**
+ * Задание на восстановление стрима
+ */
+typedef struct RecoveryJob {
+    int dir_fd; // директория стрима
+    const char *train_id;
+    int8_t res; // LPX_SUCCESS - индекс восстановлен, STRG_NOT_FOUND - у стрима нет фреймов
+    uint64_t frames_cnt; // количество фреймов в восстановленном индексе
+} RecoveryJob;
+
+/**
+ * Восстанавливает индекс одного стрима, директория которого открыта как dir_fd
+ */
+int8_t rcv_train(int dir_fd, const char *train_id, uint64_t *frames_cnt);
+
+/**
+ * Выполняет задания на восстановление пулом из threads потоков и заполняет их результаты
+ */
+void rcv_run(RecoveryJob *jobs, size_t jobs_cnt, size_t threads);
+
+#endif //LPX_RECOVERY_H
@@ -0,0 +1,71 @@
+#ifndef LPX_SCRUBBER_H
+#define LPX_SCRUBBER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "catalog.h"
+#include "stream_storage.h"
+
+/**
+ * Фоновая проверка контрольных сумм фреймов записанных стримов (StorageScrub). Поток с классом ввода-вывода idle
+ * проверяет стримы по одному порциями фреймов, не превышая заданную скорость, а стримы для проверки выбирает и
+ * результат проверки записывает хранилище.
+ */
+typedef struct Scrubber Scrubber;
+
+/**
+ * Функции хранилища, которые вызывает поток проверки
+ */
+typedef struct ScrubSource {
+    /**
+     * Выбирает стрим для проверки (scrb_select) и копирует его идентификатор в train_id, а количество фреймов по
+     * каталогу - в frames_cnt. Возвращает false, если проверять нечего.
+     */
+    bool (*next)(void *ctx, char *train_id, uint64_t *frames_cnt);
+
+    /**
+     * Открывает директорию стрима. Стрим, удалённый во время проверки, пропускается.
+     */
+    int8_t (*acquire_dir)(void *ctx, const char *train_id, int *dir_fd);
+
+    void (*release_dir)(void *ctx, int dir_fd);
+
+    /**
+     * Записывает результат проверки стрима: errors повреждённых и нечитаемых фреймов. Возвращает false, если стрим
+     * удалён во время проверки.
+     */
+    bool (*finish)(void *ctx, const char *train_id, uint64_t errors);
+
+    void *ctx;
+} ScrubSource;
+
+/**
+ * true, если стрим записан и его пора проверить: он не проверялся или проверялся давно. now - текущее время в
+ * микросекундах (realtime_us).
+ */
+bool scrb_due(const CatalogEntry *entry, int64_t now);
+
+/**
+ * Стрим каталога для проверки: самый старый из непроверенных, а если таких нет - из давно проверенных. NULL -
+ * проверять нечего.
+ */
+const CatalogEntry *scrb_select(Catalog *catalog, int64_t now);
+
+/**
+ * Запускает поток проверки со скоростью bytes_per_sec. Возвращает NULL, если поток не удалось запустить.
+ */
+Scrubber *scrb_create(uint64_t bytes_per_sec, const ScrubSource *source);
+
+/**
+ * Заполняет в scrub счётчики проверки и прогресс проверяемого стрима. Счётчики стримов каталога заполняет
+ * хранилище.
+ */
+void scrb_stats(Scrubber *scrubber, StorageScrub *scrub);
+
+/**
+ * Останавливает поток проверки. Незаконченная проверка стрима начинается заново после следующего открытия
+ * хранилища.
+ */
+void scrb_free(Scrubber *scrubber);
+
+#endif //LPX_SCRUBBER_H
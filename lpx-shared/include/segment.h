@@ -0,0 +1,216 @@
+#ifndef LPX_SEGMENT_H
+#define LPX_SEGMENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Фреймы стрима пишутся подряд в файлы сегментов seg.0, seg.1, ... размером до SEG_MAX_SIZE байт. Расположение
+ * каждого фрейма хранится в таблице frames.tbl рядом с индексом стрима.
+ * Формат файла frames.tbl:
+ * таблица ::= <заголовок><запись>*
+ * заголовок ::= SegmentTableHeader (16 байт, little endian)
+ * запись ::= FrameLocation (record_size байт), N-я запись описывает фрейм с индексом N
+ */
+#define SEG_TABLE_FILE  "frames.tbl"
+#define SEG_FILE_PREFIX "seg."
+#define SEG_MAX_SIZE    (128 * 1024 * 1024)
+// размер буфера под имя файла сегмента: префикс, номер uint32_t и завершающий ноль
+#define SEG_NAME_SIZE   (sizeof(SEG_FILE_PREFIX) + 10)
+
+// Выравнивание смещений, размеров и буферов фреймов при прямой записи
+#define SEG_DIRECT_ALIGN 4096
+
+#define SEG_MAGIC   "LPXF"
+#define SEG_VERSION 2
+
+// Фрейм сжат cdc_encode и перед выдачей распаковывается cdc_decode
+#define SEG_FRAME_LPXC 1
+// У фрейма есть контрольная сумма crc
+#define SEG_FRAME_CRC  2
+
+typedef struct SegmentTableHeader {
+    char magic[4]; // SEG_MAGIC
+    uint32_t version; // SEG_VERSION
+    uint32_t record_size; // sizeof(FrameLocation) на момент записи
+    uint32_t reserved;
+} SegmentTableHeader;
+
+/**
+ * Расположение фрейма в сегменте. Запись с нулевой длиной - фрейм не был записан.
+ */
+typedef struct FrameLocation {
+    uint32_t segment; // номер файла сегмента
+    uint32_t flags; // SEG_FRAME_*
+    uint64_t offset; // смещение фрейма в файле сегмента
+    uint64_t length; // размер фрейма в байтах
+    uint32_t crc; // CRC32C записанных байт фрейма (crc32c.h), если установлен SEG_FRAME_CRC
+    uint32_t reserved;
+} FrameLocation;
+
+// Размер записи таблиц версии 1, без контрольной суммы. Такие таблицы читаются и дописываются в своём формате.
+#define SEG_V1_RECORD_SIZE 24
+
+/**
+ * Таблица расположения фреймов стрима, открытая только для чтения
+ */
+typedef struct SegmentTable SegmentTable;
+
+/**
+ * Записывает в name (не меньше SEG_NAME_SIZE байт) имя файла сегмента с номером segment
+ */
+void seg_name(uint32_t segment, char *name);
+
+/**
+ * Открывает таблицу фреймов стрима, директория которого открыта как dir_fd. Возвращает STRG_NOT_FOUND, если стрим
+ * записан в устаревшем формате - по файлу на фрейм.
+ */
+int8_t segt_open(int dir_fd, SegmentTable **table);
+
+size_t segt_size(const SegmentTable *table);
+
+/**
+ * Расположение фрейма с индексом idx или NULL, если фрейм не был записан
+ */
+const FrameLocation *segt_frame(const SegmentTable *table, size_t idx);
+
+void segt_close(SegmentTable *table);
+
+/**
+ * Писатель фреймов одного стрима в сегменты
+ */
+typedef struct SegmentWriter SegmentWriter;
+
+/**
+ * Флаг прямой записи (O_DIRECT) в обход page cache. Место под сегменты выделяется заранее через fallocate, фреймы
+ * размещаются по смещениям, кратным SEG_DIRECT_ALIGN. Если файловая система не поддерживает O_DIRECT, писатель
+ * сообщает об этом в stderr и пишет через page cache.
+ */
+#define SEGW_DIRECT 1
+
+/**
+ * Уровень в RAM (tmpfs) для сегментов записываемого стрима. Новый сегмент создаётся в директории уровня dir_fd, а в
+ * директории стрима на его место ставится символьная ссылка, так что читатели находят сегмент по обычному имени, в
+ * каком бы уровне он ни лежал. Место под сегмент в уровне резервируется целиком (SEG_MAX_SIZE байт) и освобождается
+ * до размера записанных данных при закрытии писателя. Если места в уровне нет, сегмент создаётся прямо в директории
+ * стрима: фреймы не теряются, а пишутся на диск.
+ * Сегменты уровня дописываются только открывшим их писателем: после переоткрытия стрима запись начинается с нового
+ * сегмента.
+ */
+typedef struct SegmentTier {
+    int dir_fd; // директория стрима в уровне
+    const char *path; // абсолютный путь к ней, цель символьных ссылок
+    uint64_t capacity; // ёмкость уровня в байтах, 0 - ограничена только размером файловой системы
+    uint64_t *used; // место, занятое и зарезервированное в уровне, общее для всех писателей, меняется атомарно
+} SegmentTier;
+
+/**
+ * Счётчики записи на том, общие для всех писателей, меняются атомарно
+ */
+typedef struct SegmentVolumeStats {
+    uint64_t segments; // сегментов создано на томе
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t write_time_us; // время записи фреймов на том
+} SegmentVolumeStats;
+
+/**
+ * Том, на котором создаются сегменты стрима. Сегменты тома, отличного от директории стрима, создаются в директории
+ * dir_fd и подключаются в директорию стрима символьными ссылками, как сегменты RAM-уровня.
+ */
+typedef struct SegmentVolume {
+    int dir_fd; // директория стрима на томе, -1 - сама директория стрима
+    const char *path; // абсолютный путь к ней, цель символьных ссылок
+    SegmentVolumeStats *stats;
+} SegmentVolume;
+
+/**
+ * Размещение новых сегментов стрима. Фреймы по очереди распределяются между томами, у каждого тома свой текущий
+ * сегмент, так что фреймы одной пачки пишутся на разные тома параллельно. Том, на котором не осталось места под
+ * новый сегмент, пропускается до закрытия писателя, пока есть другие тома.
+ */
+typedef struct SegmentPlacement {
+    const SegmentTier *tier; // RAM-уровень новых сегментов или NULL
+    const SegmentVolume *volumes; // тома, по которым распределяются фреймы
+    size_t volumes_cnt; // 0 - все сегменты в директории стрима
+} SegmentPlacement;
+
+/**
+ * Место, выделенное под фрейм в сегменте
+ */
+typedef struct SegmentSlot {
+    FrameLocation location;
+    int fd; // дескриптор для записи фрейма
+    size_t write_size; // сколько байт буфера фрейма записать в fd, при прямой записи - с выравнивающим хвостом
+    int buffered_fd; // дескриптор того же сегмента без O_DIRECT, для дозаписи, если прямая запись не удалась
+    size_t volume; // индекс тома сегмента в SegmentPlacement.volumes
+} SegmentSlot;
+
+/**
+ * Открывает писателя фреймов стрима, директория которого открыта как dir_fd, с флагами SEGW_*. Писатель держит свою
+ * копию дескриптора директории. Если у стрима уже есть сегменты, запись продолжается в конец последнего.
+ * placement - размещение новых сегментов или NULL, если все они создаются в директории стрима. Писатель держит
+ * свои копии дескрипторов и путей размещения, счётчики томов должны жить дольше писателя.
+ */
+int8_t segw_open(int dir_fd, int flags, const SegmentPlacement *placement, SegmentWriter **writer);
+
+/**
+ * Дописывает фрейм в текущий сегмент (начиная новый, если текущий переполнится) и записывает его расположение с
+ * флагами SEG_FRAME_* и контрольной суммой в таблицу фреймов. Может вызываться из нескольких потоков одновременно:
+ * место под фрейм выделяется под блокировкой, а запись идёт параллельно. Если прямая запись не удалась, фрейм пишется
+ * через page cache.
+ */
+int8_t segw_append(SegmentWriter *writer, uint32_t frame_idx, const uint8_t *buf, size_t size, uint32_t flags);
+
+/**
+ * Выделяет место под фрейм размером size байт, не записывая его. Используется для записи нескольких фреймов одним
+ * запросом: после записи данных в slot->fd фрейм нужно зафиксировать вызовом segw_commit. Контрольную сумму фрейма
+ * в slot->location заполняет seg_checksum.
+ * aligned - буфер фрейма выровнен по SEG_DIRECT_ALIGN и дополнен до кратного ему размера, так что его можно записать
+ * напрямую.
+ */
+int8_t segw_reserve(SegmentWriter *writer, size_t size, bool aligned, SegmentSlot *slot);
+
+/**
+ * Учитывает в счётчиках тома volume (SegmentSlot.volume) frames записанных фреймов размером bytes байт, запись
+ * которых заняла write_time_us. segw_append учитывает свои фреймы сам.
+ */
+void segw_account(SegmentWriter *writer, size_t volume, uint64_t frames, uint64_t bytes, uint64_t write_time_us);
+
+/**
+ * Записывает в location контрольную сумму фрейма buf размером location->length байт
+ */
+void seg_checksum(FrameLocation *location, const uint8_t *buf);
+
+/**
+ * Записывает расположение фрейма в таблицу фреймов. Вызывается только после того, как данные фрейма записаны.
+ */
+int8_t segw_commit(SegmentWriter *writer, uint32_t frame_idx, const FrameLocation *location);
+
+/**
+ * Сбрасывает на диск записанные фреймы и таблицу фреймов
+ */
+int8_t segw_sync(SegmentWriter *writer);
+
+/**
+ * Начинает запись на диск фрейма, записанного в slot через page cache, не дожидаясь её окончания: к следующей
+ * фиксации (segw_sync) сбрасывать остаётся меньше
+ */
+void segw_start_writeback(const SegmentSlot *slot);
+
+/**
+ * Дублирует дескрипторы сегментов и таблицы фреймов, чтобы сбросить их на диск, не блокируя писателя: дубликаты
+ * остаются действительными и после закрытия писателя. Возвращает количество дубликатов в *fds, массив и дескрипторы
+ * нужно закрыть.
+ */
+size_t segw_dup_fds(SegmentWriter *writer, int **fds);
+
+/**
+ * true, если писатель пишет в обход page cache
+ */
+bool segw_direct(SegmentWriter *writer);
+
+int8_t segw_close(SegmentWriter *writer);
+
+#endif //LPX_SEGMENT_H
@@ -0,0 +1,29 @@
+#ifndef LPX_STATS_H
+#define LPX_STATS_H
+
+#include <stddef.h>
+#include "catalog.h"
+#include "stream_storage.h"
+
+/**
+ * Статистика стримов (StorageStats) по записям каталога. Вызывающий держит блокировку каталога и синхронизирует его
+ * с директориями стримов.
+ */
+
+/**
+ * Статистика стрима по его записи в каталоге
+ */
+void stts_entry(const CatalogEntry *entry, StorageStats *stats);
+
+/**
+ * Сводка по всем стримам каталога
+ */
+void stts_totals(Catalog *catalog, StorageStats *stats);
+
+/**
+ * Статистика всех стримов каталога в порядке их начала. Возвращает массив из *stats_cnt записей, который
+ * освобождается вызывающим.
+ */
+StorageStats *stts_list(Catalog *catalog, size_t *stats_cnt);
+
+#endif //LPX_STATS_H
@@ -1,11 +1,19 @@
 #ifndef LPX_STREAM_H
 #define LPX_STREAM_H
 
+#include "lpxstd.h"
+#include "manifest.h"
+
 /**
  * Ошибка генерации потока архива стрима
  */
 #define STRM_IO -2
 
+/**
+ * Количество фреймов в заголовке потока записываемого стрима (stream_follow): фреймы идут, пока поток не закончится
+ */
+#define STRM_FOLLOW_FRAMES UINT32_MAX
+
 /**
  * Структура записи в индексе потока
  */
@@ -14,12 +22,39 @@ typedef struct FrameMeta {
     int64_t end_time; // систмное (астрономическое) время получения фрейма в микросекундах
 } FrameMeta;
 
+/**
+ * Расположение фрейма на диске: файл сегмента (или файл фрейма для стримов, записанных по файлу на фрейм) в
+ * директории стрима и диапазон байт в нём
+ */
+typedef struct FrameRef {
+    char name[MAX_INT_LEN + 1]; // имя фрейма в архиве
+    char file[MAX_INT_LEN + 1]; // имя файла, содержащего фрейм, в директории стрима
+    uint64_t offset; // смещение фрейма в файле
+    uint64_t length; // размер фрейма в байтах, 0 - фрейм занимает весь файл
+    bool compressed; // фрейм сжат cdc_encode
+    bool verify; // сверять данные фрейма с crc при чтении
+    uint32_t crc; // CRC32C байт фрейма на диске
+    int64_t end_time; // end_time фрейма из индекса для замера задержки выдачи, 0 - не замеряется
+} FrameRef;
+
+/**
+ * Фрейм, отображённый в память только для чтения. Сжатые фреймы распаковываются из отображения в отдельный буфер.
+ */
+typedef struct MappedFrame {
+    const uint8_t *data; // raw-фрейм
+    size_t size; // размер raw-фрейма в байтах
+    void *map; // отображение, выровненное по границе страницы, NULL для распакованных фреймов
+    size_t map_size;
+    uint8_t *decoded; // буфер распакованного фрейма
+} MappedFrame;
+
 /**
  * Поток байт фреймов видео-потока.
  * BNF формата потока:
  * поток ::= <кол-во фреймов>(<eof> | <фрейм>)
  * eof ::= <0 байт>
- * кол-во фреймов ::= 32-битное беззнаковое число (little endian)
+ * кол-во фреймов ::= 32-битное беззнаковое число (little endian), STRM_FOLLOW_FRAMES - стрим ещё записывается и
+ *                    количество фреймов заранее неизвестно
  * фрейм :: = <имя файла><размер файла><n байт файла>
  * имя файла ::= строка в кодировке ascii с завершающим нулём
  * размер файла ::= 64-битное беззнаковое число (little endian)
@@ -33,7 +68,7 @@ typedef struct VideoStreamBytesStream VideoStreamBytesStream;
  * index - длина индекса фреймов
  * time_offset - время в микросекундах относительно момента начала стриминга (времени запроса первого фрейма)
  */
-ssize_t stream_find_frame(FrameMeta **index, size_t index_size, uint64_t time_offset);
+ssize_t stream_find_frame(const FrameMeta *index, size_t index_size, uint64_t time_offset);
 
 /**
  * Поиск индекса фрема ближайшего к заданному астрономическому времени
@@ -41,12 +76,81 @@ ssize_t stream_find_frame(FrameMeta **index, size_t index_size, uint64_t time_of
  * index - длина индекса фреймов
  * time_offset - астрономическое время в микросекундах
  */
-ssize_t stream_find_frame_abs(FrameMeta **index, size_t index_size, uint64_t time);
+ssize_t stream_find_frame_abs(const FrameMeta *index, size_t index_size, uint64_t time);
 
 /**
- * Инициализирует структура архива потока, содержащего заданные файлы. В случае ошибки возвращает NULL.
+ * Отображает в память фрейм frame файла fd. Отображение остаётся действительным после закрытия fd и освобождается
+ * stream_unmap_frame. Возвращает LPX_IO, если файл короче фрейма, и LPX_CORRUPT, если данные фрейма не совпадают с
+ * его контрольной суммой.
  */
-VideoStreamBytesStream *stream_open(char **files, size_t files_size);
+int8_t stream_map_frame(int fd, const FrameRef *frame, MappedFrame *mapped);
+
+/**
+ * Освобождает отображение фрейма. Повторный вызов безопасен.
+ */
+void stream_unmap_frame(MappedFrame *mapped);
+
+/**
+ * Отображает в память фреймы frames из файлов директории стрима dir_fd. Сначала ядро получает подсказки на чтение
+ * всех фреймов, затем фреймы отображаются в порядке их расположения на диске. Результаты складываются в mapped в
+ * порядке frames. В случае ошибки ни один фрейм не остаётся отображённым.
+ */
+int8_t stream_map_frames(int dir_fd, const FrameRef *frames, size_t frames_size, MappedFrame *mapped);
+
+/**
+ * Просит ядро прочитать в page cache все фреймы frames одной серией, в порядке их расположения на диске
+ */
+void stream_advise_frames(int dir_fd, const FrameRef *frames, size_t frames_size);
+
+/**
+ * Сверяет с контрольными суммами фреймы frames, у которых установлен verify, читая их в порядке расположения на
+ * диске. Возвращает LPX_CORRUPT и индекс первого найденного повреждённого фрейма в corrupted.
+ */
+int8_t stream_verify_frames(int dir_fd, const FrameRef *frames, size_t frames_size, size_t *corrupted);
+
+/**
+ * Инициализирует структура архива потока, содержащего заданные фреймы стрима, директория которого открыта как
+ * dir_fd. Фреймы конвертируются в BMP по формату format из манифеста стрима. Поток держит свою копию дескриптора
+ * директории и становится владельцем массива frames.
+ * read_ahead - количество фреймов, читаемых с диска заранее, пока отдаётся текущий. Фреймы читаются через
+ * отображение файлов в память, read_ahead только подсказывает ядру, что читать в page cache.
+ * В случае ошибки возвращает NULL.
+ */
+VideoStreamBytesStream *stream_open(int dir_fd, const FrameFormat *format, FrameRef *frames, size_t frames_size,
+                                    size_t read_ahead);
+
+/**
+ * Источник новых фреймов стрима, который ещё записывается. next дописывает в конец массива frames (расширяя его
+ * xrealloc) фреймы, появившиеся с прошлого вызова, и выставляет sealed, когда запись стрима закончена и новых фреймов
+ * не будет. wake_fd становится готов на чтение, когда могут появиться новые фреймы; next вычитывает его сам. free
+ * освобождает ctx.
+ */
+typedef struct StreamTail {
+    int8_t (*next)(void *ctx, FrameRef **frames, size_t *frames_size, bool *sealed);
+    void (*free)(void *ctx);
+    void *ctx;
+    int wake_fd;
+} StreamTail;
+
+/**
+ * Задержка выдачи фреймов потока: от end_time фрейма до передачи первых байт фрейма вызывающему stream_read
+ */
+typedef struct StreamStats {
+    uint64_t frames; // фреймов, для которых замерена задержка
+    uint64_t latency_avg_us;
+    uint64_t latency_max_us;
+} StreamStats;
+
+/**
+ * Инициализирует поток записываемого стрима, как stream_open, но начиная с фреймов frames поток дожидается новых
+ * фреймов от tail и заканчивается, когда запись стрима закончена или новые фреймы не появлялись idle_ms. Если новых
+ * фреймов ещё нет, stream_read отдаёт уже сформированные байты, а ждёт, только если отдать нечего. Поток становится
+ * владельцем tail. В случае ошибки возвращает NULL, tail освобождает вызывающий.
+ */
+VideoStreamBytesStream *stream_follow(int dir_fd, const FrameFormat *format, FrameRef *frames, size_t frames_size,
+                                      size_t read_ahead, const StreamTail *tail, unsigned idle_ms);
+
+void stream_stats(VideoStreamBytesStream *stream, StreamStats *stats);
 
 /**
  * Записывает до `max` байт архива в буффер. Возвращает количество реально записанных байт, EOF в случае
@@ -0,0 +1,137 @@
+#ifndef LPX_STREAM_INDEX_H
+#define LPX_STREAM_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "stream.h"
+
+// Имена файлов индекса в директории стрима
+#define SIDX_FILE     "index.bin"
+#define SIDX_CSV_FILE "index.csv"
+
+#define SIDX_MAGIC   "LPXI"
+#define SIDX_VERSION 1
+
+// Флаг заголовка: индекс ещё дописывается, frames_cnt не обновляется и количество записей определяется по размеру
+// файла
+#define SIDX_FLAG_OPEN 1
+// Флаг заголовка: индекс восстановлен после сбоя и время части фреймов оценено приблизительно
+#define SIDX_FLAG_APPROXIMATE 2
+// Флаг заголовка: в dropped_cnt записано количество пропущенных фреймов. Индексы, закрытые без него, считаются при
+// открытии.
+#define SIDX_FLAG_DROPPED 4
+
+/**
+ * Заголовок бинарного индекса стрима.
+ * Формат файла index.bin:
+ * индекс ::= <заголовок><запись>*
+ * заголовок ::= StreamIndexHeader (32 байта, little endian)
+ * запись ::= FrameMeta (record_size байт)
+ * Записи фиксированной длины, поэтому метаданные N-го фрейма лежат по смещению
+ * sizeof(StreamIndexHeader) + N * record_size и файл можно отобразить в память и адресовать напрямую.
+ * Во время записи стрима индекс дописывается по фрейму с флагом SIDX_FLAG_OPEN, а в конце стрима закрывается:
+ * в заголовок записывается количество фреймов и флаг снимается. Записи пропущенных фреймов остаются нулевыми.
+ */
+typedef struct StreamIndexHeader {
+    char magic[4]; // SIDX_MAGIC
+    uint32_t version; // SIDX_VERSION
+    uint32_t record_size; // sizeof(FrameMeta) на момент записи
+    uint32_t flags; // SIDX_FLAG_*
+    uint64_t frames_cnt; // количество записей закрытого индекса
+    uint64_t dropped_cnt; // количество нулевых записей закрытого индекса, если установлен SIDX_FLAG_DROPPED
+} StreamIndexHeader;
+
+/**
+ * Индекс фреймов стрима, открытый только для чтения. Записи лежат в памяти непрерывным массивом: для index.bin это
+ * отображение файла в память, для устаревшего index.csv - массив, разобранный при открытии.
+ */
+typedef struct StreamIndex StreamIndex;
+
+/**
+ * Открывает индекс стрима, директория которого открыта как dir_fd. Предпочитает index.bin, если его нет - разбирает
+ * index.csv. Возвращает STRG_NOT_FOUND, если нет ни одного файла индекса и STRG_BAD_INDEX, если индекс повреждён.
+ */
+int8_t sidx_open(int dir_fd, StreamIndex **index);
+
+size_t sidx_size(const StreamIndex *index);
+
+/**
+ * false, если индекс ещё дописывается
+ */
+bool sidx_sealed(const StreamIndex *index);
+
+/**
+ * true, если время части фреймов в индексе оценено при восстановлении индекса
+ */
+bool sidx_approximate(const StreamIndex *index);
+
+/**
+ * Количество пропущенных фреймов - записей индекса, которые так и не были записаны
+ */
+size_t sidx_dropped(const StreamIndex *index);
+
+/**
+ * Указатель на первую запись индекса. Записи идут подряд, их количество возвращает sidx_size.
+ */
+const FrameMeta *sidx_frames(const StreamIndex *index);
+
+/**
+ * Метаданные фрейма с индексом idx или NULL, если такого фрейма нет
+ */
+const FrameMeta *sidx_frame(const StreamIndex *index, size_t idx);
+
+void sidx_close(StreamIndex *index);
+
+/**
+ * Атомарно (через временный файл и rename) записывает закрытый index.bin с флагами SIDX_FLAG_* в директорию стрима
+ * dir_fd
+ */
+int8_t sidx_write(int dir_fd, const FrameMeta *frames, size_t frames_cnt, uint32_t flags);
+
+/**
+ * Переводит индекс стрима из index.csv в index.bin и удаляет index.csv. Если index.bin уже есть, ничего не делает.
+ */
+int8_t sidx_convert(int dir_fd);
+
+/**
+ * Индекс стрима, дописываемый во время записи стрима
+ */
+typedef struct IndexWriter IndexWriter;
+
+/**
+ * Открывает индекс стрима на дописывание, создавая index.bin с флагом SIDX_FLAG_OPEN. Если незакрытый индекс уже
+ * есть (запись стрима прервалась), дописывание продолжается. Возвращает STRG_EXISTS, если индекс стрима уже закрыт.
+ */
+int8_t sidxw_open(int dir_fd, IndexWriter **writer);
+
+/**
+ * Записывает метаданные фрейма с индексом frame_idx. Запись попадает в page cache и видна читателям индекса сразу,
+ * но переживает отключение питания только после sidxw_commit. Если filled не NULL, в него записывается, заняла ли
+ * запись пустое место (новый или пропущенный фрейм), а не заменила записанный ранее фрейм.
+ */
+int8_t sidxw_append(IndexWriter *writer, uint32_t frame_idx, const FrameMeta *frame, bool *filled);
+
+/**
+ * Сбрасывает дописанные записи на диск
+ */
+int8_t sidxw_commit(IndexWriter *writer);
+
+/**
+ * Дублирует дескриптор дописываемого индекса, чтобы сбросить его на диск после закрытия писателя. Возвращает -1 в
+ * случае ошибки.
+ */
+int sidxw_dup_fd(IndexWriter *writer);
+
+/**
+ * Закрывает индекс: записывает в заголовок количество фреймов и пропущенных фреймов, снимает флаг SIDX_FLAG_OPEN и
+ * сбрасывает индекс на диск. Освобождает writer.
+ */
+int8_t sidxw_seal(IndexWriter *writer);
+
+/**
+ * Освобождает writer, оставляя индекс открытым для дописывания
+ */
+int8_t sidxw_close(IndexWriter *writer);
+
+#endif //LPX_STREAM_INDEX_H
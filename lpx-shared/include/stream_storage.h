@@ -4,7 +4,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "stream.h"
+#include "stream_index.h"
 #include "list.h"
+#include "frame_writer.h"
 
 // Error codes
 #define STRG_ACCESS    2
@@ -12,39 +14,298 @@
 #define STRG_NOT_FOUND 4
 #define STRG_BAD_INDEX 5
 
+/**
+ * Уровни надёжности записи фреймов (StorageConfig.durability) - сколько записанных фреймов можно потерять при
+ * отключении питания. Фиксацию - сброс на диск сегментов, таблицы фреймов и индекса записываемого стрима - делает
+ * один поток, объединяя в группу фреймы всех потоков записи.
+ */
+#define STRG_DURABLE_NONE  0 // фреймы попадают на диск, когда решит page cache, и при закрытии стрима
+#define STRG_DURABLE_GROUP 1 // фиксация каждые index_commit_frames фреймов и не реже раза в index_commit_ms
+#define STRG_DURABLE_FRAME 2 // сохранение фрейма завершается после его фиксации, фрейм пишется без очереди записи
+
 typedef struct Storage Storage;
 
+/**
+ * Параметры хранилища
+ */
+typedef struct StorageConfig {
+    size_t write_queue_depth; // размер очереди отложенной записи, 0 - фреймы пишутся синхронно (как с DURABLE_FRAME)
+    size_t write_threads; // количество потоков отложенной записи фреймов
+    size_t write_batch; // максимальное количество фреймов, отправляемых на диск одним запросом
+    bool direct_io; // писать фреймы в обход page cache (O_DIRECT) в заранее выделенные сегменты
+    int durability; // STRG_DURABLE_*
+    size_t index_commit_frames; // через сколько фреймов фиксировать запись в режиме STRG_DURABLE_GROUP, 0 - не считать
+    unsigned index_commit_ms; // период фиксации записи в режиме STRG_DURABLE_GROUP, 0 - без ограничения по времени
+    bool recover_on_open; // восстанавливать при открытии хранилища индексы стримов, запись которых прервалась
+    size_t recovery_threads; // количество потоков восстановления индексов
+    size_t read_ahead; // количество фреймов, которые ядро читает в page cache заранее при выдаче архива стрима
+    uint64_t capacity_bytes; // ёмкость хранилища в байтах, 0 - без ограничения
+    unsigned capacity_percent; // ёмкость хранилища в процентах от размера файловой системы, 0 - без ограничения
+    bool day_buckets; // раскладывать стримы по директориям суток, стримы из базовой директории переносятся при открытии
+    bool compress; // сжимать фреймы без потерь (codec.h) перед записью, фреймы, которые не сжимаются, пишутся как есть
+    bool verify_crc; // сверять фреймы с контрольными суммами при чтении, несовпадение - ошибка LPX_CORRUPT
+    uint64_t scrub_bytes_per_sec; // скорость фоновой проверки контрольных сумм записанных стримов, 0 - без проверки
+    char *ram_dir; // директория в RAM (tmpfs) для сегментов записываемого стрима, NULL - писать сразу на диск
+    uint64_t ram_bytes; // ёмкость RAM-уровня, 0 - ограничена размером tmpfs
+    char **volumes; // директории дополнительных томов, по которым вместе с базовой распределяются фреймы
+    size_t volumes_cnt;
+} StorageConfig;
+
+/**
+ * Занятое место, вытеснение старых стримов и удаление файлов из корзины
+ */
+typedef struct StorageUsage {
+    uint64_t used_bytes; // суммарный размер стримов, включая записываемый, без корзины
+    uint64_t capacity_bytes; // ёмкость хранилища, 0 - без ограничения
+    uint64_t evicted_streams; // стримов вытеснено с момента открытия хранилища
+    uint64_t evicted_bytes;
+    uint64_t trash_bytes; // оценка размера файлов, ожидающих удаления в корзине
+    uint64_t trash_entries; // удалённых стримов (storage_clear - одна запись), файлы которых ещё не удалены
+    uint64_t reaped_files; // файлов удалено из корзины с момента открытия хранилища
+    uint64_t reaped_bytes;
+    uint64_t reap_time_us; // время, затраченное на удаление файлов из корзины
+    uint64_t ram_bytes; // место, занятое и зарезервированное сегментами в RAM-уровне
+    uint64_t migrated_segments; // сегментов перенесено из RAM-уровня на диск с момента открытия хранилища
+    uint64_t migrated_bytes;
+} StorageUsage;
+
+/**
+ * Фоновая проверка контрольных сумм фреймов. Поток с классом ввода-вывода idle проверяет записанные стримы от
+ * старых к новым порциями, не превышая scrub_bytes_per_sec, и записывает результат проверки каждого стрима в каталог
+ * (CatalogEntry.scrub_time и scrub_errors). Проверенные стримы перепроверяются через неделю.
+ * Скорость самой проверки, без пауз, - verified_bytes / scrub_time_us.
+ */
+typedef struct StorageScrub {
+    uint64_t verified_streams; // стримов проверено целиком с момента открытия хранилища
+    uint64_t verified_frames;
+    uint64_t verified_bytes;
+    uint64_t corrupt_frames; // фреймов с несовпадающей контрольной суммой
+    uint64_t failed_frames; // фреймов, которые не удалось прочитать
+    uint64_t scrub_time_us; // время чтения и проверки фреймов
+    uint64_t pending_streams; // записанных стримов, ожидающих проверки
+    uint64_t corrupt_streams; // стримов каталога с ошибками по последней проверке
+    char train_id[MAX_INT_LEN + 1]; // проверяемый стрим, пустая строка - проверять нечего или проверка выключена
+    uint64_t train_frame; // следующий проверяемый фрейм стрима
+    uint64_t train_frames; // фреймов в проверяемом стриме
+} StorageScrub;
+
+/**
+ * Том хранилища: заполненность и запись на него с момента открытия хранилища. Скорость записи на том -
+ * written_bytes / write_time_us.
+ */
+typedef struct StorageVolume {
+    const char *path; // путь к тому, действителен до закрытия хранилища
+    uint64_t total_bytes; // размер файловой системы тома
+    uint64_t free_bytes; // свободное на ней место
+    uint64_t segments; // сегментов создано на томе
+    uint64_t written_frames;
+    uint64_t written_bytes;
+    uint64_t write_time_us; // время, в течение которого на том шла запись фреймов
+} StorageVolume;
+
+/**
+ * Статистика стрима или сводка по всем стримам хранилища. Хранилище поддерживает её при сохранении и удалении
+ * фреймов и стримов, так что запрос не читает индексы и файлы стримов.
+ */
+typedef struct StorageStats {
+    char train_id[MAX_INT_LEN + 1]; // пустая строка для сводки
+    uint64_t streams; // 1 для стрима
+    uint64_t frames; // фреймов в индексе, включая пропущенные
+    uint64_t dropped_frames; // пропущенных фреймов - записей индекса без фрейма
+    uint64_t bytes;
+    int64_t start_time; // start_time первого фрейма в микросекундах, для стрима без индекса - время его создания
+    int64_t end_time; // end_time последнего фрейма в микросекундах
+    uint64_t duration_us; // для сводки - суммарная длительность стримов
+    bool open; // индекс стрима ещё дописывается или не записан
+} StorageStats;
+
+/**
+ * Заполняет параметры хранилища значениями по умолчанию
+ */
+void storage_default_config(StorageConfig *config);
+
+/**
+ * Открывает хранилище с параметрами по умолчанию
+ */
 int8_t storage_open(char *base_dir, Storage **storage);
 
+/**
+ * Открывает хранилище с заданными параметрами. Если задана ёмкость, хранилище работает как кольцевой буфер: при
+ * записи стрима фоновый поток удаляет самые старые завершённые стримы, как только занятое место приближается к
+ * ёмкости. Записываемый стрим не удаляется никогда.
+ * Если задан ram_dir, фреймы записываемого стрима попадают в RAM-уровень (SegmentTier), а после закрытия писателя
+ * (storage_seal_stream или начало следующего стрима) фоновый поток переносит их в базовую директорию. Поиск и чтение
+ * стримов находят фреймы в любом уровне, в том числе из других процессов. Когда уровень заполнен, сегменты пишутся
+ * сразу на диск. Перенос доделывается при закрытии хранилища, а сегменты, оставшиеся в уровне после аварийного
+ * завершения, переносятся при следующем открытии; после перезагрузки они теряются.
+ * Если заданы дополнительные тома, фреймы записываемого стрима по очереди распределяются между базовой директорией и
+ * томами (segment.h, SegmentPlacement), так что запись идёт на все диски параллельно. Сегменты на дополнительных
+ * томах лежат в <том>/<идентификатор стрима> и подключаются в директорию стрима символьными ссылками: каталог,
+ * поиск и чтение стримов работают только с базовой директорией. Ёмкость в процентах считается от суммарного размера
+ * файловых систем томов.
+ * Хранилище, однажды открытое с day_buckets, остаётся разложенным по суткам при любых параметрах: раскладку
+ * подхватывают все процессы, работающие с хранилищем.
+ */
+int8_t storage_open_config(char *base_dir, const StorageConfig *config, Storage **storage);
+
 int8_t storage_prepare(Storage *storage, char *train_id);
 
-int8_t storage_store_frame(Storage *storage, char *train_id, uint32_t frame_idx, const uint8_t *buf, size_t size);
+/**
+ * Сохраняет фрейм стрима. При включённой отложенной записи фрейм копируется в очередь и записывается на диск в фоне,
+ * а функция возвращает ошибки ранее поставленных в очередь фреймов. С STRG_DURABLE_FRAME фрейм пишется синхронно, и
+ * функция возвращается после его фиксации.
+ * Если meta не NULL, после записи фрейма его метаданные дописываются в индекс стрима, так что стрим доступен для
+ * поиска и чтения ещё во время записи и после аварийного завершения. В конце стрима индекс закрывается
+ * storage_seal_stream.
+ */
+int8_t storage_store_frame(Storage *storage, char *train_id, uint32_t frame_idx, const uint8_t *buf, size_t size,
+                           const FrameMeta *meta);
+
+/**
+ * Барьер отложенной записи: дожидается записи всех сохранённых фреймов и возвращает первую ошибку записи с момента
+ * предыдущего вызова
+ */
+int8_t storage_flush(Storage *storage);
+
+/**
+ * Статистика отложенной записи фреймов
+ */
+void storage_writer_stats(Storage *storage, FrameWriterStats *stats);
+
+/**
+ * Занятое место и статистика вытеснения
+ */
+void storage_usage(Storage *storage, StorageUsage *usage);
+
+/**
+ * Фиксация записанных фреймов на диске. Среднее время фиксации - sync_time_us / syncs.
+ */
+typedef struct StorageSync {
+    uint64_t syncs; // фиксаций с момента открытия хранилища
+    uint64_t synced_frames; // фреймов, зафиксированных ими
+    uint64_t sync_time_us;
+    uint64_t sync_time_max_us;
+    uint64_t sync_errors;
+    uint64_t unsynced_frames; // записанных, но не зафиксированных фреймов - столько фреймов можно потерять сейчас
+    uint64_t unsynced_frames_max; // наибольшее их количество с момента открытия хранилища
+} StorageSync;
+
+/**
+ * Статистика фиксации записанных фреймов
+ */
+void storage_sync_stats(Storage *storage, StorageSync *sync);
+
+/**
+ * Статистика стрима train_id или, если train_id NULL, сводка по всем стримам хранилища. Возвращает STRG_NOT_FOUND,
+ * если стрима нет.
+ */
+int8_t storage_stats(Storage *storage, char *train_id, StorageStats *stats);
+
+/**
+ * Статистика всех стримов хранилища в порядке их начала. Массив stats освобождается вызывающим.
+ */
+int8_t storage_list_stats(Storage *storage, StorageStats **stats, size_t *stats_cnt);
+
+/**
+ * Заполняет до max записей о томах хранилища, начиная с базовой директории, и возвращает количество томов
+ */
+size_t storage_volumes(Storage *storage, StorageVolume *volumes, size_t max);
+
+/**
+ * Состояние фоновой проверки контрольных сумм
+ */
+void storage_scrub_status(Storage *storage, StorageScrub *scrub);
+
+int8_t storage_store_stream_idx(Storage *storage, char *train_id, const FrameMeta *index, size_t frames_cnt);
 
-int8_t storage_store_stream_idx(Storage *storage, char *train_id, FrameMeta **index, size_t frames_cnt);
+/**
+ * Завершает запись стрима: дожидается записи фреймов, сбрасывает их на диск и закрывает дописываемый индекс
+ */
+int8_t storage_seal_stream(Storage *storage, char *train_id);
 
-int8_t storage_read_stream_idx(Storage *storage, char *train_id, FrameMeta ***index, size_t *frames_cnt);
+/**
+ * Открывает индекс фреймов стрима. Индекс должен быть закрыт вызовом sidx_close
+ */
+int8_t storage_open_stream_idx(Storage *storage, char *train_id, StreamIndex **index);
 
+/**
+ * Читает raw-фрейм стрима в буфер, который нужно освободить. Возвращает LPX_CORRUPT, если включена проверка
+ * контрольных сумм и фрейм повреждён.
+ */
 int8_t storage_read_frame(Storage *storage, char *train_id, uint32_t frame_idx, uint8_t **buf, size_t *buf_size);
 
+/**
+ * Отображает raw-фрейм стрима в память только для чтения, без копирования в буфер. Отображение должно быть
+ * освобождено вызовом storage_unmap_frame.
+ */
+int8_t storage_map_frame(Storage *storage, char *train_id, uint32_t frame_idx, MappedFrame *frame);
+
+void storage_unmap_frame(MappedFrame *frame);
+
+/**
+ * Отображает в память фреймы стрима с индексами frame_idxs. Чтение всех фреймов запрашивается у ядра разом, фреймы
+ * отображаются в порядке их расположения на диске, а результаты складываются в frames в порядке frame_idxs. Каждый
+ * фрейм должен быть освобождён вызовом storage_unmap_frame.
+ */
+int8_t storage_map_frames(Storage *storage, char *train_id, const uint32_t *frame_idxs, size_t frames_cnt,
+                          MappedFrame *frames);
+
+/**
+ * Записывает манифест стрима - формат его фреймов. Вызывается после storage_prepare до записи первого фрейма.
+ */
+int8_t storage_store_format(Storage *storage, char *train_id, const FrameFormat *format);
+
+/**
+ * Читает формат фреймов стрима из его манифеста. Для стримов, записанных без манифеста, возвращает mnf_legacy.
+ */
+int8_t storage_read_format(Storage *storage, char *train_id, FrameFormat *format);
+
 int8_t storage_find_stream(Storage *storage, uint64_t time, char **train_id);
 
 /**
- * Возвращает поток байт содиржащих все фремы заданного стрима начиная с заданного оффсета
+ * Возвращает поток байт содиржащих все фремы заданного стрима начиная с заданного оффсета. Возвращает LPX_CORRUPT,
+ * если повреждение фрейма обнаружено при открытии потока.
  */
 int8_t storage_open_stream(Storage *storage, char *train_id, size_t offset_idx, VideoStreamBytesStream **stream);
 
 /**
- * Возвращает поток байт содержащих фреймы по указанным индексам в заданном стриме
+ * Возвращает поток байт стрима, который ещё может записываться, начиная с фрейма offset_idx (stream_follow). Новые
+ * фреймы попадают в поток, как только их метаданные дописаны в индекс, в том числе если стрим пишет другой процесс:
+ * читатель будят изменения директории стрима (inotify). Поток заканчивается, когда индекс стрима закрыт, или если
+ * новые фреймы не появлялись 30 секунд. Пропущенные фреймы в поток не попадают.
+ */
+int8_t storage_follow_stream(Storage *storage, char *train_id, size_t offset_idx, VideoStreamBytesStream **stream);
+
+/**
+ * Возвращает поток байт содержащих фреймы по указанным индексам в заданном стриме. Выбранные фреймы сверяются с
+ * контрольными суммами до открытия потока, при повреждении возвращается LPX_CORRUPT.
  */
 int8_t storage_open_stream_frames(Storage *storage, char *train_id, List *frame_indexes, VideoStreamBytesStream **stream);
 
+/**
+ * Удаляет стрим: переносит его директорию в корзину хранилища, откуда файлы удаляет фоновый поток с пониженным
+ * приоритетом. Стрим перестаёт находиться поиском сразу.
+ */
 int8_t storage_delete_stream(Storage *storage, char *train_id);
 
 /**
- * Удаляет все стримы с диска
+ * Удаляет все стримы: переносит их в одну директорию корзины, файлы удаляются в фоне
  */
 int8_t storage_clear(Storage *storage);
 
+/**
+ * Восстанавливает индексы брошенных стримов: стримов с фреймами, но без индекса, с повреждённым или незакрытым
+ * индексом, директории которых давно не менялись. Время фреймов, не попавших в индекс, оценивается по времени
+ * изменения файлов, такие индексы помечаются как приблизительные. Стримы восстанавливаются параллельно
+ * recovery_threads потоками. В recovered (может быть NULL) возвращается количество восстановленных стримов.
+ */
+int8_t storage_recover(Storage *storage, size_t *recovered);
+
+/**
+ * Одноразовая конвертация хранилища: переводит индексы всех стримов из index.csv в index.bin
+ */
+int8_t storage_convert_indexes(Storage *storage);
+
 void storage_close(Storage *storage);
 
 #endif //LPX_STREAM_STORAGE_H
@@ -0,0 +1,62 @@
+#ifndef LPX_SYNCER_H
+#define LPX_SYNCER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "stream_storage.h"
+
+/**
+ * Фиксация записанных фреймов на диске (StorageConfig.durability). Считает проиндексированные и зафиксированные
+ * фреймы и фиксирует их в своём потоке, сбрасывая дубликаты дескрипторов записываемого стрима, так что запись фреймов
+ * во время фиксации продолжается. Поток запускается при индексации первых фреймов, чтобы хранилища, из которых только
+ * читают, его не держали.
+ */
+typedef struct Syncer Syncer;
+
+/**
+ * Функции хранилища, которые вызывает поток фиксации
+ */
+typedef struct SyncSource {
+    /**
+     * Дублирует дескрипторы сегментов, таблицы фреймов и индекса записываемого стрима в порядке, в котором их нужно
+     * сбрасывать: индекс последним. Возвращает количество дубликатов в *fds, массив и дескрипторы закрывает поток
+     * фиксации. 0 - писатель закрыт, его фреймы зафиксированы при закрытии.
+     */
+    size_t (*dup_fds)(void *ctx, int **fds);
+
+    void *ctx;
+} SyncSource;
+
+/**
+ * Создаёт фиксацию с уровнем надёжности durability (STRG_DURABLE_GROUP или STRG_DURABLE_FRAME) и порогами фиксации
+ * commit_frames и commit_ms (StorageConfig.index_commit_frames и index_commit_ms)
+ */
+Syncer *sncr_create(int durability, size_t commit_frames, unsigned commit_ms, const SyncSource *source);
+
+/**
+ * Учитывает frames записанных и проиндексированных фреймов и будит поток фиксации, если набралось достаточно
+ * фреймов. В режиме STRG_DURABLE_FRAME дожидается фиксации этих фреймов вместе с фреймами других потоков записи и
+ * возвращает LPX_IO, если не удалась фиксация, первой покрывшая эти фреймы.
+ */
+int8_t sncr_indexed(Syncer *syncer, size_t frames);
+
+/**
+ * Начинает фиксацию в вызывающем потоке, например перед закрытием писателя. Возвращает false, если все
+ * проиндексированные фреймы уже зафиксированы, иначе записывает в target, до какого фрейма дойдёт фиксация.
+ */
+bool sncr_begin(Syncer *syncer, uint64_t *target);
+
+/**
+ * Отмечает, что фиксация до target, занявшая time_us, закончилась
+ */
+void sncr_end(Syncer *syncer, uint64_t target, bool failed, uint64_t time_us);
+
+void sncr_stats(Syncer *syncer, StorageSync *sync);
+
+/**
+ * Останавливает поток фиксации. Оставшиеся фреймы фиксирует закрытие писателя.
+ */
+void sncr_free(Syncer *syncer);
+
+#endif //LPX_SYNCER_H
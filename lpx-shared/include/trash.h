@@ -0,0 +1,66 @@
+#ifndef LPX_TRASH_H
+#define LPX_TRASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lpxstd.h"
+
+// Корзина в базовой директории хранилища
+#define TRASH_DIR ".trash"
+
+/**
+ * Корзина хранилища: удаляемые стримы переименовываются в неё, так что сразу пропадают из хранилища, а их файлы
+ * удаляет фоновый поток порциями с паузами, чтобы удаление не конкурировало за диск с записью. Содержимое корзины,
+ * оставшееся от предыдущего запуска, удаляется после открытия.
+ */
+typedef struct Trash Trash;
+
+/**
+ * Перенос в корзину стримов, удаляемых одним вызовом хранилища
+ */
+typedef struct TrashBatch TrashBatch;
+
+/**
+ * Содержимое корзины, которое ещё предстоит удалить, и сколько уже удалено. Запись корзины - стрим, удалённый
+ * отдельно, или все стримы, перенесённые пачкой с generation.
+ */
+typedef struct TrashStats {
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t reaped_files;
+    uint64_t reaped_bytes;
+    uint64_t reap_time_us; // суммарное время удаления файлов
+} TrashStats;
+
+/**
+ * Открывает корзину в базовой директории base_fd и запускает удаление оставшегося в ней содержимого. Дескриптор
+ * base_fd должен оставаться открытым до trsh_free.
+ */
+Trash *trsh_open(int base_fd);
+
+/**
+ * Начинает перенос стримов в корзину, создавая её при необходимости. Если generation, все стримы пачки переносятся
+ * в одну директорию корзины и считаются одной записью.
+ */
+int8_t trsh_begin(Trash *trash, bool generation, TrashBatch **batch);
+
+/**
+ * Переносит в корзину директорию стрима train_id по пути path относительно dir_fd. bytes - размер стрима, 0 -
+ * размер неизвестен и считается по файлам. Возвращает STRG_NOT_FOUND, если директории нет.
+ */
+int8_t trsh_move(TrashBatch *batch, int dir_fd, const char *path, const char *train_id, uint64_t bytes);
+
+/**
+ * Заканчивает перенос и будит поток удаления, запуская его при необходимости. Освобождает batch.
+ */
+void trsh_end(TrashBatch *batch);
+
+void trsh_stats(Trash *trash, TrashStats *stats);
+
+/**
+ * Останавливает поток удаления, дожидаясь удаления текущей порции. Недоудалённое содержимое корзины удаляется после
+ * следующего открытия хранилища.
+ */
+void trsh_free(Trash *trash);
+
+#endif //LPX_TRASH_H
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include "../include/bmp.h"
 
 static const int HEADER_SIZE = 54;
 
@@ -71,22 +72,6 @@ static void fill_bmp_header(size_t width, size_t height, size_t image_size, size
     }
 }
 
-static uint8_t *generate_bmp(size_t width, size_t height, const uint8_t *bitmap, size_t *bmp_size) {
-    size_t image_size = width * height;
-    size_t file_size = HEADER_SIZE + (COLORS_COUNT * 4) + image_size;
-    uint8_t *content = malloc(sizeof(uint8_t) * file_size);
-    fill_bmp_header(width, height, image_size, file_size, content);
-
-    // -- PIXEL DATA -- //
-    for (int i = HEADER_SIZE + (COLORS_COUNT * 4); i < file_size; i++) {
-        content[i] = bitmap[i - (HEADER_SIZE + COLORS_COUNT * 4)];
-    }
-
-    *bmp_size = file_size;
-
-    return content;
-}
-
 static uint8_t map_pixel(uint16_t pixel) {
     static uint8_t map[UINT16_MAX];
     static bool map_filled = false;
@@ -101,34 +86,94 @@ static uint8_t map_pixel(uint16_t pixel) {
 }
 
 
-static uint8_t *raw12_to_bitmap(const uint8_t *input_buffer, size_t width, size_t height) {
-    uint8_t *buffer = (uint8_t *) malloc(width * height * sizeof(uint8_t));
-    if (buffer == NULL) {
-        fprintf(stderr, "Could not create image buffer\n");
-        return NULL;
+/**
+ * Ядро конвертации строки фрейма из width пикселей в строку 8-битного изображения
+ */
+typedef void (*row_kernel)(const uint8_t *row, size_t width, uint8_t *out);
+
+static void raw8_row(const uint8_t *row, size_t width, uint8_t *out) {
+    for (size_t j = 0; j < width; j++) {
+        out[j] = map_pixel(row[j]);
     }
+}
 
-    for (int i = 0, j = 0; j < width * height; i += 3, j += 2) {
-        uint16_t p1 = ((uint16_t) input_buffer[i]) << ((uint8_t) 4);
-        p1 |= (input_buffer[i + 2] & ((uint8_t) 0xF));
+/**
+ * RAW10: четыре пикселя в пяти байтах - старшие 8 бит каждого пикселя, затем младшие 2 бита всех четырёх
+ */
+static void raw10_row(const uint8_t *row, size_t width, uint8_t *out) {
+    for (size_t i = 0, j = 0; j < width; i += 5, j += 4) {
+        for (size_t k = 0; k < 4 && j + k < width; k++) {
+            out[j + k] = map_pixel((uint16_t) (row[i + k] << 2 | (row[i + 4] >> (2 * k) & 0x3)));
+        }
+    }
+}
 
-        uint16_t p2 = ((uint16_t) input_buffer[i + 1]) << ((uint8_t) 4);;
-        p2 |= (input_buffer[i + 2] >> ((uint8_t) 4));
+/**
+ * RAW12: два пикселя в трёх байтах - старшие 8 бит каждого пикселя, затем младшие 4 бита обоих
+ */
+static void raw12_row(const uint8_t *row, size_t width, uint8_t *out) {
+    size_t i = 0, j = 0;
+    for (; j + 1 < width; i += 3, j += 2) {
+        out[j] = map_pixel((uint16_t) (row[i] << 4 | (row[i + 2] & 0xF)));
+        out[j + 1] = map_pixel((uint16_t) (row[i + 1] << 4 | row[i + 2] >> 4));
+    }
+    if (j < width) {
+        out[j] = map_pixel((uint16_t) (row[i] << 4 | (row[i + 2] & 0xF)));
+    }
+}
 
-        buffer[j] = map_pixel(p1);
-        buffer[j + 1] = map_pixel(p2);
+static void raw16_row(const uint8_t *row, size_t width, uint8_t *out) {
+    for (size_t j = 0; j < width; j++) {
+        out[j] = map_pixel((uint16_t) (row[2 * j] | row[2 * j + 1] << 8));
     }
+}
 
-    return buffer;
+static row_kernel select_kernel(uint32_t bit_depth) {
+    switch (bit_depth) {
+        case 8:
+            return raw8_row;
+        case 10:
+            return raw10_row;
+        case 12:
+            return raw12_row;
+        case 16:
+            return raw16_row;
+        default:
+            return NULL;
+    }
 }
 
-uint8_t raw12_to_bmp(const uint8_t *raw_12, size_t width, size_t height, uint8_t **bmp, size_t *bmp_size) {
+uint8_t frame_to_bmp(const FrameFormat *format, const uint8_t *raw, size_t raw_size, uint8_t **bmp, size_t *bmp_size) {
+    row_kernel kernel = select_kernel(format->bit_depth);
+    size_t width = format->width;
+    size_t height = format->height;
+    size_t row_size = mnf_row_size(format);
+    if (kernel == NULL || height == 0 || format->stride < row_size ||
+        raw_size < (size_t) format->stride * (height - 1) + row_size) {
+        return 1;
+    }
 
-    uint8_t *bitmap = raw12_to_bitmap(raw_12, width, height);
-    if (bitmap == NULL) {
+    // строки BMP выравниваются по 4 байта
+    size_t bmp_row = (width + 3) / 4 * 4;
+    size_t image_size = bmp_row * height;
+    size_t file_size = HEADER_SIZE + (COLORS_COUNT * 4) + image_size;
+    uint8_t *content = malloc(sizeof(uint8_t) * file_size);
+    if (content == NULL) {
+        fprintf(stderr, "Could not create image buffer\n");
         return 1;
     }
+    fill_bmp_header(width, height, image_size, file_size, content);
+
+    // -- PIXEL DATA -- //
+    uint8_t *pixels = content + HEADER_SIZE + (COLORS_COUNT * 4);
+    for (size_t y = 0; y < height; y++) {
+        uint8_t *out = pixels + y * bmp_row;
+        kernel(raw + y * format->stride, width, out);
+        memset(out + width, 0, bmp_row - width);
+    }
+
+    *bmp = content;
+    *bmp_size = file_size;
 
-    *bmp = generate_bmp(width, height, bitmap, bmp_size);
-    free(bitmap);
+    return 0;
 }
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include "../include/catalog.h"
+
+#define CTLG_MAGIC   "LPXC"
+#define CTLG_VERSION 3
+
+/**
+ * Заголовок файла контрольной точки каталога, за которым следуют entries_cnt записей CatalogEntry
+ */
+typedef struct CatalogHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t entries_cnt;
+    int64_t base_mtime;
+} CatalogHeader;
+
+typedef struct Catalog {
+    CatalogEntry *entries;
+    size_t size;
+    size_t capacity;
+    uint64_t bytes; // суммарный размер стримов каталога
+    uint64_t frames; // суммарное количество фреймов стримов каталога
+    uint64_t dropped_frames;
+} Catalog;
+
+Catalog *ctlg_create() {
+    Catalog *catalog = xcalloc(1, sizeof(Catalog));
+    catalog->capacity = 64;
+    catalog->entries = xcalloc(catalog->capacity, sizeof(CatalogEntry));
+    return catalog;
+}
+
+/**
+ * Поиск идёт с конца каталога: чаще всего ищется записываемый стрим, а он самый поздний
+ */
+static ssize_t ctlg_index_of(Catalog *catalog, const char *train_id) {
+    for (size_t i = catalog->size; i > 0; i--) {
+        if (strcmp(catalog->entries[i - 1].train_id, train_id) == 0) {
+            return i - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Индекс первой записи со start_time большим time
+ */
+static size_t ctlg_upper_bound(Catalog *catalog, int64_t time) {
+    size_t lo = 0;
+    size_t hi = catalog->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (catalog->entries[mid].start_time <= time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void ctlg_put(Catalog *catalog, const CatalogEntry *entry) {
+    ctlg_remove(catalog, entry->train_id);
+
+    if (catalog->size == catalog->capacity) {
+        catalog->capacity *= 2;
+        catalog->entries = xrealloc(catalog->entries, catalog->capacity * sizeof(CatalogEntry));
+    }
+
+    size_t pos = ctlg_upper_bound(catalog, entry->start_time);
+    memmove(&catalog->entries[pos + 1], &catalog->entries[pos], (catalog->size - pos) * sizeof(CatalogEntry));
+    catalog->entries[pos] = *entry;
+    catalog->size++;
+    catalog->bytes += entry->bytes;
+    catalog->frames += entry->frames_cnt;
+    catalog->dropped_frames += entry->dropped_frames;
+}
+
+void ctlg_put_pending(Catalog *catalog, const char *train_id) {
+    CatalogEntry entry = {0};
+    strncpy(entry.train_id, train_id, MAX_INT_LEN);
+    entry.start_time = strtoll(train_id, NULL, 10) * 1000;
+    entry.end_time = entry.start_time;
+    entry.indexed = false;
+    ctlg_put(catalog, &entry);
+}
+
+bool ctlg_remove(Catalog *catalog, const char *train_id) {
+    ssize_t idx = ctlg_index_of(catalog, train_id);
+    if (idx == -1) {
+        return false;
+    }
+    catalog->bytes -= catalog->entries[idx].bytes;
+    catalog->frames -= catalog->entries[idx].frames_cnt;
+    catalog->dropped_frames -= catalog->entries[idx].dropped_frames;
+    memmove(&catalog->entries[idx], &catalog->entries[idx + 1], (catalog->size - idx - 1) * sizeof(CatalogEntry));
+    catalog->size--;
+    return true;
+}
+
+const CatalogEntry *ctlg_get(Catalog *catalog, const char *train_id) {
+    ssize_t idx = ctlg_index_of(catalog, train_id);
+    return idx == -1 ? NULL : &catalog->entries[idx];
+}
+
+const CatalogEntry *ctlg_find(Catalog *catalog, int64_t time) {
+    size_t pos = ctlg_upper_bound(catalog, time);
+    // стримы не пересекаются по времени, так что подходящим может быть только последний проиндексированный стрим,
+    // начавшийся не позже time
+    while (pos > 0) {
+        const CatalogEntry *entry = &catalog->entries[--pos];
+        if (!entry->indexed) {
+            continue;
+        }
+        return entry->end_time >= time ? entry : NULL;
+    }
+    return NULL;
+}
+
+size_t ctlg_size(Catalog *catalog) {
+    return catalog->size;
+}
+
+const CatalogEntry *ctlg_at(Catalog *catalog, size_t idx) {
+    return idx < catalog->size ? &catalog->entries[idx] : NULL;
+}
+
+uint64_t ctlg_bytes(Catalog *catalog) {
+    return catalog->bytes;
+}
+
+void ctlg_totals(Catalog *catalog, CatalogTotals *totals) {
+    memset(totals, 0, sizeof(CatalogTotals));
+    totals->streams = catalog->size;
+    totals->frames = catalog->frames;
+    totals->dropped_frames = catalog->dropped_frames;
+    totals->bytes = catalog->bytes;
+    for (size_t i = 0; i < catalog->size; i++) {
+        const CatalogEntry *entry = &catalog->entries[i];
+        if (!entry->indexed) {
+            continue;
+        }
+        // записи отсортированы по start_time
+        if (totals->start_time == 0) {
+            totals->start_time = entry->start_time;
+        }
+        if (entry->end_time > totals->end_time) {
+            totals->end_time = entry->end_time;
+        }
+        if (entry->end_time > entry->start_time) {
+            totals->duration_us += (uint64_t) (entry->end_time - entry->start_time);
+        }
+    }
+}
+
+void ctlg_clear(Catalog *catalog) {
+    catalog->size = 0;
+    catalog->bytes = 0;
+    catalog->frames = 0;
+    catalog->dropped_frames = 0;
+}
+
+void ctlg_free(Catalog *catalog) {
+    free(catalog->entries);
+    free(catalog);
+}
+
+int8_t ctlg_save(Catalog *catalog, int dir_fd, const char *name, int64_t base_mtime) {
+    int8_t res = LPX_SUCCESS;
+
+    char tmp_name[NAME_MAX + 1];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+    int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    FILE *f = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (f == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return LPX_IO;
+    }
+
+    CatalogHeader header = {
+            .magic = CTLG_MAGIC,
+            .version = CTLG_VERSION,
+            .record_size = sizeof(CatalogEntry),
+            .entries_cnt = catalog->size,
+            .base_mtime = base_mtime
+    };
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(catalog->entries, sizeof(CatalogEntry), catalog->size, f) != catalog->size) {
+        res = LPX_IO;
+    }
+    if (fclose(f) != 0) {
+        res = LPX_IO;
+    }
+
+    if (res != LPX_SUCCESS || renameat(dir_fd, tmp_name, dir_fd, name) != 0) {
+        unlinkat(dir_fd, tmp_name, 0);
+        res = LPX_IO;
+    }
+
+    return res;
+}
+
+int8_t ctlg_load(Catalog *catalog, int dir_fd, const char *name, int64_t *base_mtime) {
+    int8_t res = LPX_SUCCESS;
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    FILE *f = fd != -1 ? fdopen(fd, "r") : NULL;
+    if (f == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return LPX_IO;
+    }
+
+    CatalogHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CTLG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CTLG_VERSION || header.record_size != sizeof(CatalogEntry)) {
+        res = LPX_IO;
+        goto close_file;
+    }
+
+    CatalogEntry *entries = xcalloc(header.entries_cnt > 0 ? header.entries_cnt : 1, sizeof(CatalogEntry));
+    if (fread(entries, sizeof(CatalogEntry), header.entries_cnt, f) != header.entries_cnt) {
+        free(entries);
+        res = LPX_IO;
+        goto close_file;
+    }
+
+    free(catalog->entries);
+    catalog->entries = entries;
+    catalog->size = header.entries_cnt;
+    catalog->capacity = header.entries_cnt > 0 ? header.entries_cnt : 1;
+    catalog->bytes = 0;
+    catalog->frames = 0;
+    catalog->dropped_frames = 0;
+    for (size_t i = 0; i < catalog->size; i++) {
+        catalog->bytes += entries[i].bytes;
+        catalog->frames += entries[i].frames_cnt;
+        catalog->dropped_frames += entries[i].dropped_frames;
+    }
+    *base_mtime = header.base_mtime;
+
+    close_file:
+    fclose(f);
+
+    return res;
+}
+
+bool ctlg_is_train_id(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_INT_LEN) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char) name[i])) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/codec.h"
+
+// Векторная распаковка на расширениях GCC/clang: собирается в SSE2 на x86 и в NEON на ARM
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__ARM_NEON)) && !defined(CDC_SCALAR)
+#define CDC_VECTOR
+typedef uint16_t u16x8 __attribute__((vector_size(16)));
+#if defined(__clang__)
+#define SHUFFLE(a, b, ...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+#define SHUFFLE(a, b, ...) __builtin_shuffle(a, b, (u16x8) {__VA_ARGS__})
+#endif
+#endif
+
+#define SAMPLE_BITS 12
+#define SAMPLE_MASK ((1u << SAMPLE_BITS) - 1)
+// ширина блока хранится в 4 битах
+#define WIDTH_BITS  4
+
+static size_t row_bytes(size_t width) {
+    return width / 2 * 3;
+}
+
+static size_t widths_size(size_t width) {
+    return (width / CDC_BLOCK + 1) / 2;
+}
+
+size_t cdc_bound(size_t raw_size, size_t width) {
+    // в худшем случае остаток занимает все 12 бит пикселя, и к каждой строке добавляются ширины блоков
+    size_t rows = width > 0 ? raw_size / row_bytes(width) : 0;
+    return sizeof(CodecHeader) + raw_size + rows * widths_size(width) + sizeof(uint64_t);
+}
+
+/**
+ * Распаковывает строку RAW12 в массив 12-битных пикселей
+ */
+static void unpack_row(const uint8_t *raw, size_t width, uint16_t *samples) {
+    for (size_t i = 0, j = 0; j < width; i += 3, j += 2) {
+        samples[j] = (uint16_t) (raw[i] << 4 | (raw[i + 2] & 0xF));
+        samples[j + 1] = (uint16_t) (raw[i + 1] << 4 | raw[i + 2] >> 4);
+    }
+}
+
+static void pack_row(const uint16_t *samples, size_t width, uint8_t *raw) {
+    for (size_t i = 0, j = 0; j < width; i += 3, j += 2) {
+        raw[i] = (uint8_t) (samples[j] >> 4);
+        raw[i + 1] = (uint8_t) (samples[j + 1] >> 4);
+        raw[i + 2] = (uint8_t) ((samples[j] & 0xF) | (samples[j + 1] << 4));
+    }
+}
+
+/**
+ * Отображает 12-битный остаток по модулю 4096 в беззнаковое число так, что малым по модулю остаткам соответствуют
+ * малые числа: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+ */
+static uint16_t zigzag(uint16_t residual) {
+    int16_t d = (int16_t) (residual << (16 - SAMPLE_BITS)) >> (16 - SAMPLE_BITS);
+    return (uint16_t) ((uint16_t) (d * 2) ^ (uint16_t) (d >> 15));
+}
+
+/**
+ * Сжимает строку пикселей в out, возвращает размер сжатой строки. residuals - буфер на width остатков.
+ */
+static size_t encode_row(const uint16_t *samples, size_t width, uint16_t *residuals, uint8_t *out) {
+    for (size_t x = 0; x < width; x++) {
+        uint16_t prediction = x >= 2 ? samples[x - 2] : 0;
+        residuals[x] = zigzag((uint16_t) ((samples[x] - prediction) & SAMPLE_MASK));
+    }
+
+    uint8_t *widths = out;
+    memset(widths, 0, widths_size(width));
+    uint8_t *p = out + widths_size(width);
+    for (size_t b = 0; b < width / CDC_BLOCK; b++) {
+        const uint16_t *block = residuals + b * CDC_BLOCK;
+        unsigned any = 0;
+        for (size_t i = 0; i < CDC_BLOCK; i++) {
+            any |= block[i];
+        }
+        unsigned bits = any == 0 ? 0 : 32 - (unsigned) __builtin_clz(any);
+        widths[b / 2] |= (uint8_t) (bits << (b % 2 * WIDTH_BITS));
+
+        // CDC_BLOCK * bits кратно 8, так что блок заканчивается на границе байта
+        uint64_t acc = 0;
+        unsigned acc_bits = 0;
+        for (size_t i = 0; i < CDC_BLOCK; i++) {
+            acc |= (uint64_t) block[i] << acc_bits;
+            acc_bits += bits;
+            while (acc_bits >= 8) {
+                *p++ = (uint8_t) acc;
+                acc >>= 8;
+                acc_bits -= 8;
+            }
+        }
+    }
+    return (size_t) (p - out);
+}
+
+size_t cdc_encode(const uint8_t *raw, size_t raw_size, size_t width, uint8_t *out) {
+    if (width == 0 || width % CDC_BLOCK != 0 || width > UINT16_MAX || raw_size > UINT32_MAX ||
+        raw_size < row_bytes(width)) {
+        return 0;
+    }
+    size_t rb = row_bytes(width);
+    size_t rows = raw_size / rb;
+    uint16_t *samples = xmalloc(width * sizeof(uint16_t));
+    uint16_t *residuals = xmalloc(width * sizeof(uint16_t));
+
+    size_t size = 0;
+    uint8_t *p = out + sizeof(CodecHeader);
+    for (size_t r = 0; r < rows; r++) {
+        unpack_row(raw + r * rb, width, samples);
+        p += encode_row(samples, width, residuals, p);
+        if ((size_t) (p - out) >= raw_size) {
+            // шум не сжимается, дальше можно не пытаться
+            goto free_buffers;
+        }
+    }
+
+    CodecHeader header = {
+            .magic = CDC_MAGIC,
+            .version = CDC_VERSION,
+            .width = (uint16_t) width,
+            .raw_size = (uint32_t) raw_size,
+            .rows_size = (uint32_t) (p - out - sizeof(CodecHeader))
+    };
+    memcpy(out, &header, sizeof(header));
+    size_t tail = raw_size - rows * rb;
+    memcpy(p, raw + rows * rb, tail);
+    p += tail;
+    memset(p, 0, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+
+    if ((size_t) (p - out) < raw_size) {
+        size = (size_t) (p - out);
+    }
+
+    free_buffers:
+    free(samples);
+    free(residuals);
+
+    return size;
+}
+
+int8_t cdc_raw_size(const uint8_t *buf, size_t size, size_t *raw_size) {
+    CodecHeader header;
+    if (size < sizeof(header) + sizeof(uint64_t)) {
+        return LPX_IO;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (memcmp(header.magic, CDC_MAGIC, sizeof(header.magic)) != 0 || header.version != CDC_VERSION ||
+        header.width == 0 || header.width % CDC_BLOCK != 0) {
+        return LPX_IO;
+    }
+    *raw_size = header.raw_size;
+    return LPX_SUCCESS;
+}
+
+/**
+ * Распаковывает CDC_BLOCK остатков шириной bits бит. Читает по 8 байт, поэтому за блоком должно быть ещё 8 байт
+ * буфера.
+ */
+static void unpack_block(const uint8_t *p, unsigned bits, uint16_t *out) {
+    if (bits == 0) {
+        memset(out, 0, CDC_BLOCK * sizeof(uint16_t));
+        return;
+    }
+    uint64_t mask = (1u << bits) - 1;
+    for (size_t i = 0; i < CDC_BLOCK; i++) {
+        size_t pos = i * bits;
+        uint64_t word;
+        memcpy(&word, p + pos / 8, sizeof(word));
+        out[i] = (uint16_t) (word >> (pos % 8) & mask);
+    }
+}
+
+/**
+ * Восстанавливает пиксели строки по остаткам на месте: снимает zigzag и суммирует остатки с шагом 2 (префиксная
+ * сумма по пикселям одного цвета) по модулю 4096
+ */
+static void restore_row(uint16_t *samples, size_t width) {
+#ifdef CDC_VECTOR
+    const u16x8 zero = {0};
+    const u16x8 one = zero + 1;
+    const u16x8 mask = zero + SAMPLE_MASK;
+    u16x8 prev = zero;
+    for (size_t x = 0; x < width; x += 8) {
+        u16x8 v;
+        memcpy(&v, samples + x, sizeof(v));
+        v = (v >> 1) ^ (zero - (v & one));
+        // префиксная сумма с шагом 2 внутри вектора: сдвиги на 2 и на 4 элемента
+        v += SHUFFLE(zero, v, 0, 0, 8, 9, 10, 11, 12, 13);
+        v += SHUFFLE(zero, v, 0, 0, 0, 0, 8, 9, 10, 11);
+        // перенос из предыдущего вектора: последние пиксели каждого цвета
+        v += SHUFFLE(prev, prev, 6, 7, 6, 7, 6, 7, 6, 7);
+        v &= mask;
+        memcpy(samples + x, &v, sizeof(v));
+        prev = v;
+    }
+#else
+    for (size_t x = 0; x < width; x++) {
+        uint16_t d = (uint16_t) ((samples[x] >> 1) ^ (uint16_t) -(samples[x] & 1));
+        samples[x] = (uint16_t) (((x >= 2 ? samples[x - 2] : 0) + d) & SAMPLE_MASK);
+    }
+#endif
+}
+
+int8_t cdc_decode(const uint8_t *buf, size_t size, uint8_t *raw) {
+    size_t raw_size;
+    if (cdc_raw_size(buf, size, &raw_size) != LPX_SUCCESS) {
+        return LPX_IO;
+    }
+    CodecHeader header;
+    memcpy(&header, buf, sizeof(header));
+    size_t width = header.width;
+    size_t rb = row_bytes(width);
+    size_t rows = raw_size / rb;
+    size_t tail = raw_size - rows * rb;
+    if (sizeof(header) + (size_t) header.rows_size + tail + sizeof(uint64_t) != size) {
+        return LPX_IO;
+    }
+
+    int8_t res = LPX_SUCCESS;
+    const uint8_t *p = buf + sizeof(header);
+    const uint8_t *rows_end = p + header.rows_size;
+    uint16_t *samples = xmalloc(width * sizeof(uint16_t));
+    for (size_t r = 0; r < rows; r++) {
+        if ((size_t) (rows_end - p) < widths_size(width)) {
+            res = LPX_IO;
+            goto free_samples;
+        }
+        const uint8_t *widths = p;
+        p += widths_size(width);
+        for (size_t b = 0; b < width / CDC_BLOCK; b++) {
+            unsigned bits = widths[b / 2] >> (b % 2 * WIDTH_BITS) & ((1u << WIDTH_BITS) - 1);
+            if (bits > SAMPLE_BITS || (size_t) (rows_end - p) < CDC_BLOCK * bits / 8) {
+                res = LPX_IO;
+                goto free_samples;
+            }
+            unpack_block(p, bits, samples + b * CDC_BLOCK);
+            p += CDC_BLOCK * bits / 8;
+        }
+        restore_row(samples, width);
+        pack_row(samples, width, raw + r * rb);
+    }
+    if (p != rows_end) {
+        res = LPX_IO;
+        goto free_samples;
+    }
+    memcpy(raw + rows * rb, rows_end, tail);
+
+    free_samples:
+    free(samples);
+
+    return res;
+}
+
+bool cdc_vectorized() {
+#ifdef CDC_VECTOR
+    return true;
+#else
+    return false;
+#endif
+}
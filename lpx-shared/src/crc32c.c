@@ -0,0 +1,123 @@
+#include <string.h>
+#include <pthread.h>
+#include "../include/crc32c.h"
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(CRC_SCALAR)
+#define CRC_SSE42
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32) && !defined(CRC_SCALAR)
+#define CRC_ARM
+#include <arm_acle.h>
+#endif
+
+// отражённый полином CRC32C
+#define CRC_POLY 0x82f63b78
+
+typedef uint32_t (*CrcFunc)(uint32_t crc, const uint8_t *buf, size_t size);
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static CrcFunc crc_func;
+static bool crc_hardware;
+
+/**
+ * Таблицы для расчёта по 8 байт за шаг: table[k][b] - вклад байта b, за которым следует k байт
+ */
+static uint32_t crc_table[8][256];
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *buf, size_t size) {
+    while (size > 0 && (uintptr_t) buf % 8 != 0) {
+        crc = crc_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        size--;
+    }
+    while (size >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^ crc_table[5][(lo >> 16) & 0xff] ^
+              crc_table[4][lo >> 24] ^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        buf += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = crc_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        size--;
+    }
+    return crc;
+}
+
+#ifdef CRC_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t size) {
+    uint64_t c = crc;
+    while (size >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        c = _mm_crc32_u64(c, v);
+        buf += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        c = _mm_crc32_u8((uint32_t) c, *buf++);
+        size--;
+    }
+    return (uint32_t) c;
+}
+#endif
+
+#ifdef CRC_ARM
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t size) {
+    while (size >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        crc = __crc32cd(crc, v);
+        buf += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = __crc32cb(crc, *buf++);
+        size--;
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init() {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; i++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+        }
+        crc_table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            crc_table[k][b] = crc_table[0][crc_table[k - 1][b] & 0xff] ^ (crc_table[k - 1][b] >> 8);
+        }
+    }
+
+    crc_func = crc32c_table;
+#if defined(CRC_SSE42)
+    // SSE4.2 есть не у всех процессоров x86-64, поддержка проверяется при запуске
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_func = crc32c_hw;
+        crc_hardware = true;
+    }
+#elif defined(CRC_ARM)
+    crc_func = crc32c_hw;
+    crc_hardware = true;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t size) {
+    pthread_once(&crc_once, crc32c_init);
+    return ~crc_func(~crc, buf, size);
+}
+
+bool crc32c_hardware() {
+    pthread_once(&crc_once, crc32c_init);
+    return crc_hardware;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "../include/evictor.h"
+
+// nice потока вытеснения: запись фреймов важнее освобождения места
+#define EVICTOR_NICE 10
+
+// ioprio_set(2): у glibc нет обёртки, константы из linux/ioprio.h
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+
+typedef struct Evictor {
+    evict_fn evict;
+    void *ctx;
+    unsigned period_ms;
+    unsigned pause_ms;
+    int flags;
+
+    bool woken;
+    bool stopping;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+} Evictor;
+
+static void lock(Evictor *evictor) {
+    int r = pthread_mutex_lock(&evictor->mutex);
+    assert(r == 0 && "Could not lock evictor mutex");
+}
+
+static void unlock(Evictor *evictor) {
+    int r = pthread_mutex_unlock(&evictor->mutex);
+    assert(r == 0 && "Could not unlock evictor mutex");
+}
+
+/**
+ * Ждёт timeout_ms или evct_wake. Возвращает false, если поток останавливается. Вызывается под mutex.
+ */
+static bool evct_sleep(Evictor *evictor, unsigned timeout_ms, bool wakeable) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (!evictor->stopping && !(wakeable && evictor->woken)) {
+        if (pthread_cond_timedwait(&evictor->wake, &evictor->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    return !evictor->stopping;
+}
+
+static void *evct_thread(void *arg) {
+    Evictor *evictor = arg;
+
+    // в Linux nice задаётся для отдельного потока
+    if ((evictor->flags & EVCT_KEEP_PRIORITY) == 0 &&
+        setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), EVICTOR_NICE) != 0) {
+        fprintf(stderr, "Could not lower evictor thread priority\n");
+    }
+    int ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    if ((evictor->flags & EVCT_IDLE_IO) != 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (int) syscall(SYS_gettid), ioprio) != 0) {
+        fprintf(stderr, "Could not set idle I/O priority\n");
+    }
+
+    lock(evictor);
+    while (evct_sleep(evictor, evictor->period_ms, true)) {
+        evictor->woken = false;
+        while (true) {
+            unlock(evictor);
+            bool more = evictor->evict(evictor->ctx);
+            lock(evictor);
+            // пауза между порциями растягивает освобождение места во времени, evct_wake её не прерывает
+            if (!more || !evct_sleep(evictor, evictor->pause_ms, false)) {
+                break;
+            }
+        }
+    }
+    unlock(evictor);
+
+    return NULL;
+}
+
+Evictor *evct_create(evict_fn evict, void *ctx, unsigned period_ms, unsigned pause_ms, int flags) {
+    Evictor *evictor = xcalloc(1, sizeof(Evictor));
+    evictor->evict = evict;
+    evictor->ctx = ctx;
+    evictor->period_ms = period_ms;
+    evictor->pause_ms = pause_ms;
+    evictor->flags = flags;
+    pthread_mutex_init(&evictor->mutex, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&evictor->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&evictor->thread, NULL, evct_thread, evictor) != 0) {
+        fprintf(stderr, "Could not start evictor thread\n");
+        pthread_cond_destroy(&evictor->wake);
+        pthread_mutex_destroy(&evictor->mutex);
+        free(evictor);
+        return NULL;
+    }
+
+    return evictor;
+}
+
+void evct_wake(Evictor *evictor) {
+    lock(evictor);
+    evictor->woken = true;
+    pthread_cond_signal(&evictor->wake);
+    unlock(evictor);
+}
+
+void evct_free(Evictor *evictor) {
+    lock(evictor);
+    evictor->stopping = true;
+    pthread_cond_signal(&evictor->wake);
+    unlock(evictor);
+
+    pthread_join(evictor->thread, NULL);
+    pthread_cond_destroy(&evictor->wake);
+    pthread_mutex_destroy(&evictor->mutex);
+    free(evictor);
+}
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <time.h>
+#include "../include/frame_writer.h"
+
+typedef struct PendingFrame {
+    char train_id[MAX_INT_LEN + 1];
+    uint32_t frame_idx;
+    uint8_t *buf;
+    size_t size;
+    size_t buf_size;
+    FrameMeta meta;
+    bool has_meta;
+} PendingFrame;
+
+typedef struct FrameWriter {
+    frame_write_fn write;
+    void *ctx;
+    size_t batch; // максимальное количество фреймов, передаваемых в write за раз
+    size_t align; // выравнивание буферов фреймов, 0 - без выравнивания
+
+    /**
+     * Кольцевой буфер фреймов, ожидающих записи
+     */
+    PendingFrame *queue;
+    size_t capacity;
+    size_t head;
+    size_t queued;
+
+    /**
+     * Фреймы, взятые потоками ввода-вывода из очереди и записываемые в данный момент
+     */
+    size_t in_flight;
+    uint64_t bytes_in_flight;
+
+    int8_t error; // код первой ошибки записи после последнего fwr_flush
+    bool stopping;
+
+    pthread_t *threads;
+    size_t threads_cnt;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t drained;
+
+    uint64_t frames_written;
+    uint64_t bytes_written;
+    uint64_t write_errors;
+    uint64_t write_latency_total_us;
+    uint64_t write_latency_max_us;
+    uint64_t submit_wait_us;
+} FrameWriter;
+
+static void lock(FrameWriter *writer) {
+    int r = pthread_mutex_lock(&writer->mutex);
+    assert(r == 0 && "Could not lock frame writer mutex");
+}
+
+static void unlock(FrameWriter *writer) {
+    int r = pthread_mutex_unlock(&writer->mutex);
+    assert(r == 0 && "Could not unlock frame writer mutex");
+}
+
+static void *fwr_thread(void *arg) {
+    FrameWriter *writer = arg;
+    PendingFrame *frames = xcalloc(writer->batch, sizeof(PendingFrame));
+    FrameWrite *writes = xcalloc(writer->batch, sizeof(FrameWrite));
+
+    lock(writer);
+    while (true) {
+        while (writer->queued == 0 && !writer->stopping) {
+            pthread_cond_wait(&writer->not_empty, &writer->mutex);
+        }
+        if (writer->queued == 0 && writer->stopping) {
+            break;
+        }
+
+        size_t frames_cnt = 0;
+        while (writer->queued > 0 && frames_cnt < writer->batch) {
+            frames[frames_cnt++] = writer->queue[writer->head];
+            writer->head = (writer->head + 1) % writer->capacity;
+            writer->queued--;
+            writer->in_flight++;
+        }
+        pthread_cond_broadcast(&writer->not_full);
+        unlock(writer);
+
+        for (size_t i = 0; i < frames_cnt; i++) {
+            writes[i] = (FrameWrite) {
+                    .train_id = frames[i].train_id,
+                    .frame_idx = frames[i].frame_idx,
+                    .buf = frames[i].buf,
+                    .size = frames[i].size,
+                    .buf_size = frames[i].buf_size,
+                    .meta = frames[i].has_meta ? &frames[i].meta : NULL,
+                    .res = LPX_SUCCESS
+            };
+        }
+        uint64_t start = monotonic_us();
+        writer->write(writer->ctx, writes, frames_cnt);
+        uint64_t latency = monotonic_us() - start;
+
+        lock(writer);
+        for (size_t i = 0; i < frames_cnt; i++) {
+            free(frames[i].buf);
+            writer->in_flight--;
+            writer->bytes_in_flight -= frames[i].size;
+            if (writes[i].res == LPX_SUCCESS) {
+                writer->frames_written++;
+                writer->bytes_written += frames[i].size;
+            } else {
+                writer->write_errors++;
+                if (writer->error == LPX_SUCCESS) {
+                    writer->error = writes[i].res;
+                }
+                fprintf(stderr, "Frame %u of stream %s writing failed, errcode: %d\n", frames[i].frame_idx,
+                        frames[i].train_id, writes[i].res);
+            }
+            // фреймы пачки пишутся одновременно, поэтому каждый ждал записи всей пачки
+            writer->write_latency_total_us += latency;
+        }
+        if (latency > writer->write_latency_max_us) {
+            writer->write_latency_max_us = latency;
+        }
+        if (writer->queued == 0 && writer->in_flight == 0) {
+            pthread_cond_broadcast(&writer->drained);
+        }
+    }
+    unlock(writer);
+
+    free(writes);
+    free(frames);
+
+    return NULL;
+}
+
+FrameWriter *fwr_create(size_t queue_depth, size_t threads, size_t batch, size_t align, frame_write_fn write,
+                        void *ctx) {
+    FrameWriter *writer = xcalloc(1, sizeof(FrameWriter));
+    writer->write = write;
+    writer->ctx = ctx;
+    writer->capacity = queue_depth > 0 ? queue_depth : 1;
+    writer->batch = batch > 0 ? batch : 1;
+    writer->align = align;
+    writer->queue = xcalloc(writer->capacity, sizeof(PendingFrame));
+    writer->error = LPX_SUCCESS;
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->not_empty, NULL);
+    pthread_cond_init(&writer->not_full, NULL);
+    pthread_cond_init(&writer->drained, NULL);
+
+    writer->threads = xcalloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+    for (size_t i = 0; i < (threads > 0 ? threads : 1); i++) {
+        if (pthread_create(&writer->threads[i], NULL, fwr_thread, writer) != 0) {
+            fprintf(stderr, "Could not start frame writer thread\n");
+            break;
+        }
+        writer->threads_cnt++;
+    }
+    if (writer->threads_cnt == 0) {
+        fwr_free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+int8_t fwr_submit(FrameWriter *writer, const char *train_id, uint32_t frame_idx, const uint8_t *buf, size_t size,
+                  const FrameMeta *meta) {
+    return fwr_submit_rows(writer, train_id, frame_idx, buf, size, size, 1, meta);
+}
+
+int8_t fwr_submit_rows(FrameWriter *writer, const char *train_id, uint32_t frame_idx, const uint8_t *buf,
+                       size_t row_size, size_t stride, size_t rows, const FrameMeta *meta) {
+    // копируем вне блокировки, чтобы не задерживать потоки ввода-вывода
+    uint8_t *copy;
+    size_t size = row_size * rows;
+    size_t buf_size = size;
+    if (writer->align > 0) {
+        buf_size = (size + writer->align - 1) / writer->align * writer->align;
+        if (posix_memalign((void **) &copy, writer->align, buf_size) != 0) {
+            return LPX_IO;
+        }
+        memset(copy + size, 0, buf_size - size);
+    } else {
+        copy = xmalloc(size);
+    }
+    copy_rows(copy, buf, row_size, stride, rows);
+
+    lock(writer);
+    if (writer->queued == writer->capacity) {
+        uint64_t wait_start = monotonic_us();
+        while (writer->queued == writer->capacity) {
+            pthread_cond_wait(&writer->not_full, &writer->mutex);
+        }
+        writer->submit_wait_us += monotonic_us() - wait_start;
+    }
+
+    PendingFrame *frame = &writer->queue[(writer->head + writer->queued) % writer->capacity];
+    strncpy(frame->train_id, train_id, MAX_INT_LEN);
+    frame->train_id[MAX_INT_LEN] = 0;
+    frame->frame_idx = frame_idx;
+    frame->buf = copy;
+    frame->size = size;
+    frame->buf_size = buf_size;
+    frame->has_meta = meta != NULL;
+    if (meta != NULL) {
+        frame->meta = *meta;
+    }
+    writer->queued++;
+    writer->bytes_in_flight += size;
+    pthread_cond_signal(&writer->not_empty);
+
+    int8_t res = writer->error;
+    unlock(writer);
+
+    return res;
+}
+
+int8_t fwr_flush(FrameWriter *writer) {
+    lock(writer);
+    while (writer->queued > 0 || writer->in_flight > 0) {
+        pthread_cond_wait(&writer->drained, &writer->mutex);
+    }
+    int8_t res = writer->error;
+    writer->error = LPX_SUCCESS;
+    unlock(writer);
+
+    return res;
+}
+
+void fwr_stats(FrameWriter *writer, FrameWriterStats *stats) {
+    lock(writer);
+    stats->queue_depth = writer->queued + writer->in_flight;
+    stats->queue_capacity = writer->capacity;
+    stats->bytes_in_flight = writer->bytes_in_flight;
+    stats->frames_written = writer->frames_written;
+    stats->bytes_written = writer->bytes_written;
+    stats->write_errors = writer->write_errors;
+    uint64_t writes = writer->frames_written + writer->write_errors;
+    stats->write_latency_avg_us = writes > 0 ? writer->write_latency_total_us / writes : 0;
+    stats->write_latency_max_us = writer->write_latency_max_us;
+    stats->submit_wait_us = writer->submit_wait_us;
+    unlock(writer);
+}
+
+void fwr_free(FrameWriter *writer) {
+    lock(writer);
+    writer->stopping = true;
+    pthread_cond_broadcast(&writer->not_empty);
+    unlock(writer);
+
+    for (size_t i = 0; i < writer->threads_cnt; i++) {
+        pthread_join(writer->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&writer->drained);
+    pthread_cond_destroy(&writer->not_full);
+    pthread_cond_destroy(&writer->not_empty);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer->threads);
+    free(writer->queue);
+    free(writer);
+}
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../include/io_engine.h"
+#include "../include/lpxstd.h"
+
+#ifdef LPX_HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#endif
+
+typedef struct IoEngine {
+    unsigned depth;
+    size_t pending; // поставлено и не получено через ioe_wait
+
+    /**
+     * Результаты запросов, выполненных синхронно, в порядке постановки. Используется, когда io_uring недоступен.
+     */
+    IoCompletion *done;
+    size_t done_head;
+    size_t done_cnt;
+
+#ifdef LPX_HAVE_IO_URING
+    int ring_fd; // -1, если io_uring недоступен
+    size_t queued; // поставлено, но ещё не отправлено в ядро
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+} IoEngine;
+
+#ifdef LPX_HAVE_IO_URING
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * IORING_OP_READ и IORING_OP_WRITE появились в ядре 5.6 вместе с IORING_REGISTER_PROBE, поэтому ядра без них
+ * отсеиваются неудачным запросом списка операций.
+ */
+static bool uring_supports_rw(int fd) {
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = xcalloc(1, probe_size);
+    bool res = false;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        res = probe->last_op >= IORING_OP_WRITE &&
+              (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+              (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return res;
+}
+
+static void uring_close(IoEngine *engine) {
+    if (engine->sqes != NULL) {
+        munmap(engine->sqes, engine->sqes_size);
+    }
+    if (engine->cq_map != NULL && engine->cq_map != engine->sq_map) {
+        munmap(engine->cq_map, engine->cq_map_size);
+    }
+    if (engine->sq_map != NULL) {
+        munmap(engine->sq_map, engine->sq_map_size);
+    }
+    if (engine->ring_fd != -1) {
+        close(engine->ring_fd);
+    }
+    engine->sqes = NULL;
+    engine->cq_map = NULL;
+    engine->sq_map = NULL;
+    engine->ring_fd = -1;
+}
+
+static bool uring_open(IoEngine *engine) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    engine->ring_fd = uring_setup(engine->depth, &params);
+    if (engine->ring_fd == -1) {
+        return false;
+    }
+    if (!uring_supports_rw(engine->ring_fd)) {
+        goto error;
+    }
+
+    engine->sq_entries = params.sq_entries;
+    engine->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    engine->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map && engine->cq_map_size > engine->sq_map_size) {
+        engine->sq_map_size = engine->cq_map_size;
+    }
+
+    void *map = mmap(NULL, engine->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd,
+                     IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED) {
+        goto error;
+    }
+    engine->sq_map = map;
+
+    if (single_map) {
+        engine->cq_map = engine->sq_map;
+    } else {
+        map = mmap(NULL, engine->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd,
+                   IORING_OFF_CQ_RING);
+        if (map == MAP_FAILED) {
+            goto error;
+        }
+        engine->cq_map = map;
+    }
+
+    engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd,
+               IORING_OFF_SQES);
+    if (map == MAP_FAILED) {
+        goto error;
+    }
+    engine->sqes = map;
+
+    uint8_t *sq = engine->sq_map;
+    engine->sq_head = (unsigned *) (sq + params.sq_off.head);
+    engine->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    uint8_t *cq = engine->cq_map;
+    engine->cq_head = (unsigned *) (cq + params.cq_off.head);
+    engine->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return true;
+
+    error:
+    uring_close(engine);
+
+    return false;
+}
+
+static int8_t uring_queue(IoEngine *engine, uint8_t opcode, int fd, const void *buf, size_t len, uint64_t offset,
+                          uint64_t user_data) {
+    if (engine->queued == engine->sq_entries && ioe_submit(engine) != LPX_SUCCESS) {
+        return LPX_IO;
+    }
+
+    // хвост очереди отправки меняем только мы, голову - ядро
+    unsigned tail = *engine->sq_tail;
+    unsigned idx = tail & *engine->sq_mask;
+    struct io_uring_sqe *sqe = &engine->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = (uint32_t) len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    engine->sq_array[idx] = idx;
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    engine->queued++;
+    engine->pending++;
+
+    return LPX_SUCCESS;
+}
+
+#endif
+
+static int8_t sync_complete(IoEngine *engine, ssize_t result, uint64_t user_data) {
+    IoCompletion *completion = &engine->done[(engine->done_head + engine->done_cnt) % engine->depth];
+    completion->user_data = user_data;
+    completion->result = result >= 0 ? result : -errno;
+    engine->done_cnt++;
+    engine->pending++;
+    return LPX_SUCCESS;
+}
+
+IoEngine *ioe_create(unsigned depth) {
+    IoEngine *engine = xcalloc(1, sizeof(IoEngine));
+    engine->depth = depth > 0 ? depth : 1;
+#ifdef LPX_HAVE_IO_URING
+    engine->ring_fd = -1;
+    if (uring_open(engine)) {
+        return engine;
+    }
+#endif
+    engine->done = xcalloc(engine->depth, sizeof(IoCompletion));
+    return engine;
+}
+
+bool ioe_async(IoEngine *engine) {
+#ifdef LPX_HAVE_IO_URING
+    return engine->ring_fd != -1;
+#else
+    return false;
+#endif
+}
+
+int8_t ioe_read(IoEngine *engine, int fd, void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+    if (engine->pending == engine->depth) {
+        errno = EBUSY;
+        return LPX_IO;
+    }
+#ifdef LPX_HAVE_IO_URING
+    if (engine->ring_fd != -1) {
+        return uring_queue(engine, IORING_OP_READ, fd, buf, len, offset, user_data);
+    }
+#endif
+    return sync_complete(engine, pread(fd, buf, len, (off_t) offset), user_data);
+}
+
+int8_t ioe_write(IoEngine *engine, int fd, const void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+    if (engine->pending == engine->depth) {
+        errno = EBUSY;
+        return LPX_IO;
+    }
+#ifdef LPX_HAVE_IO_URING
+    if (engine->ring_fd != -1) {
+        return uring_queue(engine, IORING_OP_WRITE, fd, buf, len, offset, user_data);
+    }
+#endif
+    return sync_complete(engine, pwrite(fd, buf, len, (off_t) offset), user_data);
+}
+
+int8_t ioe_submit(IoEngine *engine) {
+#ifdef LPX_HAVE_IO_URING
+    while (engine->ring_fd != -1 && engine->queued > 0) {
+        int r = uring_enter(engine->ring_fd, (unsigned) engine->queued, 0, 0);
+        if (r < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return LPX_IO;
+        }
+        engine->queued -= r;
+    }
+#endif
+    return LPX_SUCCESS;
+}
+
+size_t ioe_pending(IoEngine *engine) {
+    return engine->pending;
+}
+
+int8_t ioe_wait(IoEngine *engine, IoCompletion *completion) {
+    if (engine->pending == 0) {
+        return EOF;
+    }
+#ifdef LPX_HAVE_IO_URING
+    if (engine->ring_fd != -1) {
+        if (ioe_submit(engine) != LPX_SUCCESS) {
+            return LPX_IO;
+        }
+        while (true) {
+            // голову очереди завершений меняем только мы, хвост - ядро
+            unsigned head = *engine->cq_head;
+            if (head != __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &engine->cqes[head & *engine->cq_mask];
+                completion->user_data = cqe->user_data;
+                completion->result = cqe->res;
+                __atomic_store_n(engine->cq_head, head + 1, __ATOMIC_RELEASE);
+                engine->pending--;
+                return LPX_SUCCESS;
+            }
+            if (uring_enter(engine->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                return LPX_IO;
+            }
+        }
+    }
+#endif
+    *completion = engine->done[engine->done_head];
+    engine->done_head = (engine->done_head + 1) % engine->depth;
+    engine->done_cnt--;
+    engine->pending--;
+    return LPX_SUCCESS;
+}
+
+int8_t ioe_drain(IoEngine *engine) {
+#ifdef LPX_HAVE_IO_URING
+    if (engine->ring_fd != -1 && ioe_submit(engine) != LPX_SUCCESS) {
+        // неотправленные запросы ядро ещё не видело: они в конце очереди отправки, хвост которой меняем только мы
+        __atomic_store_n(engine->sq_tail, *engine->sq_tail - (unsigned) engine->queued, __ATOMIC_RELEASE);
+        engine->pending -= engine->queued;
+        engine->queued = 0;
+    }
+#endif
+    IoCompletion completion;
+    while (engine->pending > 0) {
+        if (ioe_wait(engine, &completion) != LPX_SUCCESS) {
+            return LPX_IO;
+        }
+    }
+    return LPX_SUCCESS;
+}
+
+void ioe_free(IoEngine *engine) {
+#ifdef LPX_HAVE_IO_URING
+    if (engine->ring_fd != -1) {
+        // буферы запросов, ещё выполняемых ядром, могут принадлежать вызывающему, поэтому дожидаемся их
+        ioe_drain(engine);
+        uring_close(engine);
+    }
+#endif
+    free(engine->done);
+    free(engine);
+}
@@ -5,6 +5,8 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <list.h>
 
 /*
@@ -21,6 +23,25 @@ uint64_t tv2ms(struct timeval tv) {
     return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000ULL);
 }
 
+/*
+ * Переводит значение struct timespec в наносекунды.
+ */
+int64_t ts2ns(struct timespec ts) {
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int64_t realtime_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts2ns(ts) / 1000;
+}
+
 void print_array(char *prefix, const unsigned char *arr, int size) {
     printf("%s", prefix);
     for (int i = 0; i < size; i++) {
@@ -49,6 +70,15 @@ void *xcalloc(size_t n, size_t size) {
     return p;
 }
 
+void *xrealloc(void *p, size_t n) {
+    void *res = realloc(p, n);
+    if (res == NULL) {
+        fprintf(stderr, "Could not allocate %ld bytes", n);
+        abort();
+    }
+    return res;
+}
+
 char *append_path(char *base, char *child) {
     size_t size = sizeof(char) * (strlen(base) + 1 + strlen(child) + 1);
     char *path = xcalloc(size, sizeof(char));
@@ -77,18 +107,59 @@ int8_t fd_size(int fd, off_t *size) {
     return LPX_SUCCESS;
 }
 
+void copy_rows(uint8_t *dst, const uint8_t *src, size_t row_size, size_t stride, size_t rows) {
+    if (stride == row_size) {
+        memcpy(dst, src, row_size * rows);
+        return;
+    }
+    for (size_t i = 0; i < rows; i++) {
+        memcpy(dst + i * row_size, src + i * stride, row_size);
+    }
+}
+
 char *itoa(uint64_t i) {
     char *res = xmalloc(MAX_INT_LEN);
     snprintf(res, MAX_INT_LEN, "%" PRId64, i);
     return res;
 }
 
+uint64_t tree_bytes(int parent_fd, const char *name) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *dp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dp == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    uint64_t bytes = 0;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dp)) != NULL) {
+        struct stat st;
+        // символьные ссылки учитываются размером файла, на который они указывают
+        if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0 ||
+            fstatat(dirfd(dp), dir_entry->d_name, &st, 0) != 0) {
+            continue;
+        }
+        bytes += S_ISDIR(st.st_mode) ? tree_bytes(dirfd(dp), dir_entry->d_name) : st.st_size;
+    }
+    closedir(dp);
+    return bytes;
+}
 
 int8_t list_directory(char *dir, char ***children, size_t *children_size) {
+    return list_directory_at(AT_FDCWD, dir, children, children_size);
+}
+
+int8_t list_directory_at(int dir_fd, const char *name, char ***children, size_t *children_size) {
     DIR *dp;
     struct dirent *dir_entry;
 
-    dp = opendir(dir);
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dp == NULL && fd != -1) {
+        close(fd);
+    }
     List *chldrn = lst_create();
     if (dp != NULL) {
         while ((dir_entry = readdir(dp)) != NULL) {
@@ -107,6 +178,7 @@ int8_t list_directory(char *dir, char ***children, size_t *children_size) {
         lst_free(chldrn);
     } else {
         perror("Couldn't open the directory");
+        lst_free(chldrn);
         return LPX_IO;
     }
 
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../include/manifest.h"
+#include "../include/stream_storage.h"
+#include "../include/lpxstd.h"
+
+void mnf_legacy(FrameFormat *format) {
+    memset(format, 0, sizeof(FrameFormat));
+    format->width = 1280;
+    format->height = 800;
+    format->stride = 1920;
+    format->bit_depth = 12;
+    // MMAL выделяет буфер под высоту, выровненную до 16 строк, и ещё одну полосу в 16 строк
+    format->frame_size = 1920 * 816;
+    strcpy(format->bayer_order, "GBRG");
+    strcpy(format->sensor, "ar0144");
+}
+
+size_t mnf_row_size(const FrameFormat *format) {
+    size_t width = format->width;
+    switch (format->bit_depth) {
+        case 10:
+            // пиксели упакованы группами: 4 пикселя RAW10 в 5 байтах, 2 пикселя RAW12 в 3 байтах
+            return (width + 3) / 4 * 5;
+        case 12:
+            return (width + 1) / 2 * 3;
+        default:
+            return (width * format->bit_depth + 7) / 8;
+    }
+}
+
+int8_t mnf_write(int dir_fd, const FrameFormat *format) {
+    int8_t res = LPX_SUCCESS;
+
+    char tmp_name[] = MNF_FILE ".tmp";
+    int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return errno == ENOENT ? STRG_NOT_FOUND : LPX_IO;
+    }
+
+    ManifestHeader header = {
+            .magic = MNF_MAGIC,
+            .version = MNF_VERSION,
+            .record_size = sizeof(FrameFormat)
+    };
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, format, sizeof(FrameFormat)) != sizeof(FrameFormat)) {
+        res = LPX_IO;
+    }
+    if (close(fd) != 0) {
+        res = LPX_IO;
+    }
+
+    if (res != LPX_SUCCESS || renameat(dir_fd, tmp_name, dir_fd, MNF_FILE) != 0) {
+        unlinkat(dir_fd, tmp_name, 0);
+        res = LPX_IO;
+    }
+
+    return res;
+}
+
+int8_t mnf_read(int dir_fd, FrameFormat *format) {
+    int8_t res = LPX_SUCCESS;
+
+    int fd = openat(dir_fd, MNF_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? STRG_NOT_FOUND : LPX_IO;
+    }
+
+    ManifestHeader header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, MNF_MAGIC, sizeof(header.magic)) != 0 || header.version != MNF_VERSION ||
+        header.record_size < sizeof(FrameFormat)) {
+        res = STRG_BAD_INDEX;
+        goto close_fd;
+    }
+    // поля, добавленные в FrameFormat более новыми версиями, пропускаются
+    if (read(fd, format, sizeof(FrameFormat)) != sizeof(FrameFormat)) {
+        res = STRG_BAD_INDEX;
+        goto close_fd;
+    }
+    format->bayer_order[MNF_BAYER_ORDER_SIZE - 1] = 0;
+    format->sensor[MNF_SENSOR_SIZE - 1] = 0;
+    bool known_depth = format->bit_depth == 8 || format->bit_depth == 10 || format->bit_depth == 12 ||
+                       format->bit_depth == 16;
+    if (!known_depth || format->width == 0 || format->height == 0 || format->stride < mnf_row_size(format) ||
+        format->frame_size < (uint64_t) format->stride * (format->height - 1) + mnf_row_size(format)) {
+        res = STRG_BAD_INDEX;
+    }
+
+    close_fd:
+    close(fd);
+
+    return res;
+}
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "../include/ram_tier.h"
+#include "../include/evictor.h"
+#include "../include/stream_storage.h"
+#include "../include/lpxstd.h"
+
+// Перенос сегментов из RAM-уровня на диск: по сегменту с паузой MIGRATE_PAUSE_MS, копированием порциями по
+// MIGRATE_CHUNK байт. Кроме пробуждения при закрытии писателя уровень проверяется раз в MIGRATE_PERIOD_MS.
+#define MIGRATE_PAUSE_MS  100
+#define MIGRATE_PERIOD_MS 10000
+#define MIGRATE_CHUNK     (1024 * 1024)
+
+typedef struct RamTier {
+    RamTierSource source;
+
+    /**
+     * Директория уровня fd с абсолютным путём path. used - место, занятое и зарезервированное в уровне, его меняют
+     * писатели сегментов (SegmentTier.used).
+     */
+    int fd;
+    char *path;
+    uint64_t capacity;
+    uint64_t used;
+
+    Evictor *mover;
+    uint64_t migrated_segments;
+    uint64_t migrated_bytes;
+} RamTier;
+
+/**
+ * Переносит сегмент name стрима train_id из его директории в уровне ram_td в директорию стрима: копирует под
+ * временным именем и атомарно заменяет им символьную ссылку. Читатели, уже открывшие сегмент через ссылку, дочитывают
+ * его из уровня. Сегмент удаляется из уровня и тогда, когда переносить его некуда: стрим удалён или ссылка уже
+ * заменена копией до аварийного завершения.
+ */
+static int8_t rtr_migrate_segment(RamTier *ram, const char *train_id, int ram_td, const char *name) {
+    int8_t res = LPX_SUCCESS;
+    bool migrated = false;
+
+    int src = openat(ram_td, name, O_RDONLY | O_CLOEXEC);
+    off_t size;
+    if (src == -1 || fd_size(src, &size) != LPX_SUCCESS) {
+        res = LPX_IO;
+        goto close_src;
+    }
+
+    int td;
+    res = ram->source.acquire_dir(ram->source.ctx, train_id, &td);
+    if (res == STRG_NOT_FOUND) {
+        res = LPX_SUCCESS;
+        goto drop;
+    } else if (res != LPX_SUCCESS) {
+        goto close_src;
+    }
+
+    char target[PATH_MAX];
+    char link[PATH_MAX];
+    snprintf(target, sizeof(target), "%s/%s/%s", ram->path, train_id, name);
+    ssize_t link_len = readlinkat(td, name, link, sizeof(link) - 1);
+    if (link_len == -1 && errno != EINVAL && errno != ENOENT) {
+        res = LPX_IO;
+        goto release_dir;
+    }
+    if (link_len == -1 || (link[link_len] = 0, strcmp(link, target) != 0)) {
+        goto release_dir;
+    }
+
+    char tmp_name[SEG_NAME_SIZE + sizeof(".tmp")];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+    int dst = openat(td, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (dst == -1) {
+        res = LPX_IO;
+        goto release_dir;
+    }
+    uint8_t *buf = xmalloc(MIGRATE_CHUNK);
+    for (off_t offset = 0; offset < size && res == LPX_SUCCESS;) {
+        ssize_t r = pread(src, buf, MIGRATE_CHUNK, offset);
+        if (r <= 0 || write(dst, buf, (size_t) r) != r) {
+            res = LPX_IO;
+        }
+        offset += r;
+    }
+    free(buf);
+    // ссылка заменяется только сегментом, уже лежащим на диске
+    if (fsync(dst) != 0) {
+        res = LPX_IO;
+    }
+    if (close(dst) != 0) {
+        res = LPX_IO;
+    }
+    if (res != LPX_SUCCESS || renameat(td, tmp_name, td, name) != 0) {
+        unlinkat(td, tmp_name, 0);
+        res = LPX_IO;
+        goto release_dir;
+    }
+    migrated = true;
+
+    release_dir:
+    ram->source.release_dir(ram->source.ctx, td);
+    if (res != LPX_SUCCESS) {
+        goto close_src;
+    }
+
+    drop:
+    if (unlinkat(ram_td, name, 0) == 0) {
+        __atomic_sub_fetch(&ram->used, (uint64_t) size, __ATOMIC_RELAXED);
+    }
+    if (migrated) {
+        __atomic_add_fetch(&ram->migrated_segments, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ram->migrated_bytes, (uint64_t) size, __ATOMIC_RELAXED);
+    }
+
+    close_src:
+    if (src != -1) {
+        close(src);
+    }
+
+    return res;
+}
+
+/**
+ * Шаг переноса уровня на диск: переносит один сегмент самого старого стрима уровня, кроме записываемого, или
+ * удаляет опустевшую директорию стрима в уровне. Возвращает true, если в уровне могут остаться сегменты для
+ * переноса.
+ */
+static bool rtr_migrate(void *ctx) {
+    RamTier *ram = ctx;
+
+    char writer_train_id[MAX_INT_LEN + 1];
+    ram->source.writer_train(ram->source.ctx, writer_train_id);
+
+    int fd = openat(ram->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dp == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    char train_id[MAX_INT_LEN + 1] = {0};
+    uint64_t oldest = UINT64_MAX;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dp)) != NULL) {
+        const char *name = dir_entry->d_name;
+        if (strlen(name) == 0 || strlen(name) > MAX_INT_LEN || strspn(name, "0123456789") != strlen(name) ||
+            strcmp(name, writer_train_id) == 0) {
+            continue;
+        }
+        uint64_t time = strtoull(name, NULL, 10);
+        if (train_id[0] == 0 || time < oldest) {
+            strcpy(train_id, name);
+            oldest = time;
+        }
+    }
+    closedir(dp);
+    if (train_id[0] == 0) {
+        return false;
+    }
+
+    int ram_td = openat(ram->fd, train_id, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dp = ram_td != -1 ? fdopendir(ram_td) : NULL;
+    if (dp == NULL) {
+        if (ram_td != -1) {
+            close(ram_td);
+        }
+        return false;
+    }
+    char segment[SEG_NAME_SIZE] = {0};
+    while ((dir_entry = readdir(dp)) != NULL) {
+        if (strncmp(dir_entry->d_name, SEG_FILE_PREFIX, strlen(SEG_FILE_PREFIX)) == 0 &&
+            strlen(dir_entry->d_name) < SEG_NAME_SIZE) {
+            strcpy(segment, dir_entry->d_name);
+            break;
+        }
+    }
+    bool more = true;
+    if (segment[0] != 0) {
+        if (rtr_migrate_segment(ram, train_id, dirfd(dp), segment) != LPX_SUCCESS) {
+            fprintf(stderr, "Could not move segment %s of stream %s from RAM tier to disk\n", segment, train_id);
+            // повторная попытка - при следующей периодической проверке
+            more = false;
+        }
+    } else if (unlinkat(ram->fd, train_id, AT_REMOVEDIR) == 0) {
+        ram->source.migrated(ram->source.ctx, train_id);
+    } else {
+        more = false;
+    }
+    closedir(dp);
+
+    return more;
+}
+
+RamTier *rtr_open(const char *dir, uint64_t capacity, const RamTierSource *source) {
+    RamTier *ram = xcalloc(1, sizeof(RamTier));
+    ram->source = *source;
+    ram->capacity = capacity;
+    ram->fd = -1;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        goto error;
+    }
+    ram->path = realpath(dir, NULL);
+    if (ram->path == NULL) {
+        goto error;
+    }
+    ram->fd = open(ram->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ram->fd == -1) {
+        goto error;
+    }
+    ram->used = tree_bytes(ram->fd, ".");
+    ram->mover = evct_create(rtr_migrate, ram, MIGRATE_PERIOD_MS, MIGRATE_PAUSE_MS, 0);
+    if (ram->mover != NULL) {
+        evct_wake(ram->mover);
+    }
+    return ram;
+
+    error:
+    fprintf(stderr, "RAM tier %s is unavailable (%s), frames are written to disk\n", dir, strerror(errno));
+    free(ram->path);
+    free(ram);
+    return NULL;
+}
+
+bool rtr_placement(RamTier *ram, const char *train_id, SegmentTier *tier, char *path) {
+    if (mkdirat(ram->fd, train_id, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create stream directory %s/%s: %s\n", ram->path, train_id, strerror(errno));
+        return false;
+    }
+    tier->dir_fd = openat(ram->fd, train_id, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (tier->dir_fd == -1) {
+        return false;
+    }
+    snprintf(path, PATH_MAX, "%s/%s", ram->path, train_id);
+    tier->path = path;
+    tier->capacity = ram->capacity;
+    tier->used = &ram->used;
+    return true;
+}
+
+void rtr_wake(RamTier *ram) {
+    if (ram->mover != NULL) {
+        evct_wake(ram->mover);
+    }
+}
+
+void rtr_stats(RamTier *ram, RamTierStats *stats) {
+    stats->bytes = __atomic_load_n(&ram->used, __ATOMIC_RELAXED);
+    stats->migrated_segments = __atomic_load_n(&ram->migrated_segments, __ATOMIC_RELAXED);
+    stats->migrated_bytes = __atomic_load_n(&ram->migrated_bytes, __ATOMIC_RELAXED);
+}
+
+void rtr_free(RamTier *ram) {
+    if (ram->mover != NULL) {
+        evct_free(ram->mover);
+    }
+    while (rtr_migrate(ram));
+    close(ram->fd);
+    free(ram->path);
+    free(ram);
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "../include/recovery.h"
+#include "../include/stream_index.h"
+#include "../include/segment.h"
+#include "../include/stream_storage.h"
+#include "../include/lpxstd.h"
+
+/**
+ * Точка привязки: время окончания фрейма, оценённое по времени изменения файла
+ */
+typedef struct Anchor {
+    size_t frame_idx;
+    int64_t time; // микросекунды
+} Anchor;
+
+static int64_t mtime_us(const struct stat *st) {
+    return ts2ns(st->st_mtim) / 1000;
+}
+
+/**
+ * Точки привязки фреймов стрима, записанного в сегменты: последнему фрейму каждого сегмента соответствует mtime
+ * сегмента. В frames_cnt возвращается количество фреймов, записанных подряд с начала стрима.
+ */
+static int8_t segment_anchors(int dir_fd, size_t from, size_t *frames_cnt, Anchor **anchors, size_t *anchors_cnt) {
+    SegmentTable *table;
+    int8_t res = segt_open(dir_fd, &table);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+
+    size_t cnt = 0;
+    while (segt_frame(table, cnt) != NULL) {
+        cnt++;
+    }
+    *frames_cnt = cnt;
+    *anchors = xcalloc(cnt > from ? cnt - from : 1, sizeof(Anchor));
+    *anchors_cnt = 0;
+    for (size_t i = from; i < cnt; i++) {
+        const FrameLocation *location = segt_frame(table, i);
+        if (i + 1 < cnt && segt_frame(table, i + 1)->segment == location->segment) {
+            continue;
+        }
+        char name[SEG_NAME_SIZE];
+        seg_name(location->segment, name);
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, 0) == 0) {
+            (*anchors)[(*anchors_cnt)++] = (Anchor) {.frame_idx = i, .time = mtime_us(&st)};
+        } else {
+            res = LPX_IO;
+        }
+        if (res != LPX_SUCCESS) {
+            free(*anchors);
+            break;
+        }
+    }
+
+    segt_close(table);
+
+    return res;
+}
+
+/**
+ * Точки привязки фреймов стрима, записанного по файлу на фрейм: каждому фрейму соответствует mtime его файла
+ */
+static int8_t file_anchors(int dir_fd, size_t from, size_t *frames_cnt, Anchor **anchors, size_t *anchors_cnt) {
+    size_t capacity = 64;
+    *anchors = xcalloc(capacity, sizeof(Anchor));
+    *anchors_cnt = 0;
+
+    size_t cnt = 0;
+    while (true) {
+        char frame_file[MAX_INT_LEN + 1];
+        snprintf(frame_file, sizeof(frame_file), "%zu", cnt);
+        struct stat st;
+        if (fstatat(dir_fd, frame_file, &st, 0) != 0) {
+            break;
+        }
+        if (cnt >= from) {
+            if (*anchors_cnt == capacity) {
+                capacity *= 2;
+                *anchors = xrealloc(*anchors, capacity * sizeof(Anchor));
+            }
+            (*anchors)[(*anchors_cnt)++] = (Anchor) {.frame_idx = cnt, .time = mtime_us(&st)};
+        }
+        cnt++;
+    }
+    *frames_cnt = cnt;
+
+    return LPX_SUCCESS;
+}
+
+int8_t rcv_train(int dir_fd, const char *train_id, uint64_t *frames_cnt) {
+    int8_t res = LPX_SUCCESS;
+
+    // записи незакрытого индекса точные, их сохраняем
+    StreamIndex *index = NULL;
+    size_t known = 0;
+    if (sidx_open(dir_fd, &index) == LPX_SUCCESS) {
+        if (sidx_sealed(index)) {
+            sidx_close(index);
+            return STRG_EXISTS;
+        }
+        known = sidx_size(index);
+    }
+
+    size_t cnt;
+    Anchor *anchors;
+    size_t anchors_cnt;
+    res = segment_anchors(dir_fd, known, &cnt, &anchors, &anchors_cnt);
+    if (res == STRG_NOT_FOUND) {
+        res = file_anchors(dir_fd, known, &cnt, &anchors, &anchors_cnt);
+    }
+    if (res != LPX_SUCCESS) {
+        goto close_index;
+    }
+    if (cnt == 0) {
+        res = STRG_NOT_FOUND;
+        goto free_anchors;
+    }
+    if (known > cnt) {
+        known = cnt;
+    }
+
+    FrameMeta *frames = xcalloc(cnt, sizeof(FrameMeta));
+    if (known > 0) {
+        memcpy(frames, sidx_frames(index), known * sizeof(FrameMeta));
+    }
+
+    // время между точками привязки распределяется между фреймами равномерно
+    int64_t prev_time = known > 0 ? frames[known - 1].end_time : strtoll(train_id, NULL, 10) * 1000;
+    ssize_t prev_idx = (ssize_t) known - 1;
+    size_t anchor = 0;
+    for (size_t i = known; i < cnt; i++) {
+        while (anchors[anchor].frame_idx < i) {
+            anchor++;
+        }
+        const Anchor *next = &anchors[anchor];
+        int64_t next_time = next->time > prev_time ? next->time : prev_time;
+        frames[i].start_time = i > 0 ? frames[i - 1].end_time : prev_time;
+        frames[i].end_time = prev_time + (next_time - prev_time) * ((ssize_t) i - prev_idx) /
+                                         ((ssize_t) next->frame_idx - prev_idx);
+        if (i == next->frame_idx) {
+            prev_time = next_time;
+            prev_idx = (ssize_t) i;
+        }
+    }
+
+    res = sidx_write(dir_fd, frames, cnt, known < cnt ? SIDX_FLAG_APPROXIMATE : 0);
+    if (res == LPX_SUCCESS) {
+        *frames_cnt = cnt;
+    }
+    free(frames);
+
+    free_anchors:
+    free(anchors);
+
+    close_index:
+    if (index != NULL) {
+        sidx_close(index);
+    }
+
+    return res;
+}
+
+typedef struct RecoveryPool {
+    RecoveryJob *jobs;
+    size_t jobs_cnt;
+    size_t next_job;
+} RecoveryPool;
+
+static void *rcv_worker(void *arg) {
+    RecoveryPool *pool = arg;
+    while (true) {
+        size_t idx = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED);
+        if (idx >= pool->jobs_cnt) {
+            break;
+        }
+        RecoveryJob *job = &pool->jobs[idx];
+        job->frames_cnt = 0;
+        job->res = rcv_train(job->dir_fd, job->train_id, &job->frames_cnt);
+    }
+    return NULL;
+}
+
+void rcv_run(RecoveryJob *jobs, size_t jobs_cnt, size_t threads) {
+    RecoveryPool pool = {.jobs = jobs, .jobs_cnt = jobs_cnt, .next_job = 0};
+    if (threads > jobs_cnt) {
+        threads = jobs_cnt;
+    }
+
+    // вызывающий поток тоже разбирает задания, так что пул работает и без дополнительных потоков
+    pthread_t *workers = xcalloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+    size_t workers_cnt = 0;
+    for (size_t i = 1; i < threads; i++) {
+        if (pthread_create(&workers[workers_cnt], NULL, rcv_worker, &pool) != 0) {
+            fprintf(stderr, "Could not start recovery thread\n");
+            break;
+        }
+        workers_cnt++;
+    }
+    rcv_worker(&pool);
+    for (size_t i = 0; i < workers_cnt; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
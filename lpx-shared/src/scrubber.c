@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include "../include/scrubber.h"
+#include "../include/evictor.h"
+#include "../include/segment.h"
+#include "../include/stream.h"
+#include "../include/lpxstd.h"
+
+// Фоновая проверка контрольных сумм: порция фреймов раз в SCRUB_PAUSE_MS, поиск непроверенных стримов раз в
+// SCRUB_PERIOD_MS. Проверенный стрим перепроверяется через SCRUB_REPEAT_US.
+#define SCRUB_PAUSE_MS  100
+#define SCRUB_PERIOD_MS 10000
+#define SCRUB_REPEAT_US (7LL * 24 * 3600 * 1000000)
+
+typedef struct Scrubber {
+    ScrubSource source;
+    uint64_t bytes_per_sec;
+    Evictor *evictor;
+
+    /**
+     * Проверяемый стрим train_id меняет только поток проверки под mutex, frame и frames - прогресс проверки стрима,
+     * train_errors - найденные в нём ошибки.
+     */
+    pthread_mutex_t mutex;
+    char train_id[MAX_INT_LEN + 1];
+    uint32_t frame;
+    uint32_t frames;
+    uint64_t train_errors;
+
+    uint64_t streams;
+    uint64_t verified_frames;
+    uint64_t verified_bytes;
+    uint64_t corrupt_frames;
+    uint64_t failed_frames;
+    uint64_t time_us;
+} Scrubber;
+
+bool scrb_due(const CatalogEntry *entry, int64_t now) {
+    return entry->indexed && !entry->open && (entry->scrub_time == 0 || now - entry->scrub_time > SCRUB_REPEAT_US);
+}
+
+const CatalogEntry *scrb_select(Catalog *catalog, int64_t now) {
+    const CatalogEntry *next = NULL;
+    for (size_t i = 0; i < ctlg_size(catalog); i++) {
+        const CatalogEntry *entry = ctlg_at(catalog, i);
+        if (!scrb_due(entry, now)) {
+            continue;
+        }
+        if (entry->scrub_time == 0) {
+            return entry;
+        }
+        if (next == NULL) {
+            next = entry;
+        }
+    }
+    return next;
+}
+
+static void scrb_set_train(Scrubber *scrubber, const char *train_id) {
+    int r = pthread_mutex_lock(&scrubber->mutex);
+    assert(r == 0 && "Could not lock scrubber mutex");
+    strcpy(scrubber->train_id, train_id);
+    r = pthread_mutex_unlock(&scrubber->mutex);
+    assert(r == 0 && "Could not unlock scrubber mutex");
+}
+
+/**
+ * Проверяет фреймы стрима train_id начиная с frame, пока не наберётся budget байт. Возвращает true, если стрим
+ * проверен до конца.
+ */
+static bool scrb_frames(Scrubber *scrubber, uint64_t budget) {
+    char *train_id = scrubber->train_id;
+    int td;
+    if (scrubber->source.acquire_dir(scrubber->source.ctx, train_id, &td) != LPX_SUCCESS) {
+        return true;
+    }
+    SegmentTable *table = NULL;
+    int8_t res = segt_open(td, &table);
+    if (res != LPX_SUCCESS && res != STRG_NOT_FOUND) {
+        scrubber->train_errors++;
+        scrubber->source.release_dir(scrubber->source.ctx, td);
+        return true;
+    }
+    // у стримов, записанных по файлу на фрейм, таблицы фреймов и контрольных сумм нет
+    size_t frames_cnt = res == LPX_SUCCESS ? segt_size(table) : 0;
+    __atomic_store_n(&scrubber->frames, (uint32_t) frames_cnt, __ATOMIC_RELAXED);
+
+    uint32_t frame_idx = __atomic_load_n(&scrubber->frame, __ATOMIC_RELAXED);
+    uint64_t bytes = 0;
+    uint64_t frames = 0;
+    while (frame_idx < frames_cnt && bytes < budget) {
+        const FrameLocation *location = segt_frame(table, frame_idx++);
+        if (location == NULL || (location->flags & SEG_FRAME_CRC) == 0) {
+            continue;
+        }
+        FrameRef ref = {.offset = location->offset, .length = location->length, .verify = true, .crc = location->crc};
+        seg_name(location->segment, ref.file);
+        size_t corrupted;
+        res = stream_verify_frames(td, &ref, 1, &corrupted);
+        if (res == LPX_CORRUPT) {
+            fprintf(stderr, "Scrub: frame %u of stream %s checksum mismatch\n", frame_idx - 1, train_id);
+            __atomic_add_fetch(&scrubber->corrupt_frames, 1, __ATOMIC_RELAXED);
+            scrubber->train_errors++;
+        } else if (res != LPX_SUCCESS) {
+            fprintf(stderr, "Scrub: frame %u of stream %s could not be read\n", frame_idx - 1, train_id);
+            __atomic_add_fetch(&scrubber->failed_frames, 1, __ATOMIC_RELAXED);
+            scrubber->train_errors++;
+        }
+        bytes += location->length;
+        frames++;
+    }
+    __atomic_store_n(&scrubber->frame, frame_idx, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&scrubber->verified_frames, frames, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&scrubber->verified_bytes, bytes, __ATOMIC_RELAXED);
+
+    if (table != NULL) {
+        segt_close(table);
+    }
+    scrubber->source.release_dir(scrubber->source.ctx, td);
+
+    return frame_idx >= frames_cnt;
+}
+
+/**
+ * Шаг фоновой проверки: проверяет порцию фреймов, которую можно прочитать за SCRUB_PAUSE_MS при заданной скорости
+ * проверки. Возвращает false, если проверять нечего.
+ */
+static bool scrb_step(void *ctx) {
+    Scrubber *scrubber = ctx;
+    if (scrubber->train_id[0] == 0) {
+        char train_id[MAX_INT_LEN + 1];
+        uint64_t frames_cnt;
+        if (!scrubber->source.next(scrubber->source.ctx, train_id, &frames_cnt)) {
+            return false;
+        }
+        __atomic_store_n(&scrubber->frame, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&scrubber->frames, (uint32_t) frames_cnt, __ATOMIC_RELAXED);
+        scrubber->train_errors = 0;
+        scrb_set_train(scrubber, train_id);
+    }
+
+    uint64_t budget = scrubber->bytes_per_sec * SCRUB_PAUSE_MS / 1000;
+    uint64_t start = monotonic_us();
+    // порция не меньше одного фрейма, иначе при маленькой скорости проверка не продвигается
+    bool done = scrb_frames(scrubber, budget > 0 ? budget : 1);
+    __atomic_add_fetch(&scrubber->time_us, monotonic_us() - start, __ATOMIC_RELAXED);
+    if (done) {
+        if (scrubber->source.finish(scrubber->source.ctx, scrubber->train_id, scrubber->train_errors)) {
+            __atomic_add_fetch(&scrubber->streams, 1, __ATOMIC_RELAXED);
+        }
+        scrb_set_train(scrubber, "");
+    }
+    return true;
+}
+
+Scrubber *scrb_create(uint64_t bytes_per_sec, const ScrubSource *source) {
+    Scrubber *scrubber = xcalloc(1, sizeof(Scrubber));
+    scrubber->source = *source;
+    scrubber->bytes_per_sec = bytes_per_sec;
+    pthread_mutex_init(&scrubber->mutex, NULL);
+    scrubber->evictor = evct_create(scrb_step, scrubber, SCRUB_PERIOD_MS, SCRUB_PAUSE_MS, EVCT_IDLE_IO);
+    if (scrubber->evictor == NULL) {
+        pthread_mutex_destroy(&scrubber->mutex);
+        free(scrubber);
+        return NULL;
+    }
+    evct_wake(scrubber->evictor);
+    return scrubber;
+}
+
+void scrb_stats(Scrubber *scrubber, StorageScrub *scrub) {
+    int r = pthread_mutex_lock(&scrubber->mutex);
+    assert(r == 0 && "Could not lock scrubber mutex");
+    strcpy(scrub->train_id, scrubber->train_id);
+    r = pthread_mutex_unlock(&scrubber->mutex);
+    assert(r == 0 && "Could not unlock scrubber mutex");
+    if (scrub->train_id[0] != 0) {
+        scrub->train_frame = __atomic_load_n(&scrubber->frame, __ATOMIC_RELAXED);
+        scrub->train_frames = __atomic_load_n(&scrubber->frames, __ATOMIC_RELAXED);
+    }
+    scrub->verified_streams = __atomic_load_n(&scrubber->streams, __ATOMIC_RELAXED);
+    scrub->verified_frames = __atomic_load_n(&scrubber->verified_frames, __ATOMIC_RELAXED);
+    scrub->verified_bytes = __atomic_load_n(&scrubber->verified_bytes, __ATOMIC_RELAXED);
+    scrub->corrupt_frames = __atomic_load_n(&scrubber->corrupt_frames, __ATOMIC_RELAXED);
+    scrub->failed_frames = __atomic_load_n(&scrubber->failed_frames, __ATOMIC_RELAXED);
+    scrub->scrub_time_us = __atomic_load_n(&scrubber->time_us, __ATOMIC_RELAXED);
+}
+
+void scrb_free(Scrubber *scrubber) {
+    evct_free(scrubber->evictor);
+    pthread_mutex_destroy(&scrubber->mutex);
+    free(scrubber);
+}
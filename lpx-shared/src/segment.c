@@ -0,0 +1,657 @@
+#define _GNU_SOURCE // O_DIRECT, fallocate, sync_file_range
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <pthread.h>
+#include <assert.h>
+#include "../include/segment.h"
+#include "../include/crc32c.h"
+#include "../include/stream_storage.h"
+#include "../include/lpxstd.h"
+
+typedef struct SegmentTable {
+    const FrameLocation *frames;
+    size_t frames_cnt;
+    void *map;
+    size_t map_size;
+    FrameLocation *converted; // записи таблицы версии 1, дополненные до FrameLocation
+} SegmentTable;
+
+// У тома ещё нет текущего сегмента
+#define NO_SEGMENT UINT32_MAX
+
+/**
+ * Том, на который писатель распределяет фреймы, и его текущий сегмент
+ */
+typedef struct SegmentLane {
+    int dir_fd; // директория стрима на томе, -1 - сама директория стрима
+    char *path;
+    SegmentVolumeStats *stats; // NULL - счётчики не ведутся
+    uint32_t segment; // текущий сегмент тома, в конец которого дописываются фреймы, или NO_SEGMENT
+    uint64_t segment_size; // его размер с учётом выделенного под фреймы места
+    bool full; // на томе нет места под новый сегмент
+} SegmentLane;
+
+typedef struct SegmentWriter {
+    int dir_fd;
+    int table_fd;
+    uint32_t record_size; // размер записи таблицы: старые таблицы дописываются в своём формате
+
+    /**
+     * Дескрипторы всех открытых сегментов стрима. Сегменты не закрываются при переходе к следующему, чтобы фреймы,
+     * место под которые уже выделено в предыдущем сегменте, можно было дописать параллельно.
+     */
+    int *segment_fds;
+    size_t segment_fds_size;
+
+    /**
+     * Дескрипторы сегментов, открытые с O_DIRECT, при записи в режиме SEGW_DIRECT. Место под сегмент выделяется
+     * заранее целиком, а фреймы размещаются по смещениям, кратным SEG_DIRECT_ALIGN.
+     */
+    int *direct_fds;
+    bool direct;
+
+    /**
+     * RAM-уровень новых сегментов (tier_fd == -1 - уровня нет) и признаки сегментов, созданных в нём этим писателем
+     */
+    int tier_fd;
+    char *tier_path;
+    uint64_t tier_capacity;
+    uint64_t *tier_used;
+    bool *tier_segments;
+
+    /**
+     * Тома, по которым распределяются фреймы, - хотя бы один, директория стрима. next_lane - том следующего фрейма,
+     * next_segment - номер следующего нового сегмента стрима.
+     */
+    SegmentLane *lanes;
+    size_t lanes_cnt;
+    size_t next_lane;
+    uint32_t next_segment;
+
+    /**
+     * Защищает выделение места в сегментах, сами фреймы пишутся без блокировки
+     */
+    pthread_mutex_t mutex;
+} SegmentWriter;
+
+void seg_name(uint32_t segment, char *name) {
+    snprintf(name, SEG_NAME_SIZE, SEG_FILE_PREFIX "%u", segment);
+}
+
+int8_t segt_open(int dir_fd, SegmentTable **table) {
+    int8_t res = LPX_SUCCESS;
+
+    int fd = openat(dir_fd, SEG_TABLE_FILE, O_RDONLY);
+    if (fd == -1) {
+        return STRG_NOT_FOUND;
+    }
+
+    off_t size;
+    if (fd_size(fd, &size) != LPX_SUCCESS) {
+        res = LPX_IO;
+        goto close_fd;
+    }
+    if (size < sizeof(SegmentTableHeader)) {
+        res = STRG_BAD_INDEX;
+        goto close_fd;
+    }
+
+    void *map = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        res = LPX_IO;
+        goto close_fd;
+    }
+
+    const SegmentTableHeader *header = map;
+    bool v1 = header->version == 1 && header->record_size == SEG_V1_RECORD_SIZE;
+    if (memcmp(header->magic, SEG_MAGIC, sizeof(header->magic)) != 0 ||
+        !(v1 || (header->version == SEG_VERSION && header->record_size == sizeof(FrameLocation)))) {
+        munmap(map, (size_t) size);
+        res = STRG_BAD_INDEX;
+        goto close_fd;
+    }
+
+    SegmentTable *tbl = xcalloc(1, sizeof(SegmentTable));
+    tbl->map = map;
+    tbl->map_size = (size_t) size;
+    const uint8_t *records = (uint8_t *) map + sizeof(SegmentTableHeader);
+    // недописанная последняя запись отбрасывается
+    tbl->frames_cnt = (size - sizeof(SegmentTableHeader)) / header->record_size;
+    if (v1) {
+        tbl->converted = xcalloc(tbl->frames_cnt > 0 ? tbl->frames_cnt : 1, sizeof(FrameLocation));
+        for (size_t i = 0; i < tbl->frames_cnt; i++) {
+            memcpy(&tbl->converted[i], records + i * SEG_V1_RECORD_SIZE, SEG_V1_RECORD_SIZE);
+        }
+        tbl->frames = tbl->converted;
+    } else {
+        tbl->frames = (const FrameLocation *) records;
+    }
+    *table = tbl;
+
+    close_fd:
+    close(fd);
+
+    return res;
+}
+
+size_t segt_size(const SegmentTable *table) {
+    return table->frames_cnt;
+}
+
+const FrameLocation *segt_frame(const SegmentTable *table, size_t idx) {
+    if (idx >= table->frames_cnt || table->frames[idx].length == 0) {
+        return NULL;
+    }
+    return &table->frames[idx];
+}
+
+void segt_close(SegmentTable *table) {
+    munmap(table->map, table->map_size);
+    free(table->converted);
+    free(table);
+}
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+/**
+ * Открывает дескриптор сегмента для прямой записи и выделяет место под весь сегмент. Если файловая система не
+ * поддерживает O_DIRECT, писатель переходит к записи через page cache.
+ */
+static void segw_open_direct(SegmentWriter *writer, uint32_t segment, const char *name) {
+    writer->direct_fds[segment] = -1;
+    if (!writer->direct) {
+        return;
+    }
+
+    int fd = openat(writer->dir_fd, name, O_WRONLY | O_DIRECT);
+    if (fd == -1) {
+        fprintf(stderr, "Direct I/O is not supported for %s (%s), falling back to buffered writes\n", name,
+                strerror(errno));
+        writer->direct = false;
+        return;
+    }
+    writer->direct_fds[segment] = fd;
+
+    // размер файла не меняется, так что по нему по-прежнему определяется конец записанных данных
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, SEG_MAX_SIZE) != 0 && errno != EOPNOTSUPP) {
+        fprintf(stderr, "Could not preallocate segment %s: %s\n", name, strerror(errno));
+    }
+}
+
+/**
+ * Создаёт сегмент name в директории dir_fd с путём path вне директории стрима и ставит на его место символьную ссылку
+ * в директории стрима. preallocate - сразу выделить место под весь сегмент. Возвращает -1 в случае ошибки.
+ */
+static int segw_create_linked(SegmentWriter *writer, int dir_fd, const char *path, const char *name,
+                              bool preallocate) {
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    if (preallocate && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, SEG_MAX_SIZE) != 0 && errno != EOPNOTSUPP) {
+        goto unlink;
+    }
+    char target[PATH_MAX];
+    if (snprintf(target, sizeof(target), "%s/%s", path, name) >= (int) sizeof(target) ||
+        symlinkat(target, writer->dir_fd, name) != 0) {
+        goto unlink;
+    }
+    return fd;
+
+    unlink:
+    close(fd);
+    unlinkat(dir_fd, name, 0);
+    return -1;
+}
+
+/**
+ * Создаёт сегмент name в RAM-уровне, резервируя под него место. Возвращает -1, если уровня нет или в нём не хватает
+ * места.
+ */
+static int segw_create_tiered(SegmentWriter *writer, const char *name) {
+    if (writer->tier_fd == -1) {
+        return -1;
+    }
+    uint64_t used = __atomic_add_fetch(writer->tier_used, SEG_MAX_SIZE, __ATOMIC_RELAXED);
+    // tmpfs выделяет страницы при записи: без резервирования переполнение уровня обнаружилось бы посреди сегмента
+    int fd = writer->tier_capacity == 0 || used <= writer->tier_capacity
+             ? segw_create_linked(writer, writer->tier_fd, writer->tier_path, name, true) : -1;
+    if (fd == -1) {
+        __atomic_sub_fetch(writer->tier_used, SEG_MAX_SIZE, __ATOMIC_RELAXED);
+        fprintf(stderr, "RAM tier is full, segment %s is written to disk\n", name);
+    }
+    return fd;
+}
+
+/**
+ * Открывает сегмент segment текущим сегментом тома lane. Новый сегмент создаётся в RAM-уровне, если он есть и в нём
+ * хватает места, иначе на томе.
+ */
+static int8_t segw_open_segment(SegmentWriter *writer, size_t lane, uint32_t segment) {
+    SegmentLane *l = &writer->lanes[lane];
+    char name[SEG_NAME_SIZE];
+    seg_name(segment, name);
+    int fd = openat(writer->dir_fd, name, O_WRONLY | O_CLOEXEC);
+    bool tiered = false;
+    if (fd == -1 && errno == ENOENT) {
+        fd = segw_create_tiered(writer, name);
+        tiered = fd != -1;
+        if (fd == -1 && l->dir_fd != -1) {
+            fd = segw_create_linked(writer, l->dir_fd, l->path, name, false);
+        } else if (fd == -1) {
+            fd = openat(writer->dir_fd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        }
+        if (fd != -1 && l->stats != NULL) {
+            __atomic_add_fetch(&l->stats->segments, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (fd == -1) {
+        return LPX_IO;
+    }
+
+    off_t size;
+    if (fd_size(fd, &size) != LPX_SUCCESS) {
+        close(fd);
+        return LPX_IO;
+    }
+
+    if (segment >= writer->segment_fds_size) {
+        size_t new_size = segment + 1;
+        writer->segment_fds = xrealloc(writer->segment_fds, new_size * sizeof(int));
+        writer->direct_fds = xrealloc(writer->direct_fds, new_size * sizeof(int));
+        writer->tier_segments = xrealloc(writer->tier_segments, new_size * sizeof(bool));
+        for (size_t i = writer->segment_fds_size; i < new_size; i++) {
+            writer->segment_fds[i] = -1;
+            writer->direct_fds[i] = -1;
+            writer->tier_segments[i] = false;
+        }
+        writer->segment_fds_size = new_size;
+    }
+    writer->segment_fds[segment] = fd;
+    writer->tier_segments[segment] = tiered;
+    if (tiered) {
+        // tmpfs не поддерживает O_DIRECT, да и писать в RAM в обход page cache незачем
+        writer->direct_fds[segment] = -1;
+    } else {
+        segw_open_direct(writer, segment, name);
+    }
+    l->segment = segment;
+    l->segment_size = (uint64_t) size;
+    if (segment >= writer->next_segment) {
+        writer->next_segment = segment + 1;
+    }
+
+    return LPX_SUCCESS;
+}
+
+/**
+ * Освобождает место, выделенное заранее за концом записанных данных сегмента: усечение файла до текущего размера
+ * освобождает блоки за его концом
+ */
+static void segw_release_preallocated(int fd) {
+    off_t size;
+    if (fd_size(fd, &size) == LPX_SUCCESS && ftruncate(fd, size) != 0) {
+        fprintf(stderr, "Could not release preallocated segment space: %s\n", strerror(errno));
+    }
+}
+
+int8_t segw_open(int dir_fd, int flags, const SegmentPlacement *placement, SegmentWriter **writer) {
+    int8_t res = LPX_SUCCESS;
+
+    SegmentWriter *w = xcalloc(1, sizeof(SegmentWriter));
+    w->dir_fd = -1;
+    w->table_fd = -1;
+    w->tier_fd = -1;
+    w->direct = (flags & SEGW_DIRECT) != 0;
+    pthread_mutex_init(&w->mutex, NULL);
+
+    size_t volumes_cnt = placement != NULL ? placement->volumes_cnt : 0;
+    w->lanes_cnt = volumes_cnt > 0 ? volumes_cnt : 1;
+    w->lanes = xcalloc(w->lanes_cnt, sizeof(SegmentLane));
+    for (size_t i = 0; i < w->lanes_cnt; i++) {
+        w->lanes[i].dir_fd = -1;
+        w->lanes[i].segment = NO_SEGMENT;
+    }
+    for (size_t i = 0; i < volumes_cnt; i++) {
+        SegmentLane *lane = &w->lanes[i];
+        const SegmentVolume *volume = &placement->volumes[i];
+        lane->stats = volume->stats;
+        if (volume->dir_fd != -1) {
+            lane->dir_fd = fcntl(volume->dir_fd, F_DUPFD_CLOEXEC, 0);
+            if (lane->dir_fd == -1) {
+                res = LPX_IO;
+                goto error;
+            }
+            lane->path = xmalloc(strlen(volume->path) + 1);
+            strcpy(lane->path, volume->path);
+        }
+    }
+
+    const SegmentTier *tier = placement != NULL ? placement->tier : NULL;
+    if (tier != NULL) {
+        w->tier_fd = fcntl(tier->dir_fd, F_DUPFD_CLOEXEC, 0);
+        if (w->tier_fd == -1) {
+            res = LPX_IO;
+            goto error;
+        }
+        w->tier_path = xmalloc(strlen(tier->path) + 1);
+        strcpy(w->tier_path, tier->path);
+        w->tier_capacity = tier->capacity;
+        w->tier_used = tier->used;
+    }
+
+    w->dir_fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (w->dir_fd == -1) {
+        res = LPX_IO;
+        goto error;
+    }
+    w->table_fd = openat(w->dir_fd, SEG_TABLE_FILE, O_RDWR | O_CREAT, 0666);
+    if (w->table_fd == -1) {
+        res = LPX_IO;
+        goto error;
+    }
+
+    off_t tbl_size;
+    if (fd_size(w->table_fd, &tbl_size) != LPX_SUCCESS) {
+        res = LPX_IO;
+        goto error;
+    }
+    SegmentTableHeader header = {
+            .magic = SEG_MAGIC,
+            .version = SEG_VERSION,
+            .record_size = sizeof(FrameLocation)
+    };
+    if (tbl_size == 0) {
+        if (pwrite(w->table_fd, &header, sizeof(header), 0) != sizeof(header)) {
+            res = LPX_IO;
+            goto error;
+        }
+    } else if (pread(w->table_fd, &header, sizeof(header), 0) != sizeof(header) ||
+               memcmp(header.magic, SEG_MAGIC, sizeof(header.magic)) != 0 ||
+               (header.record_size != sizeof(FrameLocation) && header.record_size != SEG_V1_RECORD_SIZE)) {
+        res = STRG_BAD_INDEX;
+        goto error;
+    }
+    w->record_size = header.record_size;
+
+    // продолжаем запись в последний существующий сегмент, если он не в RAM-уровне
+    uint32_t segment = 0;
+    char name[SEG_NAME_SIZE];
+    struct stat st;
+    while (true) {
+        seg_name(segment + 1, name);
+        if (fstatat(w->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            break;
+        }
+        segment++;
+    }
+    seg_name(segment, name);
+    if (fstatat(w->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode)) {
+        segment++;
+    }
+    res = segw_open_segment(w, 0, segment);
+    if (res != LPX_SUCCESS) {
+        goto error;
+    }
+
+    *writer = w;
+
+    return res;
+
+    error:
+    segw_close(w);
+
+    return res;
+}
+
+/**
+ * true, если на томе lane не хватает места под новый сегмент, а у писателя есть другие тома, на которых место ещё
+ * может быть. Последний оставшийся том полным не считается: ошибки записи на него возвращаются как есть.
+ */
+static bool segw_lane_full(SegmentWriter *writer, size_t lane) {
+    size_t available = 0;
+    for (size_t i = 0; i < writer->lanes_cnt; i++) {
+        available += writer->lanes[i].full ? 0 : 1;
+    }
+    SegmentLane *l = &writer->lanes[lane];
+    struct statvfs fs;
+    if (available <= 1 || fstatvfs(l->dir_fd != -1 ? l->dir_fd : writer->dir_fd, &fs) != 0 ||
+        (uint64_t) fs.f_bavail * fs.f_frsize >= SEG_MAX_SIZE) {
+        return false;
+    }
+    fprintf(stderr, "Volume %s is full, frames are written to other volumes\n", l->path != NULL ? l->path : ".");
+    return true;
+}
+
+/**
+ * Выбирает том для следующего фрейма размером reserved байт: тома чередуются, полные пропускаются
+ */
+static size_t segw_next_lane(SegmentWriter *writer, uint64_t reserved) {
+    for (size_t i = 0; i < writer->lanes_cnt; i++) {
+        size_t lane = writer->next_lane++ % writer->lanes_cnt;
+        SegmentLane *l = &writer->lanes[lane];
+        if (l->full) {
+            continue;
+        }
+        bool new_segment = l->segment == NO_SEGMENT ||
+                           (l->segment_size > 0 &&
+                            (writer->direct ? align_up(l->segment_size, SEG_DIRECT_ALIGN) : l->segment_size) +
+                            reserved > SEG_MAX_SIZE);
+        if (!new_segment || !segw_lane_full(writer, lane)) {
+            return lane;
+        }
+        l->full = true;
+    }
+    return 0;
+}
+
+int8_t segw_reserve(SegmentWriter *writer, size_t size, bool aligned, SegmentSlot *slot) {
+    int8_t res = LPX_SUCCESS;
+
+    int r = pthread_mutex_lock(&writer->mutex);
+    assert(r == 0 && "Could not lock segment writer mutex");
+    uint64_t reserved = writer->direct ? align_up(size, SEG_DIRECT_ALIGN) : size;
+    size_t lane = segw_next_lane(writer, reserved);
+    SegmentLane *l = &writer->lanes[lane];
+    uint64_t offset = writer->direct ? align_up(l->segment_size, SEG_DIRECT_ALIGN) : l->segment_size;
+    if (l->segment == NO_SEGMENT || (l->segment_size > 0 && offset + reserved > SEG_MAX_SIZE)) {
+        res = segw_open_segment(writer, lane, writer->next_segment);
+        offset = 0;
+    }
+    if (res == LPX_SUCCESS) {
+        slot->location = (FrameLocation) {
+                .segment = l->segment,
+                .offset = offset,
+                .length = size
+        };
+        slot->volume = lane;
+        slot->buffered_fd = writer->segment_fds[l->segment];
+        int direct_fd = writer->direct_fds[l->segment];
+        if (aligned && direct_fd != -1) {
+            slot->fd = direct_fd;
+            slot->write_size = reserved;
+        } else {
+            slot->fd = slot->buffered_fd;
+            slot->write_size = size;
+        }
+        l->segment_size = offset + reserved;
+    }
+    r = pthread_mutex_unlock(&writer->mutex);
+    assert(r == 0 && "Could not unlock segment writer mutex");
+
+    return res;
+}
+
+void segw_account(SegmentWriter *writer, size_t volume, uint64_t frames, uint64_t bytes, uint64_t write_time_us) {
+    SegmentVolumeStats *stats = writer->lanes[volume].stats;
+    if (stats != NULL) {
+        __atomic_add_fetch(&stats->frames, frames, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->write_time_us, write_time_us, __ATOMIC_RELAXED);
+    }
+}
+
+void seg_checksum(FrameLocation *location, const uint8_t *buf) {
+    location->crc = crc32c(0, buf, (size_t) location->length);
+    location->flags |= SEG_FRAME_CRC;
+}
+
+int8_t segw_commit(SegmentWriter *writer, uint32_t frame_idx, const FrameLocation *location) {
+    FrameLocation record = *location;
+    if (writer->record_size < sizeof(FrameLocation)) {
+        // в записи старого формата нет места под контрольную сумму
+        record.flags &= ~SEG_FRAME_CRC;
+    }
+    off_t record_offset = sizeof(SegmentTableHeader) + (off_t) frame_idx * writer->record_size;
+    if (pwrite(writer->table_fd, &record, writer->record_size, record_offset) != writer->record_size) {
+        return LPX_IO;
+    }
+    return LPX_SUCCESS;
+}
+
+int8_t segw_append(SegmentWriter *writer, uint32_t frame_idx, const uint8_t *buf, size_t size, uint32_t flags) {
+    SegmentSlot slot;
+    bool aligned = (uintptr_t) buf % SEG_DIRECT_ALIGN == 0 && size % SEG_DIRECT_ALIGN == 0;
+    int8_t res = segw_reserve(writer, size, aligned, &slot);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+    slot.location.flags = flags;
+    seg_checksum(&slot.location, buf);
+
+    uint64_t start = monotonic_us();
+    size_t written = 0;
+    while (written < slot.write_size) {
+        ssize_t w = pwrite(slot.fd, buf + written, slot.write_size - written, slot.location.offset + written);
+        if (w > 0) {
+            written += w;
+        } else if (slot.fd != slot.buffered_fd) {
+            // прямая запись не удалась (например, EINVAL из-за выравнивания) или остаток после короткой прямой записи
+            // не выровнен: фрейм дописывается через page cache
+            slot.fd = slot.buffered_fd;
+            slot.write_size = size;
+        } else {
+            return LPX_IO;
+        }
+    }
+    segw_account(writer, slot.volume, 1, size, monotonic_us() - start);
+
+    // расположение фрейма пишется после самого фрейма, так что таблица никогда не ссылается на незаписанные данные
+    return segw_commit(writer, frame_idx, &slot.location);
+}
+
+int8_t segw_sync(SegmentWriter *writer) {
+    int8_t res = LPX_SUCCESS;
+
+    // дескрипторы копируются под блокировкой: массив может вырасти при переходе к новому сегменту
+    int r = pthread_mutex_lock(&writer->mutex);
+    assert(r == 0 && "Could not lock segment writer mutex");
+    size_t fds_size = writer->segment_fds_size;
+    int *fds = xcalloc(fds_size, sizeof(int));
+    memcpy(fds, writer->segment_fds, fds_size * sizeof(int));
+    r = pthread_mutex_unlock(&writer->mutex);
+    assert(r == 0 && "Could not unlock segment writer mutex");
+
+    for (size_t i = 0; i < fds_size; i++) {
+        if (fds[i] != -1 && fdatasync(fds[i]) != 0) {
+            res = LPX_IO;
+        }
+    }
+    free(fds);
+    if (fdatasync(writer->table_fd) != 0) {
+        res = LPX_IO;
+    }
+
+    return res;
+}
+
+void segw_start_writeback(const SegmentSlot *slot) {
+    if (slot->fd == slot->buffered_fd) {
+        sync_file_range(slot->buffered_fd, (off_t) slot->location.offset, (off_t) slot->location.length,
+                        SYNC_FILE_RANGE_WRITE);
+    }
+}
+
+size_t segw_dup_fds(SegmentWriter *writer, int **fds) {
+    int r = pthread_mutex_lock(&writer->mutex);
+    assert(r == 0 && "Could not lock segment writer mutex");
+    *fds = xcalloc(writer->segment_fds_size + 1, sizeof(int));
+    size_t fds_cnt = 0;
+    for (size_t i = 0; i < writer->segment_fds_size; i++) {
+        if (writer->segment_fds[i] != -1) {
+            (*fds)[fds_cnt] = fcntl(writer->segment_fds[i], F_DUPFD_CLOEXEC, 0);
+            fds_cnt += (*fds)[fds_cnt] != -1 ? 1 : 0;
+        }
+    }
+    r = pthread_mutex_unlock(&writer->mutex);
+    assert(r == 0 && "Could not unlock segment writer mutex");
+
+    // таблица сбрасывается после сегментов: она не должна ссылаться на фреймы, которых нет на диске
+    (*fds)[fds_cnt] = fcntl(writer->table_fd, F_DUPFD_CLOEXEC, 0);
+    fds_cnt += (*fds)[fds_cnt] != -1 ? 1 : 0;
+    return fds_cnt;
+}
+
+bool segw_direct(SegmentWriter *writer) {
+    int r = pthread_mutex_lock(&writer->mutex);
+    assert(r == 0 && "Could not lock segment writer mutex");
+    bool direct = writer->direct;
+    r = pthread_mutex_unlock(&writer->mutex);
+    assert(r == 0 && "Could not unlock segment writer mutex");
+    return direct;
+}
+
+int8_t segw_close(SegmentWriter *writer) {
+    int8_t res = LPX_SUCCESS;
+    for (size_t i = 0; i < writer->segment_fds_size; i++) {
+        if (writer->direct_fds[i] != -1) {
+            segw_release_preallocated(writer->direct_fds[i]);
+            if (close(writer->direct_fds[i]) != 0) {
+                res = LPX_IO;
+            }
+        }
+        if (writer->segment_fds[i] != -1 && writer->tier_segments[i]) {
+            // резерв сегмента в RAM-уровне уменьшается до записанных данных
+            off_t size = 0;
+            segw_release_preallocated(writer->segment_fds[i]);
+            fd_size(writer->segment_fds[i], &size);
+            __atomic_sub_fetch(writer->tier_used, SEG_MAX_SIZE - (uint64_t) size, __ATOMIC_RELAXED);
+        }
+        if (writer->segment_fds[i] != -1 && close(writer->segment_fds[i]) != 0) {
+            res = LPX_IO;
+        }
+    }
+    if (writer->table_fd != -1 && close(writer->table_fd) != 0) {
+        res = LPX_IO;
+    }
+    if (writer->dir_fd != -1) {
+        close(writer->dir_fd);
+    }
+    if (writer->tier_fd != -1) {
+        close(writer->tier_fd);
+    }
+    for (size_t i = 0; i < writer->lanes_cnt; i++) {
+        if (writer->lanes[i].dir_fd != -1) {
+            close(writer->lanes[i].dir_fd);
+        }
+        free(writer->lanes[i].path);
+    }
+    free(writer->lanes);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer->segment_fds);
+    free(writer->direct_fds);
+    free(writer->tier_segments);
+    free(writer->tier_path);
+    free(writer);
+    return res;
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/stats.h"
+#include "../include/lpxstd.h"
+
+void stts_entry(const CatalogEntry *entry, StorageStats *stats) {
+    memset(stats, 0, sizeof(StorageStats));
+    strcpy(stats->train_id, entry->train_id);
+    stats->streams = 1;
+    stats->frames = entry->frames_cnt;
+    stats->dropped_frames = entry->dropped_frames;
+    stats->bytes = entry->bytes;
+    stats->start_time = entry->start_time;
+    stats->end_time = entry->end_time;
+    stats->duration_us = entry->end_time > entry->start_time ? (uint64_t) (entry->end_time - entry->start_time) : 0;
+    stats->open = !entry->indexed || entry->open;
+}
+
+void stts_totals(Catalog *catalog, StorageStats *stats) {
+    CatalogTotals totals;
+    ctlg_totals(catalog, &totals);
+    memset(stats, 0, sizeof(StorageStats));
+    stats->streams = totals.streams;
+    stats->frames = totals.frames;
+    stats->dropped_frames = totals.dropped_frames;
+    stats->bytes = totals.bytes;
+    stats->start_time = totals.start_time;
+    stats->end_time = totals.end_time;
+    stats->duration_us = totals.duration_us;
+}
+
+StorageStats *stts_list(Catalog *catalog, size_t *stats_cnt) {
+    *stats_cnt = ctlg_size(catalog);
+    StorageStats *stats = xcalloc(*stats_cnt > 0 ? *stats_cnt : 1, sizeof(StorageStats));
+    for (size_t i = 0; i < *stats_cnt; i++) {
+        stts_entry(ctlg_at(catalog, i), &stats[i]);
+    }
+    return stats;
+}
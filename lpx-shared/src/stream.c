@@ -3,13 +3,32 @@
 #include <stdio.h>
 #include <lpxstd.h>
 #include <memory.h>
-#include <libgen.h>
 #include <stdbool.h>
 #include <poll.h>
 #include <assert.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <bmp.h>
 #include "../include/stream.h"
+#include "../include/codec.h"
+#include "../include/crc32c.h"
+
+// Внутренний код read_part: новых фреймов записываемого стрима пока нет, а ждать их нельзя
+#define FRAMES_PENDING (-3)
+// Как часто поток записываемого стрима перечитывает источник фреймов без уведомлений: событие может потеряться,
+// например, при переполнении очереди inotify
+#define FOLLOW_POLL_MS 1000
+
+/**
+ * Открытый файл с фреймами
+ */
+typedef struct OpenFile {
+    char file[MAX_INT_LEN + 1]; // имя файла в директории стрима, пустая строка - элемент не занят
+    int fd;
+    size_t refs; // количество фреймов, читаемых из файла в данный момент
+} OpenFile;
 
 typedef struct VideoStreamBytesStream {
     /**
@@ -18,25 +37,65 @@ typedef struct VideoStreamBytesStream {
     bool header_read;
 
     /**
-     * Абсолютные пути к файлам, которые должны попасть в архив.
+     * Директория стрима, из файлов которой читаются фреймы
      */
-    char **file_paths;
+    int dir_fd;
+
+    /**
+     * Фреймы, которые должны попасть в архив.
+     */
+    FrameRef *frames;
+    size_t frames_size;
+
+    /**
+     * Индекс следующего фрейма который должен быть добавлен в архив.
+     */
+    uint32_t next_frame;
+
+    /**
+     * true, пока в архив добавляется текущий фрейм
+     */
+    bool in_frame;
+
+    /**
+     * Открытые файлы фреймов. Фреймы стрима лежат подряд в общих файлах сегментов, поэтому файл остаётся открытым,
+     * пока не понадобится место под другой файл.
+     */
+    OpenFile *files;
     size_t files_size;
 
     /**
-     * Индекс следующего файла который должен быть добавлен в архив.
+     * Поток записываемого стрима: новые фреймы дописывает в frames источник tail, пока не выставит sealed или пока
+     * они не перестанут появляться на idle_ms
+     */
+    bool following;
+    StreamTail tail;
+    bool sealed;
+    unsigned idle_ms;
+
+    /**
+     * Задержка выдачи фреймов с известным end_time
+     */
+    uint64_t latency_frames;
+    uint64_t latency_sum_us;
+    uint64_t latency_max_us;
+
+    /**
+     * Упреждающее чтение: пока текущий фрейм конвертируется и отдаётся клиенту, ядро уже читает в page cache
+     * следующие read_ahead фреймов
      */
-    uint32_t next_file;
+    size_t read_ahead;
+    uint32_t next_prefetch; // индекс следующего фрейма, чтение которого нужно запросить у ядра
 
     /**
-     * Файл добавляемый в архив в данный момент
+     * Формат фреймов стрима
      */
-    FILE *file;
+    FrameFormat format;
 
     /**
-     * Указатель на буффер с raw-фреймом
+     * Отображение текущего raw-фрейма, пиксели конвертируются прямо из него
      */
-    uint8_t *raw_buf;
+    MappedFrame raw;
 
     /**
      * Указатель на буффер с bmp-версией файла
@@ -55,82 +114,461 @@ typedef struct VideoStreamBytesStream {
 
 } VideoStreamBytesStream;
 
-VideoStreamBytesStream *stream_open(char **files, size_t files_size) {
+VideoStreamBytesStream *stream_open(int dir_fd, const FrameFormat *format, FrameRef *frames, size_t frames_size,
+                                    size_t read_ahead) {
+    int fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+        return NULL;
+    }
     VideoStreamBytesStream *res = xcalloc(1, sizeof(VideoStreamBytesStream));
+    res->dir_fd = fd;
+    res->format = *format;
     res->header_read = false;
-    res->file_paths = files;
-    res->files_size = files_size;
-    res->next_file = 0;
-    res->file = NULL;
+    res->frames = frames;
+    res->frames_size = frames_size;
+    res->next_frame = 0;
+    res->in_frame = false;
+
+    res->read_ahead = read_ahead;
+    res->files_size = res->read_ahead + 1;
+    res->files = xcalloc(res->files_size, sizeof(OpenFile));
 
     return res;
 }
 
-ssize_t stream_find_frame(FrameMeta **index, size_t index_size, uint64_t time_offset) {
-    int64_t stream_base = index[0]->start_time;
+VideoStreamBytesStream *stream_follow(int dir_fd, const FrameFormat *format, FrameRef *frames, size_t frames_size,
+                                      size_t read_ahead, const StreamTail *tail, unsigned idle_ms) {
+    VideoStreamBytesStream *res = stream_open(dir_fd, format, frames, frames_size, read_ahead);
+    if (res == NULL) {
+        return NULL;
+    }
+    res->following = true;
+    res->tail = *tail;
+    res->sealed = false;
+    res->idle_ms = idle_ms;
+    return res;
+}
+
+void stream_stats(VideoStreamBytesStream *stream, StreamStats *stats) {
+    stats->frames = stream->latency_frames;
+    stats->latency_avg_us = stream->latency_frames > 0 ? stream->latency_sum_us / stream->latency_frames : 0;
+    stats->latency_max_us = stream->latency_max_us;
+}
+
+ssize_t stream_find_frame(const FrameMeta *index, size_t index_size, uint64_t time_offset) {
+    if (index_size == 0) {
+        return -1;
+    }
+    int64_t stream_base = index[0].start_time;
     for (size_t i = 0; i < index_size - 1; i++) {
-        int64_t frameOffset = index[i]->start_time - stream_base;
-        int64_t nextFrameOffset = index[i + 1]->start_time - stream_base;
+        int64_t frameOffset = index[i].start_time - stream_base;
+        int64_t nextFrameOffset = index[i + 1].start_time - stream_base;
         if (labs(nextFrameOffset - time_offset) > labs(frameOffset - time_offset)) {
             return i;
         }
     }
-    if (stream_base + time_offset < index[index_size - 1]->end_time) {
+    if (stream_base + time_offset < index[index_size - 1].end_time) {
         return index_size - 1;
     } else {
         return -1;
     }
 }
 
-ssize_t stream_find_frame_abs(FrameMeta **index, size_t index_size, uint64_t time) {
+ssize_t stream_find_frame_abs(const FrameMeta *index, size_t index_size, uint64_t time) {
     for (size_t i = 0; i < index_size; i++) {
-        if (index[i]->start_time <= time && index[i]->end_time >= time) {
-            return time;
+        if (index[i].start_time <= time && index[i].end_time >= time) {
+            return i;
         }
     }
     return -1;
 }
 
-static void close_current_file(VideoStreamBytesStream *stream) {
-    if (stream->raw_buf) {
-        free(stream->raw_buf);
-        stream->raw_buf = NULL;
-    }
+static void close_current_frame(VideoStreamBytesStream *stream) {
+    stream_unmap_frame(&stream->raw);
     if (stream->bmp_start) {
         free(stream->bmp_start);
         stream->bmp_start = NULL;
     }
-    fclose(stream->file);
-    stream->file = NULL;
+    stream->in_frame = false;
 }
 
-static int8_t open_next_file(VideoStreamBytesStream *stream, char **next_file_name) {
-    if (stream->next_file == stream->files_size) {
-        return EOF;
+/**
+ * Возвращает дескриптор открытого файла фреймов, открывая его при необходимости. Если все элементы кэша заняты,
+ * закрывается файл, из которого сейчас ничего не читается.
+ */
+static int acquire_file(VideoStreamBytesStream *stream, const char *name) {
+    OpenFile *free_file = NULL;
+    for (size_t i = 0; i < stream->files_size; i++) {
+        OpenFile *file = &stream->files[i];
+        if (file->file[0] != 0 && strcmp(file->file, name) == 0) {
+            file->refs++;
+            return file->fd;
+        }
+        if (file->refs == 0 && (free_file == NULL || file->file[0] == 0)) {
+            free_file = file;
+        }
     }
+    // файлы захватываются на время отображения одного фрейма, так что свободный элемент всегда найдётся
+    assert(free_file != NULL);
 
-    int8_t res = LPX_SUCCESS;
+    if (free_file->file[0] != 0) {
+        close(free_file->fd);
+        free_file->file[0] = 0;
+    }
+    int fd = openat(stream->dir_fd, name, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    // массив фреймов записываемого стрима перевыделяется, поэтому имя копируется
+    strcpy(free_file->file, name);
+    free_file->fd = fd;
+    free_file->refs = 1;
+    return fd;
+}
+
+static void release_file(VideoStreamBytesStream *stream, int fd) {
+    for (size_t i = 0; i < stream->files_size; i++) {
+        if (stream->files[i].file[0] != 0 && stream->files[i].fd == fd) {
+            stream->files[i].refs--;
+            return;
+        }
+    }
+}
 
-    char *filename = stream->file_paths[stream->next_file++];
-    stream->file = fopen(filename, "rb");
-    if (stream->file == NULL) {
+/**
+ * Отображает байты фрейма, как они лежат на диске, и сверяет их с контрольной суммой. data указывает на начало
+ * фрейма внутри отображения map.
+ */
+static int8_t map_stored_frame(int fd, const FrameRef *frame, void **map, size_t *map_size, const uint8_t **data,
+                               size_t *length) {
+    off_t file_len;
+    if (fd_size(fd, &file_len) != LPX_SUCCESS) {
         return LPX_IO;
     }
+    *length = frame->length > 0 ? (size_t) frame->length : (size_t) file_len;
+    // обращение к отображению за концом файла завершилось бы SIGBUS
+    if (*length == 0 || (uint64_t) file_len < frame->offset + *length) {
+        return LPX_IO;
+    }
+
+    // отображение начинается с границы страницы: фреймы в сегментах лежат по произвольным смещениям
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = frame->offset / page * page;
+    *map_size = (size_t) (frame->offset - start) + *length;
+    *map = mmap(NULL, *map_size, PROT_READ, MAP_SHARED, fd, (off_t) start);
+    if (*map == MAP_FAILED) {
+        return LPX_IO;
+    }
+    // фрейм читается один раз от начала до конца: ядро читает его целиком заранее и не держит прочитанные страницы
+    madvise(*map, *map_size, MADV_SEQUENTIAL);
+    madvise(*map, *map_size, MADV_WILLNEED);
+    *data = (const uint8_t *) *map + (frame->offset - start);
+    if (frame->verify && crc32c(0, *data, *length) != frame->crc) {
+        munmap(*map, *map_size);
+        return LPX_CORRUPT;
+    }
+    return LPX_SUCCESS;
+}
+
+int8_t stream_map_frame(int fd, const FrameRef *frame, MappedFrame *mapped) {
+    memset(mapped, 0, sizeof(MappedFrame));
+    void *map;
+    size_t map_size;
+    const uint8_t *data;
+    size_t length;
+    int8_t res = map_stored_frame(fd, frame, &map, &map_size, &data, &length);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+
+    if (!frame->compressed) {
+        mapped->map = map;
+        mapped->map_size = map_size;
+        mapped->data = data;
+        mapped->size = length;
+        return LPX_SUCCESS;
+    }
+
+    // сжатый фрейм распаковывается прямо из отображения
+    size_t raw_size;
+    if (cdc_raw_size(data, length, &raw_size) != LPX_SUCCESS) {
+        res = LPX_IO;
+        goto unmap;
+    }
+    mapped->decoded = xmalloc(raw_size);
+    if (cdc_decode(data, length, mapped->decoded) != LPX_SUCCESS) {
+        free(mapped->decoded);
+        mapped->decoded = NULL;
+        res = LPX_IO;
+        goto unmap;
+    }
+    mapped->data = mapped->decoded;
+    mapped->size = raw_size;
+
+    unmap:
+    munmap(map, map_size);
+
+    return res;
+}
+
+void stream_unmap_frame(MappedFrame *mapped) {
+    if (mapped->map != NULL) {
+        munmap(mapped->map, mapped->map_size);
+    }
+    free(mapped->decoded);
+    memset(mapped, 0, sizeof(MappedFrame));
+}
+
+/**
+ * Фрейм пакетного чтения: ссылка на фрейм и его позиция в запросе
+ */
+typedef struct BatchFrame {
+    const FrameRef *ref;
+    size_t idx;
+} BatchFrame;
+
+static int compare_location(const void *a, const void *b) {
+    const FrameRef *l = ((const BatchFrame *) a)->ref;
+    const FrameRef *r = ((const BatchFrame *) b)->ref;
+    // имена файлов отличаются только номером в конце, более короткое имя - меньший номер
+    size_t l_len = strlen(l->file);
+    size_t r_len = strlen(r->file);
+    if (l_len != r_len) {
+        return l_len < r_len ? -1 : 1;
+    }
+    int cmp = strcmp(l->file, r->file);
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (l->offset != r->offset) {
+        return l->offset < r->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Упорядочивает фреймы по расположению на диске: по номеру файла, а в файле - по смещению
+ */
+static BatchFrame *physical_order(const FrameRef *frames, size_t frames_size) {
+    BatchFrame *batch = xcalloc(frames_size > 0 ? frames_size : 1, sizeof(BatchFrame));
+    for (size_t i = 0; i < frames_size; i++) {
+        batch[i].ref = &frames[i];
+        batch[i].idx = i;
+    }
+    qsort(batch, frames_size, sizeof(BatchFrame), compare_location);
+    return batch;
+}
+
+void stream_advise_frames(int dir_fd, const FrameRef *frames, size_t frames_size) {
+    BatchFrame *batch = physical_order(frames, frames_size);
+    int fd = -1;
+    for (size_t i = 0; i < frames_size; i++) {
+        const FrameRef *frame = batch[i].ref;
+        // фреймы одного файла идут подряд, каждый файл открывается один раз
+        if (i == 0 || strcmp(frame->file, batch[i - 1].ref->file) != 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            fd = openat(dir_fd, frame->file, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd != -1) {
+            posix_fadvise(fd, (off_t) frame->offset, (off_t) frame->length, POSIX_FADV_WILLNEED);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(batch);
+}
+
+int8_t stream_map_frames(int dir_fd, const FrameRef *frames, size_t frames_size, MappedFrame *mapped) {
+    memset(mapped, 0, frames_size * sizeof(MappedFrame));
+    // сначала ядро получает запросы на чтение всех фреймов разом и может объединить их в одну серию чтений
+    stream_advise_frames(dir_fd, frames, frames_size);
+
+    int8_t res = LPX_SUCCESS;
+    BatchFrame *batch = physical_order(frames, frames_size);
+    int fd = -1;
+    for (size_t i = 0; i < frames_size && res == LPX_SUCCESS; i++) {
+        const FrameRef *frame = batch[i].ref;
+        if (i == 0 || strcmp(frame->file, batch[i - 1].ref->file) != 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            fd = openat(dir_fd, frame->file, O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                res = LPX_IO;
+                break;
+            }
+        }
+        res = stream_map_frame(fd, frame, &mapped[batch[i].idx]);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(batch);
+
+    if (res != LPX_SUCCESS) {
+        for (size_t i = 0; i < frames_size; i++) {
+            stream_unmap_frame(&mapped[i]);
+        }
+    }
+
+    return res;
+}
 
-    *next_file_name = filename;
+int8_t stream_verify_frames(int dir_fd, const FrameRef *frames, size_t frames_size, size_t *corrupted) {
+    int8_t res = LPX_SUCCESS;
+    BatchFrame *batch = physical_order(frames, frames_size);
+    int fd = -1;
+    const char *fd_file = NULL;
+    for (size_t i = 0; i < frames_size && res == LPX_SUCCESS; i++) {
+        const FrameRef *frame = batch[i].ref;
+        if (!frame->verify) {
+            continue;
+        }
+        if (fd_file == NULL || strcmp(frame->file, fd_file) != 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            fd = openat(dir_fd, frame->file, O_RDONLY | O_CLOEXEC);
+            fd_file = frame->file;
+            if (fd == -1) {
+                res = LPX_IO;
+                break;
+            }
+        }
+        void *map;
+        size_t map_size;
+        const uint8_t *data;
+        size_t length;
+        res = map_stored_frame(fd, frame, &map, &map_size, &data, &length);
+        if (res == LPX_SUCCESS) {
+            munmap(map, map_size);
+        } else if (res == LPX_CORRUPT) {
+            *corrupted = batch[i].idx;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(batch);
 
     return res;
 }
 
+/**
+ * Просит ядро заранее прочитать в page cache фреймы, следующие за текущим, пока их не наберётся read_ahead
+ */
+static void prefetch_frames(VideoStreamBytesStream *stream) {
+    if (stream->next_prefetch <= stream->next_frame) {
+        stream->next_prefetch = stream->next_frame + 1;
+    }
+    while (stream->next_prefetch < stream->frames_size &&
+           stream->next_prefetch - stream->next_frame <= stream->read_ahead) {
+        FrameRef *frame = &stream->frames[stream->next_prefetch++];
+        int fd = acquire_file(stream, frame->file);
+        if (fd != -1) {
+            // нулевая длина - фрейм занимает файл до конца
+            posix_fadvise(fd, (off_t) frame->offset, (off_t) frame->length, POSIX_FADV_WILLNEED);
+            release_file(stream, fd);
+        }
+    }
+}
+
+/**
+ * Запрашивает у источника новые фреймы записываемого стрима. Если их нет и wait, дожидается их. Возвращает EOF, если
+ * запись стрима закончена или новые фреймы не появлялись idle_ms, и FRAMES_PENDING, если фреймов нет, а ждать нельзя.
+ */
+static int8_t follow_frames(VideoStreamBytesStream *stream, bool wait) {
+    uint64_t start = monotonic_us();
+    while (true) {
+        int8_t res = stream->tail.next(stream->tail.ctx, &stream->frames, &stream->frames_size, &stream->sealed);
+        if (res != LPX_SUCCESS) {
+            return res;
+        }
+        if (stream->next_frame < stream->frames_size) {
+            return LPX_SUCCESS;
+        }
+        if (stream->sealed) {
+            return EOF;
+        }
+        if (!wait) {
+            return FRAMES_PENDING;
+        }
+        uint64_t waited_ms = (monotonic_us() - start) / 1000;
+        if (waited_ms >= stream->idle_ms) {
+            return EOF;
+        }
+        uint64_t timeout_ms = stream->idle_ms - waited_ms < FOLLOW_POLL_MS ? stream->idle_ms - waited_ms
+                                                                           : FOLLOW_POLL_MS;
+        struct pollfd pfd = {.fd = stream->tail.wake_fd, .events = POLLIN};
+        poll(&pfd, 1, (int) timeout_ms);
+    }
+}
+
+/**
+ * Учитывает задержку выдачи фрейма: время от его получения камерой до передачи его первых байт
+ */
+static void account_latency(VideoStreamBytesStream *stream, const FrameRef *frame) {
+    if (frame->end_time == 0) {
+        return;
+    }
+    int64_t latency = realtime_us() - frame->end_time;
+    uint64_t latency_us = latency > 0 ? (uint64_t) latency : 0;
+    stream->latency_frames++;
+    stream->latency_sum_us += latency_us;
+    if (latency_us > stream->latency_max_us) {
+        stream->latency_max_us = latency_us;
+    }
+}
+
+/**
+ * Отображает следующий фрейм архива в raw. Поток записываемого стрима ждёт новых фреймов, только если wait.
+ */
+static int8_t read_next_frame(VideoStreamBytesStream *stream, bool wait, FrameRef **next_frame) {
+    if (stream->next_frame == stream->frames_size && !stream->following) {
+        return EOF;
+    }
+    if (stream->next_frame == stream->frames_size) {
+        int8_t res = follow_frames(stream, wait);
+        if (res != LPX_SUCCESS) {
+            return res;
+        }
+    }
+
+    FrameRef *frame = &stream->frames[stream->next_frame];
+    int fd = acquire_file(stream, frame->file);
+    if (fd == -1) {
+        return LPX_IO;
+    }
+    // отображение остаётся действительным и после закрытия файла
+    int8_t res = stream_map_frame(fd, frame, &stream->raw);
+    release_file(stream, fd);
+    if (res == LPX_CORRUPT) {
+        fprintf(stderr, "Frame %s checksum mismatch\n", frame->name);
+    }
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+    prefetch_frames(stream);
+    stream->next_frame++;
+
+    *next_frame = frame;
+
+    return LPX_SUCCESS;
+}
+
 /**
  * Возвращает LPX_SUCCESS, если данные были успешно записаны в пайп, EOF, если стрим закончился, LPX_IO, если случилась
- * ошибка ввода-вывода. Количество прочитанных байт записывается в read.
+ * ошибка ввода-вывода, FRAMES_PENDING, если записываемый стрим ещё не получил следующий фрейм, а wait не задан.
+ * Количество прочитанных байт записывается в read.
  */
-static int8_t read_part(VideoStreamBytesStream *stream, uint8_t *buf, size_t size, size_t *read) {
+static int8_t read_part(VideoStreamBytesStream *stream, uint8_t *buf, size_t size, bool wait, size_t *read) {
     *read = 0;
 
     if (stream->header_read == false) {
-        uint32_t fsize = (uint32_t) stream->files_size;
+        uint32_t fsize = stream->following ? STRM_FOLLOW_FRAMES : (uint32_t) stream->frames_size;
         size_t files_cnt_size = sizeof(uint32_t);
         memcpy(buf, &fsize, files_cnt_size);
         size -= files_cnt_size;
@@ -140,39 +578,26 @@ static int8_t read_part(VideoStreamBytesStream *stream, uint8_t *buf, size_t siz
     }
 
     int8_t res = LPX_SUCCESS;
-    if (stream->file == NULL) {
-        char *next_file_path;
-        res = open_next_file(stream, &next_file_path);
+    if (!stream->in_frame) {
+        FrameRef *next_frame;
+        // заголовок потока отдаётся сразу, не дожидаясь первого фрейма
+        res = read_next_frame(stream, wait && *read == 0, &next_frame);
         if (res != LPX_SUCCESS) {
             return res;
         }
+        stream->in_frame = true;
 
-        char *file_name = basename(next_file_path);
-        size_t name_size = strlen(file_name) + 1;
-        memcpy(buf, file_name, name_size);
+        size_t name_size = strlen(next_frame->name) + 1;
+        memcpy(buf, next_frame->name, name_size);
         size -= name_size;
         buf += name_size;
         *read += name_size;
 
-        struct stat st;
-        int r = stat(next_file_path, &st);
-        if (r != 0) {
-            return LPX_IO;
-        }
-
-        size_t raw_buf_size = (size_t) st.st_size;
-        stream->raw_buf = xmalloc(raw_buf_size);
-
-        size_t raw_read = fread(stream->raw_buf, sizeof(uint8_t), raw_buf_size, stream->file);
-        if (raw_read < raw_buf_size) {
-            return LPX_IO;
-        }
-        
         size_t bmp_size;
-        if (raw12_to_bmp(stream->raw_buf, 1280, 800, &stream->bmp_start, &bmp_size)) {
+        if (frame_to_bmp(&stream->format, stream->raw.data, stream->raw.size, &stream->bmp_start, &bmp_size)) {
             return LPX_IO;
         }
-        free(stream->raw_buf);
+        stream_unmap_frame(&stream->raw);
         stream->bmp = stream->bmp_start;
         stream->bmp_eof = stream->bmp + sizeof(uint8_t) * bmp_size;
 
@@ -183,13 +608,14 @@ static int8_t read_part(VideoStreamBytesStream *stream, uint8_t *buf, size_t siz
         size -= fsize_size;
         buf += fsize_size;
         *read += fsize_size;
+        account_latency(stream, next_frame);
     }
 
     size_t to_cpy = size < stream->bmp_eof - stream->bmp ? size : stream->bmp_eof - stream->bmp;
     memcpy(buf, stream->bmp, to_cpy);
     stream->bmp += to_cpy;
     if (to_cpy < size) {
-        close_current_file(stream);
+        close_current_frame(stream);
     }
 
     *read += to_cpy;
@@ -201,19 +627,22 @@ ssize_t stream_read(VideoStreamBytesStream *stream, uint8_t *buf, size_t max) {
     size_t available = max;
     while (available > 0) {
         size_t read = 0;
-        int8_t res = read_part(stream, buf, available, &read);
+        // записываемый стрим ждёт новых фреймов, только если отдать пока нечего
+        int8_t res = read_part(stream, buf, available, available == max, &read);
         available -= read;
         assert(available >= 0);
         if (res == LPX_SUCCESS) {
             buf += read;
             continue;
+        } else if (res == FRAMES_PENDING) {
+            break;
         } else if (res == EOF) {
             if (max == available) {
                 return EOF;
             } else {
                 break;
             }
-        } else if (res == LPX_IO) {
+        } else if (res == LPX_IO || res == LPX_CORRUPT) {
             return STRM_IO;
         }
     }
@@ -221,19 +650,21 @@ ssize_t stream_read(VideoStreamBytesStream *stream, uint8_t *buf, size_t max) {
 }
 
 void stream_close(VideoStreamBytesStream *stream) {
-    if (stream->raw_buf) {
-        free(stream->raw_buf);
-    }
+    stream_unmap_frame(&stream->raw);
     if (stream->bmp_start) {
         free(stream->bmp_start);
     }
-    if (stream->file) {
-        fclose(stream->file);
+    for (size_t i = 0; i < stream->files_size; i++) {
+        if (stream->files[i].file[0] != 0) {
+            close(stream->files[i].fd);
+        }
     }
-    for (int i = 0; i < stream->files_size; i++) {
-        free(stream->file_paths[i]);
+    free(stream->files);
+    if (stream->following) {
+        stream->tail.free(stream->tail.ctx);
     }
-    free(stream->file_paths);
+    close(stream->dir_fd);
+    free(stream->frames);
     free(stream);
 }
 
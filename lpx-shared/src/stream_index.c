@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/stream_index.h"
+#include "../include/stream_storage.h"
+#include "../include/lpxstd.h"
+
+// формат записи в устаревшем текстовом индексе потока
+#define FRAME_FORMAT "%" PRId64 ",%" PRId64 "\n"
+
+typedef struct StreamIndex {
+    const FrameMeta *frames;
+    size_t frames_cnt;
+
+    /**
+     * Отображение index.bin в память, NULL для индекса, прочитанного из index.csv
+     */
+    void *map;
+    size_t map_size;
+    bool sealed;
+    bool approximate;
+    size_t dropped_cnt;
+
+    /**
+     * Массив записей, разобранный из index.csv, NULL для отображённого index.bin
+     */
+    FrameMeta *parsed;
+} StreamIndex;
+
+/**
+ * Количество нулевых записей - пропущенных фреймов
+ */
+static size_t sidx_count_dropped(const FrameMeta *frames, size_t frames_cnt) {
+    size_t dropped = 0;
+    for (size_t i = 0; i < frames_cnt; i++) {
+        if (frames[i].start_time == 0) {
+            dropped++;
+        }
+    }
+    return dropped;
+}
+
+/**
+ * Отображает в память index.bin, открытый как fd
+ */
+static int8_t sidx_map_bin(int fd, StreamIndex *index) {
+    off_t size;
+    if (fd_size(fd, &size) != LPX_SUCCESS) {
+        return LPX_IO;
+    }
+    if (size < sizeof(StreamIndexHeader)) {
+        return STRG_BAD_INDEX;
+    }
+
+    void *map = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return LPX_IO;
+    }
+
+    const StreamIndexHeader *header = map;
+    size_t records_cnt = (size - sizeof(StreamIndexHeader)) / sizeof(FrameMeta);
+    bool sealed = (header->flags & SIDX_FLAG_OPEN) == 0;
+    if (memcmp(header->magic, SIDX_MAGIC, sizeof(header->magic)) != 0 || header->version != SIDX_VERSION ||
+        header->record_size != sizeof(FrameMeta) || (sealed && header->frames_cnt > records_cnt)) {
+        munmap(map, (size_t) size);
+        return STRG_BAD_INDEX;
+    }
+
+    index->map = map;
+    index->map_size = (size_t) size;
+    index->frames = (const FrameMeta *) ((uint8_t *) map + sizeof(StreamIndexHeader));
+    index->sealed = sealed;
+    index->approximate = (header->flags & SIDX_FLAG_APPROXIMATE) != 0;
+    if (sealed) {
+        index->frames_cnt = header->frames_cnt;
+    } else {
+        // недописанная последняя запись отбрасывается, как и записи в конце файла, место под которые выделено
+        // записью следующих фреймов, но ещё не заполнено
+        while (records_cnt > 0 && index->frames[records_cnt - 1].start_time == 0) {
+            records_cnt--;
+        }
+        index->frames_cnt = records_cnt;
+    }
+    if (sealed && (header->flags & SIDX_FLAG_DROPPED) != 0) {
+        index->dropped_cnt = header->dropped_cnt;
+    } else {
+        index->dropped_cnt = sidx_count_dropped(index->frames, index->frames_cnt);
+    }
+
+    return LPX_SUCCESS;
+}
+
+/**
+ * Разбирает index.csv, открытый как fd. Дескриптор закрывается.
+ */
+static int8_t sidx_parse_csv(int fd, StreamIndex *index) {
+    int8_t res = LPX_SUCCESS;
+
+    FILE *idx_f = fdopen(fd, "r");
+    if (idx_f == NULL) {
+        close(fd);
+        return LPX_IO;
+    }
+
+    size_t capacity = 64;
+    size_t frames_cnt = 0;
+    FrameMeta *frames = xcalloc(capacity, sizeof(FrameMeta));
+
+    char buf[256];
+    while (fgets(buf, sizeof(buf), idx_f) != NULL) {
+        if (frames_cnt == capacity) {
+            capacity *= 2;
+            frames = xrealloc(frames, capacity * sizeof(FrameMeta));
+        }
+        FrameMeta *frame = &frames[frames_cnt];
+        int r = sscanf(buf, FRAME_FORMAT, &frame->start_time, &frame->end_time);
+        if (r == EOF || r != 2) {
+            res = STRG_BAD_INDEX;
+            goto free_frames;
+        }
+        frames_cnt++;
+    }
+    if (ferror(idx_f)) {
+        res = LPX_IO;
+        goto free_frames;
+    }
+
+    index->parsed = frames;
+    index->frames = frames;
+    index->frames_cnt = frames_cnt;
+    index->dropped_cnt = sidx_count_dropped(frames, frames_cnt);
+    index->sealed = true;
+    fclose(idx_f);
+
+    return res;
+
+    free_frames:
+    free(frames);
+    fclose(idx_f);
+
+    return res;
+}
+
+int8_t sidx_open(int dir_fd, StreamIndex **index) {
+    int8_t res = LPX_SUCCESS;
+
+    StreamIndex *idx = xcalloc(1, sizeof(StreamIndex));
+
+    int fd = openat(dir_fd, SIDX_FILE, O_RDONLY);
+    if (fd != -1) {
+        res = sidx_map_bin(fd, idx);
+        close(fd);
+    } else if (errno == ENOENT && (fd = openat(dir_fd, SIDX_CSV_FILE, O_RDONLY)) != -1) {
+        res = sidx_parse_csv(fd, idx);
+    } else {
+        res = errno == ENOENT ? STRG_NOT_FOUND : LPX_IO;
+    }
+
+    if (res == LPX_SUCCESS) {
+        *index = idx;
+    } else {
+        free(idx);
+    }
+
+    return res;
+}
+
+size_t sidx_size(const StreamIndex *index) {
+    return index->frames_cnt;
+}
+
+bool sidx_sealed(const StreamIndex *index) {
+    return index->sealed;
+}
+
+bool sidx_approximate(const StreamIndex *index) {
+    return index->approximate;
+}
+
+size_t sidx_dropped(const StreamIndex *index) {
+    return index->dropped_cnt;
+}
+
+const FrameMeta *sidx_frames(const StreamIndex *index) {
+    return index->frames;
+}
+
+const FrameMeta *sidx_frame(const StreamIndex *index, size_t idx) {
+    if (idx >= index->frames_cnt) {
+        return NULL;
+    }
+    return &index->frames[idx];
+}
+
+void sidx_close(StreamIndex *index) {
+    if (index->map) {
+        munmap(index->map, index->map_size);
+    }
+    free(index->parsed);
+    free(index);
+}
+
+int8_t sidx_write(int dir_fd, const FrameMeta *frames, size_t frames_cnt, uint32_t flags) {
+    int8_t res = LPX_SUCCESS;
+
+    int fd = openat(dir_fd, SIDX_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    FILE *idx_f = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (idx_f == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return LPX_IO;
+    }
+
+    StreamIndexHeader header = {
+            .magic = SIDX_MAGIC,
+            .version = SIDX_VERSION,
+            .record_size = sizeof(FrameMeta),
+            .flags = (flags & ~SIDX_FLAG_OPEN) | SIDX_FLAG_DROPPED,
+            .frames_cnt = frames_cnt,
+            .dropped_cnt = sidx_count_dropped(frames, frames_cnt)
+    };
+    if (fwrite(&header, sizeof(header), 1, idx_f) != 1 ||
+        (frames_cnt > 0 && fwrite(frames, sizeof(FrameMeta), frames_cnt, idx_f) != frames_cnt)) {
+        res = LPX_IO;
+    }
+
+    if (fclose(idx_f) != 0) {
+        res = LPX_IO;
+    }
+    if (res == LPX_SUCCESS && renameat(dir_fd, SIDX_FILE ".tmp", dir_fd, SIDX_FILE) != 0) {
+        res = LPX_IO;
+    }
+    if (res != LPX_SUCCESS) {
+        unlinkat(dir_fd, SIDX_FILE ".tmp", 0);
+    }
+
+    return res;
+}
+
+int8_t sidx_convert(int dir_fd) {
+    if (faccessat(dir_fd, SIDX_FILE, F_OK, 0) == 0) {
+        return LPX_SUCCESS;
+    }
+    int fd = openat(dir_fd, SIDX_CSV_FILE, O_RDONLY);
+    if (fd == -1) {
+        return errno == ENOENT ? LPX_SUCCESS : LPX_IO;
+    }
+
+    StreamIndex index = {0};
+    int8_t res = sidx_parse_csv(fd, &index);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+
+    res = sidx_write(dir_fd, index.frames, index.frames_cnt, 0);
+    free(index.parsed);
+    if (res == LPX_SUCCESS && unlinkat(dir_fd, SIDX_CSV_FILE, 0) != 0) {
+        res = LPX_IO;
+    }
+
+    return res;
+}
+
+typedef struct IndexWriter {
+    int fd;
+    uint64_t frames_cnt; // индекс последнего записанного фрейма + 1
+} IndexWriter;
+
+int8_t sidxw_open(int dir_fd, IndexWriter **writer) {
+    int8_t res = LPX_SUCCESS;
+
+    int fd = openat(dir_fd, SIDX_FILE, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        return LPX_IO;
+    }
+
+    off_t size;
+    if (fd_size(fd, &size) != LPX_SUCCESS) {
+        res = LPX_IO;
+        goto error;
+    }
+
+    StreamIndexHeader header;
+    if (size == 0) {
+        header = (StreamIndexHeader) {
+                .magic = SIDX_MAGIC,
+                .version = SIDX_VERSION,
+                .record_size = sizeof(FrameMeta),
+                .flags = SIDX_FLAG_OPEN
+        };
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            res = LPX_IO;
+            goto error;
+        }
+        size = sizeof(header);
+    } else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+               memcmp(header.magic, SIDX_MAGIC, sizeof(header.magic)) != 0 || header.version != SIDX_VERSION ||
+               header.record_size != sizeof(FrameMeta)) {
+        res = STRG_BAD_INDEX;
+        goto error;
+    } else if ((header.flags & SIDX_FLAG_OPEN) == 0) {
+        res = STRG_EXISTS;
+        goto error;
+    }
+
+    IndexWriter *w = xcalloc(1, sizeof(IndexWriter));
+    w->fd = fd;
+    w->frames_cnt = (size - sizeof(StreamIndexHeader)) / sizeof(FrameMeta);
+    *writer = w;
+
+    return res;
+
+    error:
+    close(fd);
+
+    return res;
+}
+
+int8_t sidxw_append(IndexWriter *writer, uint32_t frame_idx, const FrameMeta *frame, bool *filled) {
+    off_t offset = sizeof(StreamIndexHeader) + (off_t) frame_idx * sizeof(FrameMeta);
+    if (filled != NULL) {
+        // запись за концом индекса всегда новая, а внутри индекса читается только при записи не по порядку
+        FrameMeta prev;
+        *filled = frame_idx >= __atomic_load_n(&writer->frames_cnt, __ATOMIC_RELAXED) ||
+                  pread(writer->fd, &prev, sizeof(prev), offset) != sizeof(prev) || prev.start_time == 0;
+    }
+    if (pwrite(writer->fd, frame, sizeof(FrameMeta), offset) != sizeof(FrameMeta)) {
+        return LPX_IO;
+    }
+    // фреймы могут дописываться несколькими потоками
+    uint64_t frames_cnt = (uint64_t) frame_idx + 1;
+    uint64_t cur = __atomic_load_n(&writer->frames_cnt, __ATOMIC_RELAXED);
+    while (cur < frames_cnt &&
+           !__atomic_compare_exchange_n(&writer->frames_cnt, &cur, frames_cnt, false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+    return LPX_SUCCESS;
+}
+
+int8_t sidxw_commit(IndexWriter *writer) {
+    return fdatasync(writer->fd) == 0 ? LPX_SUCCESS : LPX_IO;
+}
+
+int sidxw_dup_fd(IndexWriter *writer) {
+    return fcntl(writer->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/**
+ * Считает пропущенные фреймы дописываемого индекса, читая его записи
+ */
+static int8_t sidxw_count_dropped(IndexWriter *writer, uint64_t *dropped) {
+    FrameMeta frames[1024];
+    *dropped = 0;
+    for (uint64_t i = 0; i < writer->frames_cnt; i += ALEN(frames)) {
+        size_t cnt = writer->frames_cnt - i < ALEN(frames) ? writer->frames_cnt - i : ALEN(frames);
+        off_t offset = sizeof(StreamIndexHeader) + (off_t) i * sizeof(FrameMeta);
+        ssize_t r = pread(writer->fd, frames, cnt * sizeof(FrameMeta), offset);
+        if (r < 0) {
+            return LPX_IO;
+        }
+        // хвост, под который место не выделено, - пропущенные фреймы
+        size_t read_cnt = (size_t) r / sizeof(FrameMeta);
+        *dropped += sidx_count_dropped(frames, read_cnt) + cnt - read_cnt;
+    }
+    return LPX_SUCCESS;
+}
+
+int8_t sidxw_seal(IndexWriter *writer) {
+    int8_t res = LPX_SUCCESS;
+
+    StreamIndexHeader header = {
+            .magic = SIDX_MAGIC,
+            .version = SIDX_VERSION,
+            .record_size = sizeof(FrameMeta),
+            .frames_cnt = writer->frames_cnt
+    };
+    if (sidxw_count_dropped(writer, &header.dropped_cnt) == LPX_SUCCESS) {
+        header.flags |= SIDX_FLAG_DROPPED;
+    }
+    // записи должны попасть на диск раньше заголовка, который на них ссылается
+    if (fdatasync(writer->fd) != 0 || pwrite(writer->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        fdatasync(writer->fd) != 0) {
+        res = LPX_IO;
+    }
+
+    if (sidxw_close(writer) != LPX_SUCCESS) {
+        res = LPX_IO;
+    }
+
+    return res;
+}
+
+int8_t sidxw_close(IndexWriter *writer) {
+    int8_t res = close(writer->fd) == 0 ? LPX_SUCCESS : LPX_IO;
+    free(writer);
+    return res;
+}
@@ -1,432 +1,2529 @@
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <assert.h>
 #include "../include/stream_storage.h"
+#include "../include/catalog.h"
+#include "../include/segment.h"
+#include "../include/io_engine.h"
+#include "../include/recovery.h"
+#include "../include/evictor.h"
+#include "../include/codec.h"
+#include "../include/crc32c.h"
+#include "../include/manifest.h"
+#include "../include/trash.h"
+#include "../include/scrubber.h"
+#include "../include/ram_tier.h"
+#include "../include/syncer.h"
+#include "../include/stats.h"
 #include "../include/lpxstd.h"
 
-// формат записи в файле индекса потока
-#define FRAME_FORMAT "%" PRId64 ",%" PRId64 "\n"
+// Период, в течение которого mtime базовой директории не считается надёжным признаком отсутствия изменений: в пределах
+// одного тика часов файловой системы директорию мог изменить другой процесс
+#define CATALOG_MTIME_SLACK_SEC 2
+
+// Файл контрольной точки каталога в базовой директории
+#define CATALOG_CHECKPOINT_FILE "catalog.ckpt"
+
+// Файл-признак раскладки стримов по директориям суток в базовой директории
+#define DAY_BUCKETS_FILE ".day_buckets"
+// Директория суток называется датой UTC начала стрима: YYYY-MM-DD
+#define BUCKET_NAME_SIZE sizeof("1970-01-01")
+// Путь к директории стрима относительно базовой директории: [<директория суток>/]<идентификатор стрима>
+#define TRAIN_PATH_SIZE (BUCKET_NAME_SIZE + MAX_INT_LEN + 1)
+#define MS_IN_DAY 86400000
+
+// ~12 МБ фреймов 1280x800 в очереди отложенной записи
+#define DEFAULT_WRITE_QUEUE_DEPTH 8
+#define DEFAULT_WRITE_THREADS     1
+#define DEFAULT_WRITE_BATCH       4
+#define DEFAULT_READ_AHEAD        4
+// ~1 секунда записи при 30 fps
+#define DEFAULT_INDEX_COMMIT_FRAMES 30
+#define DEFAULT_INDEX_COMMIT_MS     1000
+#define DEFAULT_RECOVERY_THREADS    4
+
+// Стрим без закрытого индекса считается брошенным, если его директория не менялась дольше этого времени. Более свежие
+// стримы могут в этот момент записываться другим процессом.
+#define RECOVERY_MIN_AGE_SEC 60
+
+// Вытеснение начинается, когда занятое место превышает EVICT_HIGH_PERCENT ёмкости, и продолжается, пока оно не
+// опустится до EVICT_LOW_PERCENT. Запас до полной ёмкости позволяет освобождать место до того, как запись упрётся в
+// ограничение, а разрыв между границами - удалять стримы пачкой, а не по одному на каждый записанный фрейм.
+#define EVICT_HIGH_PERCENT 90
+#define EVICT_LOW_PERCENT  80
+#define EVICT_PERIOD_MS    1000
+// пауза между вытеснением стримов растягивает вытеснение во времени
+#define EVICT_PAUSE_MS 200
+
+
+// Сколько поток записываемого стрима ждёт новых фреймов, прежде чем закончиться: запись могла прерваться, не
+// закрыв индекс
+#define FOLLOW_IDLE_MS 30000
+
+// Количество дескрипторов директорий стримов, которые хранилище держит открытыми
+#define TRAIN_DIRS_CACHE_SIZE 8
+
+/**
+ * Открытая директория стрима в кэше хранилища
+ */
+typedef struct TrainDir {
+    char train_id[MAX_INT_LEN + 1]; // пустая строка - элемент не занят
+    int fd;
+    size_t refs; // количество захвативших дескриптор
+    uint64_t last_used; // для вытеснения давно не использованных директорий
+    bool stale; // стрим удалён, дескриптор закрывается, когда его освободят
+} TrainDir;
+
+/**
+ * Том хранилища, на который пишутся сегменты стримов
+ */
+typedef struct StripeVolume {
+    char *path; // абсолютный путь
+    int fd; // открытая директория тома, -1 - базовая директория: сегменты создаются в директориях стримов
+    SegmentVolumeStats stats;
+} StripeVolume;
+
+/**
+ * Директория суток и её mtime в наносекундах на момент последней синхронизации её стримов с каталогом, 0 - стримы
+ * директории ещё не читались
+ */
+typedef struct TrainBucket {
+    char name[BUCKET_NAME_SIZE];
+    int64_t mtime;
+} TrainBucket;
 
 typedef struct Storage {
     char *base_dir;
+    StorageConfig config;
+
+    /**
+     * Открытая базовая директория. Все файлы хранилища открываются относительно неё и директорий стримов, без
+     * построения полных путей.
+     */
+    int base_fd;
+
+    /**
+     * Кэш открытых директорий стримов: записываемого стрима и стримов, которые недавно читали
+     */
+    TrainDir dirs[TRAIN_DIRS_CACHE_SIZE];
+    uint64_t dirs_clock;
+    pthread_mutex_t dirs_mutex;
+
+    /**
+     * Каталог временных интервалов стримов. Строится при открытии хранилища и обновляется при изменении стримов через
+     * этот экземпляр хранилища. Изменения, сделанные другим процессом (стримы пишет lpx-control, а ищет lpx-server),
+     * подхватываются при поиске по изменению mtime базовой директории и по появлению индексов у незавершённых стримов.
+     */
+    Catalog *catalog;
+
+    /**
+     * mtime базовой директории в наносекундах на момент последней синхронизации каталога
+     */
+    int64_t base_mtime;
+
+    /**
+     * Раскладка стримов по директориям суток: в базовой директории лежат только директории суток, так что поиск и
+     * удаление стрима затрагивают одну-две небольшие директории вместо одной огромной. Раскладка - свойство хранилища
+     * (файл DAY_BUCKETS_FILE), и её подхватывают все открывшие хранилище процессы. buckets - известные директории
+     * суток, buckets_listed - базовая директория уже перечитывалась.
+     */
+    bool day_buckets;
+    TrainBucket *buckets;
+    size_t buckets_cnt;
+    bool buckets_listed;
+
+    /**
+     * Защищает catalog, base_mtime и buckets: каталог меняют поток, получающий фреймы, и поток вытеснения
+     */
+    pthread_mutex_t catalog_mutex;
+
+    /**
+     * Писатель сегментов стрима, который записывается в данный момент, и идентификатор этого стрима. writer_refs -
+     * количество пачек, которые пишутся через writer в этот момент (потоков отложенной записи может быть несколько):
+     * писатель закрывается только после того, как их запись закончится, об этом сообщает writer_idle.
+     */
+    SegmentWriter *writer;
+    size_t writer_refs;
+    pthread_cond_t writer_idle;
+    char writer_train_id[MAX_INT_LEN + 1];
+    int writer_dir_fd; // директория записываемого стрима, захваченная из кэша
+    FrameFormat writer_format; // формат фреймов записываемого стрима из его манифеста
+
+    /**
+     * Формат, в котором камера отдаёт фреймы стрима source_train_id, с выравниванием строк и буфера MMAL. Фреймы
+     * этого стрима при сохранении ужимаются до пикселей изображения.
+     */
+    char source_train_id[MAX_INT_LEN + 1];
+    FrameFormat source_format;
+
+    /**
+     * Дописываемый индекс того же стрима. Открывается при записи первого фрейма с метаданными.
+     */
+    IndexWriter *index_writer;
+
+    /**
+     * Фиксация записанных фреймов (StorageConfig.durability). NULL - фреймы не фиксируются (STRG_DURABLE_NONE).
+     */
+    Syncer *syncer;
+
+    /**
+     * Очередь отложенной записи фреймов. Создаётся при сохранении первого фрейма, чтобы хранилища, из которых только
+     * читают, не держали потоки записи.
+     */
+    FrameWriter *frame_writer;
+
+    /**
+     * Защищает writer и frame_writer, которые используются потоками записи и потоком, получающим фреймы. Если нужны
+     * оба мьютекса, catalog_mutex захватывается первым.
+     */
+    pthread_mutex_t writer_mutex;
+
+    /**
+     * Ёмкость хранилища в байтах, 0 - без ограничения. Занятое место складывается из размера стримов каталога, в
+     * котором записываемый стрим заменяется на writer_bytes - размер его файлов, увеличиваемый при записи фреймов.
+     */
+    uint64_t capacity;
+    uint64_t writer_bytes;
+
+    /**
+     * Поток вытеснения старых стримов при превышении ёмкости. Запускается при открытии первого писателя.
+     * evict_wake_bytes - значение writer_bytes, при достижении которого запись будит поток вытеснения, не дожидаясь
+     * периодической проверки. evicting и evict_stalled меняет только поток вытеснения.
+     */
+    Evictor *evictor;
+    uint64_t evict_wake_bytes;
+    bool evicting;
+    bool evict_stalled;
+    uint64_t evicted_streams;
+    uint64_t evicted_bytes;
+
+    /**
+     * Корзина, в которую переносятся удаляемые стримы: стрим, удалённый storage_delete_stream, и все стримы,
+     * удалённые одним storage_clear, - по одной записи корзины
+     */
+    Trash *trash;
+
+    /**
+     * Фоновая проверка контрольных сумм. Запускается при открытии хранилища, если задан scrub_bytes_per_sec.
+     */
+    Scrubber *scrubber;
+
+    /**
+     * RAM-уровень, в который пишутся сегменты записываемого стрима. NULL - уровня нет, сегменты пишутся сразу на
+     * диск.
+     */
+    RamTier *ram;
+
+    /**
+     * Тома, по которым распределяются фреймы записываемого стрима: базовая директория и дополнительные тома
+     * (StorageConfig.volumes). Сегменты стрима на дополнительном томе лежат в <том>/<идентификатор стрима>.
+     */
+    StripeVolume *volumes;
+    size_t volumes_cnt;
+
+    /**
+     * Движок ввода-вывода потока отложенной записи. У каждого потока свой движок, он освобождается при завершении
+     * потока.
+     */
+    pthread_key_t io_engine_key;
 } Storage;
 
+/**
+ * Имя директории суток, к которым относится время time_ms
+ */
+static void bucket_name(uint64_t time_ms, char *bucket) {
+    time_t t = (time_t) (time_ms / 1000);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(bucket, BUCKET_NAME_SIZE, "%Y-%m-%d", &tm);
+}
+
+/**
+ * Директория суток стрима: идентификатор стрима - время его начала в миллисекундах
+ */
+static void train_bucket(const char *train_id, char *bucket) {
+    bucket_name(strtoull(train_id, NULL, 10), bucket);
+}
+
+static bool is_bucket_name(const char *name) {
+    if (strlen(name) != BUCKET_NAME_SIZE - 1) {
+        return false;
+    }
+    for (size_t i = 0; i < BUCKET_NAME_SIZE - 1; i++) {
+        if (i == 4 || i == 7 ? name[i] != '-' : !isdigit((unsigned char) name[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Путь к директории стрима относительно базовой директории в раскладке по суткам или без неё
+ */
+static void train_path(const char *train_id, bool day_buckets, char *path) {
+    if (day_buckets) {
+        char bucket[BUCKET_NAME_SIZE];
+        train_bucket(train_id, bucket);
+        snprintf(path, TRAIN_PATH_SIZE, "%s/%s", bucket, train_id);
+    } else {
+        snprintf(path, TRAIN_PATH_SIZE, "%s", train_id);
+    }
+}
+
+static bool storage_day_buckets(Storage *storage) {
+    return __atomic_load_n(&storage->day_buckets, __ATOMIC_RELAXED);
+}
+
+/**
+ * Путь к директории стрима в текущей раскладке хранилища
+ */
+static void storage_train_path(Storage *storage, const char *train_id, char *path) {
+    train_path(train_id, storage_day_buckets(storage), path);
+}
+
+/**
+ * Возвращает дескриптор директории стрима, открывая её при необходимости. Дескриптор нужно освободить
+ * storage_release_dir. Возвращает STRG_NOT_FOUND, если стрима нет.
+ */
+static int8_t storage_acquire_dir(Storage *storage, const char *train_id, int *fd) {
+    int8_t res = LPX_SUCCESS;
+
+    int r = pthread_mutex_lock(&storage->dirs_mutex);
+    assert(r == 0 && "Could not lock storage dirs mutex");
+    TrainDir *victim = NULL;
+    for (size_t i = 0; i < TRAIN_DIRS_CACHE_SIZE; i++) {
+        TrainDir *dir = &storage->dirs[i];
+        if (dir->train_id[0] != 0 && !dir->stale && strcmp(dir->train_id, train_id) == 0) {
+            dir->refs++;
+            dir->last_used = ++storage->dirs_clock;
+            *fd = dir->fd;
+            goto unlock;
+        }
+        if (dir->train_id[0] == 0) {
+            if (victim == NULL || victim->train_id[0] != 0) {
+                victim = dir;
+            }
+        } else if (dir->refs == 0 &&
+                   (victim == NULL || (victim->train_id[0] != 0 && dir->last_used < victim->last_used))) {
+            victim = dir;
+        }
+    }
+
+    char path[TRAIN_PATH_SIZE];
+    bool day_buckets = storage_day_buckets(storage);
+    train_path(train_id, day_buckets, path);
+    *fd = openat(storage->base_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (*fd == -1 && errno == ENOENT) {
+        // стрим ещё не перенесён в директорию суток или раскладку только что сменил другой процесс
+        train_path(train_id, !day_buckets, path);
+        *fd = openat(storage->base_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (*fd == -1) {
+        res = errno == ENOENT || errno == ENOTDIR ? STRG_NOT_FOUND : LPX_IO;
+        goto unlock;
+    }
+    // если все директории кэша заняты, дескриптор не кэшируется и закрывается при освобождении
+    if (victim != NULL) {
+        if (victim->train_id[0] != 0) {
+            close(victim->fd);
+        }
+        strncpy(victim->train_id, train_id, MAX_INT_LEN);
+        victim->fd = *fd;
+        victim->refs = 1;
+        victim->last_used = ++storage->dirs_clock;
+        victim->stale = false;
+    }
+
+    unlock:
+    r = pthread_mutex_unlock(&storage->dirs_mutex);
+    assert(r == 0 && "Could not unlock storage dirs mutex");
+
+    return res;
+}
+
+static void storage_release_dir(Storage *storage, int fd) {
+    int r = pthread_mutex_lock(&storage->dirs_mutex);
+    assert(r == 0 && "Could not lock storage dirs mutex");
+    bool cached = false;
+    for (size_t i = 0; i < TRAIN_DIRS_CACHE_SIZE && !cached; i++) {
+        TrainDir *dir = &storage->dirs[i];
+        if (dir->train_id[0] != 0 && dir->fd == fd) {
+            cached = true;
+            dir->refs--;
+            if (dir->stale && dir->refs == 0) {
+                close(dir->fd);
+                dir->train_id[0] = 0;
+            }
+        }
+    }
+    if (!cached) {
+        close(fd);
+    }
+    r = pthread_mutex_unlock(&storage->dirs_mutex);
+    assert(r == 0 && "Could not unlock storage dirs mutex");
+}
+
+/**
+ * Убирает директорию удалённого стрима из кэша: она переименована, и стрим с тем же идентификатором открывается
+ * заново
+ */
+static void storage_forget_dir(Storage *storage, const char *train_id) {
+    int r = pthread_mutex_lock(&storage->dirs_mutex);
+    assert(r == 0 && "Could not lock storage dirs mutex");
+    for (size_t i = 0; i < TRAIN_DIRS_CACHE_SIZE; i++) {
+        TrainDir *dir = &storage->dirs[i];
+        if (dir->train_id[0] != 0 && !dir->stale && strcmp(dir->train_id, train_id) == 0) {
+            if (dir->refs == 0) {
+                close(dir->fd);
+                dir->train_id[0] = 0;
+            } else {
+                dir->stale = true;
+            }
+        }
+    }
+    r = pthread_mutex_unlock(&storage->dirs_mutex);
+    assert(r == 0 && "Could not unlock storage dirs mutex");
+}
+
+static void lock_writer(Storage *storage) {
+    int r = pthread_mutex_lock(&storage->writer_mutex);
+    assert(r == 0 && "Could not lock storage writer mutex");
+}
+
+static void unlock_writer(Storage *storage) {
+    int r = pthread_mutex_unlock(&storage->writer_mutex);
+    assert(r == 0 && "Could not unlock storage writer mutex");
+}
+
+static void lock_catalog(Storage *storage) {
+    int r = pthread_mutex_lock(&storage->catalog_mutex);
+    assert(r == 0 && "Could not lock storage catalog mutex");
+}
+
+static void unlock_catalog(Storage *storage) {
+    int r = pthread_mutex_unlock(&storage->catalog_mutex);
+    assert(r == 0 && "Could not unlock storage catalog mutex");
+}
+
+/**
+ * Добавляет стрим в каталог, читая границы его интервала из индекса. Стрим без индекса добавляется как незавершённый.
+ * Вызывается под catalog_mutex.
+ */
+static void storage_catalog_add(Storage *storage, const char *train_id) {
+    int td;
+    if (storage_acquire_dir(storage, train_id, &td) != LPX_SUCCESS) {
+        ctlg_put_pending(storage->catalog, train_id);
+        return;
+    }
+    struct stat st;
+    StreamIndex *index;
+    if (fstat(td, &st) == 0 && sidx_open(td, &index) == LPX_SUCCESS) {
+        size_t size = sidx_size(index);
+        if (size > 0) {
+            CatalogEntry entry = {0};
+            strncpy(entry.train_id, train_id, MAX_INT_LEN);
+            entry.indexed = true;
+            entry.open = !sidx_sealed(index);
+            entry.approximate = sidx_approximate(index);
+            entry.start_time = sidx_frame(index, 0)->start_time;
+            entry.end_time = sidx_frame(index, size - 1)->end_time;
+            entry.frames_cnt = size;
+            entry.dropped_frames = sidx_dropped(index);
+            entry.bytes = tree_bytes(td, ".");
+            entry.dir_mtime = ts2ns(st.st_mtim);
+            ctlg_put(storage->catalog, &entry);
+        } else {
+            ctlg_put_pending(storage->catalog, train_id);
+        }
+        sidx_close(index);
+    } else {
+        ctlg_put_pending(storage->catalog, train_id);
+    }
+    storage_release_dir(storage, td);
+}
+
+/**
+ * Проверяет, что директория стрима не менялась с момента чтения стрима в каталог
+ */
+static bool storage_catalog_fresh(Storage *storage, const CatalogEntry *entry) {
+    char path[TRAIN_PATH_SIZE];
+    storage_train_path(storage, entry->train_id, path);
+    struct stat st;
+    return fstatat(storage->base_fd, path, &st, 0) == 0 && ts2ns(st.st_mtim) == entry->dir_mtime;
+}
+
+static int stream_id_cmp(const void *a, const void *b) {
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/**
+ * true, если стрим лежит в директории суток bucket. NULL - стримы лежат в базовой директории.
+ */
+static bool train_in_bucket(const char *train_id, const char *bucket) {
+    if (bucket == NULL) {
+        return true;
+    }
+    char train_bucket_name[BUCKET_NAME_SIZE];
+    train_bucket(train_id, train_bucket_name);
+    return strcmp(train_bucket_name, bucket) == 0;
+}
+
+/**
+ * Копирует в train_id идентификатор стрима, который пишет этот экземпляр хранилища, или пустую строку. Запись
+ * каталога о нём обновляется при сохранении фреймов, перечитывать её с диска не нужно.
+ */
+static void storage_writer_train(Storage *storage, char *train_id) {
+    lock_writer(storage);
+    strcpy(train_id, storage->writer != NULL ? storage->writer_train_id : "");
+    unlock_writer(storage);
+}
+
+/**
+ * Перечитывает незавершённые стримы директории суток bucket (NULL - все): стримы без индекса и стримы, индекс
+ * которых ещё дописывается, кроме записываемого. Вызывается под catalog_mutex.
+ */
+static void storage_catalog_refresh(Storage *storage, const char *bucket) {
+    char writer_train_id[MAX_INT_LEN + 1];
+    storage_writer_train(storage, writer_train_id);
+    // добавление в каталог меняет порядок записей, поэтому сначала собираем незавершённые стримы
+    List *pending = lst_create();
+    for (size_t i = 0; i < ctlg_size(storage->catalog); i++) {
+        const CatalogEntry *entry = ctlg_at(storage->catalog, i);
+        if ((!entry->indexed || entry->open) && train_in_bucket(entry->train_id, bucket) &&
+            strcmp(entry->train_id, writer_train_id) != 0) {
+            lst_append(pending, strdup(entry->train_id));
+        }
+    }
+    ListIter *iter = lst_iterator(pending);
+    while (lst_iter_advance(iter)) {
+        storage_catalog_add(storage, (char *) lst_iter_peak(iter));
+    }
+    lst_iter_free(iter);
+    lst_deep_free(pending);
+}
+
+/**
+ * Приводит записи каталога о стримах директории dir в соответствие с её содержимым. bucket - имя директории суток,
+ * NULL - стримы лежат прямо в базовой директории. Вызывается под catalog_mutex.
+ */
+static int8_t storage_catalog_scan(Storage *storage, const char *dir, const char *bucket) {
+    char **streams;
+    size_t streams_size;
+    if (list_directory_at(storage->base_fd, dir, &streams, &streams_size) != LPX_SUCCESS) {
+        return LPX_IO;
+    }
+    qsort(streams, streams_size, sizeof(char *), stream_id_cmp);
+
+    for (size_t i = 0; i < ctlg_size(storage->catalog);) {
+        const char *train_id = ctlg_at(storage->catalog, i)->train_id;
+        if (train_in_bucket(train_id, bucket) &&
+            bsearch(&train_id, streams, streams_size, sizeof(char *), stream_id_cmp) == NULL) {
+            ctlg_remove(storage->catalog, train_id);
+        } else {
+            i++;
+        }
+    }
+
+    char writer_train_id[MAX_INT_LEN + 1];
+    storage_writer_train(storage, writer_train_id);
+    for (size_t i = 0; i < streams_size; i++) {
+        if (!ctlg_is_train_id(streams[i])) {
+            continue;
+        }
+        const CatalogEntry *entry = ctlg_get(storage->catalog, streams[i]);
+        bool writing = entry != NULL && strcmp(streams[i], writer_train_id) == 0;
+        if (entry == NULL || (!writing && (!entry->indexed || entry->open || !storage_catalog_fresh(storage, entry)))) {
+            storage_catalog_add(storage, streams[i]);
+        }
+    }
+
+    free_array((void **) streams, streams_size);
+
+    return LPX_SUCCESS;
+}
+
+/**
+ * Забывает директорию суток buckets[idx] вместе с её стримами в каталоге. Стримы, ещё не перенесённые в директорию
+ * суток и лежащие в базовой директории, остаются. Вызывается под catalog_mutex.
+ */
+static void storage_drop_bucket(Storage *storage, size_t idx) {
+    for (size_t i = 0; i < ctlg_size(storage->catalog);) {
+        const char *train_id = ctlg_at(storage->catalog, i)->train_id;
+        struct stat st;
+        if (train_in_bucket(train_id, storage->buckets[idx].name) &&
+            fstatat(storage->base_fd, train_id, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            ctlg_remove(storage->catalog, train_id);
+        } else {
+            i++;
+        }
+    }
+    storage->buckets[idx] = storage->buckets[--storage->buckets_cnt];
+}
+
+/**
+ * Индекс директории суток name в buckets, директория добавляется, если она ещё не известна. Вызывается под
+ * catalog_mutex.
+ */
+static size_t storage_bucket(Storage *storage, const char *name) {
+    for (size_t i = 0; i < storage->buckets_cnt; i++) {
+        if (strcmp(storage->buckets[i].name, name) == 0) {
+            return i;
+        }
+    }
+    storage->buckets = xrealloc(storage->buckets, (storage->buckets_cnt + 1) * sizeof(TrainBucket));
+    TrainBucket *bucket = &storage->buckets[storage->buckets_cnt];
+    strncpy(bucket->name, name, BUCKET_NAME_SIZE - 1);
+    bucket->name[BUCKET_NAME_SIZE - 1] = 0;
+    bucket->mtime = 0;
+    return storage->buckets_cnt++;
+}
+
+/**
+ * Синхронизирует с каталогом стримы директории суток buckets[idx]. Пропавшая директория забывается, так что после
+ * вызова buckets[idx] может указывать на другую директорию. Вызывается под catalog_mutex.
+ */
+static int8_t storage_catalog_sync_bucket(Storage *storage, size_t idx, bool force) {
+    TrainBucket *bucket = &storage->buckets[idx];
+    struct stat st;
+    if (fstatat(storage->base_fd, bucket->name, &st, 0) != 0) {
+        if (errno != ENOENT) {
+            return LPX_IO;
+        }
+        storage_drop_bucket(storage, idx);
+        return LPX_SUCCESS;
+    }
+
+    if (!force && ts2ns(st.st_mtim) == bucket->mtime && time(NULL) - st.st_mtim.tv_sec >= CATALOG_MTIME_SLACK_SEC) {
+        storage_catalog_refresh(storage, bucket->name);
+        return LPX_SUCCESS;
+    }
+    int8_t res = storage_catalog_scan(storage, bucket->name, bucket->name);
+    if (res == LPX_SUCCESS) {
+        bucket->mtime = ts2ns(st.st_mtim);
+    }
+    return res;
+}
+
+/**
+ * Перечитывает список директорий суток в базовой директории. Стримы пропавших директорий убираются из каталога.
+ * Вызывается под catalog_mutex.
+ */
+static int8_t storage_list_buckets(Storage *storage) {
+    char **names;
+    size_t names_size;
+    if (list_directory_at(storage->base_fd, ".", &names, &names_size) != LPX_SUCCESS) {
+        return LPX_IO;
+    }
+    qsort(names, names_size, sizeof(char *), stream_id_cmp);
+
+    // записи каталога, например из контрольной точки, о стримах директорий, которых больше нет. Стрим, ещё не
+    // перенесённый в директорию суток, лежит в базовой директории.
+    for (size_t i = 0; i < ctlg_size(storage->catalog);) {
+        const char *train_id = ctlg_at(storage->catalog, i)->train_id;
+        char bucket[BUCKET_NAME_SIZE];
+        train_bucket(train_id, bucket);
+        char *key = bucket;
+        char *flat_key = (char *) train_id;
+        if (bsearch(&key, names, names_size, sizeof(char *), stream_id_cmp) == NULL &&
+            bsearch(&flat_key, names, names_size, sizeof(char *), stream_id_cmp) == NULL) {
+            ctlg_remove(storage->catalog, train_id);
+        } else {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < storage->buckets_cnt;) {
+        char *key = storage->buckets[i].name;
+        if (bsearch(&key, names, names_size, sizeof(char *), stream_id_cmp) == NULL) {
+            storage->buckets[i] = storage->buckets[--storage->buckets_cnt];
+        } else {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < names_size; i++) {
+        if (is_bucket_name(names[i])) {
+            storage_bucket(storage, names[i]);
+        }
+    }
+    storage->buckets_listed = true;
+
+    free_array((void **) names, names_size);
+
+    return LPX_SUCCESS;
+}
+
+/**
+ * Приводит каталог в соответствие с содержимым хранилища. Базовая директория и директории суток перечитываются только
+ * если они изменились с момента прошлой синхронизации, иначе перепроверяются только стримы без индекса и стримы,
+ * индекс которых ещё дописывается. Вызывается под catalog_mutex.
+ */
+static int8_t storage_catalog_sync(Storage *storage, bool force) {
+    struct stat st;
+    if (fstat(storage->base_fd, &st) != 0) {
+        return LPX_IO;
+    }
+
+    bool changed = force || ts2ns(st.st_mtim) != storage->base_mtime ||
+                   time(NULL) - st.st_mtim.tv_sec < CATALOG_MTIME_SLACK_SEC;
+
+    if (changed && !storage->day_buckets && faccessat(storage->base_fd, DAY_BUCKETS_FILE, F_OK, 0) == 0) {
+        // хранилище перевёл на раскладку по суткам другой процесс
+        __atomic_store_n(&storage->day_buckets, true, __ATOMIC_RELAXED);
+    }
+
+    if (!storage->day_buckets) {
+        if (!changed) {
+            storage_catalog_refresh(storage, NULL);
+            return LPX_SUCCESS;
+        }
+        if (storage_catalog_scan(storage, ".", NULL) != LPX_SUCCESS) {
+            return LPX_IO;
+        }
+    } else {
+        if ((changed || !storage->buckets_listed) && storage_list_buckets(storage) != LPX_SUCCESS) {
+            return LPX_IO;
+        }
+        for (size_t i = 0; i < storage->buckets_cnt;) {
+            size_t buckets_cnt = storage->buckets_cnt;
+            if (storage_catalog_sync_bucket(storage, i, force) != LPX_SUCCESS) {
+                return LPX_IO;
+            }
+            if (storage->buckets_cnt == buckets_cnt) {
+                i++;
+            }
+        }
+    }
+
+    storage->base_mtime = ts2ns(st.st_mtim);
+
+    return LPX_SUCCESS;
+}
+
+/**
+ * Синхронизирует с каталогом стримы, которые могут содержать момент time (в микросекундах). При раскладке по суткам
+ * перечитываются только директории суток time и предыдущих суток, потому что стрим мог начаться до полуночи.
+ * Вызывается под catalog_mutex.
+ */
+static int8_t storage_catalog_sync_time(Storage *storage, uint64_t time) {
+    if (!storage->day_buckets || !storage->buckets_listed) {
+        return storage_catalog_sync(storage, false);
+    }
+    uint64_t time_ms = time / 1000;
+    for (int day = 1; day >= 0; day--) {
+        char name[BUCKET_NAME_SIZE];
+        bucket_name(time_ms >= day * MS_IN_DAY ? time_ms - day * MS_IN_DAY : 0, name);
+        if (storage_catalog_sync_bucket(storage, storage_bucket(storage, name), false) != LPX_SUCCESS) {
+            return LPX_IO;
+        }
+    }
+    return LPX_SUCCESS;
+}
+
+/**
+ * Открывает таблицу фреймов стрима. Для стримов, записанных по файлу на фрейм, table устанавливается в NULL.
+ */
+static int8_t storage_open_frame_table(int td, SegmentTable **table) {
+    *table = NULL;
+    int8_t res = segt_open(td, table);
+    return res == STRG_NOT_FOUND ? LPX_SUCCESS : res;
+}
+
+/**
+ * Выбирает стрим для проверки (ScrubSource.next)
+ */
+static bool storage_scrub_next(void *ctx, char *train_id, uint64_t *frames_cnt) {
+    Storage *storage = ctx;
+    lock_catalog(storage);
+    const CatalogEntry *next = scrb_select(storage->catalog, realtime_us());
+    if (next != NULL) {
+        strcpy(train_id, next->train_id);
+        *frames_cnt = next->frames_cnt;
+    }
+    unlock_catalog(storage);
+    return next != NULL;
+}
+
+/**
+ * storage_acquire_dir и storage_release_dir для фоновых потоков модулей хранилища (ScrubSource, RamTierSource)
+ */
+static int8_t storage_source_acquire_dir(void *ctx, const char *train_id, int *dir_fd) {
+    return storage_acquire_dir(ctx, train_id, dir_fd);
+}
+
+static void storage_source_release_dir(void *ctx, int dir_fd) {
+    storage_release_dir(ctx, dir_fd);
+}
+
+/**
+ * Записывает результат проверки стрима в каталог (ScrubSource.finish)
+ */
+static bool storage_scrub_finish(void *ctx, const char *train_id, uint64_t errors) {
+    Storage *storage = ctx;
+    lock_catalog(storage);
+    const CatalogEntry *entry = ctlg_get(storage->catalog, train_id);
+    if (entry != NULL) {
+        CatalogEntry scrubbed = *entry;
+        scrubbed.scrub_time = realtime_us();
+        scrubbed.scrub_errors = errors;
+        ctlg_put(storage->catalog, &scrubbed);
+    }
+    unlock_catalog(storage);
+    return entry != NULL;
+}
+
+/**
+ * Переносит стримы в корзину и убирает их из каталога. Переименование атомарно, так что стрим сразу перестаёт
+ * находиться поиском, а файлы удаляются в фоне. Если generation, все стримы переносятся в одну директорию корзины,
+ * а отсутствующие стримы пропускаются.
+ */
+static int8_t storage_trash(Storage *storage, char **train_ids, size_t train_ids_cnt, bool generation) {
+    TrashBatch *batch;
+    int8_t res = trsh_begin(storage->trash, generation, &batch);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+
+    lock_catalog(storage);
+    for (size_t i = 0; i < train_ids_cnt; i++) {
+        const CatalogEntry *entry = ctlg_get(storage->catalog, train_ids[i]);
+        uint64_t bytes = entry != NULL && entry->indexed ? entry->bytes : 0;
+        char path[TRAIN_PATH_SIZE];
+        bool day_buckets = storage_day_buckets(storage);
+        train_path(train_ids[i], day_buckets, path);
+        int8_t r = trsh_move(batch, storage->base_fd, path, train_ids[i], bytes);
+        if (r == STRG_NOT_FOUND) {
+            train_path(train_ids[i], !day_buckets, path);
+            r = trsh_move(batch, storage->base_fd, path, train_ids[i], bytes);
+        }
+        if (r != LPX_SUCCESS) {
+            if (!generation || r != STRG_NOT_FOUND) {
+                res = LPX_IO;
+                break;
+            }
+            continue;
+        }
+        char *bucket_end = strchr(path, '/');
+        if (bucket_end != NULL) {
+            // директория суток удаляется вместе с последним стримом, чтобы базовая директория не копила пустые
+            *bucket_end = 0;
+            unlinkat(storage->base_fd, path, AT_REMOVEDIR);
+        }
+        storage_forget_dir(storage, train_ids[i]);
+        ctlg_remove(storage->catalog, train_ids[i]);
+    }
+    trsh_end(batch);
+    unlock_catalog(storage);
+
+    return res;
+}
+
+/**
+ * Переводит хранилище на раскладку стримов по директориям суток и переносит в них стримы из базовой директории.
+ * Перенос - переименование директорий, данные стримов не копируются. Стримы, которые уже перенёс другой процесс,
+ * пропускаются.
+ */
+static int8_t storage_migrate_buckets(Storage *storage) {
+    // признак раскладки создаётся до переноса: другие процессы переходят на новую раскладку, а ещё не перенесённые
+    // стримы находят по старому пути
+    int fd = openat(storage->base_fd, DAY_BUCKETS_FILE, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return LPX_IO;
+    }
+    close(fd);
+    __atomic_store_n(&storage->day_buckets, true, __ATOMIC_RELAXED);
+
+    char **names;
+    size_t names_size;
+    if (list_directory_at(storage->base_fd, ".", &names, &names_size) != LPX_SUCCESS) {
+        return LPX_IO;
+    }
+
+    int8_t res = LPX_SUCCESS;
+    size_t migrated = 0;
+    for (size_t i = 0; i < names_size; i++) {
+        if (!ctlg_is_train_id(names[i])) {
+            continue;
+        }
+        char bucket[BUCKET_NAME_SIZE];
+        train_bucket(names[i], bucket);
+        char path[TRAIN_PATH_SIZE];
+        train_path(names[i], true, path);
+        if ((mkdirat(storage->base_fd, bucket, 0777) != 0 && errno != EEXIST) ||
+            (renameat(storage->base_fd, names[i], storage->base_fd, path) != 0 && errno != ENOENT)) {
+            fprintf(stderr, "Could not move stream %s into %s\n", names[i], bucket);
+            res = LPX_IO;
+            continue;
+        }
+        migrated++;
+    }
+    if (migrated > 0) {
+        fprintf(stderr, "Moved %zu streams into day buckets\n", migrated);
+    }
+
+    free_array((void **) names, names_size);
+
+    return res;
+}
+
+static void storage_ram_writer_train(void *ctx, char *train_id) {
+    Storage *storage = ctx;
+    lock_writer(storage);
+    strcpy(train_id, storage->writer_train_id);
+    unlock_writer(storage);
+}
+
+/**
+ * Обновляет запись стрима, все сегменты которого перенесены из RAM-уровня: размер стрима в каталоге учитывал только
+ * символьные ссылки
+ */
+static void storage_ram_migrated(void *ctx, const char *train_id) {
+    Storage *storage = ctx;
+    lock_catalog(storage);
+    if (ctlg_get(storage->catalog, train_id) != NULL) {
+        storage_catalog_add(storage, train_id);
+    }
+    unlock_catalog(storage);
+}
+
+/**
+ * Дублирует дескрипторы записываемого стрима для потока фиксации (SyncSource.dup_fds). Дескрипторы дублируются под
+ * writer_mutex, а сбрасываются без блокировки, так что писатель во время фиксации может закрыться.
+ */
+static size_t storage_sync_fds(void *ctx, int **fds) {
+    Storage *storage = ctx;
+    size_t fds_cnt = 0;
+    *fds = NULL;
+    lock_writer(storage);
+    if (storage->writer != NULL) {
+        fds_cnt = segw_dup_fds(storage->writer, fds);
+        int index_fd = storage->index_writer != NULL ? sidxw_dup_fd(storage->index_writer) : -1;
+        if (index_fd != -1) {
+            *fds = xrealloc(*fds, (fds_cnt + 1) * sizeof(int));
+            (*fds)[fds_cnt++] = index_fd;
+        }
+    }
+    unlock_writer(storage);
+    return fds_cnt;
+}
+
+void storage_default_config(StorageConfig *config) {
+    memset(config, 0, sizeof(StorageConfig));
+    config->write_queue_depth = DEFAULT_WRITE_QUEUE_DEPTH;
+    config->write_threads = DEFAULT_WRITE_THREADS;
+    config->write_batch = DEFAULT_WRITE_BATCH;
+    config->read_ahead = DEFAULT_READ_AHEAD;
+    config->durability = STRG_DURABLE_GROUP;
+    config->index_commit_frames = DEFAULT_INDEX_COMMIT_FRAMES;
+    config->index_commit_ms = DEFAULT_INDEX_COMMIT_MS;
+    config->recover_on_open = true;
+    config->recovery_threads = DEFAULT_RECOVERY_THREADS;
+    config->verify_crc = true;
+}
+
+/**
+ * Ёмкость хранилища по параметрам: меньшая из capacity_bytes и capacity_percent от суммарного размера файловых систем
+ * томов. Вызывается после открытия томов.
+ */
+static uint64_t storage_capacity(Storage *storage, const StorageConfig *config) {
+    uint64_t capacity = config->capacity_bytes;
+    if (config->capacity_percent == 0) {
+        return capacity;
+    }
+    uint64_t fs_size = 0;
+    for (size_t i = 0; i < storage->volumes_cnt; i++) {
+        struct statvfs fs;
+        if (statvfs(storage->volumes[i].path, &fs) == 0) {
+            fs_size += (uint64_t) fs.f_blocks * fs.f_frsize;
+        }
+    }
+    uint64_t fs_capacity = fs_size / 100 * config->capacity_percent;
+    if (fs_capacity > 0 && (capacity == 0 || fs_capacity < capacity)) {
+        capacity = fs_capacity;
+    }
+    return capacity;
+}
+
+/**
+ * Открывает тома хранилища: базовую директорию и дополнительные тома из параметров. Недоступный том пропускается,
+ * его фреймы пишутся на остальные тома.
+ */
+static void storage_open_volumes(Storage *storage, const StorageConfig *config) {
+    storage->volumes = xcalloc(config->volumes_cnt + 1, sizeof(StripeVolume));
+    StripeVolume *base = &storage->volumes[storage->volumes_cnt++];
+    base->path = realpath(storage->base_dir, NULL);
+    if (base->path == NULL) {
+        base->path = xmalloc(strlen(storage->base_dir) + 1);
+        strcpy(base->path, storage->base_dir);
+    }
+    base->fd = -1;
+    for (size_t i = 0; i < config->volumes_cnt; i++) {
+        StripeVolume *volume = &storage->volumes[storage->volumes_cnt];
+        volume->path = realpath(config->volumes[i], NULL);
+        volume->fd = volume->path != NULL ? open(volume->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (volume->fd == -1) {
+            fprintf(stderr, "Volume %s is unavailable (%s), frames are written to other volumes\n",
+                    config->volumes[i], strerror(errno));
+            free(volume->path);
+            volume->path = NULL;
+            continue;
+        }
+        storage->volumes_cnt++;
+    }
+}
+
 int8_t storage_open(char *base_dir, Storage **storage) {
+    StorageConfig config;
+    storage_default_config(&config);
+    return storage_open_config(base_dir, &config, storage);
+}
+
+int8_t storage_open_config(char *base_dir, const StorageConfig *config, Storage **storage) {
     if (access(base_dir, W_OK) != 0) {
         return STRG_ACCESS;
     }
-    Storage *res = xmalloc(sizeof(Storage));
+    int base_fd = open(base_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd == -1) {
+        return STRG_ACCESS;
+    }
+    Storage *res = xcalloc(1, sizeof(Storage));
     char *bd = xcalloc(sizeof(char), strlen(base_dir) + 1);
     strncpy(bd, base_dir, strlen(base_dir));
     res->base_dir = bd;
+    res->base_fd = base_fd;
+    res->writer_dir_fd = -1;
+    res->config = *config;
+    pthread_mutex_init(&res->writer_mutex, NULL);
+    pthread_mutex_init(&res->catalog_mutex, NULL);
+    pthread_mutex_init(&res->dirs_mutex, NULL);
+    pthread_cond_init(&res->writer_idle, NULL);
+    storage_open_volumes(res, config);
+    res->capacity = storage_capacity(res, config);
+    pthread_key_create(&res->io_engine_key, (void (*)(void *)) ioe_free);
+    res->catalog = ctlg_create();
+
+    // Каталог из контрольной точки достаточно досканировать: при неизменной базовой директории перечитываются только
+    // незавершённые стримы, иначе - только стримы, директории которых изменились после записи контрольной точки
+    bool loaded = ctlg_load(res->catalog, res->base_fd, CATALOG_CHECKPOINT_FILE, &res->base_mtime) == LPX_SUCCESS;
+
+    if ((config->day_buckets || faccessat(res->base_fd, DAY_BUCKETS_FILE, F_OK, 0) == 0) &&
+        storage_migrate_buckets(res) != LPX_SUCCESS) {
+        fprintf(stderr, "Stream migration into day buckets failed\n");
+    }
+
+    if (storage_catalog_sync(res, !loaded) != LPX_SUCCESS) {
+        storage_close(res);
+        return LPX_IO;
+    }
+    if (config->recover_on_open && storage_recover(res, NULL) != LPX_SUCCESS) {
+        fprintf(stderr, "Stream index recovery failed\n");
+    }
+    res->trash = trsh_open(res->base_fd);
+    if (config->durability != STRG_DURABLE_NONE) {
+        SyncSource source = {storage_sync_fds, res};
+        res->syncer = sncr_create(config->durability, config->index_commit_frames, config->index_commit_ms, &source);
+    }
+    if (config->ram_dir != NULL) {
+        RamTierSource source = {storage_source_acquire_dir, storage_source_release_dir, storage_ram_writer_train,
+                                storage_ram_migrated, res};
+        res->ram = rtr_open(config->ram_dir, config->ram_bytes, &source);
+    }
+    if (config->scrub_bytes_per_sec > 0) {
+        ScrubSource source = {storage_scrub_next, storage_source_acquire_dir, storage_source_release_dir,
+                              storage_scrub_finish, res};
+        res->scrubber = scrb_create(config->scrub_bytes_per_sec, &source);
+    }
     *storage = res;
     return LPX_SUCCESS;
 }
 
-static char *train_dir(Storage *storage, char *train_id) {
-    return append_path(storage->base_dir, train_id);
+int8_t storage_prepare(Storage *storage, char *train_id) {
+    char path[TRAIN_PATH_SIZE];
+    bool day_buckets = storage_day_buckets(storage);
+    train_path(train_id, day_buckets, path);
+    int r = mkdirat(storage->base_fd, path, 0777);
+    while (r != 0 && errno == ENOENT && day_buckets) {
+        // первый стрим суток, или директорию суток удалили вместе с её последним стримом. Удаление стрима другим
+        // процессом может убрать директорию суток между её созданием и созданием стрима, тогда создаём её заново.
+        char bucket[BUCKET_NAME_SIZE];
+        train_bucket(train_id, bucket);
+        if (mkdirat(storage->base_fd, bucket, 0777) != 0 && errno != EEXIST) {
+            return LPX_IO;
+        }
+        r = mkdirat(storage->base_fd, path, 0777);
+    }
+    if (r != 0) {
+        return errno == EEXIST ? STRG_EXISTS : LPX_IO;
+    }
+
+    lock_catalog(storage);
+    ctlg_put_pending(storage->catalog, train_id);
+    unlock_catalog(storage);
+
+    return LPX_SUCCESS;
+}
+
+/**
+ * Фиксирует записанные фреймы в вызывающем потоке, если не все они зафиксированы. Вызывается под writer_mutex.
+ */
+static int8_t storage_sync_writer(Storage *storage) {
+    uint64_t target;
+    if (storage->syncer == NULL || !sncr_begin(storage->syncer, &target)) {
+        return LPX_SUCCESS;
+    }
+    uint64_t start = monotonic_us();
+    bool failed = segw_sync(storage->writer) != LPX_SUCCESS ||
+                  (storage->index_writer != NULL && sidxw_commit(storage->index_writer) != LPX_SUCCESS);
+    sncr_end(storage->syncer, target, failed, monotonic_us() - start);
+    return failed ? LPX_IO : LPX_SUCCESS;
+}
+
+/**
+ * Дожидается, пока закончится запись пачек через текущего писателя. Вызывается под writer_mutex, который отпускается
+ * на время ожидания, поэтому писатель после возврата может оказаться другим.
+ */
+static void storage_wait_writer_idle(Storage *storage) {
+    while (storage->writer_refs > 0) {
+        pthread_cond_wait(&storage->writer_idle, &storage->writer_mutex);
+    }
+}
+
+/**
+ * Закрывает писателя сегментов стрима и его дописываемый индекс, если они открыты, дождавшись окончания записи через
+ * них. Индекс остаётся незакрытым для дописывания. Вызывается под writer_mutex.
+ */
+static int8_t storage_close_writer(Storage *storage, char *train_id) {
+    storage_wait_writer_idle(storage);
+    if (storage->writer == NULL || (train_id != NULL && strcmp(storage->writer_train_id, train_id) != 0)) {
+        return LPX_SUCCESS;
+    }
+    // фреймы закрываемого стрима фиксируются сразу: поток фиксации работает только с открытым писателем
+    int8_t res = storage_sync_writer(storage);
+    if (segw_close(storage->writer) != LPX_SUCCESS) {
+        res = LPX_IO;
+    }
+    if (storage->index_writer != NULL && sidxw_close(storage->index_writer) != LPX_SUCCESS) {
+        res = LPX_IO;
+    }
+    storage_release_dir(storage, storage->writer_dir_fd);
+    // на томах, на которые не попал ни один сегмент стрима, его директории не нужны
+    for (size_t i = 0; i < storage->volumes_cnt; i++) {
+        if (storage->volumes[i].fd != -1) {
+            unlinkat(storage->volumes[i].fd, storage->writer_train_id, AT_REMOVEDIR);
+        }
+    }
+    storage->writer = NULL;
+    storage->index_writer = NULL;
+    storage->writer_train_id[0] = 0;
+    storage->writer_dir_fd = -1;
+    __atomic_store_n(&storage->writer_bytes, 0, __ATOMIC_RELAXED);
+    if (storage->ram != NULL) {
+        rtr_wake(storage->ram);
+    }
+    return res;
+}
+
+/**
+ * Занятое стримами место. Вызывается под catalog_mutex.
+ */
+static uint64_t storage_used_bytes(Storage *storage) {
+    uint64_t used = ctlg_bytes(storage->catalog);
+    lock_writer(storage);
+    if (storage->writer != NULL) {
+        const CatalogEntry *entry = ctlg_get(storage->catalog, storage->writer_train_id);
+        if (entry != NULL) {
+            used -= entry->bytes;
+        }
+        used += __atomic_load_n(&storage->writer_bytes, __ATOMIC_RELAXED);
+    }
+    unlock_writer(storage);
+    return used;
+}
+
+/**
+ * Шаг вытеснения: если занятое место выше верхней границы, переносит в корзину самый старый завершённый стрим.
+ * Записываемый стрим, стримы без индекса и с незакрытым индексом не удаляются. Место, занятое корзиной, в занятое
+ * стримами не входит, иначе стримы вытеснялись бы, пока корзина не опустеет.
+ */
+static bool storage_evict(void *ctx) {
+    Storage *storage = ctx;
+
+    lock_catalog(storage);
+    if (storage_catalog_sync(storage, false) != LPX_SUCCESS) {
+        unlock_catalog(storage);
+        return false;
+    }
+    uint64_t used = storage_used_bytes(storage);
+    uint64_t high = storage->capacity / 100 * EVICT_HIGH_PERCENT;
+    uint64_t low = storage->capacity / 100 * EVICT_LOW_PERCENT;
+    if (used <= low || (!storage->evicting && used <= high)) {
+        // следующая внеочередная проверка - когда записываемый стрим займёт оставшееся до верхней границы место
+        uint64_t written = __atomic_load_n(&storage->writer_bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&storage->evict_wake_bytes, written + (high > used ? high - used : 0), __ATOMIC_RELAXED);
+        storage->evicting = false;
+        storage->evict_stalled = false;
+        unlock_catalog(storage);
+        return false;
+    }
+    storage->evicting = true;
+
+    lock_writer(storage);
+    char writer_train_id[MAX_INT_LEN + 1];
+    strcpy(writer_train_id, storage->writer_train_id);
+    unlock_writer(storage);
+
+    CatalogEntry victim;
+    bool found = false;
+    for (size_t i = 0; i < ctlg_size(storage->catalog) && !found; i++) {
+        const CatalogEntry *entry = ctlg_at(storage->catalog, i);
+        if (entry->indexed && !entry->open && strcmp(entry->train_id, writer_train_id) != 0) {
+            victim = *entry;
+            found = true;
+        }
+    }
+    if (!found) {
+        if (!storage->evict_stalled) {
+            fprintf(stderr, "Storage is over capacity, but there are no completed streams to evict\n");
+        }
+        storage->evict_stalled = true;
+        // до следующей периодической проверки запись поток вытеснения не будит
+        __atomic_store_n(&storage->evict_wake_bytes, UINT64_MAX, __ATOMIC_RELAXED);
+        unlock_catalog(storage);
+        return false;
+    }
+    unlock_catalog(storage);
+
+    char *train_id = victim.train_id;
+    if (storage_trash(storage, &train_id, 1, false) != LPX_SUCCESS) {
+        fprintf(stderr, "Could not evict stream %s\n", victim.train_id);
+        return false;
+    }
+    __atomic_add_fetch(&storage->evicted_streams, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&storage->evicted_bytes, victim.bytes, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+/**
+ * Учитывает записанные в текущий стрим байты и будит поток вытеснения, если стрим дорос до верхней границы
+ */
+static void storage_account_written(Storage *storage, uint64_t bytes) {
+    uint64_t written = __atomic_add_fetch(&storage->writer_bytes, bytes, __ATOMIC_RELAXED);
+    if (storage->evictor != NULL && written >= __atomic_load_n(&storage->evict_wake_bytes, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&storage->evict_wake_bytes, UINT64_MAX, __ATOMIC_RELAXED);
+        evct_wake(storage->evictor);
+    }
+}
+
+/**
+ * Формат фреймов стрима, директория которого открыта как td: из манифеста стрима, а для стримов без манифеста -
+ * формат, в котором они записывались до появления манифестов
+ */
+static int8_t storage_frame_format(int td, FrameFormat *format) {
+    int8_t res = mnf_read(td, format);
+    if (res == STRG_NOT_FOUND) {
+        mnf_legacy(format);
+        res = LPX_SUCCESS;
+    }
+    return res;
+}
+
+/**
+ * Размещение сегментов записываемого стрима: RAM-уровень и тома с директориями стрима на них
+ */
+typedef struct TrainPlacement {
+    SegmentPlacement placement;
+    SegmentTier tier;
+    char tier_path[PATH_MAX];
+    SegmentVolume *volumes;
+    char (*volume_paths)[PATH_MAX];
+} TrainPlacement;
+
+/**
+ * Создаёт директорию стрима train_id в директории parent_fd с путём parent_path и открывает её. Путь к ней
+ * записывается в path (PATH_MAX байт).
+ */
+static bool storage_open_train_subdir(int parent_fd, const char *parent_path, const char *train_id, char *path,
+                                      int *fd) {
+    if (mkdirat(parent_fd, train_id, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create stream directory %s/%s: %s\n", parent_path, train_id, strerror(errno));
+        return false;
+    }
+    *fd = openat(parent_fd, train_id, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    snprintf(path, PATH_MAX, "%s/%s", parent_path, train_id);
+    return *fd != -1;
+}
+
+/**
+ * Заполняет размещение сегментов стрима train_id. Если директорию стрима в RAM-уровне или на томе не удалось
+ * создать, сегменты пишутся без уровня или на остальные тома.
+ */
+static void storage_open_placement(Storage *storage, const char *train_id, TrainPlacement *p) {
+    memset(p, 0, sizeof(TrainPlacement));
+    if (storage->ram != NULL && rtr_placement(storage->ram, train_id, &p->tier, p->tier_path)) {
+        p->placement.tier = &p->tier;
+    }
+
+    p->volumes = xcalloc(storage->volumes_cnt, sizeof(SegmentVolume));
+    p->volume_paths = xcalloc(storage->volumes_cnt, PATH_MAX);
+    for (size_t i = 0; i < storage->volumes_cnt; i++) {
+        StripeVolume *volume = &storage->volumes[i];
+        SegmentVolume *v = &p->volumes[p->placement.volumes_cnt];
+        v->dir_fd = -1;
+        v->stats = &volume->stats;
+        if (volume->fd != -1) {
+            if (!storage_open_train_subdir(volume->fd, volume->path, train_id, p->volume_paths[i], &v->dir_fd)) {
+                continue;
+            }
+            v->path = p->volume_paths[i];
+        }
+        p->placement.volumes_cnt++;
+    }
+    p->placement.volumes = p->volumes;
+}
+
+static void storage_close_placement(TrainPlacement *p) {
+    if (p->placement.tier != NULL) {
+        close(p->tier.dir_fd);
+    }
+    for (size_t i = 0; i < p->placement.volumes_cnt; i++) {
+        if (p->volumes[i].dir_fd != -1) {
+            close(p->volumes[i].dir_fd);
+        }
+    }
+    free(p->volumes);
+    free(p->volume_paths);
+}
+
+/**
+ * Возвращает писателя сегментов стрима, открывая его, если сейчас записывается другой стрим. Писатель другого стрима
+ * закрывается после того, как через него допишутся пачки остальных потоков записи. В format копируется формат
+ * фреймов стрима. Писателя нужно освободить storage_release_writer.
+ */
+static int8_t storage_acquire_writer(Storage *storage, const char *train_id, SegmentWriter **writer,
+                                     FrameFormat *format) {
+    int8_t res = LPX_SUCCESS;
+
+    lock_writer(storage);
+    while (storage->writer == NULL || strcmp(storage->writer_train_id, train_id) != 0) {
+        if (storage->writer_refs > 0) {
+            // другие потоки дописывают пачки предыдущего стрима, его писатель закрывается после них
+            storage_wait_writer_idle(storage);
+            continue;
+        }
+        storage_close_writer(storage, NULL);
+
+        int td;
+        res = storage_acquire_dir(storage, train_id, &td);
+        if (res == LPX_SUCCESS) {
+            TrainPlacement placement;
+            storage_open_placement(storage, train_id, &placement);
+            res = segw_open(td, storage->config.direct_io ? SEGW_DIRECT : 0, &placement.placement,
+                            &storage->writer);
+            storage_close_placement(&placement);
+            if (res != LPX_SUCCESS) {
+                storage_release_dir(storage, td);
+            }
+        }
+        if (res != LPX_SUCCESS) {
+            storage->writer = NULL;
+            break;
+        }
+        strncpy(storage->writer_train_id, train_id, MAX_INT_LEN);
+        storage->writer_dir_fd = td;
+        if (storage_frame_format(td, &storage->writer_format) != LPX_SUCCESS) {
+            // фреймы пишутся как есть: формат нужен только для сжатия
+            mnf_legacy(&storage->writer_format);
+        }
+        // стрим мог быть начат до перезапуска, занятое им место учитывается целиком. Первая запись в новый стрим
+        // будит поток вытеснения.
+        __atomic_store_n(&storage->writer_bytes, tree_bytes(td, "."), __ATOMIC_RELAXED);
+        __atomic_store_n(&storage->evict_wake_bytes, 0, __ATOMIC_RELAXED);
+        if (storage->capacity > 0 && storage->evictor == NULL) {
+            storage->evictor = evct_create(storage_evict, storage, EVICT_PERIOD_MS, EVICT_PAUSE_MS, 0);
+        }
+    }
+    if (res == LPX_SUCCESS) {
+        // писатель не закроется, пока вызывающий не освободит его storage_release_writer
+        storage->writer_refs++;
+        *writer = storage->writer;
+        *format = storage->writer_format;
+    }
+    unlock_writer(storage);
+
+    return res;
+}
+
+/**
+ * Освобождает писателя, полученного storage_acquire_writer
+ */
+static void storage_release_writer(Storage *storage) {
+    lock_writer(storage);
+    if (--storage->writer_refs == 0) {
+        pthread_cond_broadcast(&storage->writer_idle);
+    }
+    unlock_writer(storage);
+}
+
+/**
+ * Учитывает в записи каталога о записываемом стриме сохранённые фреймы: их количество, пропуски, интервал и размер
+ * обновляются без чтения индекса и файлов стрима. filled - заняла ли запись фрейма в индексе пустое место: повторно
+ * записанный фрейм не меняет количество фреймов и пропусков, но его копия занимает новое место в сегментах и
+ * учитывается в bytes. Закрытые стримы и стримы, которых нет в каталоге, не меняются.
+ */
+static void storage_catalog_account(Storage *storage, const char *train_id, const FrameWrite *frames,
+                                    const bool *filled, size_t frames_cnt, uint64_t bytes) {
+    lock_catalog(storage);
+    const CatalogEntry *current = ctlg_get(storage->catalog, train_id);
+    if (current == NULL || (current->indexed && !current->open)) {
+        unlock_catalog(storage);
+        return;
+    }
+    CatalogEntry entry = *current;
+    entry.bytes += bytes;
+    for (size_t i = 0; i < frames_cnt; i++) {
+        const FrameWrite *frame = &frames[i];
+        if (frame->res != LPX_SUCCESS || frame->meta == NULL || !filled[i]) {
+            continue;
+        }
+        if (!entry.indexed) {
+            entry.indexed = true;
+            entry.open = true;
+            entry.start_time = frame->meta->start_time;
+            entry.end_time = frame->meta->end_time;
+        }
+        if (frame->frame_idx >= entry.frames_cnt) {
+            // фреймы между последним записанным и этим пропущены
+            entry.dropped_frames += frame->frame_idx - entry.frames_cnt;
+            entry.frames_cnt = (uint64_t) frame->frame_idx + 1;
+        } else if (entry.dropped_frames > 0) {
+            // фрейм из пачки, записанной не по порядку, заполнил пропуск
+            entry.dropped_frames--;
+        }
+        if (frame->frame_idx == 0 || frame->meta->start_time < entry.start_time) {
+            entry.start_time = frame->meta->start_time;
+        }
+        if (frame->meta->end_time > entry.end_time) {
+            entry.end_time = frame->meta->end_time;
+        }
+    }
+    ctlg_put(storage->catalog, &entry);
+    unlock_catalog(storage);
+}
+
+/**
+ * Дописывает в индекс стрима метаданные записанных фреймов. Записи индекса появляются только после того, как фреймы
+ * записаны в сегменты, так что индекс никогда не ссылается на незаписанный фрейм. Затем фреймы фиксируются по уровню
+ * надёжности: раз в index_commit_frames фреймов будится поток фиксации, а в режиме STRG_DURABLE_FRAME вызывающий
+ * дожидается фиксации своих фреймов. bytes - размер успешно записанных фреймов на диске.
+ */
+static void storage_index_frames(Storage *storage, SegmentWriter *writer, FrameWrite *frames, size_t frames_cnt,
+                                 uint64_t bytes) {
+    // вызывающий держит писателя (storage_acquire_writer), поэтому стрим не сменится, а индекс не закроется, пока
+    // записи пачки дописываются без блокировки
+    lock_writer(storage);
+    int8_t res = LPX_SUCCESS;
+    if (storage->writer != writer) {
+        // индекс другого стрима не трогаем
+        res = LPX_IO;
+    } else if (storage->index_writer == NULL) {
+        res = sidxw_open(storage->writer_dir_fd, &storage->index_writer);
+    }
+    IndexWriter *index_writer = storage->index_writer;
+    unlock_writer(storage);
+
+    size_t written = 0;
+    bool *filled = xcalloc(frames_cnt, sizeof(bool));
+    for (size_t i = 0; i < frames_cnt; i++) {
+        FrameWrite *frame = &frames[i];
+        if (frame->res == LPX_SUCCESS && frame->meta != NULL) {
+            // STRG_EXISTS - индекс стрима уже закрыт
+            frame->res = res != LPX_SUCCESS ? res
+                                            : sidxw_append(index_writer, frame->frame_idx, frame->meta, &filled[i]);
+        }
+        if (frame->res == LPX_SUCCESS) {
+            written++;
+        }
+    }
+    if (written > 0) {
+        storage_catalog_account(storage, frames[0].train_id, frames, filled, frames_cnt, bytes);
+    }
+    free(filled);
+    if (written == 0 || storage->syncer == NULL || sncr_indexed(storage->syncer, written) == LPX_SUCCESS) {
+        return;
+    }
+    for (size_t i = 0; i < frames_cnt; i++) {
+        if (frames[i].res == LPX_SUCCESS) {
+            frames[i].res = LPX_IO;
+        }
+    }
+}
+
+/**
+ * Сжимает фрейм в формате format, если хранилище открыто со сжатием. Сжатый фрейм записывается в encoded - буфер,
+ * выровненный по SEG_DIRECT_ALIGN и дополненный нулями до кратного ему размера encoded_buf_size, так что его можно
+ * записать напрямую. Возвращает размер сжатого фрейма или 0, если фрейм пишется как есть: сжатие выключено, формат
+ * не RAW12 или фрейм не сжимается.
+ */
+static size_t storage_encode_frame(Storage *storage, const FrameFormat *format, const uint8_t *buf, size_t size,
+                                   uint8_t **encoded, size_t *encoded_buf_size) {
+    *encoded = NULL;
+    if (!storage->config.compress || format->bit_depth != 12 || format->stride % 3 != 0) {
+        return 0;
+    }
+    // строки сжимаются вместе с выравниванием: width - пикселей в stride байтах
+    size_t width = format->stride / 3 * 2;
+    size_t bound = cdc_bound(size, width);
+    *encoded_buf_size = (bound + SEG_DIRECT_ALIGN - 1) / SEG_DIRECT_ALIGN * SEG_DIRECT_ALIGN;
+    if (posix_memalign((void **) encoded, SEG_DIRECT_ALIGN, *encoded_buf_size) != 0) {
+        *encoded = NULL;
+        return 0;
+    }
+    size_t encoded_size = cdc_encode(buf, size, width, *encoded);
+    if (encoded_size == 0) {
+        free(*encoded);
+        *encoded = NULL;
+        return 0;
+    }
+    memset(*encoded + encoded_size, 0, *encoded_buf_size - encoded_size);
+    return encoded_size;
+}
+
+/**
+ * Синхронная запись фрейма в сегменты стрима
+ */
+static int8_t storage_write_frame(Storage *storage, const char *train_id, uint32_t frame_idx, const uint8_t *buf,
+                                  size_t size, const FrameMeta *meta) {
+    SegmentWriter *writer;
+    FrameFormat format;
+    int8_t res = storage_acquire_writer(storage, train_id, &writer, &format);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+    uint8_t *encoded;
+    size_t encoded_buf_size;
+    size_t encoded_size = storage_encode_frame(storage, &format, buf, size, &encoded, &encoded_buf_size);
+    FrameWrite frame = {
+            .train_id = train_id,
+            .frame_idx = frame_idx,
+            .buf = buf,
+            .size = size,
+            .buf_size = size,
+            .meta = meta,
+            .res = encoded != NULL ? segw_append(writer, frame_idx, encoded, encoded_size, SEG_FRAME_LPXC)
+                                   : segw_append(writer, frame_idx, buf, size, 0)
+    };
+    uint64_t written = 0;
+    if (frame.res == LPX_SUCCESS) {
+        written = encoded != NULL ? encoded_size : size;
+        storage_account_written(storage, written);
+    }
+    free(encoded);
+    storage_index_frames(storage, writer, &frame, 1, written);
+    storage_release_writer(storage);
+    return frame.res;
+}
+
+static IoEngine *storage_io_engine(Storage *storage) {
+    IoEngine *engine = pthread_getspecific(storage->io_engine_key);
+    if (engine == NULL) {
+        engine = ioe_create((unsigned) storage->config.write_batch);
+        pthread_setspecific(storage->io_engine_key, engine);
+    }
+    return engine;
+}
+
+/**
+ * Отбрасывает запросы движка потока, результаты которых не получены из-за ошибки отправки или ожидания. Если
+ * дождаться их не удалось, движок закрывается, а следующая пачка потока создаёт новый.
+ */
+static void storage_drain_io_engine(Storage *storage, IoEngine *engine) {
+    if (ioe_drain(engine) != LPX_SUCCESS) {
+        pthread_setspecific(storage->io_engine_key, NULL);
+        ioe_free(engine);
+    }
+}
+
+/**
+ * Фрейм пачки, место под который выделено в сегменте
+ */
+typedef struct ReservedFrame {
+    SegmentSlot slot;
+    const uint8_t *buf; // записываемые данные: исходный или сжатый фрейм
+    size_t size;
+    uint8_t *encoded; // сжатый фрейм или NULL
+    size_t written;
+    bool queued; // запись поставлена в очередь движка ввода-вывода
+    uint64_t done_us; // время окончания записи фрейма
+} ReservedFrame;
+
+/**
+ * Учитывает в счётчиках томов записанные фреймы пачки. Временем записи на том считается время от отправки пачки до
+ * окончания записи последнего фрейма тома: фреймы одного тома пишутся параллельно.
+ */
+static void storage_account_volumes(SegmentWriter *writer, FrameWrite *frames, ReservedFrame *reserved,
+                                    size_t frames_cnt, uint64_t submit_us) {
+    for (size_t i = 0; i < frames_cnt; i++) {
+        if (frames[i].res != LPX_SUCCESS || reserved[i].done_us == 0) {
+            continue;
+        }
+        size_t volume = reserved[i].slot.volume;
+        uint64_t done_us = 0;
+        for (size_t j = i; j < frames_cnt; j++) {
+            if (frames[j].res == LPX_SUCCESS && reserved[j].done_us != 0 && reserved[j].slot.volume == volume) {
+                segw_account(writer, volume, 1, reserved[j].size, 0);
+                done_us = reserved[j].done_us > done_us ? reserved[j].done_us : done_us;
+                reserved[j].done_us = 0;
+            }
+        }
+        segw_account(writer, volume, 0, 0, done_us - submit_us);
+    }
+}
+
+/**
+ * Запись фреймов одного стрима одним запросом. Место под все фреймы выделяется заранее, данные отправляются на диск
+ * через движок ввода-вывода, а расположения фреймов записываются в таблицу после завершения записи данных.
+ */
+static void storage_write_train_frames(Storage *storage, IoEngine *engine, FrameWrite *frames, size_t frames_cnt) {
+    SegmentWriter *writer;
+    FrameFormat format;
+    int8_t res = storage_acquire_writer(storage, frames[0].train_id, &writer, &format);
+    if (res != LPX_SUCCESS) {
+        for (size_t i = 0; i < frames_cnt; i++) {
+            frames[i].res = res;
+        }
+        return;
+    }
+
+    ReservedFrame *reserved = xcalloc(frames_cnt, sizeof(ReservedFrame));
+    uint64_t written = 0;
+    for (size_t i = 0; i < frames_cnt; i++) {
+        FrameWrite *frame = &frames[i];
+        ReservedFrame *r = &reserved[i];
+        size_t buf_size;
+        r->size = storage_encode_frame(storage, &format, frame->buf, frame->size, &r->encoded, &buf_size);
+        if (r->encoded != NULL) {
+            r->buf = r->encoded;
+        } else {
+            r->buf = frame->buf;
+            r->size = frame->size;
+            buf_size = frame->buf_size;
+        }
+        bool aligned = (uintptr_t) r->buf % SEG_DIRECT_ALIGN == 0 && buf_size % SEG_DIRECT_ALIGN == 0;
+        frame->res = segw_reserve(writer, r->size, aligned, &r->slot);
+        if (frame->res == LPX_SUCCESS) {
+            r->slot.location.flags = r->encoded != NULL ? SEG_FRAME_LPXC : 0;
+            seg_checksum(&r->slot.location, r->buf);
+            r->queued = ioe_write(engine, r->slot.fd, r->buf, r->slot.write_size, r->slot.location.offset, i) ==
+                        LPX_SUCCESS;
+        }
+    }
+    uint64_t submit_us = monotonic_us();
+    bool failed = ioe_submit(engine) != LPX_SUCCESS;
+
+    IoCompletion completion;
+    while (!failed && ioe_pending(engine) > 0) {
+        if (ioe_wait(engine, &completion) != LPX_SUCCESS) {
+            failed = true;
+            break;
+        }
+        ReservedFrame *r = &reserved[completion.user_data];
+        r->queued = false;
+        r->done_us = monotonic_us();
+        if (completion.result >= 0) {
+            r->written = (size_t) completion.result;
+        } else if (r->slot.fd != r->slot.buffered_fd) {
+            // прямая запись не удалась (например, EINVAL из-за выравнивания), фрейм пишется через page cache
+            r->slot.fd = r->slot.buffered_fd;
+            r->slot.write_size = r->size;
+        } else {
+            frames[completion.user_data].res = LPX_IO;
+        }
+    }
+    if (failed) {
+        // ядро ещё может писать из буферов пачки, а их завершения не должны достаться следующей пачке
+        storage_drain_io_engine(storage, engine);
+    }
+
+    for (size_t i = 0; i < frames_cnt; i++) {
+        FrameWrite *frame = &frames[i];
+        ReservedFrame *r = &reserved[i];
+        if (frame->res != LPX_SUCCESS) {
+            continue;
+        }
+        if (r->queued) {
+            // результат записи не получен
+            frame->res = LPX_IO;
+            continue;
+        }
+        // короткая запись и запись, не поместившаяся в очередь движка, дописываются синхронно
+        while (r->written < r->slot.write_size) {
+            ssize_t w = pwrite(r->slot.fd, r->buf + r->written, r->slot.write_size - r->written,
+                               r->slot.location.offset + r->written);
+            if (w > 0) {
+                r->written += w;
+            } else if (r->slot.fd != r->slot.buffered_fd) {
+                // остаток после короткой прямой записи может быть не выровнен
+                r->slot.fd = r->slot.buffered_fd;
+                r->slot.write_size = r->size;
+            } else {
+                frame->res = LPX_IO;
+                break;
+            }
+            r->done_us = monotonic_us();
+        }
+        if (frame->res == LPX_SUCCESS) {
+            frame->res = segw_commit(writer, frame->frame_idx, &r->slot.location);
+        }
+        if (frame->res == LPX_SUCCESS) {
+            written += r->size;
+            if (storage->config.durability != STRG_DURABLE_NONE) {
+                // ядро начинает писать фрейм сразу, и фиксации остаётся меньше работы
+                segw_start_writeback(&r->slot);
+            }
+        }
+    }
+    storage_account_written(storage, written);
+    storage_account_volumes(writer, frames, reserved, frames_cnt, submit_us);
+    storage_index_frames(storage, writer, frames, frames_cnt, written);
+    storage_release_writer(storage);
+
+    for (size_t i = 0; i < frames_cnt; i++) {
+        free(reserved[i].encoded);
+    }
+    free(reserved);
+}
+
+/**
+ * Запись пачки фреймов потоком отложенной записи. Фреймы разных стримов пишутся отдельными запросами, потому что
+ * переход к другому стриму закрывает писателя сегментов предыдущего.
+ */
+static void storage_write_frames(void *ctx, FrameWrite *frames, size_t frames_cnt) {
+    Storage *storage = ctx;
+
+    size_t start = 0;
+    while (start < frames_cnt) {
+        size_t end = start + 1;
+        while (end < frames_cnt && strcmp(frames[end].train_id, frames[start].train_id) == 0) {
+            end++;
+        }
+        // движок берётся для каждого стрима: после ошибки записи предыдущего он мог быть закрыт
+        storage_write_train_frames(storage, storage_io_engine(storage), frames + start, end - start);
+        start = end;
+    }
+}
+
+/**
+ * Раскладка фрейма стрима train_id размером size байт на строки: если формат фреймов стрима задан
+ * storage_store_format, фрейм сохраняется без выравнивания строк и буфера. Иначе, как и для фреймов, не совпадающих с
+ * форматом, фрейм сохраняется одной строкой целиком. Вызывается под writer_mutex.
+ */
+static void storage_frame_rows(Storage *storage, const char *train_id, size_t size, size_t *row_size, size_t *stride,
+                               size_t *rows) {
+    *row_size = size;
+    *stride = size;
+    *rows = 1;
+    const FrameFormat *format = &storage->source_format;
+    if (strcmp(storage->source_train_id, train_id) != 0 || format->height == 0) {
+        return;
+    }
+    size_t format_row_size = mnf_row_size(format);
+    if (format->stride < format_row_size || size < (size_t) format->stride * (format->height - 1) + format_row_size) {
+        return;
+    }
+    *row_size = format_row_size;
+    *stride = format->stride;
+    *rows = format->height;
+}
+
+int8_t storage_store_frame(Storage *storage, char *train_id, uint32_t frame_idx, const uint8_t *buf, size_t size,
+                           const FrameMeta *meta) {
+    size_t row_size, stride, rows;
+    lock_writer(storage);
+    storage_frame_rows(storage, train_id, size, &row_size, &stride, &rows);
+    // в режиме STRG_DURABLE_FRAME сохранение возвращает результат фиксации фрейма, поэтому фрейм пишется и
+    // фиксируется в вызывающем потоке, а не в очереди
+    if (storage->config.write_queue_depth > 0 && storage->config.durability != STRG_DURABLE_FRAME &&
+        storage->frame_writer == NULL) {
+        storage->frame_writer = fwr_create(storage->config.write_queue_depth, storage->config.write_threads,
+                                           storage->config.write_batch,
+                                           storage->config.direct_io ? SEG_DIRECT_ALIGN : 0,
+                                           storage_write_frames, storage);
+    }
+    FrameWriter *frame_writer = storage->frame_writer;
+    unlock_writer(storage);
+
+    if (frame_writer != NULL) {
+        // выравнивание отбрасывается при копировании фрейма в очередь, отдельного прохода по фрейму нет
+        return fwr_submit_rows(frame_writer, train_id, frame_idx, buf, row_size, stride, rows, meta);
+    }
+
+    // отложенная запись выключена или не удалось запустить её потоки, пишем синхронно
+    if (rows == 1) {
+        return storage_write_frame(storage, train_id, frame_idx, buf, size, meta);
+    }
+    uint8_t *compact = xmalloc(row_size * rows);
+    copy_rows(compact, buf, row_size, stride, rows);
+    int8_t res = storage_write_frame(storage, train_id, frame_idx, compact, row_size * rows, meta);
+    free(compact);
+    return res;
 }
 
-static char *frame_path(char *train_dir, size_t frame_idx) {
-    char frame_file[21 + 1]; // Любое число uint64_t влезет в 21 символ
-    snprintf(frame_file, 16, "%ld", frame_idx);
-    char *frame_path = append_path(train_dir, frame_file);
-    return frame_path;
+int8_t storage_flush(Storage *storage) {
+    lock_writer(storage);
+    FrameWriter *frame_writer = storage->frame_writer;
+    unlock_writer(storage);
+
+    return frame_writer != NULL ? fwr_flush(frame_writer) : LPX_SUCCESS;
 }
 
-int8_t storage_prepare(Storage *storage, char *train_id) {
-    int8_t res = LPX_SUCCESS;
+void storage_writer_stats(Storage *storage, FrameWriterStats *stats) {
+    lock_writer(storage);
+    FrameWriter *frame_writer = storage->frame_writer;
+    unlock_writer(storage);
+
+    if (frame_writer != NULL) {
+        fwr_stats(frame_writer, stats);
+    } else {
+        memset(stats, 0, sizeof(FrameWriterStats));
+        stats->queue_capacity = storage->config.write_queue_depth;
+    }
+}
 
-    char *td = train_dir(storage, train_id);
+int8_t
+storage_store_stream_idx(Storage *storage, char *train_id, const FrameMeta *index, size_t frames_cnt) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
 
-    if (access(td, F_OK) == 0) {
-        res = STRG_EXISTS;
+    // индекс пишется после последнего фрейма стрима. Ошибки записи фреймов сообщает storage_flush, который
+    // вызывающий делает перед записью индекса, здесь дожидаемся только окончания записи.
+    storage_flush(storage);
+    lock_writer(storage);
+    res = storage_close_writer(storage, train_id);
+    unlock_writer(storage);
+    if (res != LPX_SUCCESS) {
         goto cleanup;
     }
 
-    if (mkdir(td, 0777) != 0) {
-        res = LPX_IO;
-        goto cleanup;
+    res = sidx_write(td, index, frames_cnt, 0);
+    if (res == LPX_SUCCESS) {
+        lock_catalog(storage);
+        storage_catalog_add(storage, train_id);
+        unlock_catalog(storage);
     }
 
     cleanup:
-    free(td);
+    storage_release_dir(storage, td);
 
     return res;
 }
 
-int8_t
-storage_store_frame(Storage *storage, char *train_id, uint32_t frame_idx, const uint8_t *buf, size_t size) {
-    int8_t res = LPX_SUCCESS;
-
-    char *td = train_dir(storage, train_id);
-
-    if (access(td, F_OK) != 0) {
-        res = STRG_NOT_FOUND;
-        goto free_td;
+int8_t storage_seal_stream(Storage *storage, char *train_id) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
     }
 
-    char *fp = frame_path(td, frame_idx);
-
-    FILE *frame_f = fopen(fp, "w+");
-    if (frame_f == NULL) {
-        res = LPX_IO;
-        goto free_fp;
+    // ошибки записи фреймов сообщает storage_flush, который вызывающий делает перед закрытием индекса
+    storage_flush(storage);
+    lock_writer(storage);
+    storage_wait_writer_idle(storage);
+    IndexWriter *index_writer = NULL;
+    if (storage->writer != NULL && strcmp(storage->writer_train_id, train_id) == 0) {
+        // фреймы должны попасть на диск раньше закрытого индекса
+        res = segw_sync(storage->writer);
+        index_writer = storage->index_writer;
+        storage->index_writer = NULL;
     }
-
-    if (fwrite(buf, 1, size, frame_f) == -1) {
+    if (storage_close_writer(storage, train_id) != LPX_SUCCESS) {
         res = LPX_IO;
-        goto close_file;
+    }
+    unlock_writer(storage);
+    if (res != LPX_SUCCESS) {
+        if (index_writer != NULL) {
+            sidxw_close(index_writer);
+        }
+        goto cleanup;
     }
 
-    close_file:
-    fclose(frame_f);
+    if (index_writer == NULL) {
+        // стрим без фреймов или записанный другим экземпляром хранилища
+        res = sidxw_open(td, &index_writer);
+        if (res == STRG_EXISTS) {
+            res = LPX_SUCCESS;
+            goto catalog_add;
+        } else if (res != LPX_SUCCESS) {
+            goto cleanup;
+        }
+    }
+    res = sidxw_seal(index_writer);
 
-    free_fp:
-    free(fp);
+    catalog_add:
+    if (res == LPX_SUCCESS) {
+        lock_catalog(storage);
+        storage_catalog_add(storage, train_id);
+        unlock_catalog(storage);
+    }
 
-    free_td:
-    free(td);
+    cleanup:
+    storage_release_dir(storage, td);
 
     return res;
 }
 
-int8_t
-storage_store_stream_idx(Storage *storage, char *train_id, FrameMeta **index, size_t frames_cnt) {
-    int8_t res = LPX_SUCCESS;
-
-    char *td = train_dir(storage, train_id);
+int8_t storage_store_format(Storage *storage, char *train_id, const FrameFormat *format) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
 
-    if (access(td, F_OK) != 0) {
-        res = STRG_NOT_FOUND;
-        goto cleanup;
+    // фреймы хранятся без выравнивания: строки идут подряд, буфер заканчивается последней строкой
+    FrameFormat stored = *format;
+    stored.stride = (uint32_t) mnf_row_size(format);
+    stored.frame_size = (uint64_t) stored.stride * stored.height;
+    res = mnf_write(td, &stored);
+    storage_release_dir(storage, td);
+    if (res == LPX_SUCCESS) {
+        lock_writer(storage);
+        strncpy(storage->source_train_id, train_id, MAX_INT_LEN);
+        storage->source_format = *format;
+        if (storage->writer != NULL && strcmp(storage->writer_train_id, train_id) == 0) {
+            storage->writer_format = stored;
+        }
+        unlock_writer(storage);
     }
 
-    char *idx_path = append_path(td, "index.csv");
+    return res;
+}
 
-    FILE *idx_f = fopen(idx_path, "w+");
-    if (idx_f == NULL) {
-        res = LPX_IO;
-        goto cleanup;
+int8_t storage_read_format(Storage *storage, char *train_id, FrameFormat *format) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
     }
 
-    for (int i = 0; i < frames_cnt; i++) {
-        int r = fprintf(idx_f, FRAME_FORMAT, index[i]->start_time, index[i]->end_time);
-        if (r < 0) {
-            goto close_file;
-        }
-    }
+    res = storage_frame_format(td, format);
+    storage_release_dir(storage, td);
 
-    close_file:
-    fclose(idx_f);
+    return res;
+}
 
-    cleanup:
-    free(td);
-    free(idx_path);
+int8_t storage_open_stream_idx(Storage *storage, char *train_id, StreamIndex **index) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+
+    res = sidx_open(td, index);
+    storage_release_dir(storage, td);
 
     return res;
 }
 
-int8_t storage_read_stream_idx(Storage *storage, char *train_id, FrameMeta ***index, size_t *frames_cnt) {
-    int8_t res = LPX_SUCCESS;
-
-    char *td = train_dir(storage, train_id);
+/**
+ * Заполняет расположение фрейма frame_idx в директории стрима. table - таблица фреймов стрима или NULL, если стрим
+ * записан в устаревшем формате - по файлу на фрейм.
+ */
+static int8_t storage_frame_ref(Storage *storage, SegmentTable *table, size_t frame_idx, FrameRef *ref) {
+    ref->verify = false;
+    if (table != NULL) {
+        const FrameLocation *location = segt_frame(table, frame_idx);
+        if (location == NULL) {
+            return STRG_NOT_FOUND;
+        }
+        seg_name(location->segment, ref->file);
+        ref->offset = location->offset;
+        ref->length = location->length;
+        ref->compressed = (location->flags & SEG_FRAME_LPXC) != 0;
+        // у фреймов таблиц первой версии контрольной суммы нет
+        ref->verify = storage->config.verify_crc && (location->flags & SEG_FRAME_CRC) != 0;
+        ref->crc = location->crc;
+    } else {
+        snprintf(ref->file, sizeof(ref->file), "%zu", frame_idx);
+        ref->offset = 0;
+        ref->length = 0;
+        ref->compressed = false;
+    }
+    snprintf(ref->name, sizeof(ref->name), "%zu", frame_idx);
+    return LPX_SUCCESS;
+}
 
-    if (access(td, F_OK) != 0) {
-        res = STRG_NOT_FOUND;
-        goto free_td;
+int8_t storage_read_frame(Storage *storage, char *train_id, uint32_t frame_idx, uint8_t **buf, size_t *buf_size) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
     }
 
-    char *idx_path = append_path(td, "index.csv");
-    if (access(idx_path, F_OK) != 0) {
-        res = STRG_NOT_FOUND;
-        goto free_td;
+    SegmentTable *table;
+    res = storage_open_frame_table(td, &table);
+    if (res != LPX_SUCCESS) {
+        goto release_td;
     }
 
-    FILE *idx_f = fopen(idx_path, "r");
-    if (idx_f == NULL) {
-        res = LPX_IO;
-        goto free_td;
+    FrameRef ref = {0};
+    res = storage_frame_ref(storage, table, frame_idx, &ref);
+    if (res != LPX_SUCCESS) {
+        goto close_table;
     }
 
-    List *frames = lst_create();
+    int fd = openat(td, ref.file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        res = errno == ENOENT ? STRG_NOT_FOUND : LPX_IO;
+        goto close_table;
+    }
 
-    char *buf = xcalloc(sizeof(char), 256);
-    while (fgets(buf, 256, idx_f) != NULL) {
-        FrameMeta *frame = xmalloc(sizeof(FrameMeta));
-        int r = sscanf(buf, FRAME_FORMAT, &frame->start_time, &frame->end_time);
-        if (r == EOF || r != 2) {
-            res = STRG_BAD_INDEX;
-            goto free_frames;
+    size_t size = (size_t) ref.length;
+    if (size == 0) {
+        if (fd_size(fd, (off_t *) &size) != LPX_SUCCESS) {
+            res = LPX_IO;
+            goto close_file;
         }
-        lst_append(frames, frame);
     }
-    if (ferror(idx_f)) {
-        res = LPX_IO;
-        goto free_frames;
+    *buf = xmalloc(size);
+    *buf_size = size;
+
+    size_t read = 0;
+    while (read < size) {
+        ssize_t r = pread(fd, *buf + read, size - read, ref.offset + read);
+        if (r <= 0) {
+            free(*buf);
+            *buf = NULL;
+            res = LPX_IO;
+            goto close_file;
+        }
+        read += r;
     }
 
-    FrameMeta **frame_array = lst_size(frames) == 0 ? NULL : xcalloc(lst_size(frames), sizeof(FrameMeta *));
+    if (ref.verify && crc32c(0, *buf, size) != ref.crc) {
+        fprintf(stderr, "Frame %u of stream %s checksum mismatch\n", frame_idx, train_id);
+        free(*buf);
+        *buf = NULL;
+        res = LPX_CORRUPT;
+        goto close_file;
+    }
 
-    if (lst_size(frames) > 0) {
-        lst_to_array(frames, (const void **) frame_array);
+    if (ref.compressed) {
+        size_t raw_size;
+        uint8_t *raw = NULL;
+        if (cdc_raw_size(*buf, size, &raw_size) == LPX_SUCCESS) {
+            raw = xmalloc(raw_size);
+            if (cdc_decode(*buf, size, raw) != LPX_SUCCESS) {
+                free(raw);
+                raw = NULL;
+            }
+        }
+        free(*buf);
+        *buf = raw;
+        if (raw == NULL) {
+            res = LPX_IO;
+            goto close_file;
+        }
+        *buf_size = raw_size;
     }
 
-    *index = frame_array;
-    *frames_cnt = lst_size(frames);
+    close_file:
+    close(fd);
 
-    free_frames:
-    lst_free(frames);
-    fclose(idx_f);
-    free(buf);
+    close_table:
+    if (table != NULL) {
+        segt_close(table);
+    }
 
-    free_td:
-    free(td);
-    free(idx_path);
+    release_td:
+    storage_release_dir(storage, td);
 
     return res;
 }
 
-int8_t storage_read_frame(Storage *storage, char *train_id, uint32_t frame_idx, uint8_t **buf, size_t *buf_size) {
-    int8_t res = LPX_SUCCESS;
+int8_t storage_map_frame(Storage *storage, char *train_id, uint32_t frame_idx, MappedFrame *frame) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
 
-    char *td = train_dir(storage, train_id);
-    if (access(td, F_OK) != 0) {
-        res = STRG_NOT_FOUND;
-        goto cleanup;
+    SegmentTable *table;
+    res = storage_open_frame_table(td, &table);
+    if (res != LPX_SUCCESS) {
+        goto release_td;
     }
 
-    char *fp = frame_path(td, frame_idx);
-    if (access(fp, F_OK) != 0) {
-        res = STRG_NOT_FOUND;
-        goto cleanup;
+    FrameRef ref = {0};
+    res = storage_frame_ref(storage, table, frame_idx, &ref);
+    if (res != LPX_SUCCESS) {
+        goto close_table;
     }
 
-    FILE *frame_f = fopen(fp, "r");
-    if (frame_f == NULL) {
-        res = LPX_IO;
-        goto cleanup;
+    int fd = openat(td, ref.file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        res = errno == ENOENT ? STRG_NOT_FOUND : LPX_IO;
+        goto close_table;
+    }
+    res = stream_map_frame(fd, &ref, frame);
+    close(fd);
+
+    close_table:
+    if (table != NULL) {
+        segt_close(table);
     }
 
+    release_td:
+    storage_release_dir(storage, td);
 
-    size_t size;
-    if (file_size(frame_f, (off_t *) &size) != 0) {
-        res = LPX_IO;
-        goto close_file;
+    return res;
+}
+
+void storage_unmap_frame(MappedFrame *frame) {
+    stream_unmap_frame(frame);
+}
+
+int8_t storage_map_frames(Storage *storage, char *train_id, const uint32_t *frame_idxs, size_t frames_cnt,
+                          MappedFrame *frames) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
     }
-    *buf = xmalloc(size);
-    *buf_size = size;
 
-    if (fread(*buf, size, 1, frame_f) != 0) {
-        res = LPX_IO;
-        goto close_file;
+    SegmentTable *table;
+    res = storage_open_frame_table(td, &table);
+    if (res != LPX_SUCCESS) {
+        goto release_td;
     }
 
-    close_file:
-    fclose(frame_f);
+    FrameRef *refs = xcalloc(frames_cnt > 0 ? frames_cnt : 1, sizeof(FrameRef));
+    for (size_t i = 0; i < frames_cnt; i++) {
+        res = storage_frame_ref(storage, table, frame_idxs[i], &refs[i]);
+        if (res != LPX_SUCCESS) {
+            goto free_refs;
+        }
+    }
+    res = stream_map_frames(td, refs, frames_cnt, frames);
 
-    cleanup:
-    free(td);
-    free(fp);
+    free_refs:
+    free(refs);
+
+    if (table != NULL) {
+        segt_close(table);
+    }
+
+    release_td:
+    storage_release_dir(storage, td);
 
     return res;
 }
 
+/**
+ * Идентификаторы всех стримов хранилища, в том числе разложенных по директориям суток
+ */
 static int8_t storage_list_streams(Storage *storage, char ***train_ids, size_t *train_ids_size) {
-    return list_directory(storage->base_dir, train_ids, train_ids_size);
+    char **names;
+    size_t names_size;
+    if (list_directory_at(storage->base_fd, ".", &names, &names_size) != LPX_SUCCESS) {
+        return LPX_IO;
+    }
+
+    List *ids = lst_create();
+    for (size_t i = 0; i < names_size; i++) {
+        char **bucket_names;
+        size_t bucket_names_size;
+        if (ctlg_is_train_id(names[i])) {
+            lst_append(ids, strdup(names[i]));
+        } else if (is_bucket_name(names[i]) &&
+                   list_directory_at(storage->base_fd, names[i], &bucket_names, &bucket_names_size) == LPX_SUCCESS) {
+            for (size_t j = 0; j < bucket_names_size; j++) {
+                if (ctlg_is_train_id(bucket_names[j])) {
+                    lst_append(ids, strdup(bucket_names[j]));
+                }
+            }
+            free_array((void **) bucket_names, bucket_names_size);
+        }
+    }
+    free_array((void **) names, names_size);
+
+    *train_ids_size = lst_size(ids);
+    *train_ids = xcalloc(*train_ids_size > 0 ? *train_ids_size : 1, sizeof(char *));
+    lst_to_array(ids, (const void **) *train_ids);
+    lst_free(ids);
+
+    return LPX_SUCCESS;
 }
 
-static int8_t storage_read_frame_meta(Storage *storage, char *train_id, uint32_t idx, FrameMeta **frame_meta) {
-    int8_t res = LPX_SUCCESS;
+int8_t storage_find_stream(Storage *storage, uint64_t time, char **train_id) {
+    lock_catalog(storage);
+    if (storage_catalog_sync_time(storage, time) != LPX_SUCCESS) {
+        unlock_catalog(storage);
+        return LPX_IO;
+    }
+
+    const CatalogEntry *entry = ctlg_find(storage->catalog, (int64_t) time);
+    if (entry != NULL) {
+        *train_id = xcalloc(strlen(entry->train_id) + 1, sizeof(char));
+        strcpy(*train_id, entry->train_id);
+    }
+    unlock_catalog(storage);
 
-    char *td = train_dir(storage, train_id);
+    return LPX_SUCCESS;
+}
 
-    if (access(td, F_OK) != 0) {
-        res = STRG_NOT_FOUND;
-        goto cleanup;
+/**
+ * Открывает поток байт, содержащий фреймы стрима с заданными индексами. Если advise_all, ядро сразу получает
+ * подсказки на чтение всех фреймов потока, а не только ближайших read_ahead.
+ */
+static int8_t
+storage_open_frames(Storage *storage, char *train_id, const size_t *frame_idxs, size_t frames_cnt, bool advise_all,
+                    VideoStreamBytesStream **stream) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
     }
 
-    char *idx_path = append_path(td, "index.csv");
-    if (access(idx_path, F_OK) != 0) {
-        res = STRG_NOT_FOUND;
-        goto cleanup;
+    SegmentTable *table;
+    res = storage_open_frame_table(td, &table);
+    if (res != LPX_SUCCESS) {
+        goto release_td;
     }
 
-    FILE *idx_f = fopen(idx_path, "r");
-    if (idx_f == NULL) {
-        res = LPX_IO;
-        goto cleanup;
+    FrameFormat format;
+    res = storage_frame_format(td, &format);
+    if (res != LPX_SUCCESS) {
+        goto close_table;
     }
 
+    FrameRef *frames = xcalloc(frames_cnt > 0 ? frames_cnt : 1, sizeof(FrameRef));
+    for (size_t i = 0; i < frames_cnt; i++) {
+        res = storage_frame_ref(storage, table, frame_idxs[i], &frames[i]);
+        if (res != LPX_SUCCESS) {
+            free(frames);
+            goto close_table;
+        }
+    }
 
-    char *buf = NULL;
-    buf = xcalloc(sizeof(char), 256);
-    FrameMeta *frame = xmalloc(sizeof(FrameMeta));
-    while (fgets(buf, 256, idx_f) != NULL) {
-        int r = sscanf(buf, FRAME_FORMAT, &frame->start_time, &frame->end_time);
-        if (r == EOF || r != 2) {
-            res = STRG_BAD_INDEX;
-            goto close_file;
+    if (advise_all) {
+        stream_advise_frames(td, frames, frames_cnt);
+        // повреждение нескольких выбранных фреймов выгоднее обнаружить до начала выдачи архива, пока клиенту ещё
+        // можно ответить ошибкой: фреймы всё равно читаются с диска, а при выдаче берутся из page cache
+        size_t corrupted;
+        res = stream_verify_frames(td, frames, frames_cnt, &corrupted);
+        if (res == LPX_CORRUPT) {
+            fprintf(stderr, "Frame %s of stream %s checksum mismatch\n", frames[corrupted].name, train_id);
         }
-        if (idx-- == 0) {
-            break;
+        if (res != LPX_SUCCESS) {
+            free(frames);
+            goto close_table;
         }
     }
-    if (ferror(idx_f)) {
+    // поток держит свою копию дескриптора директории, так что стрим можно удалить во время его чтения
+    *stream = stream_open(td, &format, frames, frames_cnt, advise_all ? 0 : storage->config.read_ahead);
+    if (*stream == NULL) {
+        free(frames);
         res = LPX_IO;
-        goto close_file;
     }
 
-    *frame_meta = frame;
-
-    close_file:
-    fclose(idx_f);
-    free(buf);
+    close_table:
+    if (table != NULL) {
+        segt_close(table);
+    }
 
-    cleanup:
-    free(td);
-    free(idx_path);
+    release_td:
+    storage_release_dir(storage, td);
 
     return res;
 }
 
-int8_t storage_find_stream(Storage *storage, uint64_t time, char **train_id) {
-    char **streams;
-    size_t streams_size;
-    int8_t res = list_directory(storage->base_dir, &streams, &streams_size);
+int8_t storage_open_stream(Storage *storage, char *train_id, size_t offset_idx, VideoStreamBytesStream **stream) {
+    StreamIndex *index = NULL;
+    int8_t res = storage_open_stream_idx(storage, train_id, &index);
     if (res != LPX_SUCCESS) {
         return LPX_IO;
     }
+    size_t index_size = sidx_size(index);
+    sidx_close(index);
 
-    ssize_t found_train_idx = -1;
-    for (int i = 0; i < streams_size; i++) {
-        FrameMeta **index;
-        size_t index_size;
-        res = storage_read_stream_idx(storage, streams[i], &index, &index_size);
-        if (res != LPX_SUCCESS) {
+    size_t frames_cnt = offset_idx < index_size ? index_size - offset_idx : 0;
+    size_t *frame_idxs = xcalloc(frames_cnt > 0 ? frames_cnt : 1, sizeof(size_t));
+    for (size_t i = 0; i < frames_cnt; i++) {
+        frame_idxs[i] = i + offset_idx;
+    }
+
+    res = storage_open_frames(storage, train_id, frame_idxs, frames_cnt, false, stream);
+    free(frame_idxs);
+
+    return res == LPX_SUCCESS || res == LPX_CORRUPT ? res : LPX_IO;
+}
+
+/**
+ * Источник фреймов записываемого стрима (StreamTail). Любое изменение директории стрима будит читателя, а фреймы
+ * берутся из индекса: запись индекса появляется после записи фрейма и его расположения в таблице фреймов.
+ */
+typedef struct TrainTail {
+    Storage *storage;
+    int td;
+    int inotify_fd;
+    size_t next_idx; // индекс следующего фрейма стрима, который ещё не отдан в поток
+} TrainTail;
+
+static int8_t storage_tail_next(void *ctx, FrameRef **frames, size_t *frames_size, bool *sealed) {
+    TrainTail *tail = ctx;
+    // события вычитываются до чтения индекса, так что фреймы, дописанные после этого, разбудят читателя снова
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(tail->inotify_fd, events, sizeof(events)) > 0);
+
+    StreamIndex *index;
+    int8_t res = sidx_open(tail->td, &index);
+    if (res == STRG_NOT_FOUND) {
+        // индекс появится с первым фреймом
+        return LPX_SUCCESS;
+    } else if (res != LPX_SUCCESS) {
+        return res;
+    }
+    size_t size = sidx_size(index);
+    SegmentTable *table = NULL;
+    if (size > tail->next_idx) {
+        res = storage_open_frame_table(tail->td, &table);
+    }
+    if (res == LPX_SUCCESS && size > tail->next_idx) {
+        *frames = xrealloc(*frames, (*frames_size + size - tail->next_idx) * sizeof(FrameRef));
+    }
+    for (; res == LPX_SUCCESS && tail->next_idx < size; tail->next_idx++) {
+        const FrameMeta *meta = sidx_frame(index, tail->next_idx);
+        FrameRef *ref = &(*frames)[*frames_size];
+        memset(ref, 0, sizeof(FrameRef));
+        // у пропущенного фрейма нет ни записи в индексе, ни расположения
+        if (meta->start_time == 0 || storage_frame_ref(tail->storage, table, tail->next_idx, ref) != LPX_SUCCESS) {
             continue;
         }
-        ssize_t idx = stream_find_frame_abs(index, index_size, time);
-        free_array((void **) index, index_size);
-        if (idx != -1) {
-            found_train_idx = i;
-        }
+        ref->end_time = meta->end_time;
+        (*frames_size)++;
     }
-    if (found_train_idx != -1) {
-        *train_id = xcalloc(strlen(streams[found_train_idx]) + 1, sizeof(char));
-        strcpy(*train_id, streams[found_train_idx]);
+    *sealed = res == LPX_SUCCESS && sidx_sealed(index);
+
+    if (table != NULL) {
+        segt_close(table);
     }
+    sidx_close(index);
 
-    free_array((void **) streams, streams_size);
+    return res;
+}
 
-    return LPX_SUCCESS;
+static void storage_tail_free(void *ctx) {
+    TrainTail *tail = ctx;
+    close(tail->inotify_fd);
+    close(tail->td);
+    free(tail);
 }
 
-int8_t storage_open_stream(Storage *storage, char *train_id, size_t offset_idx, VideoStreamBytesStream **stream) {
-    char *td = train_dir(storage, train_id);
-    FrameMeta **index = NULL;
-    size_t index_size = 0;
-    int8_t res = storage_read_stream_idx(storage, train_id, &index, &index_size);
+int8_t storage_follow_stream(Storage *storage, char *train_id, size_t offset_idx, VideoStreamBytesStream **stream) {
+    int td;
+    int8_t res = storage_acquire_dir(storage, train_id, &td);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+
+    FrameFormat format;
+    res = storage_frame_format(td, &format);
     if (res != LPX_SUCCESS) {
+        goto release_td;
+    }
+
+    TrainTail *tail = xcalloc(1, sizeof(TrainTail));
+    tail->storage = storage;
+    tail->next_idx = offset_idx;
+    tail->td = fcntl(td, F_DUPFD_CLOEXEC, 0);
+    tail->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    // директория отслеживается через свой дескриптор: путь к ней меняется при раскладке по суткам
+    char path[sizeof("/proc/self/fd/") + MAX_INT_LEN];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", tail->td);
+    if (tail->td == -1 || tail->inotify_fd == -1 ||
+        inotify_add_watch(tail->inotify_fd, path, IN_MODIFY | IN_CREATE | IN_MOVED_TO) == -1) {
         res = LPX_IO;
-        goto free_index;
+        goto free_tail;
     }
 
-    size_t files_size = offset_idx < index_size ? index_size - offset_idx : 0;
-    char **files = xcalloc(files_size, sizeof(char *));
-    for (size_t i = 0; i < files_size; i++) {
-        files[i] = frame_path(td, i + offset_idx);
+    StreamTail stream_tail = {
+            .next = storage_tail_next,
+            .free = storage_tail_free,
+            .ctx = tail,
+            .wake_fd = tail->inotify_fd
+    };
+    FrameRef *frames = xcalloc(1, sizeof(FrameRef));
+    *stream = stream_follow(td, &format, frames, 0, storage->config.read_ahead, &stream_tail, FOLLOW_IDLE_MS);
+    if (*stream == NULL) {
+        free(frames);
+        res = LPX_IO;
+        goto free_tail;
     }
+    storage_release_dir(storage, td);
 
-    *stream = stream_open(files, files_size);
+    return LPX_SUCCESS;
 
-    free_index:
-    free_array((void **) index, index_size);
+    free_tail:
+    if (tail->inotify_fd != -1) {
+        close(tail->inotify_fd);
+    }
+    if (tail->td != -1) {
+        close(tail->td);
+    }
+    free(tail);
 
-    free(td);
+    release_td:
+    storage_release_dir(storage, td);
 
     return res;
 }
 
 int8_t
 storage_open_stream_frames(Storage *storage, char *train_id, List *frame_indexes, VideoStreamBytesStream **stream) {
-    char *td = train_dir(storage, train_id);
-    FrameMeta **index = NULL;
-    size_t index_size = 0;
-    int8_t res = storage_read_stream_idx(storage, train_id, &index, &index_size);
+    StreamIndex *index = NULL;
+    int8_t res = storage_open_stream_idx(storage, train_id, &index);
     if (res != LPX_SUCCESS) {
-        res = LPX_IO;
-        goto free_index;
+        return LPX_IO;
     }
+    sidx_close(index);
 
-    size_t files_size = lst_size(frame_indexes);
-    char **files = xcalloc(files_size, sizeof(char *));
+    size_t frames_cnt = lst_size(frame_indexes);
+    size_t *frame_idxs = xcalloc(frames_cnt > 0 ? frames_cnt : 1, sizeof(size_t));
     ListIter *iter = lst_iterator(frame_indexes);
     for (int i = 0; lst_iter_advance(iter); i++) {
-        files[i] = frame_path(td, *((size_t *) lst_iter_peak(iter)));
+        frame_idxs[i] = *((size_t *) lst_iter_peak(iter));
     }
+    lst_iter_free(iter);
 
-    *stream = stream_open(files, files_size);
+    // выборка обычно состоит из нескольких разрозненных фреймов, их чтение с диска запрашивается одной серией
+    res = storage_open_frames(storage, train_id, frame_idxs, frames_cnt, true, stream);
+    free(frame_idxs);
 
-    lst_iter_free(iter);
+    return res == LPX_SUCCESS || res == LPX_CORRUPT ? res : LPX_IO;
+}
+
+int8_t storage_delete_stream(Storage *storage, char *train_id) {
+    storage_flush(storage);
+    lock_writer(storage);
+    storage_close_writer(storage, train_id);
+    unlock_writer(storage);
+
+    return storage_trash(storage, &train_id, 1, false);
+}
 
-    free_index:
-    free_array((void **) index, index_size);
+int8_t storage_clear(Storage *storage) {
+    char **streams;
+    size_t streams_size;
+    if (storage_list_streams(storage, &streams, &streams_size) != LPX_SUCCESS) {
+        return LPX_IO;
+    }
+
+    storage_flush(storage);
+    lock_writer(storage);
+    storage_close_writer(storage, NULL);
+    unlock_writer(storage);
 
-    free(td);
+    int8_t res = storage_trash(storage, streams, streams_size, true);
+
+    free_array((void **) streams, streams_size);
 
     return res;
 }
 
-int8_t storage_delete_stream(Storage *storage, char *train_id) {
-    int8_t res = 0;
-
-    char *td = train_dir(storage, train_id);
-    char **files;
-    size_t files_size;
-    res = list_directory(td, &files, &files_size);
-    if (res != LPX_SUCCESS) {
-        res = LPX_IO;
-        goto free_td;
+int8_t storage_recover(Storage *storage, size_t *recovered) {
+    if (recovered != NULL) {
+        *recovered = 0;
+    }
+    lock_catalog(storage);
+    if (storage_catalog_sync(storage, false) != LPX_SUCCESS) {
+        unlock_catalog(storage);
+        return LPX_IO;
     }
 
-    for (int i = 0; i < files_size; i++) {
-        char *path = append_path(td, files[i]);
-        int r = unlink(path);
-        free(path);
-        if (r != 0) {
-            res = LPX_IO;
-            goto free_files;
+    // стримы без индекса или с незакрытым индексом, которые давно не менялись
+    lock_writer(storage);
+    char writer_train_id[MAX_INT_LEN + 1];
+    strcpy(writer_train_id, storage->writer_train_id);
+    unlock_writer(storage);
+
+    time_t now = time(NULL);
+    size_t jobs_cnt = 0;
+    RecoveryJob *jobs = xcalloc(ctlg_size(storage->catalog) + 1, sizeof(RecoveryJob));
+    for (size_t i = 0; i < ctlg_size(storage->catalog); i++) {
+        const CatalogEntry *entry = ctlg_at(storage->catalog, i);
+        if ((entry->indexed && !entry->open) || strcmp(entry->train_id, writer_train_id) == 0) {
+            continue;
         }
+        char path[TRAIN_PATH_SIZE];
+        storage_train_path(storage, entry->train_id, path);
+        struct stat st;
+        int td;
+        if (fstatat(storage->base_fd, path, &st, 0) != 0 || now - st.st_mtim.tv_sec < RECOVERY_MIN_AGE_SEC ||
+            storage_acquire_dir(storage, entry->train_id, &td) != LPX_SUCCESS) {
+            continue;
+        }
+        jobs[jobs_cnt].dir_fd = td;
+        jobs[jobs_cnt].train_id = strdup(entry->train_id);
+        jobs_cnt++;
     }
-    rmdir(td);
+    unlock_catalog(storage);
 
-    free_files:
-    free_array((void **) files, files_size);
+    rcv_run(jobs, jobs_cnt, storage->config.recovery_threads);
 
-    free_td:
-    free(td);
+    int8_t res = LPX_SUCCESS;
+    for (size_t i = 0; i < jobs_cnt; i++) {
+        RecoveryJob *job = &jobs[i];
+        if (job->res == LPX_SUCCESS) {
+            fprintf(stderr, "Recovered index of stream %s, frames: %" PRIu64 "\n", job->train_id, job->frames_cnt);
+            lock_catalog(storage);
+            storage_catalog_add(storage, (char *) job->train_id);
+            unlock_catalog(storage);
+            if (recovered != NULL) {
+                (*recovered)++;
+            }
+        } else if (job->res != STRG_NOT_FOUND && job->res != STRG_EXISTS) {
+            fprintf(stderr, "Could not recover index of stream %s, errcode: %d\n", job->train_id, job->res);
+            res = job->res;
+        }
+        storage_release_dir(storage, job->dir_fd);
+        free((char *) job->train_id);
+    }
+    free(jobs);
 
     return res;
 }
 
-int8_t storage_clear(Storage *storage) {
-    int8_t res = 0;
+int8_t storage_convert_indexes(Storage *storage) {
     char **streams;
     size_t streams_size;
-    res = list_directory(storage->base_dir, &streams, &streams_size);
+    int8_t res = storage_list_streams(storage, &streams, &streams_size);
     if (res != LPX_SUCCESS) {
         return LPX_IO;
     }
 
     for (int i = 0; i < streams_size; i++) {
-        res = storage_delete_stream(storage, streams[i]);
+        int td;
+        res = storage_acquire_dir(storage, streams[i], &td);
+        if (res == LPX_SUCCESS) {
+            res = sidx_convert(td);
+            storage_release_dir(storage, td);
+        }
         if (res != LPX_SUCCESS) {
+            fprintf(stderr, "Could not convert index of stream %s, errcode: %d\n", streams[i], res);
             break;
         }
     }
@@ -436,7 +2533,161 @@ int8_t storage_clear(Storage *storage) {
     return res;
 }
 
+int8_t storage_stats(Storage *storage, char *train_id, StorageStats *stats) {
+    int8_t res = LPX_SUCCESS;
+    lock_catalog(storage);
+    if (storage_catalog_sync(storage, false) != LPX_SUCCESS) {
+        res = LPX_IO;
+    } else if (train_id != NULL) {
+        const CatalogEntry *entry = ctlg_get(storage->catalog, train_id);
+        if (entry != NULL) {
+            stts_entry(entry, stats);
+        } else {
+            res = STRG_NOT_FOUND;
+        }
+    } else {
+        stts_totals(storage->catalog, stats);
+    }
+    unlock_catalog(storage);
+    return res;
+}
+
+int8_t storage_list_stats(Storage *storage, StorageStats **stats, size_t *stats_cnt) {
+    lock_catalog(storage);
+    if (storage_catalog_sync(storage, false) != LPX_SUCCESS) {
+        unlock_catalog(storage);
+        return LPX_IO;
+    }
+    *stats = stts_list(storage->catalog, stats_cnt);
+    unlock_catalog(storage);
+    return LPX_SUCCESS;
+}
+
+void storage_sync_stats(Storage *storage, StorageSync *sync) {
+    if (storage->syncer != NULL) {
+        sncr_stats(storage->syncer, sync);
+    } else {
+        memset(sync, 0, sizeof(StorageSync));
+    }
+}
+
+size_t storage_volumes(Storage *storage, StorageVolume *volumes, size_t max) {
+    for (size_t i = 0; i < storage->volumes_cnt && i < max; i++) {
+        StripeVolume *volume = &storage->volumes[i];
+        StorageVolume *v = &volumes[i];
+        memset(v, 0, sizeof(StorageVolume));
+        v->path = volume->path;
+        struct statvfs fs;
+        if (statvfs(volume->path, &fs) == 0) {
+            v->total_bytes = (uint64_t) fs.f_blocks * fs.f_frsize;
+            v->free_bytes = (uint64_t) fs.f_bavail * fs.f_frsize;
+        }
+        v->segments = __atomic_load_n(&volume->stats.segments, __ATOMIC_RELAXED);
+        v->written_frames = __atomic_load_n(&volume->stats.frames, __ATOMIC_RELAXED);
+        v->written_bytes = __atomic_load_n(&volume->stats.bytes, __ATOMIC_RELAXED);
+        v->write_time_us = __atomic_load_n(&volume->stats.write_time_us, __ATOMIC_RELAXED);
+    }
+    return storage->volumes_cnt;
+}
+
+void storage_usage(Storage *storage, StorageUsage *usage) {
+    lock_catalog(storage);
+    usage->used_bytes = storage_used_bytes(storage);
+    unlock_catalog(storage);
+    usage->capacity_bytes = storage->capacity;
+    usage->evicted_streams = __atomic_load_n(&storage->evicted_streams, __ATOMIC_RELAXED);
+    usage->evicted_bytes = __atomic_load_n(&storage->evicted_bytes, __ATOMIC_RELAXED);
+    TrashStats trash;
+    trsh_stats(storage->trash, &trash);
+    usage->trash_bytes = trash.bytes;
+    usage->trash_entries = trash.entries;
+    usage->reaped_files = trash.reaped_files;
+    usage->reaped_bytes = trash.reaped_bytes;
+    usage->reap_time_us = trash.reap_time_us;
+    if (storage->ram != NULL) {
+        RamTierStats ram;
+        rtr_stats(storage->ram, &ram);
+        usage->ram_bytes = ram.bytes;
+        usage->migrated_segments = ram.migrated_segments;
+        usage->migrated_bytes = ram.migrated_bytes;
+    } else {
+        usage->ram_bytes = 0;
+        usage->migrated_segments = 0;
+        usage->migrated_bytes = 0;
+    }
+}
+
+void storage_scrub_status(Storage *storage, StorageScrub *scrub) {
+    memset(scrub, 0, sizeof(StorageScrub));
+    int64_t now = realtime_us();
+    lock_catalog(storage);
+    for (size_t i = 0; i < ctlg_size(storage->catalog); i++) {
+        const CatalogEntry *entry = ctlg_at(storage->catalog, i);
+        if (scrb_due(entry, now)) {
+            scrub->pending_streams++;
+        }
+        if (entry->scrub_time != 0 && entry->scrub_errors > 0) {
+            scrub->corrupt_streams++;
+        }
+    }
+    unlock_catalog(storage);
+    if (storage->scrubber != NULL) {
+        scrb_stats(storage->scrubber, scrub);
+    }
+}
+
 void storage_close(struct Storage *storage) {
+    if (storage->scrubber != NULL) {
+        scrb_free(storage->scrubber);
+    }
+    // очередь записи дописывает оставшиеся фреймы и может будить поток вытеснения, поэтому закрывается первой
+    if (storage->frame_writer != NULL) {
+        fwr_free(storage->frame_writer);
+    }
+    // запись фреймов закончена, оставшиеся фреймы фиксирует закрытие писателя. Поток вытеснения ещё работает и
+    // читает состояние писателя, поэтому писатель закрывается под writer_mutex.
+    lock_writer(storage);
+    storage_close_writer(storage, NULL);
+    unlock_writer(storage);
+    if (storage->syncer != NULL) {
+        sncr_free(storage->syncer);
+    }
+    // вытеснение переносит стримы в корзину, поэтому останавливается раньше неё
+    if (storage->evictor != NULL) {
+        evct_free(storage->evictor);
+    }
+    if (storage->trash != NULL) {
+        trsh_free(storage->trash);
+    }
+    if (storage->ram != NULL) {
+        rtr_free(storage->ram);
+    }
+    for (size_t i = 0; i < storage->volumes_cnt; i++) {
+        if (storage->volumes[i].fd != -1) {
+            close(storage->volumes[i].fd);
+        }
+        free(storage->volumes[i].path);
+    }
+    free(storage->volumes);
+    pthread_key_delete(storage->io_engine_key);
+    pthread_cond_destroy(&storage->writer_idle);
+    pthread_mutex_destroy(&storage->writer_mutex);
+    pthread_mutex_destroy(&storage->catalog_mutex);
+    if (storage->catalog) {
+        int8_t res = ctlg_save(storage->catalog, storage->base_fd, CATALOG_CHECKPOINT_FILE, storage->base_mtime);
+        if (res != LPX_SUCCESS) {
+            fprintf(stderr, "Could not write catalog checkpoint %s/%s\n", storage->base_dir, CATALOG_CHECKPOINT_FILE);
+        }
+    }
+    ctlg_free(storage->catalog);
+    for (size_t i = 0; i < TRAIN_DIRS_CACHE_SIZE; i++) {
+        if (storage->dirs[i].train_id[0] != 0) {
+            close(storage->dirs[i].fd);
+        }
+    }
+    pthread_mutex_destroy(&storage->dirs_mutex);
+    close(storage->base_fd);
+    free(storage->buckets);
     free(storage->base_dir);
     free(storage);
 }
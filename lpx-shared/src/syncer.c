@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+#include "../include/syncer.h"
+#include "../include/evictor.h"
+#include "../include/lpxstd.h"
+
+/**
+ * Поток записи, дожидающийся в режиме STRG_DURABLE_FRAME фиксации фреймов до seq. Результат - фиксации, которая
+ * первой закончилась и покрыла seq.
+ */
+typedef struct SyncWaiter {
+    uint64_t seq;
+    bool done;
+    bool failed;
+    struct SyncWaiter *next;
+} SyncWaiter;
+
+typedef struct Syncer {
+    SyncSource source;
+    int durability;
+    size_t commit_frames;
+    unsigned commit_ms;
+
+    /**
+     * indexed - фреймов записано и проиндексировано с момента открытия хранилища, durable - сколько из них
+     * зафиксировано на диске, об изменении durable сообщает durable_cond. uncommitted - фреймов, проиндексированных
+     * после начала последней фиксации. Защищены mutex.
+     */
+    pthread_mutex_t mutex;
+    pthread_cond_t durable_cond;
+    uint64_t indexed;
+    uint64_t durable;
+    size_t uncommitted;
+    SyncWaiter *waiters;
+
+    /**
+     * Поток фиксации. Запускается при индексации первых фреймов, started - запуск уже пробовали. Если поток не
+     * запустился, фреймы фиксирует поток записи.
+     */
+    Evictor *evictor;
+    bool started;
+
+    uint64_t syncs;
+    uint64_t synced_frames;
+    uint64_t sync_time_us;
+    uint64_t sync_time_max_us;
+    uint64_t sync_errors;
+    uint64_t unsynced_frames_max;
+} Syncer;
+
+static void lock_syncer(Syncer *syncer) {
+    int r = pthread_mutex_lock(&syncer->mutex);
+    assert(r == 0 && "Could not lock syncer mutex");
+}
+
+static void unlock_syncer(Syncer *syncer) {
+    int r = pthread_mutex_unlock(&syncer->mutex);
+    assert(r == 0 && "Could not unlock syncer mutex");
+}
+
+bool sncr_begin(Syncer *syncer, uint64_t *target) {
+    lock_syncer(syncer);
+    *target = syncer->indexed;
+    bool pending = *target != syncer->durable;
+    if (pending) {
+        syncer->uncommitted = 0;
+    }
+    unlock_syncer(syncer);
+    return pending;
+}
+
+/**
+ * Сообщает результат фиксации до target потокам записи, фреймы которых она покрыла, и будит их. Вызывается под
+ * mutex.
+ */
+static void sncr_covered(Syncer *syncer, uint64_t target, bool failed) {
+    for (SyncWaiter *waiter = syncer->waiters; waiter != NULL; waiter = waiter->next) {
+        if (!waiter->done && waiter->seq <= target) {
+            waiter->done = true;
+            waiter->failed = failed;
+        }
+    }
+    pthread_cond_broadcast(&syncer->durable_cond);
+}
+
+void sncr_end(Syncer *syncer, uint64_t target, bool failed, uint64_t time_us) {
+    lock_syncer(syncer);
+    if (failed) {
+        syncer->sync_errors++;
+    }
+    if (target > syncer->durable) {
+        syncer->synced_frames += target - syncer->durable;
+        syncer->durable = target;
+    }
+    syncer->syncs++;
+    syncer->sync_time_us += time_us;
+    if (time_us > syncer->sync_time_max_us) {
+        syncer->sync_time_max_us = time_us;
+    }
+    sncr_covered(syncer, target, failed);
+    unlock_syncer(syncer);
+}
+
+/**
+ * Фиксирует на диске записанные фреймы: сбрасывает дубликаты дескрипторов записываемого стрима. Фиксация покрывает
+ * все фреймы, проиндексированные к её началу.
+ */
+static bool sncr_sync(void *ctx) {
+    Syncer *syncer = ctx;
+
+    uint64_t target;
+    if (!sncr_begin(syncer, &target)) {
+        return false;
+    }
+    int *fds;
+    size_t fds_cnt = syncer->source.dup_fds(syncer->source.ctx, &fds);
+    if (fds_cnt == 0) {
+        // фреймы, проиндексированные до закрытия писателя, зафиксированы при его закрытии
+        free(fds);
+        lock_syncer(syncer);
+        if (target > syncer->durable) {
+            syncer->durable = target;
+        }
+        sncr_covered(syncer, target, false);
+        unlock_syncer(syncer);
+        return false;
+    }
+
+    uint64_t start = monotonic_us();
+    bool failed = false;
+    for (size_t i = 0; i < fds_cnt; i++) {
+        failed |= fdatasync(fds[i]) != 0;
+        close(fds[i]);
+    }
+    free(fds);
+    if (failed) {
+        fprintf(stderr, "Could not sync written frames: %s\n", strerror(errno));
+    }
+    sncr_end(syncer, target, failed, monotonic_us() - start);
+
+    return false;
+}
+
+Syncer *sncr_create(int durability, size_t commit_frames, unsigned commit_ms, const SyncSource *source) {
+    Syncer *syncer = xcalloc(1, sizeof(Syncer));
+    syncer->source = *source;
+    syncer->durability = durability;
+    syncer->commit_frames = commit_frames;
+    syncer->commit_ms = commit_ms;
+    pthread_mutex_init(&syncer->mutex, NULL);
+    pthread_cond_init(&syncer->durable_cond, NULL);
+    return syncer;
+}
+
+int8_t sncr_indexed(Syncer *syncer, size_t frames) {
+    lock_syncer(syncer);
+    if (!syncer->started) {
+        syncer->started = true;
+        unsigned period_ms = syncer->commit_ms > 0 ? syncer->commit_ms : UINT_MAX;
+        syncer->evictor = evct_create(sncr_sync, syncer, period_ms, 0, EVCT_KEEP_PRIORITY);
+    }
+    Evictor *evictor = syncer->evictor;
+    uint64_t seq = syncer->indexed += frames;
+    uint64_t unsynced = seq - syncer->durable;
+    if (unsynced > syncer->unsynced_frames_max) {
+        syncer->unsynced_frames_max = unsynced;
+    }
+    syncer->uncommitted += frames;
+    bool commit = syncer->durability == STRG_DURABLE_FRAME ||
+                  (syncer->commit_frames > 0 && syncer->uncommitted >= syncer->commit_frames);
+    // ожидание регистрируется до фиксации, иначе её результат можно пропустить
+    SyncWaiter waiter = {.seq = seq};
+    if (syncer->durability == STRG_DURABLE_FRAME) {
+        waiter.next = syncer->waiters;
+        syncer->waiters = &waiter;
+    }
+    unlock_syncer(syncer);
+
+    if (commit && evictor == NULL) {
+        // поток фиксации не запустился, фиксируем сами
+        sncr_sync(syncer);
+    } else if (commit) {
+        evct_wake(evictor);
+    }
+    if (syncer->durability != STRG_DURABLE_FRAME) {
+        return LPX_SUCCESS;
+    }
+
+    // фреймы зафиксирует текущая или следующая фиксация, вместе с фреймами других потоков записи
+    lock_syncer(syncer);
+    while (!waiter.done) {
+        pthread_cond_wait(&syncer->durable_cond, &syncer->mutex);
+    }
+    for (SyncWaiter **w = &syncer->waiters; *w != NULL; w = &(*w)->next) {
+        if (*w == &waiter) {
+            *w = waiter.next;
+            break;
+        }
+    }
+    unlock_syncer(syncer);
+    return waiter.failed ? LPX_IO : LPX_SUCCESS;
+}
+
+void sncr_stats(Syncer *syncer, StorageSync *sync) {
+    lock_syncer(syncer);
+    sync->syncs = syncer->syncs;
+    sync->synced_frames = syncer->synced_frames;
+    sync->sync_time_us = syncer->sync_time_us;
+    sync->sync_time_max_us = syncer->sync_time_max_us;
+    sync->sync_errors = syncer->sync_errors;
+    sync->unsynced_frames = syncer->indexed - syncer->durable;
+    sync->unsynced_frames_max = syncer->unsynced_frames_max;
+    unlock_syncer(syncer);
+}
+
+void sncr_free(Syncer *syncer) {
+    if (syncer->evictor != NULL) {
+        evct_free(syncer->evictor);
+    }
+    pthread_cond_destroy(&syncer->durable_cond);
+    pthread_mutex_destroy(&syncer->mutex);
+    free(syncer);
+}
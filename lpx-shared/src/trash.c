@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "../include/trash.h"
+#include "../include/evictor.h"
+#include "../include/stream_storage.h"
+
+// Файлы удаляются порциями по REAP_BATCH_FILES с паузой REAP_PAUSE_MS между порциями. Кроме пробуждения при
+// удалении стрима корзина проверяется раз в REAP_PERIOD_MS.
+#define REAP_BATCH_FILES 8
+#define REAP_PAUSE_MS    10
+#define REAP_PERIOD_MS   10000
+
+#define BATCH_SUFFIX ".tmp"
+
+typedef struct Trash {
+    int base_fd;
+
+    /**
+     * Поток удаления файлов. Запускается при первом удалении стрима или при открытии непустой корзины, создаётся под
+     * mutex.
+     */
+    Evictor *reaper;
+    pthread_mutex_t mutex;
+
+    /**
+     * Пачек generation, которые ещё заполняются. Их директории в корзине имеют суффикс BATCH_SUFFIX и не удаляются,
+     * пока пачка не закончена, иначе поток удаления может удалить ещё пустую директорию пачки до переноса в неё
+     * стримов. Директории незаконченных пачек, оставшиеся после аварийного завершения, удаляются, когда
+     * незаконченных пачек нет. Проверка batches и удаление такой директории идут под mutex, под которым же пачка
+     * создаёт свою директорию.
+     */
+    int batches;
+
+    /**
+     * Оценка содержимого корзины, которое ещё предстоит удалить. Может ненадолго уйти в минус, если поток удаления
+     * успел удалить стрим раньше, чем перенос учёл его.
+     */
+    int64_t bytes;
+    int64_t entries;
+    uint64_t reaped_files;
+    uint64_t reaped_bytes;
+    uint64_t reap_time_us;
+} Trash;
+
+typedef struct TrashBatch {
+    Trash *trash;
+    int trash_fd;
+    int dest_fd; // директория, в которую переносятся стримы: корзина или директория пачки
+    bool generation;
+    int64_t time; // время начала переноса в наносекундах, из него строятся имена в корзине
+    char name[MAX_INT_LEN + sizeof("clear.")]; // имя директории пачки generation в корзине
+    size_t moved;
+} TrashBatch;
+
+/**
+ * Удаляет сегмент, на который указывает символьная ссылка name в директории dir_fd: сегмент на другом томе или в
+ * RAM-уровне. Директория стрима на томе удаляется вместе с последним сегментом. Возвращает размер удалённого
+ * сегмента.
+ */
+static uint64_t reap_link_target(int dir_fd, const char *name) {
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(dir_fd, name, target, sizeof(target) - 1);
+    if (len <= 0) {
+        return 0;
+    }
+    target[len] = 0;
+    // писатель сегментов ссылается только на файлы с тем же именем по абсолютному пути
+    char *slash = strrchr(target, '/');
+    struct stat st;
+    if (target[0] != '/' || strcmp(slash + 1, name) != 0 || stat(target, &st) != 0 || !S_ISREG(st.st_mode) ||
+        unlink(target) != 0) {
+        return 0;
+    }
+    *slash = 0;
+    rmdir(target);
+    return (uint64_t) st.st_size;
+}
+
+/**
+ * Удаляет не больше *budget файлов из дерева name в директории parent_fd, уменьшая *budget на количество удалённых
+ * файлов. Возвращает true, если дерево удалено целиком.
+ */
+static bool reap_tree(int parent_fd, const char *name, size_t *budget, uint64_t *files, uint64_t *bytes) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd == -1) {
+        return errno == ENOENT;
+    }
+    DIR *dp = fdopendir(fd);
+    if (dp == NULL) {
+        close(fd);
+        return false;
+    }
+
+    bool removed = true;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dp)) != NULL) {
+        if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (*budget == 0) {
+            removed = false;
+            break;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dp), dir_entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (!reap_tree(dirfd(dp), dir_entry->d_name, budget, files, bytes)) {
+                removed = false;
+                break;
+            }
+            continue;
+        }
+        if (S_ISLNK(st.st_mode)) {
+            *bytes += reap_link_target(dirfd(dp), dir_entry->d_name);
+        }
+        if (unlinkat(dirfd(dp), dir_entry->d_name, 0) == 0 || errno == ENOENT) {
+            (*budget)--;
+            (*files)++;
+            *bytes += st.st_size;
+        } else {
+            removed = false;
+            break;
+        }
+    }
+    closedir(dp);
+
+    // удаление во время обхода могло пропустить записи директории, тогда rmdir не пройдёт и дерево дочистится позже
+    return removed && (unlinkat(parent_fd, name, AT_REMOVEDIR) == 0 || errno == ENOENT);
+}
+
+/**
+ * Шаг удаления файлов из корзины: удаляет порцию файлов и возвращает true, если в корзине, возможно, ещё что-то
+ * осталось
+ */
+static bool trsh_reap(void *ctx) {
+    Trash *trash = ctx;
+
+    uint64_t start = monotonic_us();
+    int fd = openat(trash->base_fd, TRASH_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dp == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+
+    size_t budget = REAP_BATCH_FILES;
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    struct dirent *dir_entry;
+    while (budget > 0 && (dir_entry = readdir(dp)) != NULL) {
+        if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
+            continue;
+        }
+        size_t len = strlen(dir_entry->d_name);
+        bool batch = len > strlen(BATCH_SUFFIX) &&
+                     strcmp(dir_entry->d_name + len - strlen(BATCH_SUFFIX), BATCH_SUFFIX) == 0;
+        if (batch) {
+            int r = pthread_mutex_lock(&trash->mutex);
+            assert(r == 0 && "Could not lock trash mutex");
+        }
+        if (!batch || trash->batches == 0) {
+            if (reap_tree(dirfd(dp), dir_entry->d_name, &budget, &files, &bytes)) {
+                __atomic_sub_fetch(&trash->entries, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (batch) {
+            int r = pthread_mutex_unlock(&trash->mutex);
+            assert(r == 0 && "Could not unlock trash mutex");
+        }
+    }
+    closedir(dp);
+
+    __atomic_sub_fetch(&trash->bytes, (int64_t) bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trash->reaped_files, files, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trash->reaped_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trash->reap_time_us, monotonic_us() - start, __ATOMIC_RELAXED);
+
+    return budget == 0;
+}
+
+/**
+ * Будит поток удаления файлов, запуская его при необходимости
+ */
+static void trsh_wake(Trash *trash) {
+    int r = pthread_mutex_lock(&trash->mutex);
+    assert(r == 0 && "Could not lock trash mutex");
+    if (trash->reaper == NULL) {
+        trash->reaper = evct_create(trsh_reap, trash, REAP_PERIOD_MS, REAP_PAUSE_MS, 0);
+    }
+    if (trash->reaper != NULL) {
+        evct_wake(trash->reaper);
+    }
+    r = pthread_mutex_unlock(&trash->mutex);
+    assert(r == 0 && "Could not unlock trash mutex");
+}
+
+Trash *trsh_open(int base_fd) {
+    Trash *trash = xcalloc(1, sizeof(Trash));
+    trash->base_fd = base_fd;
+    pthread_mutex_init(&trash->mutex, NULL);
+
+    // оценка содержимого, оставшегося с прошлого запуска
+    int fd = openat(base_fd, TRASH_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dp == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return trash;
+    }
+    int64_t entries = 0;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dp)) != NULL) {
+        if (strcmp(dir_entry->d_name, ".") != 0 && strcmp(dir_entry->d_name, "..") != 0) {
+            entries++;
+        }
+    }
+    closedir(dp);
+
+    trash->bytes = (int64_t) tree_bytes(base_fd, TRASH_DIR);
+    trash->entries = entries;
+    if (entries > 0) {
+        trsh_wake(trash);
+    }
+    return trash;
+}
+
+int8_t trsh_begin(Trash *trash, bool generation, TrashBatch **batch) {
+    if (mkdirat(trash->base_fd, TRASH_DIR, 0777) != 0 && errno != EEXIST) {
+        return LPX_IO;
+    }
+    int trash_fd = openat(trash->base_fd, TRASH_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (trash_fd == -1) {
+        return LPX_IO;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    TrashBatch *b = xcalloc(1, sizeof(TrashBatch));
+    b->trash = trash;
+    b->trash_fd = trash_fd;
+    b->dest_fd = trash_fd;
+    b->generation = generation;
+    b->time = ts2ns(now);
+    if (generation) {
+        snprintf(b->name, sizeof(b->name), "clear.%" PRId64, b->time);
+        char tmp_name[sizeof(b->name) + sizeof(BATCH_SUFFIX)];
+        snprintf(tmp_name, sizeof(tmp_name), "%s" BATCH_SUFFIX, b->name);
+        int r = pthread_mutex_lock(&trash->mutex);
+        assert(r == 0 && "Could not lock trash mutex");
+        bool created = mkdirat(trash_fd, tmp_name, 0777) == 0 &&
+                       (b->dest_fd = openat(trash_fd, tmp_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1;
+        if (created) {
+            trash->batches++;
+        }
+        r = pthread_mutex_unlock(&trash->mutex);
+        assert(r == 0 && "Could not unlock trash mutex");
+        if (!created) {
+            close(trash_fd);
+            free(b);
+            return LPX_IO;
+        }
+    }
+    *batch = b;
+    return LPX_SUCCESS;
+}
+
+int8_t trsh_move(TrashBatch *batch, int dir_fd, const char *path, const char *train_id, uint64_t bytes) {
+    // стримы пачки лежат в своей директории корзины, а отдельно удалённые стримы - в корзине под уникальным именем:
+    // стрим с тем же идентификатором мог быть удалён раньше и ещё не удалён из корзины
+    char name[2 * MAX_INT_LEN + 2];
+    if (batch->generation) {
+        snprintf(name, sizeof(name), "%s", train_id);
+    } else {
+        snprintf(name, sizeof(name), "%s.%" PRId64, train_id, batch->time);
+    }
+    if (renameat(dir_fd, path, batch->dest_fd, name) != 0) {
+        // ENOENT и при пропавшей директории назначения: стрима нет, только если нет его директории
+        struct stat st;
+        return errno == ENOENT && fstatat(dir_fd, path, &st, AT_SYMLINK_NOFOLLOW) != 0 && errno == ENOENT
+               ? STRG_NOT_FOUND : LPX_IO;
+    }
+    if (bytes == 0) {
+        bytes = tree_bytes(batch->dest_fd, name);
+    }
+    __atomic_add_fetch(&batch->trash->bytes, (int64_t) bytes, __ATOMIC_RELAXED);
+    batch->moved++;
+    return LPX_SUCCESS;
+}
+
+void trsh_end(TrashBatch *batch) {
+    Trash *trash = batch->trash;
+    if (batch->generation) {
+        // пачка закончена, её директорию можно удалять
+        char tmp_name[sizeof(batch->name) + sizeof(BATCH_SUFFIX)];
+        snprintf(tmp_name, sizeof(tmp_name), "%s" BATCH_SUFFIX, batch->name);
+        renameat(batch->trash_fd, tmp_name, batch->trash_fd, batch->name);
+        int r = pthread_mutex_lock(&trash->mutex);
+        assert(r == 0 && "Could not lock trash mutex");
+        trash->batches--;
+        r = pthread_mutex_unlock(&trash->mutex);
+        assert(r == 0 && "Could not unlock trash mutex");
+    }
+    if (batch->moved > 0 || batch->generation) {
+        __atomic_add_fetch(&trash->entries, batch->generation ? 1 : (int64_t) batch->moved, __ATOMIC_RELAXED);
+        trsh_wake(trash);
+    }
+    if (batch->dest_fd != batch->trash_fd) {
+        close(batch->dest_fd);
+    }
+    close(batch->trash_fd);
+    free(batch);
+}
+
+void trsh_stats(Trash *trash, TrashStats *stats) {
+    int64_t bytes = __atomic_load_n(&trash->bytes, __ATOMIC_RELAXED);
+    int64_t entries = __atomic_load_n(&trash->entries, __ATOMIC_RELAXED);
+    stats->bytes = bytes > 0 ? (uint64_t) bytes : 0;
+    stats->entries = entries > 0 ? (uint64_t) entries : 0;
+    stats->reaped_files = __atomic_load_n(&trash->reaped_files, __ATOMIC_RELAXED);
+    stats->reaped_bytes = __atomic_load_n(&trash->reaped_bytes, __ATOMIC_RELAXED);
+    stats->reap_time_us = __atomic_load_n(&trash->reap_time_us, __ATOMIC_RELAXED);
+}
+
+void trsh_free(Trash *trash) {
+    if (trash->reaper != NULL) {
+        evct_free(trash->reaper);
+    }
+    pthread_mutex_destroy(&trash->mutex);
+    free(trash);
+}
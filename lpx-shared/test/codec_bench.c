@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <lpxstd.h>
+#include <manifest.h>
+#include <codec.h>
+#include <crc32c.h>
+
+/*
+ * Бенчмарк сжатия фреймов: сжимает и распаковывает фреймы тестовых стримов, проверяет, что фреймы восстанавливаются
+ * без потерь, и печатает степень сжатия, скорость сжатия и распаковки и время расчёта контрольной суммы фрейма.
+ * lpx-codec-bench [директория со стримами] [повторов распаковки]
+ */
+
+#define DEFAULT_DATA_DIR "lpx-shared/test/test_dir"
+#define DEFAULT_ROUNDS   5
+
+typedef struct Frame {
+    uint8_t *raw;
+    size_t raw_size;
+    uint8_t *encoded;
+    size_t encoded_size;
+} Frame;
+
+static int8_t read_file(char *path, uint8_t **buf, size_t *size) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return LPX_IO;
+    }
+    off_t file_len;
+    int8_t res = file_size(f, &file_len);
+    if (res == LPX_SUCCESS) {
+        *size = (size_t) file_len;
+        *buf = xmalloc(*size > 0 ? *size : 1);
+        if (fread(*buf, 1, *size, f) != *size) {
+            free(*buf);
+            res = LPX_IO;
+        }
+    }
+    fclose(f);
+    return res;
+}
+
+/**
+ * Читает фреймы стримов, записанных по файлу на фрейм
+ */
+static size_t read_frames(char *data_dir, Frame **frames) {
+    size_t frames_cnt = 0;
+    *frames = NULL;
+    char **trains;
+    size_t trains_cnt;
+    if (list_directory(data_dir, &trains, &trains_cnt) != LPX_SUCCESS) {
+        return 0;
+    }
+    for (size_t i = 0; i < trains_cnt; i++) {
+        char *td = append_path(data_dir, trains[i]);
+        char **files;
+        size_t files_cnt;
+        if (list_directory(td, &files, &files_cnt) == LPX_SUCCESS) {
+            for (size_t j = 0; j < files_cnt; j++) {
+                char *end;
+                strtoul(files[j], &end, 10);
+                if (*end != 0) {
+                    continue;
+                }
+                char *path = append_path(td, files[j]);
+                Frame frame = {0};
+                if (read_file(path, &frame.raw, &frame.raw_size) == LPX_SUCCESS) {
+                    *frames = xrealloc(*frames, (frames_cnt + 1) * sizeof(Frame));
+                    (*frames)[frames_cnt++] = frame;
+                }
+                free(path);
+            }
+            free_array((void **) files, files_cnt);
+        }
+        free(td);
+    }
+    free_array((void **) trains, trains_cnt);
+    return frames_cnt;
+}
+
+int main(int argc, char **argv) {
+    char *data_dir = argc > 1 ? argv[1] : DEFAULT_DATA_DIR;
+    int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+
+    Frame *frames;
+    size_t frames_cnt = read_frames(data_dir, &frames);
+    if (frames_cnt == 0) {
+        fprintf(stderr, "No frames in %s\n", data_dir);
+        return 1;
+    }
+
+    // тестовые стримы записаны без манифеста: RAW12, строки сжимаются вместе с выравниванием
+    FrameFormat format;
+    mnf_legacy(&format);
+    size_t width = format.stride / 3 * 2;
+
+    uint64_t raw_bytes = 0;
+    uint64_t encoded_bytes = 0;
+    size_t stored_raw = 0;
+    uint64_t start = monotonic_us();
+    for (size_t i = 0; i < frames_cnt; i++) {
+        Frame *frame = &frames[i];
+        frame->encoded = xmalloc(cdc_bound(frame->raw_size, width));
+        frame->encoded_size = cdc_encode(frame->raw, frame->raw_size, width, frame->encoded);
+        raw_bytes += frame->raw_size;
+        if (frame->encoded_size == 0) {
+            stored_raw++;
+            encoded_bytes += frame->raw_size;
+        } else {
+            encoded_bytes += frame->encoded_size;
+        }
+    }
+    uint64_t encode_us = monotonic_us() - start;
+
+    uint64_t decode_us = 0;
+    uint64_t decoded_bytes = 0;
+    for (int round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < frames_cnt; i++) {
+            Frame *frame = &frames[i];
+            if (frame->encoded_size == 0) {
+                continue;
+            }
+            size_t raw_size;
+            if (cdc_raw_size(frame->encoded, frame->encoded_size, &raw_size) != LPX_SUCCESS ||
+                raw_size != frame->raw_size) {
+                fprintf(stderr, "Frame %zu: bad header\n", i);
+                return 1;
+            }
+            uint8_t *decoded = xmalloc(raw_size);
+            start = monotonic_us();
+            int8_t res = cdc_decode(frame->encoded, frame->encoded_size, decoded);
+            decode_us += monotonic_us() - start;
+            decoded_bytes += raw_size;
+            if (res != LPX_SUCCESS || memcmp(decoded, frame->raw, raw_size) != 0) {
+                fprintf(stderr, "Frame %zu: decoded frame differs\n", i);
+                return 1;
+            }
+            free(decoded);
+        }
+    }
+
+    start = monotonic_us();
+    for (int round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < frames_cnt; i++) {
+            crc32c(0, frames[i].raw, frames[i].raw_size);
+        }
+    }
+    uint64_t crc_us = monotonic_us() - start;
+
+    printf("frames:          %zu (%zu stored raw)\n", frames_cnt, stored_raw);
+    printf("raw bytes:       %" PRIu64 "\n", raw_bytes);
+    printf("encoded bytes:   %" PRIu64 "\n", encoded_bytes);
+    printf("ratio:           %.3f\n", (double) raw_bytes / (double) encoded_bytes);
+    printf("encode:          %.1f MB/s\n", (double) raw_bytes / (double) (encode_us > 0 ? encode_us : 1));
+    printf("decode:          %.1f MB/s (%s)\n", (double) decoded_bytes / (double) (decode_us > 0 ? decode_us : 1),
+           cdc_vectorized() ? "vector" : "scalar");
+    printf("crc32c:          %.3f ms/frame (%s)\n", (double) crc_us / 1000 / (double) (rounds * frames_cnt),
+           crc32c_hardware() ? "hardware" : "table");
+
+    for (size_t i = 0; i < frames_cnt; i++) {
+        free(frames[i].raw);
+        free(frames[i].encoded);
+    }
+    free(frames);
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <lpxstd.h>
+#include <stream.h>
+#include <stream_storage.h>
+
+/*
+ * Бенчмарк надёжности записи: пишет одинаковые стримы с каждым уровнем надёжности и печатает скорость записи,
+ * количество и время фиксаций и сколько фреймов можно было потерять при отключении питания.
+ * lpx-durability-bench <директория хранилища> [фреймов] [размер фрейма]
+ */
+
+#define DEFAULT_FRAMES     500
+#define DEFAULT_FRAME_SIZE (1920 * 816)
+
+typedef struct Level {
+    const char *name;
+    int durability;
+    size_t commit_frames;
+    unsigned commit_ms;
+} Level;
+
+static const Level levels[] = {
+        {"none",         STRG_DURABLE_NONE,  0,  0},
+        {"group 64/1s",  STRG_DURABLE_GROUP, 64, 1000},
+        {"group 8",      STRG_DURABLE_GROUP, 8,  0},
+        {"group 100ms",  STRG_DURABLE_GROUP, 0,  100},
+        {"frame",        STRG_DURABLE_FRAME, 0,  0},
+};
+
+static int8_t write_stream(char *storage_dir, const Level *level, char *train_id, uint32_t frames, const uint8_t *buf,
+                           size_t frame_size) {
+    StorageConfig config;
+    storage_default_config(&config);
+    config.durability = level->durability;
+    config.index_commit_frames = level->commit_frames;
+    config.index_commit_ms = level->commit_ms;
+    Storage *s;
+    int8_t res = storage_open_config(storage_dir, &config, &s);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+
+    res = storage_prepare(s, train_id);
+    uint64_t start = monotonic_us();
+    int64_t meta_start = (int64_t) start;
+    for (uint32_t i = 0; i < frames && res == LPX_SUCCESS; i++) {
+        FrameMeta meta = {meta_start + i * 40000, meta_start + i * 40000 + 39999};
+        res = storage_store_frame(s, train_id, i, buf, frame_size, &meta);
+    }
+    if (res == LPX_SUCCESS) {
+        res = storage_flush(s);
+    }
+    if (res == LPX_SUCCESS) {
+        res = storage_seal_stream(s, train_id);
+    }
+    uint64_t time_us = monotonic_us() - start;
+
+    StorageSync sync;
+    storage_sync_stats(s, &sync);
+    printf("%-12s %8.1f fps %8.1f MB/s %6" PRIu64 " syncs %8.3f ms/sync %8.3f ms max %6" PRIu64 " max unsynced\n",
+           level->name, (double) frames * 1000000 / (double) (time_us > 0 ? time_us : 1),
+           (double) frames * frame_size / (double) (time_us > 0 ? time_us : 1), sync.syncs,
+           sync.syncs > 0 ? (double) sync.sync_time_us / 1000 / (double) sync.syncs : 0,
+           (double) sync.sync_time_max_us / 1000, sync.unsynced_frames_max);
+
+    storage_delete_stream(s, train_id);
+    storage_close(s);
+    return res;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: lpx-durability-bench <storage dir> [frames] [frame size]\n");
+        return 1;
+    }
+    char *storage_dir = argv[1];
+    uint32_t frames = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10) : DEFAULT_FRAMES;
+    size_t frame_size = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_FRAME_SIZE;
+
+    uint8_t *buf = xmalloc(frame_size);
+    for (size_t i = 0; i < frame_size; i++) {
+        buf[i] = (uint8_t) (i * 31 + i / 1920);
+    }
+
+    int res = 0;
+    for (size_t i = 0; i < ALEN(levels); i++) {
+        char *train_id = itoa(1529489000000 + i * 1000);
+        int8_t r = write_stream(storage_dir, &levels[i], train_id, frames, buf, frame_size);
+        if (r != LPX_SUCCESS) {
+            fprintf(stderr, "%s: write error %d\n", levels[i].name, r);
+            res = 1;
+        }
+        free(train_id);
+    }
+
+    free(buf);
+    return res;
+}
@@ -2,6 +2,7 @@
 #include <lpxstd.h>
 #include <assert.h>
 #include "../include/stream_storage.h"
+#include "../include/bmp.h"
 #include "../src/stream_storage.c"
 #include "CUnit/Basic.h"
 
@@ -11,12 +12,80 @@ if ((NULL == CU_add_test(P_SUITE, #TEST , TEST ))) { \
     return CU_get_error(); \
 }
 
+static char *test_data_dir;
+
 static char *base_dir;
 
 int init_suite(void) { return 0; }
 
 int clean_suite(void) { return 0; }
 
+/*
+ * Создаёт временное хранилище с копией тестового стрима, чтобы тесты, изменяющие хранилище, не портили тестовые данные
+ */
+static char *scratch_storage(char *train_id) {
+    char *dir = strdup("/tmp/lpx-test-XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        return NULL;
+    }
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "cp -r %s/%s %s", test_data_dir, train_id, dir);
+    if (system(cmd) != 0) {
+        return NULL;
+    }
+    return dir;
+}
+
+static void remove_scratch_storage(char *dir) {
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+    free(dir);
+}
+
+/*
+ * Путь к файлу сегмента стрима в директории td
+ */
+static char *segment_path(char *td, uint32_t segment) {
+    char name[SEG_NAME_SIZE];
+    seg_name(segment, name);
+    return append_path(td, name);
+}
+
+/*
+ * Путь к файлу фрейма стрима, записанного в устаревшем формате - по файлу на фрейм
+ */
+static char *legacy_frame_path(char *td, size_t frame_idx) {
+    char name[MAX_INT_LEN + 1];
+    snprintf(name, sizeof(name), "%zu", frame_idx);
+    return append_path(td, name);
+}
+
+/*
+ * Метаданные фрейма idx стрима из его индекса
+ */
+static int8_t storage_read_frame_meta(Storage *storage, char *train_id, uint32_t idx, FrameMeta **frame_meta) {
+    StreamIndex *index;
+    int8_t res = storage_open_stream_idx(storage, train_id, &index);
+    if (res != LPX_SUCCESS) {
+        return res;
+    }
+
+    const FrameMeta *frame = sidx_frame(index, idx);
+    if (frame == NULL) {
+        res = STRG_NOT_FOUND;
+        goto close_index;
+    }
+
+    *frame_meta = xmalloc(sizeof(FrameMeta));
+    **frame_meta = *frame;
+
+    close_index:
+    sidx_close(index);
+
+    return res;
+}
+
 int stringcmp(const void *a, const void *b) {
     const char **ia = (const char **) a;
     const char **ib = (const char **) b;
@@ -115,13 +184,22 @@ void test_stream_streaming(void) {
     uint8_t *stream_file = xcalloc(file_size, sizeof(uint8_t));
     fread(stream_file, sizeof(uint8_t), file_size, out);
 
+    // фрейм архива совпадает с BMP исходного фрейма
     uint8_t *original = NULL;
     size_t original_len = 0;
-    storage_read_frame(s, "1529488179409", 0, &original, &original_len);
+    CU_ASSERT_EQUAL(storage_read_frame(s, "1529488179409", 0, &original, &original_len), LPX_SUCCESS);
+    FrameFormat format;
+    mnf_legacy(&format);
+    uint8_t *original_bmp = NULL;
+    size_t original_bmp_size = 0;
+    CU_ASSERT_EQUAL(frame_to_bmp(&format, original, original_len, &original_bmp, &original_bmp_size), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(original_bmp_size, file_size);
+    CU_ASSERT_EQUAL(memcmp(original_bmp, stream_file, file_size), 0);
 
     free(file_name);
     free(stream_file);
     free(original);
+    free(original_bmp);
 
     fclose(out);
     storage_close(s);
@@ -162,12 +240,1820 @@ void test_stream_streaming_empty(void) {
     storage_close(s);
 }
 
+void test_convert_index(void) {
+    char *dir = scratch_storage("1529488204470");
+    CU_ASSERT_PTR_NOT_NULL(dir);
+    Storage *s;
+    storage_open(dir, &s);
+
+    CU_ASSERT_EQUAL(storage_convert_indexes(s), LPX_SUCCESS);
+
+    char *td = append_path(dir, "1529488204470");
+    char *csv_path = append_path(td, SIDX_CSV_FILE);
+    CU_ASSERT_NOT_EQUAL(access(csv_path, F_OK), 0);
+
+    StreamIndex *index;
+    int td_fd = open(td, O_RDONLY | O_DIRECTORY);
+    CU_ASSERT_EQUAL(sidx_open(td_fd, &index), LPX_SUCCESS);
+    close(td_fd);
+    CU_ASSERT_EQUAL(sidx_size(index), 30);
+    CU_ASSERT_EQUAL(sidx_frame(index, 0)->start_time, 1529488204473095);
+    CU_ASSERT_EQUAL(sidx_frame(index, 29)->end_time, 1529488207690131);
+    CU_ASSERT_PTR_NULL(sidx_frame(index, 30));
+    sidx_close(index);
+
+    FrameMeta *fm;
+    CU_ASSERT_EQUAL(storage_read_frame_meta(s, "1529488204470", 29, &fm), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(1529488207551183, fm->start_time);
+    free(fm);
+
+    free(csv_path);
+    free(td);
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+void test_catalog_find(void) {
+    Catalog *c = ctlg_create();
+    CatalogEntry first = {.train_id = "1000", .start_time = 1000000, .end_time = 1999999, .indexed = true};
+    CatalogEntry second = {.train_id = "3000", .start_time = 3000000, .end_time = 3999999, .indexed = true};
+    ctlg_put(c, &second);
+    ctlg_put(c, &first);
+    ctlg_put_pending(c, "5000");
+
+    CU_ASSERT_EQUAL(ctlg_size(c), 3);
+    CU_ASSERT_STRING_EQUAL(ctlg_at(c, 0)->train_id, "1000");
+    CU_ASSERT_STRING_EQUAL(ctlg_find(c, 1000000)->train_id, "1000");
+    CU_ASSERT_STRING_EQUAL(ctlg_find(c, 3999999)->train_id, "3000");
+    CU_ASSERT_PTR_NULL(ctlg_find(c, 999999));
+    CU_ASSERT_PTR_NULL(ctlg_find(c, 2500000));
+    CU_ASSERT_PTR_NULL(ctlg_find(c, 5000001));
+
+    CU_ASSERT_TRUE(ctlg_remove(c, "1000"));
+    CU_ASSERT_PTR_NULL(ctlg_find(c, 1000000));
+    CU_ASSERT_FALSE(ctlg_is_train_id("index.csv"));
+
+    ctlg_free(c);
+}
+
+void test_catalog_updates(void) {
+    char *dir = scratch_storage("1529488204470");
+    Storage *s;
+    storage_open(dir, &s);
+
+    char *stream = NULL;
+    CU_ASSERT_EQUAL(storage_prepare(s, "1529489000000"), LPX_SUCCESS);
+    storage_find_stream(s, 1529489000000500, &stream);
+    CU_ASSERT_PTR_NULL(stream);
+
+    FrameMeta index[] = {{1529489000000100, 1529489000000900}, {1529489000001000, 1529489000002000}};
+    CU_ASSERT_EQUAL(storage_store_stream_idx(s, "1529489000000", index, ALEN(index)), LPX_SUCCESS);
+    storage_find_stream(s, 1529489000001500, &stream);
+    CU_ASSERT_STRING_EQUAL(stream, "1529489000000");
+    free(stream);
+    stream = NULL;
+
+    CU_ASSERT_EQUAL(storage_delete_stream(s, "1529489000000"), LPX_SUCCESS);
+    storage_find_stream(s, 1529489000001500, &stream);
+    CU_ASSERT_PTR_NULL(stream);
+
+    storage_find_stream(s, 1529488204473096, &stream);
+    CU_ASSERT_STRING_EQUAL(stream, "1529488204470");
+    free(stream);
+
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+void test_catalog_checkpoint(void) {
+    char *dir = scratch_storage("1529488204470");
+    Storage *s;
+    storage_open(dir, &s);
+    storage_close(s);
+
+    char *checkpoint = append_path(dir, CATALOG_CHECKPOINT_FILE);
+    CU_ASSERT_EQUAL(access(checkpoint, F_OK), 0);
+
+    Catalog *c = ctlg_create();
+    int64_t base_mtime = 0;
+    CU_ASSERT_EQUAL(ctlg_load(c, AT_FDCWD, checkpoint, &base_mtime), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(ctlg_size(c), 1);
+    CU_ASSERT_EQUAL(ctlg_at(c, 0)->frames_cnt, 30);
+    CU_ASSERT_EQUAL(ctlg_at(c, 0)->bytes, 30 * 1566720 + 1020);
+    CU_ASSERT_NOT_EQUAL(base_mtime, 0);
+    ctlg_free(c);
+
+    // стрим, появившийся после записи контрольной точки, должен быть найден при следующем открытии
+    char *td = append_path(dir, "1529489000000");
+    mkdir(td, 0777);
+    FrameMeta index[] = {{1529489000000100, 1529489000000900}};
+    int td_fd = open(td, O_RDONLY | O_DIRECTORY);
+    sidx_write(td_fd, index, ALEN(index), 0);
+    close(td_fd);
+
+    storage_open(dir, &s);
+    char *stream = NULL;
+    storage_find_stream(s, 1529489000000500, &stream);
+    CU_ASSERT_STRING_EQUAL(stream, "1529489000000");
+    free(stream);
+    stream = NULL;
+    storage_find_stream(s, 1529488204473096, &stream);
+    CU_ASSERT_STRING_EQUAL(stream, "1529488204470");
+    free(stream);
+    storage_close(s);
+
+    free(td);
+    free(checkpoint);
+    remove_scratch_storage(dir);
+}
+
+static ssize_t read_whole_stream(VideoStreamBytesStream *stream) {
+    size_t buf_size = 10240;
+    uint8_t *buf = xcalloc(buf_size, sizeof(uint8_t));
+    ssize_t written = 0;
+    ssize_t read = stream_read(stream, buf, buf_size);
+    while (read >= 0) {
+        written += read;
+        read = stream_read(stream, buf, buf_size);
+    }
+    free(buf);
+    return read == EOF ? written : read;
+}
+
+void test_segment_frames(void) {
+    char *dir = scratch_storage("1529488204470");
+    Storage *src;
+    storage_open(base_dir, &src);
+    Storage *s;
+    storage_open(dir, &s);
+
+    char *train_id = "1529489000000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    uint8_t *frames[3];
+    size_t sizes[3];
+    FrameMeta index[3];
+    for (uint32_t i = 0; i < ALEN(frames); i++) {
+        CU_ASSERT_EQUAL(storage_read_frame(src, "1529488179409", i, &frames[i], &sizes[i]), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(sizes[i], 1566720);
+        CU_ASSERT_EQUAL(storage_store_frame(s, train_id, i, frames[i], sizes[i], NULL), LPX_SUCCESS);
+        index[i].start_time = 1529489000000000 + i * 1000;
+        index[i].end_time = index[i].start_time + 999;
+    }
+    CU_ASSERT_EQUAL(storage_store_stream_idx(s, train_id, index, ALEN(index)), LPX_SUCCESS);
+
+    char *td = append_path(dir, train_id);
+    char *segment = segment_path(td, 0);
+    char *legacy_frame = legacy_frame_path(td, 0);
+    CU_ASSERT_EQUAL(access(segment, F_OK), 0);
+    CU_ASSERT_NOT_EQUAL(access(legacy_frame, F_OK), 0);
+
+    for (uint32_t i = 0; i < ALEN(frames); i++) {
+        uint8_t *frame = NULL;
+        size_t size = 0;
+        CU_ASSERT_EQUAL(storage_read_frame(s, train_id, i, &frame, &size), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(size, sizes[i]);
+        CU_ASSERT_EQUAL(memcmp(frame, frames[i], size), 0);
+        free(frame);
+        free(frames[i]);
+    }
+
+    VideoStreamBytesStream *stream = NULL;
+    CU_ASSERT_EQUAL(storage_open_stream(s, train_id, 1, &stream), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(read_whole_stream(stream), 4 + 2 * (2 + 8 + 1025078));
+    stream_close(stream);
+
+    free(segment);
+    free(legacy_frame);
+    free(td);
+    storage_close(s);
+    storage_close(src);
+    remove_scratch_storage(dir);
+}
+
+void test_write_behind(void) {
+    char *dir = scratch_storage("1529488204470");
+    StorageConfig config;
+    storage_default_config(&config);
+    config.write_queue_depth = 2;
+    config.write_threads = 2;
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+
+    char *train_id = "1529489000000";
+    storage_prepare(s, train_id);
+    size_t frame_size = 4096;
+    uint8_t *frame = xmalloc(frame_size);
+    for (uint32_t i = 0; i < 6; i++) {
+        memset(frame, i, frame_size);
+        CU_ASSERT_EQUAL(storage_store_frame(s, train_id, i, frame, frame_size, NULL), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+
+    FrameWriterStats stats;
+    storage_writer_stats(s, &stats);
+    CU_ASSERT_EQUAL(stats.frames_written, 6);
+    CU_ASSERT_EQUAL(stats.bytes_written, 6 * frame_size);
+    CU_ASSERT_EQUAL(stats.queue_depth, 0);
+    CU_ASSERT_EQUAL(stats.bytes_in_flight, 0);
+
+    for (uint32_t i = 0; i < 6; i++) {
+        uint8_t *read = NULL;
+        size_t read_size = 0;
+        CU_ASSERT_EQUAL(storage_read_frame(s, train_id, i, &read, &read_size), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(read_size, frame_size);
+        CU_ASSERT_TRUE(read[0] == i && read[frame_size - 1] == i);
+        free(read);
+    }
+
+    // фреймы двух стримов вперемешку: писатель стрима закрывается только после того, как через него допишут все
+    // потоки записи, и метаданные фреймов попадают в индекс своего стрима
+    char *trains[] = {"1529489100000", "1529489200000"};
+    storage_prepare(s, trains[0]);
+    storage_prepare(s, trains[1]);
+    for (uint32_t i = 0; i < 40; i++) {
+        memset(frame, i, frame_size);
+        int64_t start_time = (1529489100000 + i % 2 * 100000) * 1000 + i / 2 * 1000;
+        FrameMeta meta = {.start_time = start_time, .end_time = start_time + 999};
+        CU_ASSERT_EQUAL(storage_store_frame(s, trains[i % 2], i / 2, frame, frame_size, &meta), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    for (uint32_t i = 0; i < 40; i++) {
+        uint8_t *read = NULL;
+        size_t read_size = 0;
+        CU_ASSERT_EQUAL(storage_read_frame(s, trains[i % 2], i / 2, &read, &read_size), LPX_SUCCESS);
+        CU_ASSERT_TRUE(read_size == frame_size && read[0] == i && read[frame_size - 1] == i);
+        free(read);
+    }
+    for (size_t t = 0; t < ALEN(trains); t++) {
+        CU_ASSERT_EQUAL(storage_seal_stream(s, trains[t]), LPX_SUCCESS);
+        StreamIndex *index;
+        CU_ASSERT_EQUAL(storage_open_stream_idx(s, trains[t], &index), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(sidx_size(index), 20);
+        for (size_t i = 0; i < 20; i++) {
+            CU_ASSERT_EQUAL(sidx_frame(index, i)->start_time, (1529489100000 + (int64_t) t * 100000) * 1000 + i * 1000);
+        }
+        sidx_close(index);
+    }
+
+    // ошибка фоновой записи возвращается барьером
+    storage_store_frame(s, "1529489999999", 0, frame, frame_size, NULL);
+    CU_ASSERT_EQUAL(storage_flush(s), STRG_NOT_FOUND);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+
+    free(frame);
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+void test_io_engine(void) {
+    char path[] = "/tmp/lpx-ioe-XXXXXX";
+    int fd = mkstemp(path);
+    CU_ASSERT_NOT_EQUAL(fd, -1);
+
+    IoEngine *engine = ioe_create(2);
+    char first[] = "first", second[] = "second";
+    CU_ASSERT_EQUAL(ioe_write(engine, fd, first, sizeof(first), 0, 1), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(ioe_write(engine, fd, second, sizeof(second), sizeof(first), 2), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(ioe_write(engine, fd, second, sizeof(second), 0, 3), LPX_IO);
+    CU_ASSERT_EQUAL(ioe_pending(engine), 2);
+
+    IoCompletion completion;
+    uint64_t completed = 0;
+    while (ioe_wait(engine, &completion) == LPX_SUCCESS) {
+        CU_ASSERT_EQUAL(completion.result, completion.user_data == 1 ? sizeof(first) : sizeof(second));
+        completed |= completion.user_data;
+    }
+    CU_ASSERT_EQUAL(completed, 3);
+    CU_ASSERT_EQUAL(ioe_wait(engine, &completion), EOF);
+
+    char buf[sizeof(second)] = {0};
+    CU_ASSERT_EQUAL(ioe_read(engine, fd, buf, sizeof(second), sizeof(first), 4), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(ioe_wait(engine, &completion), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(completion.user_data, 4);
+    CU_ASSERT_STRING_EQUAL(buf, second);
+    ioe_free(engine);
+    close(fd);
+    unlink(path);
+
+    // архив с упреждающим чтением совпадает с архивом, прочитанным по фрейму
+    StorageConfig config;
+    storage_default_config(&config);
+    config.read_ahead = 0;
+    Storage *sync_storage;
+    storage_open_config(base_dir, &config, &sync_storage);
+    config.read_ahead = 3;
+    Storage *ahead_storage;
+    storage_open_config(base_dir, &config, &ahead_storage);
+
+    VideoStreamBytesStream *sync_stream = NULL, *ahead_stream = NULL;
+    CU_ASSERT_EQUAL(storage_open_stream(sync_storage, "1529488179409", 2, &sync_stream), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_open_stream(ahead_storage, "1529488179409", 2, &ahead_stream), LPX_SUCCESS);
+    size_t buf_size = 65536;
+    uint8_t *sync_buf = xmalloc(buf_size);
+    uint8_t *ahead_buf = xmalloc(buf_size);
+    ssize_t total = 0;
+    while (true) {
+        ssize_t sync_read = stream_read(sync_stream, sync_buf, buf_size);
+        ssize_t ahead_read = stream_read(ahead_stream, ahead_buf, buf_size);
+        CU_ASSERT_EQUAL(sync_read, ahead_read);
+        if (sync_read <= 0 || sync_read != ahead_read) {
+            break;
+        }
+        CU_ASSERT_EQUAL(memcmp(sync_buf, ahead_buf, (size_t) sync_read), 0);
+        total += sync_read;
+    }
+    CU_ASSERT_EQUAL(total, 4 + 28 * (1025078 + 8) + 8 * 2 + 20 * 3);
+
+    free(sync_buf);
+    free(ahead_buf);
+    stream_close(sync_stream);
+    stream_close(ahead_stream);
+    storage_close(sync_storage);
+    storage_close(ahead_storage);
+}
+
+void test_direct_io(void) {
+    char *dir = scratch_storage("1529488204470");
+    StorageConfig config;
+    storage_default_config(&config);
+    config.direct_io = true;
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+
+    char *train_id = "1529489000000";
+    storage_prepare(s, train_id);
+    uint8_t *frames[3];
+    size_t sizes[3];
+    for (uint32_t i = 0; i < ALEN(frames); i++) {
+        CU_ASSERT_EQUAL(storage_read_frame(s, "1529488204470", i, &frames[i], &sizes[i]), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(storage_store_frame(s, train_id, i, frames[i], sizes[i], NULL), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+
+    char *td = append_path(dir, train_id);
+    SegmentTable *table;
+    int td_fd = open(td, O_RDONLY | O_DIRECTORY);
+    CU_ASSERT_EQUAL(segt_open(td_fd, &table), LPX_SUCCESS);
+    close(td_fd);
+    CU_ASSERT_EQUAL(segt_size(table), 3);
+    for (uint32_t i = 0; i < ALEN(frames); i++) {
+        const FrameLocation *location = segt_frame(table, i);
+        CU_ASSERT_EQUAL(location->offset % SEG_DIRECT_ALIGN, 0);
+        CU_ASSERT_EQUAL(location->length, sizes[i]);
+
+        uint8_t *frame = NULL;
+        size_t size = 0;
+        CU_ASSERT_EQUAL(storage_read_frame(s, train_id, i, &frame, &size), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(size, sizes[i]);
+        CU_ASSERT_EQUAL(memcmp(frame, frames[i], size), 0);
+        free(frame);
+        free(frames[i]);
+    }
+    segt_close(table);
+    storage_close(s);
+
+    // заранее выделенное место за концом данных освобождается при закрытии сегмента
+    char *segment = segment_path(td, 0);
+    struct stat st;
+    CU_ASSERT_EQUAL(stat(segment, &st), 0);
+    CU_ASSERT_TRUE(st.st_blocks * 512 < SEG_MAX_SIZE / 2);
+
+    free(segment);
+    free(td);
+    remove_scratch_storage(dir);
+}
+
+void test_index_append(void) {
+    char *dir = scratch_storage("1529488204470");
+    StorageConfig config;
+    storage_default_config(&config);
+    config.index_commit_frames = 2;
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    // хранилище читателя в другом процессе
+    Storage *reader;
+    CU_ASSERT_EQUAL(storage_open(dir, &reader), LPX_SUCCESS);
+
+    char *train_id = "1529489000000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    size_t frame_size = 4096;
+    uint8_t *frame = xcalloc(frame_size, 1);
+    for (uint32_t i = 0; i < 5; i++) {
+        FrameMeta meta = {.start_time = 1529489000000000 + i * 1000, .end_time = 1529489000000000 + i * 1000 + 999};
+        CU_ASSERT_EQUAL(storage_store_frame(s, train_id, i, frame, frame_size, &meta), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+
+    // стрим виден читателю до окончания записи
+    char *found = NULL;
+    CU_ASSERT_EQUAL(storage_find_stream(reader, 1529489000002500, &found), LPX_SUCCESS);
+    CU_ASSERT_PTR_NOT_NULL(found);
+    CU_ASSERT_STRING_EQUAL(found, train_id);
+    free(found);
+    CU_ASSERT_TRUE(ctlg_get(reader->catalog, train_id)->open);
+
+    StreamIndex *index;
+    CU_ASSERT_EQUAL(storage_open_stream_idx(reader, train_id, &index), LPX_SUCCESS);
+    CU_ASSERT_FALSE(sidx_sealed(index));
+    CU_ASSERT_EQUAL(sidx_size(index), 5);
+    CU_ASSERT_EQUAL(sidx_frame(index, 4)->end_time, 1529489000004999);
+    sidx_close(index);
+
+    // запись прерывается без закрытия индекса и продолжается новым экземпляром хранилища
+    storage_close(s);
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    FrameMeta meta = {.start_time = 1529489000005000, .end_time = 1529489000005999};
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 5, frame, frame_size, &meta), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_seal_stream(s, train_id), LPX_SUCCESS);
+
+    CU_ASSERT_EQUAL(storage_open_stream_idx(reader, train_id, &index), LPX_SUCCESS);
+    CU_ASSERT_TRUE(sidx_sealed(index));
+    CU_ASSERT_EQUAL(sidx_size(index), 6);
+    sidx_close(index);
+    CU_ASSERT_EQUAL(storage_find_stream(reader, 1529489000005500, &found), LPX_SUCCESS);
+    CU_ASSERT_PTR_NOT_NULL(found);
+    free(found);
+    CU_ASSERT_FALSE(ctlg_get(reader->catalog, train_id)->open);
+
+    // в закрытый индекс фреймы не дописываются
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 6, frame, frame_size, &meta), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), STRG_EXISTS);
+
+    free(frame);
+    storage_close(reader);
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+/*
+ * Устанавливает mtime файла в микросекундах
+ */
+static void set_mtime(const char *path, int64_t mtime_us) {
+    struct timespec times[2] = {
+            {.tv_sec = mtime_us / 1000000, .tv_nsec = (mtime_us % 1000000) * 1000},
+            {.tv_sec = mtime_us / 1000000, .tv_nsec = (mtime_us % 1000000) * 1000}
+    };
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+void test_index_recovery(void) {
+    char *dir = scratch_storage("1529488179409");
+    char *legacy_id = "1529488179409";
+    char *segment_id = "1529489000000";
+    int64_t old = 1529488179409000;
+
+    // стрим с файлом на фрейм потерял индекс
+    Storage *s;
+    StorageConfig config;
+    storage_default_config(&config);
+    config.recover_on_open = false;
+    storage_open_config(dir, &config, &s);
+    char *legacy_dir = append_path(dir, legacy_id);
+    char *csv = append_path(legacy_dir, SIDX_CSV_FILE);
+    unlink(csv);
+    for (size_t i = 0; i < 30; i++) {
+        char *frame = legacy_frame_path(legacy_dir, i);
+        set_mtime(frame, old + 100000 + i * 33000);
+        free(frame);
+    }
+
+    // запись стрима в сегменты прервалась, последние фреймы не попали в индекс
+    storage_prepare(s, segment_id);
+    uint8_t frame[512] = {0};
+    for (uint32_t i = 0; i < 4; i++) {
+        FrameMeta meta = {.start_time = 1529489000000000 + i * 1000, .end_time = 1529489000000999 + i * 1000};
+        storage_store_frame(s, segment_id, i, frame, sizeof(frame), i < 2 ? &meta : NULL);
+    }
+    char *segment_dir = append_path(dir, segment_id);
+    char *segment = segment_path(segment_dir, 0);
+    storage_close(s);
+    set_mtime(segment, 1529489000009000);
+    set_mtime(legacy_dir, old);
+    set_mtime(segment_dir, old);
+
+    size_t recovered = 0;
+    storage_open_config(dir, &config, &s);
+    CU_ASSERT_EQUAL(storage_recover(s, &recovered), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(recovered, 2);
+
+    StreamIndex *index;
+    CU_ASSERT_EQUAL(storage_open_stream_idx(s, legacy_id, &index), LPX_SUCCESS);
+    CU_ASSERT_TRUE(sidx_sealed(index));
+    CU_ASSERT_TRUE(sidx_approximate(index));
+    CU_ASSERT_EQUAL(sidx_size(index), 30);
+    CU_ASSERT_EQUAL(sidx_frame(index, 0)->start_time, old);
+    CU_ASSERT_EQUAL(sidx_frame(index, 29)->end_time, old + 100000 + 29 * 33000);
+    CU_ASSERT_EQUAL(sidx_frame(index, 29)->start_time, sidx_frame(index, 28)->end_time);
+    sidx_close(index);
+    CU_ASSERT_TRUE(ctlg_get(s->catalog, legacy_id)->approximate);
+
+    CU_ASSERT_EQUAL(storage_open_stream_idx(s, segment_id, &index), LPX_SUCCESS);
+    CU_ASSERT_TRUE(sidx_approximate(index));
+    CU_ASSERT_EQUAL(sidx_size(index), 4);
+    CU_ASSERT_EQUAL(sidx_frame(index, 1)->end_time, 1529489000001999);
+    CU_ASSERT_EQUAL(sidx_frame(index, 2)->end_time, 1529489000005499);
+    CU_ASSERT_EQUAL(sidx_frame(index, 3)->end_time, 1529489000009000);
+    sidx_close(index);
+
+    char *found = NULL;
+    storage_find_stream(s, 1529489000008000, &found);
+    CU_ASSERT_PTR_NOT_NULL(found);
+    free(found);
+
+    // повторное восстановление не трогает закрытые индексы
+    CU_ASSERT_EQUAL(storage_recover(s, &recovered), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(recovered, 0);
+
+    storage_close(s);
+    free(segment);
+    free(segment_dir);
+    free(csv);
+    free(legacy_dir);
+    remove_scratch_storage(dir);
+}
+
+/*
+ * Ждёт, пока поток вытеснения удалит заданное количество стримов
+ */
+static bool wait_evicted(Storage *s, uint64_t streams) {
+    for (int i = 0; i < 200; i++) {
+        StorageUsage usage;
+        storage_usage(s, &usage);
+        if (usage.evicted_streams >= streams) {
+            return true;
+        }
+        usleep(50000);
+    }
+    return false;
+}
+
+void test_capacity_eviction(void) {
+    char *dir = scratch_storage("*");
+    char *oldest_id = "1529488179409";
+    char *recording_id = "1529490000000";
+    Storage *s;
+    StorageConfig config;
+    storage_default_config(&config);
+    storage_open_config(dir, &config, &s);
+    StorageUsage usage;
+    storage_usage(s, &usage);
+    CU_ASSERT_EQUAL(usage.capacity_bytes, 0);
+    uint64_t total = usage.used_bytes;
+    uint64_t oldest = ctlg_get(s->catalog, oldest_id)->bytes;
+    CU_ASSERT_TRUE(oldest > 0 && total > oldest);
+    storage_close(s);
+
+    // ёмкость, при которой хранилище выше верхней границы, а вытеснения самого старого стрима достаточно, даже с
+    // учётом фреймов записываемого стрима
+    uint8_t frame[4096] = {0};
+    config.capacity_bytes = (total - oldest + 4 * sizeof(frame)) / EVICT_LOW_PERCENT * 100 + 200;
+    storage_open_config(dir, &config, &s);
+    storage_prepare(s, recording_id);
+    for (uint32_t i = 0; i < 3; i++) {
+        CU_ASSERT_EQUAL(storage_store_frame(s, recording_id, i, frame, sizeof(frame), NULL), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    CU_ASSERT_TRUE(wait_evicted(s, 1));
+    usleep((EVICT_PAUSE_MS + EVICT_PERIOD_MS) * 1000);
+
+    storage_usage(s, &usage);
+    CU_ASSERT_EQUAL(usage.evicted_streams, 1);
+    CU_ASSERT_EQUAL(usage.evicted_bytes, oldest);
+    CU_ASSERT_TRUE(usage.used_bytes <= usage.capacity_bytes / 100 * EVICT_LOW_PERCENT);
+    char *oldest_dir = append_path(dir, oldest_id);
+    CU_ASSERT_NOT_EQUAL(access(oldest_dir, F_OK), 0);
+    CU_ASSERT_PTR_NULL(ctlg_get(s->catalog, oldest_id));
+    CU_ASSERT_PTR_NOT_NULL(ctlg_get(s->catalog, "1529488204470"));
+    char *found = NULL;
+    storage_find_stream(s, 1529488179409000, &found);
+    CU_ASSERT_PTR_NULL(found);
+    storage_close(s);
+
+    // при любой нехватке места записываемый стрим остаётся, вытесняются только завершённые
+    config.capacity_bytes = 1;
+    storage_open_config(dir, &config, &s);
+    CU_ASSERT_EQUAL(storage_store_frame(s, recording_id, 3, frame, sizeof(frame), NULL), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    CU_ASSERT_TRUE(wait_evicted(s, 2));
+    storage_usage(s, &usage);
+    // кроме фреймов - таблица фреймов сегментов
+    CU_ASSERT_TRUE(usage.used_bytes >= 4 * sizeof(frame) && usage.used_bytes < 5 * sizeof(frame));
+    CU_ASSERT_EQUAL(ctlg_size(s->catalog), 1);
+    for (uint32_t i = 0; i < 4; i++) {
+        uint8_t *read = NULL;
+        size_t read_size = 0;
+        CU_ASSERT_EQUAL(storage_read_frame(s, recording_id, i, &read, &read_size), LPX_SUCCESS);
+        free(read);
+    }
+    storage_close(s);
+
+    // фреймы, оставшиеся в очереди записи, дописываются при закрытии, пока поток вытеснения ещё работает
+    storage_open_config(dir, &config, &s);
+    for (uint32_t i = 4; i < 8; i++) {
+        CU_ASSERT_EQUAL(storage_store_frame(s, recording_id, i, frame, sizeof(frame), NULL), LPX_SUCCESS);
+    }
+    storage_close(s);
+    storage_open_config(dir, &config, &s);
+    uint8_t *read = NULL;
+    size_t read_size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(s, recording_id, 7, &read, &read_size), LPX_SUCCESS);
+    free(read);
+    storage_close(s);
+
+    free(oldest_dir);
+    remove_scratch_storage(dir);
+}
+
+/*
+ * Ждёт, пока корзина хранилища опустеет
+ */
+static bool wait_reaped(Storage *s) {
+    for (int i = 0; i < 200; i++) {
+        StorageUsage usage;
+        storage_usage(s, &usage);
+        if (usage.trash_entries == 0) {
+            return true;
+        }
+        usleep(50000);
+    }
+    return false;
+}
+
+void test_trash_reaper(void) {
+    char *dir = scratch_storage("*");
+    char *deleted_id = "1529488179409";
+    Storage *s;
+    storage_open(dir, &s);
+    uint64_t deleted_bytes = ctlg_get(s->catalog, deleted_id)->bytes;
+    uint64_t total_bytes = ctlg_bytes(s->catalog);
+
+    // стрим пропадает сразу, файлы удаляются в фоне
+    char *deleted_dir = append_path(dir, deleted_id);
+    CU_ASSERT_EQUAL(storage_delete_stream(s, deleted_id), LPX_SUCCESS);
+    CU_ASSERT_NOT_EQUAL(access(deleted_dir, F_OK), 0);
+    CU_ASSERT_PTR_NULL(ctlg_get(s->catalog, deleted_id));
+    char *found = NULL;
+    storage_find_stream(s, 1529488179409000, &found);
+    CU_ASSERT_PTR_NULL(found);
+    CU_ASSERT_TRUE(wait_reaped(s));
+    StorageUsage usage;
+    storage_usage(s, &usage);
+    CU_ASSERT_EQUAL(usage.reaped_bytes, deleted_bytes);
+    CU_ASSERT_EQUAL(usage.trash_bytes, 0);
+
+    // все стримы переносятся в корзину разом
+    CU_ASSERT_EQUAL(storage_clear(s), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(ctlg_size(s->catalog), 0);
+    storage_find_stream(s, 1529488204470000, &found);
+    CU_ASSERT_PTR_NULL(found);
+    CU_ASSERT_TRUE(wait_reaped(s));
+    storage_usage(s, &usage);
+    CU_ASSERT_EQUAL(usage.reaped_bytes, total_bytes);
+    CU_ASSERT_TRUE(usage.reaped_files > 0 && usage.reap_time_us > 0);
+    storage_close(s);
+
+    // корзина, оставшаяся с прошлого запуска, удаляется после открытия хранилища
+    char *trash = append_path(dir, TRASH_DIR);
+    char *leftover = append_path(trash, "1529488204470.1");
+    mkdir(leftover, 0777);
+    char *leftover_file = append_path(leftover, "0");
+    FILE *f = fopen(leftover_file, "w");
+    fputs("frame", f);
+    fclose(f);
+    storage_open(dir, &s);
+    storage_usage(s, &usage);
+    CU_ASSERT_TRUE(usage.trash_entries <= 1);
+    CU_ASSERT_TRUE(wait_reaped(s));
+    CU_ASSERT_NOT_EQUAL(access(leftover, F_OK), 0);
+
+    // директория незаконченной пачки не удаляется, пока в неё переносятся стримы
+    TrashBatch *batch;
+    TrashBatch *other;
+    CU_ASSERT_EQUAL(trsh_begin(s->trash, true, &batch), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(trsh_begin(s->trash, true, &other), LPX_SUCCESS);
+    trsh_end(other);
+    CU_ASSERT_TRUE(wait_reaped(s));
+    CU_ASSERT_EQUAL(mkdirat(s->base_fd, "1529488204470", 0777), 0);
+    CU_ASSERT_EQUAL(trsh_move(batch, s->base_fd, "1529488204470", "1529488204470", 0), LPX_SUCCESS);
+    trsh_end(batch);
+    CU_ASSERT_TRUE(wait_reaped(s));
+    storage_close(s);
+
+    free(leftover_file);
+    free(leftover);
+    free(trash);
+    free(deleted_dir);
+    remove_scratch_storage(dir);
+}
+
+/*
+ * Количество директорий стримов, открытых в кэше хранилища
+ */
+static size_t cached_dirs(Storage *s, const char *train_id) {
+    size_t cnt = 0;
+    for (size_t i = 0; i < TRAIN_DIRS_CACHE_SIZE; i++) {
+        if (s->dirs[i].train_id[0] != 0 && (train_id == NULL || strcmp(s->dirs[i].train_id, train_id) == 0)) {
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+void test_train_dir_cache(void) {
+    char *dir = scratch_storage("1529488204470");
+    char *train_id = "1529488204470";
+    Storage *s;
+    storage_open(dir, &s);
+
+    uint8_t *frame = NULL;
+    size_t size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(s, train_id, 0, &frame, &size), LPX_SUCCESS);
+    free(frame);
+    CU_ASSERT_EQUAL(cached_dirs(s, train_id), 1);
+    CU_ASSERT_EQUAL(storage_read_frame(s, "1529488204471", 0, &frame, &size), STRG_NOT_FOUND);
+
+    // стримов больше, чем мест в кэше: давно не использованные директории закрываются
+    char id[MAX_INT_LEN + 1];
+    uint8_t data[512] = {1};
+    for (int i = 0; i < TRAIN_DIRS_CACHE_SIZE + 2; i++) {
+        snprintf(id, sizeof(id), "%d", 1529489000000 + i);
+        CU_ASSERT_EQUAL(storage_prepare(s, id), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(storage_store_frame(s, id, 0, data, sizeof(data), NULL), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(cached_dirs(s, NULL), TRAIN_DIRS_CACHE_SIZE);
+    for (int i = 0; i < TRAIN_DIRS_CACHE_SIZE + 2; i++) {
+        snprintf(id, sizeof(id), "%d", 1529489000000 + i);
+        CU_ASSERT_EQUAL(storage_read_frame(s, id, 0, &frame, &size), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(size, sizeof(data));
+        free(frame);
+    }
+
+    // удалённый стрим забывается кэшем: стрим с тем же идентификатором пишется в новую директорию
+    CU_ASSERT_EQUAL(storage_delete_stream(s, id), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(cached_dirs(s, id), 0);
+    CU_ASSERT_EQUAL(storage_read_frame(s, id, 0, &frame, &size), STRG_NOT_FOUND);
+    CU_ASSERT_EQUAL(storage_prepare(s, id), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_store_frame(s, id, 0, data, 100, NULL), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_read_frame(s, id, 0, &frame, &size), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(size, 100);
+    free(frame);
+
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+static bool path_exists(char *dir, char *child) {
+    char *path = append_path(dir, child);
+    bool exists = access(path, F_OK) == 0;
+    free(path);
+    return exists;
+}
+
+void test_day_buckets(void) {
+    char *dir = scratch_storage("*");
+    // хранилище, открытое до смены раскладки, как lpx-server
+    Storage *reader;
+    storage_open(dir, &reader);
+
+    Storage *s;
+    StorageConfig config;
+    storage_default_config(&config);
+    config.day_buckets = true;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    CU_ASSERT_TRUE(path_exists(dir, DAY_BUCKETS_FILE));
+    CU_ASSERT_TRUE(path_exists(dir, "2018-06-20/1529488179409"));
+    CU_ASSERT_TRUE(path_exists(dir, "2018-06-20/1529489555016"));
+    CU_ASSERT_FALSE(path_exists(dir, "1529488204470"));
+
+    char *found = NULL;
+    storage_find_stream(s, 1529488204473096, &found);
+    CU_ASSERT_STRING_EQUAL(found, "1529488204470");
+    free(found);
+    found = NULL;
+    storage_find_stream(reader, 1529488179500000, &found);
+    CU_ASSERT_STRING_EQUAL(found, "1529488179409");
+    free(found);
+    found = NULL;
+    uint8_t *frame = NULL;
+    size_t size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(reader, "1529488204470", 0, &frame, &size), LPX_SUCCESS);
+    free(frame);
+
+    // стрим следующих суток попадает в свою директорию и находится другими экземплярами хранилища
+    char *next_day_id = "1529539200000";
+    uint8_t data[512] = {0};
+    FrameMeta meta = {.start_time = 1529539200000100, .end_time = 1529539200000900};
+    CU_ASSERT_EQUAL(storage_prepare(s, next_day_id), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_prepare(s, next_day_id), STRG_EXISTS);
+    CU_ASSERT_EQUAL(storage_store_frame(s, next_day_id, 0, data, sizeof(data), &meta), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_seal_stream(s, next_day_id), LPX_SUCCESS);
+    CU_ASSERT_TRUE(path_exists(dir, "2018-06-21/1529539200000"));
+    storage_find_stream(reader, 1529539200000500, &found);
+    CU_ASSERT_STRING_EQUAL(found, next_day_id);
+    free(found);
+    found = NULL;
+    storage_close(reader);
+
+    // раскладка остаётся и без day_buckets в параметрах
+    storage_open(dir, &reader);
+    storage_find_stream(reader, 1529539200000500, &found);
+    CU_ASSERT_STRING_EQUAL(found, next_day_id);
+    free(found);
+    found = NULL;
+    storage_close(reader);
+
+    // стрим, ещё не перенесённый в директорию суток, остаётся в каталоге
+    char *bucket = append_path(dir, "2018-06-21");
+    char *bucket_path = append_path(bucket, next_day_id);
+    char *flat_path = append_path(dir, next_day_id);
+    CU_ASSERT_EQUAL(rename(bucket_path, flat_path), 0);
+    CU_ASSERT_EQUAL(rmdir(bucket), 0);
+    storage_find_stream(s, 1529539200000500, &found);
+    CU_ASSERT_STRING_EQUAL(found, next_day_id);
+    free(found);
+    found = NULL;
+    free(flat_path);
+    free(bucket_path);
+    free(bucket);
+
+    // пустая директория суток удаляется вместе с последним стримом
+    CU_ASSERT_EQUAL(storage_delete_stream(s, next_day_id), LPX_SUCCESS);
+    CU_ASSERT_FALSE(path_exists(dir, "2018-06-21"));
+    storage_find_stream(s, 1529539200000500, &found);
+    CU_ASSERT_PTR_NULL(found);
+
+    CU_ASSERT_EQUAL(storage_clear(s), LPX_SUCCESS);
+    CU_ASSERT_FALSE(path_exists(dir, "2018-06-20"));
+    CU_ASSERT_EQUAL(ctlg_size(s->catalog), 0);
+    storage_close(s);
+
+    remove_scratch_storage(dir);
+}
+
+void test_frame_codec(void) {
+    Storage *src;
+    storage_open(base_dir, &src);
+    uint8_t *raw = NULL;
+    size_t raw_size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(src, "1529488179409", 0, &raw, &raw_size), LPX_SUCCESS);
+    storage_close(src);
+
+    FrameFormat format;
+    mnf_legacy(&format);
+    uint8_t *encoded = xmalloc(cdc_bound(raw_size, format.width));
+    size_t encoded_size = cdc_encode(raw, raw_size, format.width, encoded);
+    CU_ASSERT_TRUE(encoded_size > 0 && encoded_size < raw_size / 2);
+    size_t decoded_size = 0;
+    CU_ASSERT_EQUAL(cdc_raw_size(encoded, encoded_size, &decoded_size), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(decoded_size, raw_size);
+    uint8_t *decoded = xmalloc(decoded_size);
+    CU_ASSERT_EQUAL(cdc_decode(encoded, encoded_size, decoded), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(memcmp(decoded, raw, raw_size), 0);
+    CU_ASSERT_EQUAL(cdc_decode(encoded, encoded_size - 1, decoded), LPX_IO);
+    CU_ASSERT_EQUAL(cdc_decode(raw, raw_size, decoded), LPX_IO);
+    free(decoded);
+
+    // шум не сжимается и пишется как есть
+    uint8_t *noise = xmalloc(raw_size);
+    srand(1);
+    for (size_t i = 0; i < raw_size; i++) {
+        noise[i] = (uint8_t) rand();
+    }
+    CU_ASSERT_EQUAL(cdc_encode(noise, raw_size, format.width, encoded), 0);
+    free(encoded);
+
+    char *dir = scratch_storage("1529488204470");
+    StorageConfig config;
+    storage_default_config(&config);
+    config.compress = true;
+    config.direct_io = true;
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    char *train_id = "1529489000000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 0, raw, raw_size, NULL), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 1, noise, raw_size, NULL), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    FrameMeta index[2] = {{1529489000000000, 1529489000000999}, {1529489000001000, 1529489000001999}};
+    CU_ASSERT_EQUAL(storage_store_stream_idx(s, train_id, index, ALEN(index)), LPX_SUCCESS);
+
+    char *td = append_path(dir, train_id);
+    int td_fd = open(td, O_RDONLY | O_DIRECTORY);
+    SegmentTable *table = NULL;
+    CU_ASSERT_EQUAL(segt_open(td_fd, &table), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(segt_frame(table, 0)->flags, SEG_FRAME_LPXC | SEG_FRAME_CRC);
+    CU_ASSERT_EQUAL(segt_frame(table, 0)->length, encoded_size);
+    CU_ASSERT_EQUAL(segt_frame(table, 1)->flags, SEG_FRAME_CRC);
+    CU_ASSERT_EQUAL(segt_frame(table, 1)->length, raw_size);
+    segt_close(table);
+    close(td_fd);
+    free(td);
+
+    // фреймы распаковываются при чтении, в том числе другим экземпляром хранилища без сжатия
+    Storage *reader;
+    storage_open(dir, &reader);
+    uint8_t *frame = NULL;
+    size_t size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(reader, train_id, 0, &frame, &size), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(size, raw_size);
+    CU_ASSERT_EQUAL(memcmp(frame, raw, raw_size), 0);
+    free(frame);
+    CU_ASSERT_EQUAL(storage_read_frame(reader, train_id, 1, &frame, &size), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(size, raw_size);
+    CU_ASSERT_EQUAL(memcmp(frame, noise, raw_size), 0);
+    free(frame);
+
+    VideoStreamBytesStream *stream = NULL;
+    CU_ASSERT_EQUAL(storage_open_stream(reader, train_id, 0, &stream), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(read_whole_stream(stream), 4 + 2 * (2 + 8 + 1025078));
+    stream_close(stream);
+    storage_close(reader);
+
+    free(noise);
+    free(raw);
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+/*
+ * Упаковывает строку 10-битных пикселей в RAW10: по 4 пикселя в 5 байтах
+ */
+static void pack_raw10(const uint16_t *pixels, size_t width, uint8_t *row) {
+    for (size_t i = 0, j = 0; j < width; i += 5, j += 4) {
+        row[i + 4] = 0;
+        for (size_t k = 0; k < 4 && j + k < width; k++) {
+            row[i + k] = (uint8_t) (pixels[j + k] >> 2);
+            row[i + 4] |= (uint8_t) ((pixels[j + k] & 0x3) << (2 * k));
+        }
+    }
+}
+
+void test_stream_manifest(void) {
+    char *dir = scratch_storage("1529488204470");
+    Storage *s;
+    storage_open(dir, &s);
+
+    // стримы, записанные до появления манифестов, сняты ar0144 в RAW12
+    FrameFormat format;
+    CU_ASSERT_EQUAL(storage_read_format(s, "1529488204470", &format), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(format.width, 1280);
+    CU_ASSERT_EQUAL(format.height, 800);
+    CU_ASSERT_EQUAL(format.stride, 1920);
+    CU_ASSERT_EQUAL(format.bit_depth, 12);
+    CU_ASSERT_STRING_EQUAL(format.sensor, "ar0144");
+
+    // RAW10 6x2, строки выровнены до 16 байт
+    char *train_id = "1529489000000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    FrameFormat raw10 = {.width = 6, .height = 2, .stride = 16, .bit_depth = 10, .frame_size = 32,
+                         .bayer_order = "BGGR", .sensor = "imx219"};
+    CU_ASSERT_EQUAL(storage_store_format(s, train_id, &raw10), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_read_format(s, train_id, &format), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(format.width, raw10.width);
+    CU_ASSERT_EQUAL(format.bit_depth, raw10.bit_depth);
+    CU_ASSERT_STRING_EQUAL(format.bayer_order, "BGGR");
+    CU_ASSERT_STRING_EQUAL(format.sensor, "imx219");
+    // фреймы хранятся без выравнивания строк
+    CU_ASSERT_EQUAL(format.stride, 10);
+    CU_ASSERT_EQUAL(format.frame_size, 20);
+
+    uint16_t pixels[2][6] = {{0x3FF, 0x000, 0x200, 0x155, 0x0F0, 0x00F},
+                             {0x001, 0x002, 0x003, 0x004, 0x005, 0x3FE}};
+    uint8_t frame[32];
+    memset(frame, 0xAA, sizeof(frame));
+    pack_raw10(pixels[0], 6, frame);
+    pack_raw10(pixels[1], 6, frame + raw10.stride);
+    FrameMeta meta[2] = {{1529489000000000, 1529489000000999}, {1529489000001000, 1529489000001999}};
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 0, frame, sizeof(frame), &meta[0]), LPX_SUCCESS);
+    // фрейм короче, чем требует формат
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 1, frame, raw10.stride, &meta[1]), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_seal_stream(s, train_id), LPX_SUCCESS);
+
+    VideoStreamBytesStream *stream = NULL;
+    CU_ASSERT_EQUAL(storage_open_stream(s, train_id, 0, &stream), LPX_SUCCESS);
+    size_t bmp_size = 54 + 256 * 4 + 8 * 2;
+    uint8_t out[4 + 2 + 8 + 54 + 256 * 4 + 8 * 2];
+    // первый фрейм целиком, ошибка конвертации второго возвращается следующим чтением
+    ssize_t read = stream_read(stream, out, sizeof(out));
+    CU_ASSERT_EQUAL(read, sizeof(out));
+    uint64_t size;
+    memcpy(&size, out + 4 + 2, sizeof(size));
+    CU_ASSERT_EQUAL(size, bmp_size);
+    uint8_t *bmp_pixels = out + 4 + 2 + 8 + 54 + 256 * 4;
+    for (size_t y = 0; y < 2; y++) {
+        for (size_t x = 0; x < 6; x++) {
+            CU_ASSERT_EQUAL(bmp_pixels[y * 8 + x], (uint8_t) pixels[y][x]);
+        }
+        CU_ASSERT_EQUAL(bmp_pixels[y * 8 + 6], 0);
+    }
+    CU_ASSERT_EQUAL(stream_read(stream, out, sizeof(out)), STRM_IO);
+    stream_close(stream);
+
+    // повреждённый манифест не подменяется форматом по умолчанию
+    char *manifest = append_path(dir, train_id);
+    char *manifest_path = append_path(manifest, MNF_FILE);
+    truncate(manifest_path, sizeof(ManifestHeader) + 4);
+    CU_ASSERT_EQUAL(storage_read_format(s, train_id, &format), STRG_BAD_INDEX);
+    CU_ASSERT_EQUAL(storage_open_stream(s, train_id, 0, &stream), LPX_IO);
+    free(manifest_path);
+    free(manifest);
+
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+void test_compact_frames(void) {
+    Storage *src;
+    storage_open(base_dir, &src);
+    uint8_t *padded = NULL;
+    size_t padded_size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(src, "1529488179409", 0, &padded, &padded_size), LPX_SUCCESS);
+    storage_close(src);
+    FrameFormat legacy;
+    mnf_legacy(&legacy);
+    CU_ASSERT_EQUAL(padded_size, legacy.frame_size);
+    size_t payload = 1280 * 800 * 3 / 2;
+
+    char *dir = scratch_storage("1529488204470");
+    for (size_t queue_depth = 0; queue_depth <= 2; queue_depth += 2) {
+        StorageConfig config;
+        storage_default_config(&config);
+        config.write_queue_depth = queue_depth;
+        Storage *s;
+        CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+
+        // фрейм камеры с выравниванием MMAL сохраняется без последних 16 строк
+        char *train_id = queue_depth == 0 ? "1529489000000" : "1529489100000";
+        CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(storage_store_format(s, train_id, &legacy), LPX_SUCCESS);
+        FrameMeta meta = {1529489000000000, 1529489000000999};
+        CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 0, padded, padded_size, &meta), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(storage_seal_stream(s, train_id), LPX_SUCCESS);
+
+        FrameFormat format;
+        CU_ASSERT_EQUAL(storage_read_format(s, train_id, &format), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(format.stride, 1920);
+        CU_ASSERT_EQUAL(format.frame_size, payload);
+        uint8_t *frame = NULL;
+        size_t size = 0;
+        CU_ASSERT_EQUAL(storage_read_frame(s, train_id, 0, &frame, &size), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(size, payload);
+        CU_ASSERT_EQUAL(memcmp(frame, padded, payload), 0);
+        free(frame);
+
+        // BMP из ужатого фрейма совпадает с BMP старого фрейма с выравниванием
+        VideoStreamBytesStream *stream = NULL;
+        CU_ASSERT_EQUAL(storage_open_stream(s, train_id, 0, &stream), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(read_whole_stream(stream), 4 + 2 + 8 + 1025078);
+        stream_close(stream);
+        storage_close(s);
+    }
+
+    // строки, выровненные до 8 байт, сохраняются подряд
+    Storage *s;
+    storage_open(dir, &s);
+    char *train_id = "1529489200000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    FrameFormat raw8 = {.width = 6, .height = 2, .stride = 8, .bit_depth = 8, .frame_size = 16};
+    CU_ASSERT_EQUAL(storage_store_format(s, train_id, &raw8), LPX_SUCCESS);
+    uint8_t rows[16] = {1, 2, 3, 4, 5, 6, 0, 0, 7, 8, 9, 10, 11, 12, 0, 0};
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 0, rows, sizeof(rows), NULL), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    uint8_t *frame = NULL;
+    size_t size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(s, train_id, 0, &frame, &size), LPX_SUCCESS);
+    uint8_t compact[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    CU_ASSERT_EQUAL(size, sizeof(compact));
+    CU_ASSERT_EQUAL(memcmp(frame, compact, sizeof(compact)), 0);
+    free(frame);
+    storage_close(s);
+
+    free(padded);
+    remove_scratch_storage(dir);
+}
+
+void test_map_frame(void) {
+    Storage *src;
+    storage_open(base_dir, &src);
+    uint8_t *raw = NULL;
+    size_t raw_size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(src, "1529488179409", 0, &raw, &raw_size), LPX_SUCCESS);
+    // фрейм, записанный отдельным файлом, отображается целиком
+    MappedFrame mapped;
+    CU_ASSERT_EQUAL(storage_map_frame(src, "1529488179409", 0, &mapped), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(mapped.size, raw_size);
+    CU_ASSERT_EQUAL(memcmp(mapped.data, raw, raw_size), 0);
+    storage_unmap_frame(&mapped);
+    storage_unmap_frame(&mapped);
+    CU_ASSERT_EQUAL(storage_map_frame(src, "1529488179409", 100000, &mapped), STRG_NOT_FOUND);
+    storage_close(src);
+
+    // в сегменте за сжатым фреймом следует несжатый, по смещению не на границе страницы
+    char *dir = scratch_storage("1529488204470");
+    StorageConfig config;
+    storage_default_config(&config);
+    config.compress = true;
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    char *train_id = "1529489000000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    uint8_t *noise = xmalloc(raw_size);
+    srand(1);
+    for (size_t i = 0; i < raw_size; i++) {
+        noise[i] = (uint8_t) rand();
+    }
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 0, raw, raw_size, NULL), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 1, noise, raw_size, NULL), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+
+    CU_ASSERT_EQUAL(storage_map_frame(s, train_id, 0, &mapped), LPX_SUCCESS);
+    CU_ASSERT_PTR_NULL(mapped.map);
+    CU_ASSERT_EQUAL(mapped.size, raw_size);
+    CU_ASSERT_EQUAL(memcmp(mapped.data, raw, raw_size), 0);
+    storage_unmap_frame(&mapped);
+    CU_ASSERT_EQUAL(storage_map_frame(s, train_id, 1, &mapped), LPX_SUCCESS);
+    CU_ASSERT_PTR_NOT_NULL(mapped.map);
+    CU_ASSERT_EQUAL(mapped.size, raw_size);
+    CU_ASSERT_EQUAL(memcmp(mapped.data, noise, raw_size), 0);
+    storage_unmap_frame(&mapped);
+    CU_ASSERT_EQUAL(storage_map_frame(s, train_id, 2, &mapped), STRG_NOT_FOUND);
+
+    // фрейм, выходящий за конец файла, не отображается
+    int fd = open("/dev/null", O_RDONLY);
+    FrameRef ref = {.offset = 0, .length = 16};
+    CU_ASSERT_EQUAL(stream_map_frame(fd, &ref, &mapped), LPX_IO);
+    close(fd);
+
+    free(noise);
+    free(raw);
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+void test_map_frames(void) {
+    Storage *s;
+    storage_open(base_dir, &s);
+    // фреймы отдаются в порядке запроса, в том числе повторяющиеся
+    char *train_id = "1529488179409";
+    uint32_t idxs[] = {7, 2, 20, 2};
+    MappedFrame frames[ALEN(idxs)];
+    CU_ASSERT_EQUAL(storage_map_frames(s, train_id, idxs, ALEN(idxs), frames), LPX_SUCCESS);
+    for (size_t i = 0; i < ALEN(idxs); i++) {
+        uint8_t *frame = NULL;
+        size_t size = 0;
+        CU_ASSERT_EQUAL(storage_read_frame(s, train_id, idxs[i], &frame, &size), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(frames[i].size, size);
+        CU_ASSERT_EQUAL(memcmp(frames[i].data, frame, size), 0);
+        free(frame);
+        storage_unmap_frame(&frames[i]);
+    }
+    // при ошибке ничего не остаётся отображённым
+    uint32_t bad_idxs[] = {3, 100000};
+    CU_ASSERT_NOT_EQUAL(storage_map_frames(s, train_id, bad_idxs, ALEN(bad_idxs), frames), LPX_SUCCESS);
+    CU_ASSERT_PTR_NULL(frames[0].map);
+    CU_ASSERT_PTR_NULL(frames[1].map);
+    storage_close(s);
+
+    // фреймы сегмента
+    char *dir = scratch_storage("1529488204470");
+    storage_open(dir, &s);
+    train_id = "1529489000000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    uint8_t bufs[5][64];
+    for (uint32_t i = 0; i < ALEN(bufs); i++) {
+        memset(bufs[i], (int) i + 1, sizeof(bufs[i]));
+        CU_ASSERT_EQUAL(storage_store_frame(s, train_id, i, bufs[i], sizeof(bufs[i]), NULL), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    uint32_t seg_idxs[] = {4, 0, 3, 1};
+    CU_ASSERT_EQUAL(storage_map_frames(s, train_id, seg_idxs, ALEN(seg_idxs), frames), LPX_SUCCESS);
+    for (size_t i = 0; i < ALEN(seg_idxs); i++) {
+        CU_ASSERT_EQUAL(frames[i].size, sizeof(bufs[0]));
+        CU_ASSERT_EQUAL(memcmp(frames[i].data, bufs[seg_idxs[i]], sizeof(bufs[0])), 0);
+        storage_unmap_frame(&frames[i]);
+    }
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+/*
+ * Портит байт файла path по смещению offset
+ */
+static void flip_byte(char *path, uint64_t offset) {
+    int fd = open(path, O_RDWR);
+    uint8_t b = 0;
+    CU_ASSERT_EQUAL(pread(fd, &b, 1, (off_t) offset), 1);
+    b ^= 0x10;
+    CU_ASSERT_EQUAL(pwrite(fd, &b, 1, (off_t) offset), 1);
+    close(fd);
+}
+
+void test_frame_checksum(void) {
+    const char *check = "123456789";
+    CU_ASSERT_EQUAL(crc32c(0, (const uint8_t *) check, strlen(check)), 0xe3069283);
+    CU_ASSERT_EQUAL(crc32c(crc32c(0, (const uint8_t *) check, 4), (const uint8_t *) check + 4, 5), 0xe3069283);
+
+    char *dir = scratch_storage("1529488204470");
+    Storage *s;
+    storage_open(dir, &s);
+    char *train_id = "1529489000000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    FrameFormat raw8 = {.width = 8, .height = 8, .stride = 8, .bit_depth = 8, .frame_size = 64};
+    CU_ASSERT_EQUAL(storage_store_format(s, train_id, &raw8), LPX_SUCCESS);
+    uint8_t bufs[3][64];
+    for (uint32_t i = 0; i < ALEN(bufs); i++) {
+        memset(bufs[i], (int) i + 1, sizeof(bufs[i]));
+        CU_ASSERT_EQUAL(storage_store_frame(s, train_id, i, bufs[i], sizeof(bufs[i]), NULL), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    FrameMeta index[3] = {{1529489000000000, 1529489000000999}, {1529489000001000, 1529489000001999},
+                          {1529489000002000, 1529489000002999}};
+    CU_ASSERT_EQUAL(storage_store_stream_idx(s, train_id, index, ALEN(index)), LPX_SUCCESS);
+
+    char *td = append_path(dir, train_id);
+    int td_fd = open(td, O_RDONLY | O_DIRECTORY);
+    SegmentTable *table = NULL;
+    CU_ASSERT_EQUAL(segt_open(td_fd, &table), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(segt_frame(table, 1)->crc, crc32c(0, bufs[1], sizeof(bufs[1])));
+    uint64_t offset = segt_frame(table, 1)->offset;
+    segt_close(table);
+    char *segment = segment_path(td, 0);
+    flip_byte(segment, offset + 7);
+
+    // повреждённый фрейм не отдаётся ни одним способом чтения, соседние читаются
+    uint8_t *frame = NULL;
+    size_t size = 0;
+    CU_ASSERT_EQUAL(storage_read_frame(s, train_id, 1, &frame, &size), LPX_CORRUPT);
+    CU_ASSERT_EQUAL(storage_read_frame(s, train_id, 2, &frame, &size), LPX_SUCCESS);
+    free(frame);
+    MappedFrame mapped;
+    CU_ASSERT_EQUAL(storage_map_frame(s, train_id, 1, &mapped), LPX_CORRUPT);
+    List *idxs = lst_create();
+    size_t idx_values[] = {0, 1};
+    lst_append(idxs, &idx_values[0]);
+    lst_append(idxs, &idx_values[1]);
+    VideoStreamBytesStream *stream = NULL;
+    CU_ASSERT_EQUAL(storage_open_stream_frames(s, train_id, idxs, &stream), LPX_CORRUPT);
+    lst_free(idxs);
+    CU_ASSERT_EQUAL(storage_open_stream(s, train_id, 0, &stream), LPX_SUCCESS);
+    uint8_t buf[64 * 1024];
+    ssize_t read;
+    do {
+        read = stream_read(stream, buf, sizeof(buf));
+    } while (read > 0);
+    CU_ASSERT_EQUAL(read, STRM_IO);
+    stream_close(stream);
+    storage_close(s);
+
+    // без проверки контрольных сумм фрейм читается как есть
+    StorageConfig config;
+    storage_default_config(&config);
+    config.verify_crc = false;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_read_frame(s, train_id, 1, &frame, &size), LPX_SUCCESS);
+    CU_ASSERT_NOT_EQUAL(memcmp(frame, bufs[1], size), 0);
+    free(frame);
+    storage_close(s);
+    flip_byte(segment, offset + 7);
+
+    // таблица первой версии, без контрольных сумм, читается и дописывается в своём формате
+    char *tbl_path = append_path(td, SEG_TABLE_FILE);
+    FILE *tbl = fopen(tbl_path, "r+");
+    SegmentTableHeader header;
+    fread(&header, sizeof(header), 1, tbl);
+    FrameLocation records[3];
+    fread(records, sizeof(FrameLocation), ALEN(records), tbl);
+    header.version = 1;
+    header.record_size = SEG_V1_RECORD_SIZE;
+    fseek(tbl, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, tbl);
+    for (size_t i = 0; i < ALEN(records); i++) {
+        records[i].flags &= ~SEG_FRAME_CRC;
+        fwrite(&records[i], SEG_V1_RECORD_SIZE, 1, tbl);
+    }
+    fclose(tbl);
+    truncate(tbl_path, sizeof(header) + ALEN(records) * SEG_V1_RECORD_SIZE);
+
+    storage_open(dir, &s);
+    uint8_t extra[64];
+    memset(extra, 9, sizeof(extra));
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 3, extra, sizeof(extra), NULL), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(segt_open(td_fd, &table), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(segt_size(table), 4);
+    CU_ASSERT_EQUAL(segt_frame(table, 3)->flags, 0);
+    segt_close(table);
+    for (uint32_t i = 0; i < 4; i++) {
+        CU_ASSERT_EQUAL(storage_read_frame(s, train_id, i, &frame, &size), LPX_SUCCESS);
+        CU_ASSERT_EQUAL(memcmp(frame, i < 3 ? bufs[i] : extra, size), 0);
+        free(frame);
+    }
+    storage_close(s);
+
+    close(td_fd);
+    free(tbl_path);
+    free(segment);
+    free(td);
+    remove_scratch_storage(dir);
+}
+
+static bool wait_scrubbed(Storage *s) {
+    for (int i = 0; i < 200; i++) {
+        StorageScrub scrub;
+        storage_scrub_status(s, &scrub);
+        if (scrub.pending_streams == 0 && scrub.train_id[0] == 0) {
+            return true;
+        }
+        usleep(50000);
+    }
+    return false;
+}
+
+void test_scrubber(void) {
+    char *dir = scratch_storage("1529488204470");
+    Storage *s;
+    storage_open(dir, &s);
+    char *train_ids[] = {"1529489000000", "1529489100000"};
+    uint8_t buf[4096];
+    for (size_t t = 0; t < ALEN(train_ids); t++) {
+        CU_ASSERT_EQUAL(storage_prepare(s, train_ids[t]), LPX_SUCCESS);
+        for (uint32_t i = 0; i < 5; i++) {
+            memset(buf, (int) (t * 5 + i), sizeof(buf));
+            int64_t start = 1529489000000000 + (int64_t) t * 100000000 + i * 1000;
+            FrameMeta meta = {start, start + 999};
+            CU_ASSERT_EQUAL(storage_store_frame(s, train_ids[t], i, buf, sizeof(buf), &meta), LPX_SUCCESS);
+        }
+        CU_ASSERT_EQUAL(storage_seal_stream(s, train_ids[t]), LPX_SUCCESS);
+    }
+    storage_close(s);
+
+    // портим фрейм 3 второго стрима
+    char *td = append_path(dir, train_ids[1]);
+    char *segment = segment_path(td, 0);
+    flip_byte(segment, 3 * sizeof(buf) + 100);
+
+    StorageConfig config;
+    storage_default_config(&config);
+    config.scrub_bytes_per_sec = 64 * 1024 * 1024;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    CU_ASSERT_TRUE(wait_scrubbed(s));
+    StorageScrub scrub;
+    storage_scrub_status(s, &scrub);
+    // у стрима, записанного по файлу на фрейм, проверять нечего, но он тоже считается проверенным
+    CU_ASSERT_EQUAL(scrub.verified_streams, 3);
+    CU_ASSERT_EQUAL(scrub.verified_frames, 10);
+    CU_ASSERT_EQUAL(scrub.verified_bytes, 10 * sizeof(buf));
+    CU_ASSERT_EQUAL(scrub.corrupt_frames, 1);
+    CU_ASSERT_EQUAL(scrub.failed_frames, 0);
+    CU_ASSERT_EQUAL(scrub.pending_streams, 0);
+    CU_ASSERT_EQUAL(scrub.corrupt_streams, 1);
+    storage_close(s);
+
+    // результаты проверки сохраняются в контрольной точке каталога, проверенные стримы не проверяются повторно
+    storage_open_config(dir, &config, &s);
+    lock_catalog(s);
+    const CatalogEntry *entry = ctlg_get(s->catalog, train_ids[0]);
+    CU_ASSERT_TRUE(entry != NULL && entry->scrub_time > 0 && entry->scrub_errors == 0);
+    entry = ctlg_get(s->catalog, train_ids[1]);
+    CU_ASSERT_TRUE(entry != NULL && entry->scrub_time > 0 && entry->scrub_errors == 1);
+    unlock_catalog(s);
+    storage_scrub_status(s, &scrub);
+    CU_ASSERT_EQUAL(scrub.pending_streams, 0);
+    CU_ASSERT_EQUAL(scrub.verified_frames, 0);
+    storage_close(s);
+
+    free(segment);
+    free(td);
+    remove_scratch_storage(dir);
+}
+
+static bool is_symlink(const char *path) {
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+static off_t path_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static bool wait_migrated(Storage *s, uint64_t segments) {
+    for (int i = 0; i < 200; i++) {
+        StorageUsage usage;
+        storage_usage(s, &usage);
+        if (usage.migrated_segments >= segments) {
+            return true;
+        }
+        usleep(50000);
+    }
+    return false;
+}
+
+/*
+ * Записывает в стрим train_id frames фреймов по 4096 байт, заполненных номером фрейма
+ */
+static void store_test_frames(Storage *s, char *train_id, uint32_t frames) {
+    uint8_t buf[4096];
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    for (uint32_t i = 0; i < frames; i++) {
+        memset(buf, (int) i, sizeof(buf));
+        int64_t start = (int64_t) strtoull(train_id, NULL, 10) * 1000 + i * 1000;
+        FrameMeta meta = {start, start + 999};
+        CU_ASSERT_EQUAL(storage_store_frame(s, train_id, i, buf, sizeof(buf), &meta), LPX_SUCCESS);
+    }
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+}
+
+static bool check_test_frame(Storage *s, char *train_id, uint32_t frame_idx) {
+    uint8_t *buf;
+    size_t size;
+    if (storage_read_frame(s, train_id, frame_idx, &buf, &size) != LPX_SUCCESS) {
+        return false;
+    }
+    bool res = size == 4096 && buf[0] == frame_idx && buf[size - 1] == frame_idx;
+    free(buf);
+    return res;
+}
+
+void test_ram_tier(void) {
+    char *dir = scratch_storage("1529488204470");
+    char *ram = strdup("/tmp/lpx-ram-XXXXXX");
+    CU_ASSERT_PTR_NOT_NULL(mkdtemp(ram));
+    StorageConfig config;
+    storage_default_config(&config);
+    config.ram_dir = ram;
+    config.ram_bytes = 2 * SEG_MAX_SIZE;
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+
+    // записываемый стрим лежит в RAM, но ищется и читается как обычно, в том числе другим экземпляром хранилища
+    char *train_id = "1529489000000";
+    store_test_frames(s, train_id, 5);
+    char *td = append_path(dir, train_id);
+    char *segment = segment_path(td, 0);
+    CU_ASSERT_TRUE(is_symlink(segment));
+    StorageUsage usage;
+    storage_usage(s, &usage);
+    CU_ASSERT_EQUAL(usage.ram_bytes, SEG_MAX_SIZE);
+    CU_ASSERT_TRUE(check_test_frame(s, train_id, 3));
+    Storage *reader;
+    CU_ASSERT_EQUAL(storage_open(dir, &reader), LPX_SUCCESS);
+    char *found = NULL;
+    CU_ASSERT_EQUAL(storage_find_stream(reader, 1529489000002000, &found), LPX_SUCCESS);
+    CU_ASSERT_STRING_EQUAL(found != NULL ? found : "", train_id);
+    free(found);
+    CU_ASSERT_TRUE(check_test_frame(reader, train_id, 2));
+
+    // после закрытия стрима сегмент переносится на диск, место в RAM освобождается
+    CU_ASSERT_EQUAL(storage_seal_stream(s, train_id), LPX_SUCCESS);
+    CU_ASSERT_TRUE(wait_migrated(s, 1));
+    CU_ASSERT_FALSE(is_symlink(segment));
+    CU_ASSERT_EQUAL(path_size(segment), 5 * 4096);
+    storage_usage(s, &usage);
+    CU_ASSERT_EQUAL(usage.ram_bytes, 0);
+    CU_ASSERT_EQUAL(usage.migrated_bytes, 5 * 4096);
+    CU_ASSERT_TRUE(check_test_frame(s, train_id, 4));
+    CU_ASSERT_TRUE(check_test_frame(reader, train_id, 4));
+    storage_close(reader);
+
+    // незакрытый стрим переносится при закрытии хранилища
+    char *open_train_id = "1529489100000";
+    store_test_frames(s, open_train_id, 3);
+    storage_close(s);
+    char *open_td = append_path(dir, open_train_id);
+    char *open_segment = segment_path(open_td, 0);
+    CU_ASSERT_FALSE(is_symlink(open_segment));
+    CU_ASSERT_EQUAL(path_size(open_segment), 3 * 4096);
+    char *ram_td = append_path(ram, open_train_id);
+    CU_ASSERT_NOT_EQUAL(access(ram_td, F_OK), 0);
+
+    // когда сегмент не помещается в RAM, он пишется сразу на диск
+    config.ram_bytes = SEG_MAX_SIZE / 2;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    char *spilled_train_id = "1529489200000";
+    store_test_frames(s, spilled_train_id, 2);
+    char *spilled_td = append_path(dir, spilled_train_id);
+    char *spilled_segment = segment_path(spilled_td, 0);
+    CU_ASSERT_FALSE(is_symlink(spilled_segment));
+    CU_ASSERT_TRUE(check_test_frame(s, spilled_train_id, 1));
+    storage_usage(s, &usage);
+    CU_ASSERT_EQUAL(usage.ram_bytes, 0);
+    CU_ASSERT_EQUAL(storage_seal_stream(s, spilled_train_id), LPX_SUCCESS);
+    storage_close(s);
+
+    free(spilled_segment);
+    free(spilled_td);
+    free(ram_td);
+    free(open_segment);
+    free(open_td);
+    free(segment);
+    free(td);
+    remove_scratch_storage(ram);
+    remove_scratch_storage(dir);
+}
+
+void test_durability(void) {
+    char *dir = scratch_storage("1529488204470");
+    StorageConfig config;
+    storage_default_config(&config);
+    config.durability = STRG_DURABLE_FRAME;
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+
+    // сохранение фрейма завершается после фиксации, незафиксированных фреймов не остаётся
+    store_test_frames(s, "1529489000000", 8);
+    StorageSync sync;
+    storage_sync_stats(s, &sync);
+    CU_ASSERT_TRUE(sync.syncs > 0);
+    CU_ASSERT_EQUAL(sync.synced_frames, 8);
+    CU_ASSERT_EQUAL(sync.unsynced_frames, 0);
+    CU_ASSERT_EQUAL(sync.sync_errors, 0);
+    CU_ASSERT_TRUE(check_test_frame(s, "1529489000000", 7));
+
+    // фрейм пишется без очереди записи и зафиксирован уже при возврате из сохранения, без storage_flush
+    uint8_t buf[4096] = {0};
+    FrameMeta meta = {1529489000008000, 1529489000008999};
+    CU_ASSERT_EQUAL(storage_store_frame(s, "1529489000000", 8, buf, sizeof(buf), &meta), LPX_SUCCESS);
+    storage_sync_stats(s, &sync);
+    CU_ASSERT_EQUAL(sync.synced_frames, 9);
+    CU_ASSERT_EQUAL(sync.unsynced_frames, 0);
+    storage_close(s);
+
+    // групповая фиксация раз в 4 фрейма: потерять можно не больше группы и пачки записи
+    config.durability = STRG_DURABLE_GROUP;
+    config.index_commit_frames = 4;
+    config.index_commit_ms = 0;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    store_test_frames(s, "1529490000000", 32);
+    CU_ASSERT_EQUAL(storage_seal_stream(s, "1529490000000"), LPX_SUCCESS);
+    storage_sync_stats(s, &sync);
+    CU_ASSERT_TRUE(sync.syncs > 0);
+    CU_ASSERT_EQUAL(sync.synced_frames, 32);
+    CU_ASSERT_EQUAL(sync.unsynced_frames, 0);
+    CU_ASSERT_TRUE(sync.unsynced_frames_max >= 4 && sync.unsynced_frames_max <= 32);
+    storage_close(s);
+
+    // без фиксации фреймы остаются в page cache
+    config.durability = STRG_DURABLE_NONE;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+    store_test_frames(s, "1529491000000", 8);
+    CU_ASSERT_EQUAL(storage_seal_stream(s, "1529491000000"), LPX_SUCCESS);
+    storage_sync_stats(s, &sync);
+    CU_ASSERT_EQUAL(sync.syncs, 0);
+    CU_ASSERT_EQUAL(sync.unsynced_frames_max, 0);
+    CU_ASSERT_TRUE(check_test_frame(s, "1529491000000", 7));
+    storage_close(s);
+
+    remove_scratch_storage(dir);
+}
+
+void test_storage_stats(void) {
+    char *dir = scratch_storage("1529488204470");
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open(dir, &s), LPX_SUCCESS);
+    StorageStats base;
+    CU_ASSERT_EQUAL(storage_stats(s, NULL, &base), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(base.streams, 1);
+
+    // статистика записываемого стрима обновляется при сохранении фреймов, пропуски считаются по индексам фреймов
+    char *train_id = "1529489000000";
+    store_test_frames(s, train_id, 4);
+    uint8_t buf[4096] = {0};
+    FrameMeta meta = {1529489000006000, 1529489000006999};
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 6, buf, sizeof(buf), &meta), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    StorageStats stats;
+    CU_ASSERT_EQUAL(storage_stats(s, train_id, &stats), LPX_SUCCESS);
+    CU_ASSERT_STRING_EQUAL(stats.train_id, train_id);
+    CU_ASSERT_EQUAL(stats.frames, 7);
+    CU_ASSERT_EQUAL(stats.dropped_frames, 2);
+    CU_ASSERT_EQUAL(stats.bytes, 5 * 4096);
+    CU_ASSERT_EQUAL(stats.start_time, 1529489000000000);
+    CU_ASSERT_EQUAL(stats.end_time, 1529489000006999);
+    CU_ASSERT_EQUAL(stats.duration_us, 6999);
+    CU_ASSERT_TRUE(stats.open);
+    meta = (FrameMeta) {1529489000004000, 1529489000004999};
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 4, buf, sizeof(buf), &meta), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_stats(s, train_id, &stats), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(stats.dropped_frames, 1);
+    // повторно записанный фрейм пропуск не заполняет
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, 4, buf, sizeof(buf), &meta), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_stats(s, train_id, &stats), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(stats.frames, 7);
+    CU_ASSERT_EQUAL(stats.dropped_frames, 1);
+
+    // закрытый индекс хранит количество пропусков, другой экземпляр хранилища видит ту же статистику
+    CU_ASSERT_EQUAL(storage_seal_stream(s, train_id), LPX_SUCCESS);
+    Storage *reader;
+    CU_ASSERT_EQUAL(storage_open(dir, &reader), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_stats(reader, train_id, &stats), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(stats.frames, 7);
+    CU_ASSERT_EQUAL(stats.dropped_frames, 1);
+    CU_ASSERT_FALSE(stats.open);
+    storage_close(reader);
+    int td = open(dir, O_RDONLY | O_DIRECTORY);
+    int fd = openat(td, train_id, O_RDONLY | O_DIRECTORY);
+    StreamIndex *index;
+    CU_ASSERT_EQUAL(sidx_open(fd, &index), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(sidx_dropped(index), 1);
+    sidx_close(index);
+    close(fd);
+    close(td);
+
+    // сводка и список стримов
+    store_test_frames(s, "1529490000000", 2);
+    CU_ASSERT_EQUAL(storage_stats(s, NULL, &stats), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(stats.streams, base.streams + 2);
+    CU_ASSERT_EQUAL(stats.frames, base.frames + 9);
+    CU_ASSERT_EQUAL(stats.dropped_frames, base.dropped_frames + 1);
+    CU_ASSERT_EQUAL(stats.end_time, 1529490000001999);
+    StorageStats *list;
+    size_t list_cnt;
+    CU_ASSERT_EQUAL(storage_list_stats(s, &list, &list_cnt), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(list_cnt, 3);
+    CU_ASSERT_STRING_EQUAL(list[2].train_id, "1529490000000");
+    free(list);
+
+    // удаление стрима убирает его из статистики
+    CU_ASSERT_EQUAL(storage_delete_stream(s, train_id), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_stats(s, train_id, &stats), STRG_NOT_FOUND);
+    CU_ASSERT_EQUAL(storage_stats(s, NULL, &stats), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(stats.frames, base.frames + 2);
+    CU_ASSERT_EQUAL(stats.dropped_frames, base.dropped_frames);
+
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+/*
+ * Фрейм 8-битного формата 4x2, end_time которого - момент сохранения
+ */
+static void store_live_frame(Storage *s, char *train_id, uint32_t frame_idx) {
+    uint8_t frame[8];
+    memset(frame, (int) frame_idx, sizeof(frame));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t end = ts2ns(now) / 1000;
+    FrameMeta meta = {end - 1000, end};
+    CU_ASSERT_EQUAL(storage_store_frame(s, train_id, frame_idx, frame, sizeof(frame), &meta), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(storage_flush(s), LPX_SUCCESS);
+}
+
+static void *record_live_frames(void *ctx) {
+    Storage *s = ctx;
+    // фрейм 3 пропущен
+    uint32_t frames[] = {2, 4};
+    for (size_t i = 0; i < ALEN(frames); i++) {
+        usleep(50000);
+        store_live_frame(s, "1529489000000", frames[i]);
+    }
+    usleep(50000);
+    CU_ASSERT_EQUAL(storage_seal_stream(s, "1529489000000"), LPX_SUCCESS);
+    return NULL;
+}
+
+void test_follow_stream(void) {
+    char *dir = scratch_storage("1529488204470");
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open(dir, &s), LPX_SUCCESS);
+    char *train_id = "1529489000000";
+    CU_ASSERT_EQUAL(storage_prepare(s, train_id), LPX_SUCCESS);
+    FrameFormat format = {.width = 4, .height = 2, .stride = 4, .bit_depth = 8, .frame_size = 8,
+                          .bayer_order = "BGGR", .sensor = "test"};
+    CU_ASSERT_EQUAL(storage_store_format(s, train_id, &format), LPX_SUCCESS);
+    store_live_frame(s, train_id, 0);
+    store_live_frame(s, train_id, 1);
+
+    // читатель - другой экземпляр хранилища, как у сервера; поток начинается с фрейма 1
+    Storage *reader;
+    CU_ASSERT_EQUAL(storage_open(dir, &reader), LPX_SUCCESS);
+    VideoStreamBytesStream *stream = NULL;
+    CU_ASSERT_EQUAL(storage_follow_stream(reader, train_id, 1, &stream), LPX_SUCCESS);
+    if (stream == NULL) {
+        storage_close(reader);
+        storage_close(s);
+        remove_scratch_storage(dir);
+        return;
+    }
+    size_t bmp_size = 54 + 256 * 4 + 4 * 2;
+    uint8_t buf[10240];
+    // записанный фрейм отдаётся сразу, не дожидаясь следующих
+    ssize_t read = stream_read(stream, buf, sizeof(buf));
+    CU_ASSERT_EQUAL(read, 4 + 2 + 8 + bmp_size);
+    uint32_t frames_cnt;
+    memcpy(&frames_cnt, buf, sizeof(frames_cnt));
+    CU_ASSERT_EQUAL(frames_cnt, STRM_FOLLOW_FRAMES);
+    CU_ASSERT_STRING_EQUAL((char *) buf + 4, "1");
+
+    // новые фреймы приходят по мере записи, поток заканчивается закрытием индекса
+    pthread_t recorder;
+    pthread_create(&recorder, NULL, record_live_frames, s);
+    size_t received = 0;
+    while ((read = stream_read(stream, buf + received, sizeof(buf) - received)) > 0) {
+        received += read;
+    }
+    CU_ASSERT_EQUAL(read, EOF);
+    pthread_join(recorder, NULL);
+    CU_ASSERT_EQUAL(received, 2 * (2 + 8 + bmp_size));
+    CU_ASSERT_STRING_EQUAL((char *) buf, "2");
+    CU_ASSERT_STRING_EQUAL((char *) buf + 2 + 8 + bmp_size, "4");
+
+    StreamStats stats;
+    stream_stats(stream, &stats);
+    CU_ASSERT_EQUAL(stats.frames, 3);
+    CU_ASSERT_TRUE(stats.latency_max_us < 5000000);
+    stream_close(stream);
+
+    // закрытый стрим отдаётся целиком и сразу заканчивается
+    CU_ASSERT_EQUAL(storage_follow_stream(reader, train_id, 0, &stream), LPX_SUCCESS);
+    CU_ASSERT_EQUAL(read_whole_stream(stream), 4 + 4 * (2 + 8 + bmp_size));
+    stream_close(stream);
+
+    storage_close(reader);
+    storage_close(s);
+    remove_scratch_storage(dir);
+}
+
+void test_volume_striping(void) {
+    char *dir = scratch_storage("1529488204470");
+    char *volumes[] = {strdup("/tmp/lpx-vol-XXXXXX"), strdup("/tmp/lpx-vol-XXXXXX")};
+    for (size_t i = 0; i < ALEN(volumes); i++) {
+        CU_ASSERT_PTR_NOT_NULL(mkdtemp(volumes[i]));
+    }
+    StorageConfig config;
+    storage_default_config(&config);
+    config.volumes = volumes;
+    config.volumes_cnt = ALEN(volumes);
+    Storage *s;
+    CU_ASSERT_EQUAL(storage_open_config(dir, &config, &s), LPX_SUCCESS);
+
+    // фреймы по очереди попадают в базовую директорию и на тома, у каждого тома свой сегмент
+    char *train_id = "1529489000000";
+    store_test_frames(s, train_id, 6);
+    CU_ASSERT_EQUAL(storage_seal_stream(s, train_id), LPX_SUCCESS);
+    char *td = append_path(dir, train_id);
+    for (uint32_t i = 0; i < 3; i++) {
+        char *segment = segment_path(td, i);
+        CU_ASSERT_EQUAL(is_symlink(segment), i > 0);
+        CU_ASSERT_EQUAL(path_size(segment), 2 * 4096);
+        free(segment);
+    }
+    StorageVolume stats[4];
+    CU_ASSERT_EQUAL(storage_volumes(s, stats, ALEN(stats)), 3);
+    for (size_t i = 0; i < 3; i++) {
+        CU_ASSERT_EQUAL(stats[i].segments, 1);
+        CU_ASSERT_EQUAL(stats[i].written_frames, 2);
+        CU_ASSERT_EQUAL(stats[i].written_bytes, 2 * 4096);
+        CU_ASSERT_TRUE(stats[i].total_bytes > 0 && stats[i].free_bytes <= stats[i].total_bytes);
+    }
+
+    // читателю размещение фреймов не видно
+    Storage *reader;
+    CU_ASSERT_EQUAL(storage_open(dir, &reader), LPX_SUCCESS);
+    char *found = NULL;
+    CU_ASSERT_EQUAL(storage_find_stream(reader, 1529489000004000, &found), LPX_SUCCESS);
+    CU_ASSERT_STRING_EQUAL(found != NULL ? found : "", train_id);
+    free(found);
+    for (uint32_t i = 0; i < 6; i++) {
+        CU_ASSERT_TRUE(check_test_frame(reader, train_id, i));
+    }
+    storage_close(reader);
+
+    // сегменты на томах удаляются вместе со стримом
+    CU_ASSERT_EQUAL(storage_delete_stream(s, train_id), LPX_SUCCESS);
+    CU_ASSERT_TRUE(wait_reaped(s));
+    for (size_t i = 0; i < ALEN(volumes); i++) {
+        char *volume_td = append_path(volumes[i], train_id);
+        CU_ASSERT_NOT_EQUAL(access(volume_td, F_OK), 0);
+        free(volume_td);
+    }
+    storage_close(s);
+
+    free(td);
+    for (size_t i = 0; i < ALEN(volumes); i++) {
+        remove_scratch_storage(volumes[i]);
+    }
+    remove_scratch_storage(dir);
+}
+
 int main(int argc, char **argv) {
     if (argc != 2) {
         fprintf(stderr, "Base dir arg missed");
         return -1;
     }
-    base_dir = append_path(argv[1], "lpx-shared/test/test_dir");
+    test_data_dir = append_path(argv[1], "lpx-shared/test/test_dir");
+    // хранилище пишет в базовую директорию контрольную точку каталога, поэтому тесты работают с копией тестовых данных
+    base_dir = scratch_storage("*");
+    if (base_dir == NULL) {
+        fprintf(stderr, "Could not copy test data");
+        return -1;
+    }
 
     CU_pSuite pSuite = NULL;
 
@@ -190,6 +2076,32 @@ int main(int argc, char **argv) {
     ADD_TEST(pSuite, test_find_second_stream)
     ADD_TEST(pSuite, test_stream_streaming);
     ADD_TEST(pSuite, test_stream_streaming_empty);
+    ADD_TEST(pSuite, test_convert_index);
+    ADD_TEST(pSuite, test_catalog_find);
+    ADD_TEST(pSuite, test_catalog_updates);
+    ADD_TEST(pSuite, test_catalog_checkpoint);
+    ADD_TEST(pSuite, test_segment_frames);
+    ADD_TEST(pSuite, test_write_behind);
+    ADD_TEST(pSuite, test_io_engine);
+    ADD_TEST(pSuite, test_direct_io);
+    ADD_TEST(pSuite, test_index_append);
+    ADD_TEST(pSuite, test_index_recovery);
+    ADD_TEST(pSuite, test_capacity_eviction);
+    ADD_TEST(pSuite, test_trash_reaper);
+    ADD_TEST(pSuite, test_train_dir_cache);
+    ADD_TEST(pSuite, test_day_buckets);
+    ADD_TEST(pSuite, test_frame_codec);
+    ADD_TEST(pSuite, test_stream_manifest);
+    ADD_TEST(pSuite, test_compact_frames);
+    ADD_TEST(pSuite, test_map_frame);
+    ADD_TEST(pSuite, test_map_frames);
+    ADD_TEST(pSuite, test_frame_checksum);
+    ADD_TEST(pSuite, test_scrubber);
+    ADD_TEST(pSuite, test_ram_tier);
+    ADD_TEST(pSuite, test_volume_striping);
+    ADD_TEST(pSuite, test_durability);
+    ADD_TEST(pSuite, test_storage_stats);
+    ADD_TEST(pSuite, test_follow_stream);
 
     /* Run tests using Basic interface */
     CU_basic_run_tests();
@@ -198,6 +2110,7 @@ int main(int argc, char **argv) {
     /* Clean up registry and return */
 
     CU_cleanup_registry();
-    free(base_dir);
+    remove_scratch_storage(base_dir);
+    free(test_data_dir);
     return CU_get_error() || failures_count;
 }
\ No newline at end of file